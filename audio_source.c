@@ -0,0 +1,182 @@
+#include "audio_source.h"
+#include "sample_clock.h"
+#include "spsc_ring.h"
+#include <CoreAudio/CoreAudio.h>
+#include <AudioToolbox/AudioToolbox.h>
+#include <CoreFoundation/CoreFoundation.h>
+#include <mach/mach_time.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define RING_CAPACITY 64
+#define NUM_BUFFERS 3
+
+struct audio_source {
+    AudioQueueRef queue;
+    pulse_detector_t *detector;
+    sample_clock_t *clock;
+    spsc_ring_t *ring;
+    int wake[2];               /* read end, write end */
+};
+
+void audio_source_default_config(audio_source_config_t *config) {
+    config->device_uid = NULL;
+    config->sample_rate = 48000.0;
+    config->buffer_size = 4096;
+    pulse_detector_default_config(&config->detector);
+}
+
+/* Runs on the audio queue's thread */
+static void input_callback(void *arg, AudioQueueRef queue, AudioQueueBufferRef buffer,
+                           const AudioTimeStamp *start, UInt32 packets,
+                           const AudioStreamPacketDescription *descs) {
+    audio_source_t *src = arg;
+    float *samples = (float *)buffer->mAudioData;
+    UInt32 count = buffer->mAudioDataByteSize / sizeof(float);
+
+    /* Track the sample clock before detection so that a discontinuity at
+     * the start of this buffer invalidates pulses that straddle it */
+    UInt32 flags = kAudioTimeStampSampleTimeValid | kAudioTimeStampHostTimeValid;
+    if ((start->mFlags & flags) == flags) {
+        unsigned clock_flags = sample_clock_update(src->clock, pulse_detector_samples(src->detector),
+                                                   start->mSampleTime, start->mHostTime, count);
+        if (clock_flags & SAMPLE_CLOCK_GAP) {
+            pulse_detector_gap(src->detector, sample_clock_last_gap(src->clock));
+        }
+    }
+
+    pulse_event_t events[4];
+    size_t num_events = pulse_detector_process(src->detector, samples, count, start->mHostTime, events, 4);
+    if (num_events > 0) {
+        audio_source_pulse_t pulse;
+        memset(&pulse, 0, sizeof(pulse));
+        pulse_detector_status(src->detector, &pulse.status);
+        for (size_t i = 0; i < num_events; i++) {
+            pulse.event = events[i];
+            /* Time the pulse from the smoothed sample clock, not the buffer's host time */
+            pulse.valid = sample_clock_host_time(src->clock, events[i].sample_pos, &pulse.event.host_time) == 0;
+            spsc_ring_push(src->ring, &pulse);
+        }
+        char byte = 0;
+        (void)write(src->wake[1], &byte, 1);
+    }
+
+    AudioQueueEnqueueBuffer(queue, buffer, 0, NULL);
+    (void)packets;
+    (void)descs;
+}
+
+audio_source_t *audio_source_open(const audio_source_config_t *config) {
+    audio_source_t *src = calloc(1, sizeof(audio_source_t));
+    if (src == NULL) {
+        return NULL;
+    }
+    src->wake[0] = src->wake[1] = -1;
+
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    double ticks_per_second = 1e9 * (double)timebase.denom / (double)timebase.numer;
+
+    pulse_detector_config_t detector_config = config->detector;
+    detector_config.sample_rate = config->sample_rate;
+    detector_config.ticks_per_second = ticks_per_second;
+    src->detector = pulse_detector_create(&detector_config);
+
+    sample_clock_config_t clock_config;
+    sample_clock_default_config(&clock_config);
+    clock_config.sample_rate = config->sample_rate;
+    clock_config.ticks_per_second = ticks_per_second;
+    src->clock = sample_clock_create(&clock_config);
+
+    src->ring = spsc_ring_create(RING_CAPACITY, sizeof(audio_source_pulse_t));
+    if (src->detector == NULL || src->clock == NULL || src->ring == NULL || pipe(src->wake) < 0) {
+        audio_source_close(src);
+        return NULL;
+    }
+    fcntl(src->wake[0], F_SETFL, O_NONBLOCK);
+    fcntl(src->wake[1], F_SETFL, O_NONBLOCK);
+
+    AudioStreamBasicDescription format;
+    memset(&format, 0, sizeof(format));
+    format.mSampleRate = config->sample_rate;
+    format.mFormatID = kAudioFormatLinearPCM;
+    format.mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked;
+    format.mFramesPerPacket = 1;
+    format.mChannelsPerFrame = 1;
+    format.mBitsPerChannel = 32;
+    format.mBytesPerPacket = format.mBytesPerFrame = 4;
+
+    /* No run loop: callbacks come on the queue's own thread */
+    if (AudioQueueNewInput(&format, input_callback, src, NULL, NULL, 0, &src->queue) != noErr) {
+        src->queue = NULL;
+        audio_source_close(src);
+        errno = EIO;
+        return NULL;
+    }
+    if (config->device_uid) {
+        CFStringRef uid = CFStringCreateWithCString(kCFAllocatorDefault, config->device_uid, kCFStringEncodingUTF8);
+        OSStatus status = uid ? AudioQueueSetProperty(src->queue, kAudioQueueProperty_CurrentDevice,
+                                                      &uid, sizeof(uid)) : -1;
+        if (uid) {
+            CFRelease(uid);
+        }
+        if (status != noErr) {
+            audio_source_close(src);
+            errno = ENODEV;
+            return NULL;
+        }
+    }
+    for (int i = 0; i < NUM_BUFFERS; i++) {
+        AudioQueueBufferRef buffer;
+        if (AudioQueueAllocateBuffer(src->queue, config->buffer_size, &buffer) == noErr) {
+            AudioQueueEnqueueBuffer(src->queue, buffer, 0, NULL);
+        }
+    }
+    if (AudioQueueStart(src->queue, NULL) != noErr) {
+        audio_source_close(src);
+        errno = EIO;
+        return NULL;
+    }
+    return src;
+}
+
+int audio_source_fd(const audio_source_t *src) {
+    return src->wake[0];
+}
+
+int audio_source_read(audio_source_t *src, audio_source_pulse_t *pulse) {
+    if (spsc_ring_pop(src->ring, pulse)) {
+        return 1;
+    }
+    /* Clear the wake-ups and look again, so that a pulse pushed in
+     * between is either taken now or leaves the pipe readable */
+    char bytes[64];
+    while (read(src->wake[0], bytes, sizeof(bytes)) > 0)
+        ;
+    return spsc_ring_pop(src->ring, pulse) ? 1 : 0;
+}
+
+uint64_t audio_source_overflows(const audio_source_t *src) {
+    return spsc_ring_overflows(src->ring);
+}
+
+void audio_source_close(audio_source_t *src) {
+    if (src == NULL) {
+        return;
+    }
+    if (src->queue) {
+        AudioQueueStop(src->queue, true);
+        AudioQueueDispose(src->queue, true);
+    }
+    if (src->wake[0] >= 0) {
+        close(src->wake[0]);
+        close(src->wake[1]);
+    }
+    spsc_ring_destroy(src->ring);
+    sample_clock_destroy(src->clock);
+    pulse_detector_destroy(src->detector);
+    free(src);
+}
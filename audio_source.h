@@ -0,0 +1,58 @@
+#ifndef AUDIO_SOURCE_H
+#define AUDIO_SOURCE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pulse_detector.h"
+
+/* Audio input as a source of pulses for an event loop (macOS only).
+ *
+ * An audio queue captures from a Core Audio input, with its callbacks on
+ * the queue's own thread rather than a run loop. As in audiopps, the
+ * callback tracks the sample clock, runs the pulse detector and passes
+ * the pulses on through a lock-free ring. A pipe becomes readable when
+ * there are pulses in the ring, so the event loop sleeps until a pulse
+ * arrives instead of waking up to look.
+ *
+ * Host times are mach_absolute_time ticks.
+ */
+
+typedef struct audio_source audio_source_t;
+
+typedef struct {
+    const char *device_uid;    /* NULL for the default input */
+    double sample_rate;
+    unsigned buffer_size;      /* bytes in each audio queue buffer */
+    pulse_detector_config_t detector; /* sample_rate and ticks_per_second are filled in */
+} audio_source_config_t;
+
+typedef struct {
+    pulse_event_t event;
+    bool valid;                /* event could be timed from the sample clock */
+    pulse_detector_status_t status; /* detector status after the buffer with the pulse */
+} audio_source_pulse_t;
+
+/* Fill in the default configuration (default input, 48kHz, 4096 byte
+ * buffers, default detector) */
+void audio_source_default_config(audio_source_config_t *config);
+
+/* Create a source and start capturing
+ * Returns NULL on error
+ */
+audio_source_t *audio_source_open(const audio_source_config_t *config);
+
+/* Get a descriptor that is readable when pulses are waiting */
+int audio_source_fd(const audio_source_t *src);
+
+/* Take the next pulse, if any
+ * Returns 1 if pulse was filled in, 0 if there are none waiting
+ */
+int audio_source_read(audio_source_t *src, audio_source_pulse_t *pulse);
+
+/* Get the number of pulses lost because the ring was full */
+uint64_t audio_source_overflows(const audio_source_t *src);
+
+/* Stop capturing and destroy the source */
+void audio_source_close(audio_source_t *src);
+
+#endif /* AUDIO_SOURCE_H */
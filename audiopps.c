@@ -10,16 +10,75 @@
 #include <mach/mach_time.h>
 #include <math.h>
 #include <stdbool.h>
+#include <pthread.h>
 #include "chrony_client.h"
+#include "ntp_shm.h"
+#include "clock_model.h"
+#include "sample_clock.h"
+#include "timens.h"
+#include "pulse_detector.h"
+#include "pulse_filter.h"
+#include "pulse_journal.h"
+#include "pulse_feed.h"
+#include "pulse_snippet.h"
+#include "spsc_ring.h"
+#include "stage_trace.h"
+#include "calibration.h"
 
 static CFRunLoopRef runLoop = NULL;
 static AudioQueueRef audioQueue = NULL;
 static volatile sig_atomic_t keepRunning = 1;
 static int debugMode = 0;
 static float pulseThreshold = 0.5f;
+static pulse_mode_t pulseMode = PULSE_MODE_THRESHOLD;
+static float cfdFraction = 0.5f;
+static pulse_interp_t pulseInterp = PULSE_INTERP_LINEAR;
+static bool trackPulses = true;
 static chrony_client_t *chrony_client = NULL;
+static pulse_detector_t *detector = NULL;
+static sample_clock_t *sampleClock = NULL;
+static pulse_filter_t *pulseFilter = NULL;
+static pulse_journal_t *pulseJournal = NULL;
+static pulse_feed_t *pulseFeed = NULL;
+static pulse_snippet_recorder_t *snippetRecorder = NULL;
+static pulse_snippet_file_t *snippetFile = NULL;
+static float *snippetSamples = NULL;
 static bool use_chrony = false;
 static char remote_path[256] = "/var/run/chrony.audiopps.sock";
+static unsigned chronyQueue = CHRONY_CLIENT_DEFAULT_QUEUE;
+static ntp_shm_t *ntpShm = NULL;
+static const char *templatePath = NULL;
+static const char *saveTemplatePath = NULL;
+static volatile sig_atomic_t latencyRequested = 0;
+static bool reportLatency = false;
+static calibration_t *pulseCalibration = NULL;
+static bool loopbackMode = false;
+static AudioQueueRef loopbackQueue = NULL;
+static double loopbackRate = 0.0;
+static uint64_t loopbackSamples = 0;      /* samples played so far (output thread only) */
+static spsc_ring_t *loopbackRing = NULL;  /* host times of clicks, from the output thread */
+
+/* Loopback clicks: a square pulse at the start of each second of samples */
+#define LOOPBACK_CLICK_WIDTH 0.01
+#define LOOPBACK_CLICK_LEVEL 0.8f
+#define LOOPBACK_RING_CAPACITY 16
+
+/* Stages of a pulse's path from the audio hardware to chrony */
+enum {
+    STAGE_CAPTURE,             /* first sample of the buffer until the callback ran */
+    STAGE_DETECT,              /* callback until its records were queued */
+    STAGE_HANDOFF,             /* queued until the worker popped the record */
+    STAGE_CONVERT,             /* host time to system time */
+    STAGE_FILTER,              /* outlier rejection, smoothing and logging */
+    STAGE_SEND,                /* sending to chrony and SHM */
+    STAGE_TOTAL,               /* callback until sent */
+    STAGE_AGE,                 /* pulse edge until sent */
+    STAGE_COUNT
+};
+static const char *const stageNames[STAGE_COUNT] = {
+    "capture", "detect", "handoff", "convert", "filter", "send", "total", "age"
+};
+static stage_trace_t *stageTrace = NULL;
 
 void list_input_sources(AudioDeviceID deviceID);
 
@@ -36,32 +95,19 @@ void setup_timebase_info(void) {
                                     (double)timebaseInfo.timebase.numer;
 }
 
-void convert_past_host_time_to_timeval(uint64_t hostTime, struct timeval *result) {
-    struct timeval tv_before, tv_after;
-    uint64_t mt_before, mt_after;
-    
-    // "Sandwich" gettimeofday() between two mach_absolute_time() calls
-    mt_before = mach_absolute_time();
-    gettimeofday(&tv_before, NULL);
-    mt_after = mach_absolute_time();
-    
-    // Calculate the midpoint time in mach time
-    uint64_t mt_midpoint = (mt_before + mt_after) / 2;
-    
-    // Calculate how long ago the hostTime was relative to our midpoint
-    uint64_t mt_diff = mt_midpoint - hostTime;
-    double seconds_ago = (double)mt_diff * timebaseInfo.timebase.numer / 
-                         (timebaseInfo.timebase.denom * 1e9);
-    
-    // Convert tv_before to double seconds
-    double tv_before_seconds = tv_before.tv_sec + tv_before.tv_usec / 1e6;
-    
-    // Subtract the time difference to get the target time
-    double target_time = tv_before_seconds - seconds_ago;
-    
-    // Convert back to struct timeval
-    result->tv_sec = (time_t)target_time;
-    result->tv_usec = (suseconds_t)((target_time - result->tv_sec) * 1e6);
+static clock_model_t *clockModel = NULL;
+
+static uint64_t read_host_time(void) {
+    return mach_absolute_time();
+}
+
+/* Convert a past host time to system time (ns since the epoch) with the
+ * clock model, which is fitted to bursts of mach_absolute_time()/
+ * clock_gettime()/mach_absolute_time() "sandwiches" in the background
+ * Returns 0 on success, -1 if the model is not ready
+ */
+int convert_past_host_time(uint64_t hostTime, timens_t *result, double *uncertainty) {
+    return clock_model_convert(clockModel, hostTime, result, uncertainty);
 }
 
 void signal_handler(int sig) {
@@ -71,77 +117,467 @@ void signal_handler(int sig) {
     }
 }
 
+void latency_signal_handler(int sig) {
+    latencyRequested = 1;
+}
+
+/* Nanoseconds in a span of host ticks */
+static int64_t host_ticks_to_ns(int64_t ticks) {
+    return (int64_t)((double)ticks * timebaseInfo.timebase.numer / timebaseInfo.timebase.denom);
+}
+
+/* Records passed from the audio callback to the pulse worker thread */
+typedef enum {
+    RECORD_PULSE,
+    RECORD_LEVELS,
+    RECORD_LOCK,
+    RECORD_DISCONTINUITY
+} RecordKind;
+
+typedef struct {
+    RecordKind kind;
+    pulse_event_t event;
+    bool valid;                 /* event could be timed from the sample clock */
+    unsigned clock_flags;       /* SAMPLE_CLOCK_* flags */
+    sample_clock_status_t clock;
+    pulse_detector_status_t status;
+    float min_level;
+    float max_level;
+    UInt32 num_samples;
+    timens_t entered;           /* CLOCK_MONOTONIC when the callback ran */
+    timens_t queued;            /* CLOCK_MONOTONIC when the records were queued */
+} PulseRecord;
+
+#define PULSE_RING_CAPACITY 64
+
+#define DEFAULT_SNIPPET_SAMPLES 64
+
+/* Recent pulse verdicts, by sequence number, for labelling their snippets */
+#define SNIPPET_VERDICTS 64
+
+typedef struct {
+    uint64_t seq;
+    pulse_snippet_kind_t kind;
+    timens_t time;
+} SnippetVerdict;
+
+static SnippetVerdict snippetVerdicts[SNIPPET_VERDICTS];
+
+static spsc_ring_t *pulseRing = NULL;
+
+/* Runs on the audio queue's thread: detection only. Everything that can
+ * block (time conversion, chrony, stdout) is left to pulse_worker. */
 void audio_input_callback(void *inUserData,
                          AudioQueueRef inAQ,
                          AudioQueueBufferRef inBuffer,
                          const AudioTimeStamp *inStartTime,
                          UInt32 inNumberPacketDescriptions,
                          const AudioStreamPacketDescription *inPacketDescs) {
-    static int pulse_detected = 0;
-    static uint64_t last_pulse_time = 0;
     static int callback_count = 0;
+    static pulse_state_t lock_state = PULSE_STATE_ACQUIRE;
+    static uint64_t missed = 0;
+    timens_t entered = timens_now(CLOCK_MONOTONIC);
+    stage_trace_record(stageTrace, STAGE_CAPTURE,
+                       host_ticks_to_ns((int64_t)(mach_absolute_time() - inStartTime->mHostTime)));
     
     float *samples = (float *)inBuffer->mAudioData;
     UInt32 numSamples = inBuffer->mAudioDataByteSize / sizeof(float);
     
     callback_count++;
     
-    float max_level = 0.0f;
-    float min_level = 0.0f;
+    /* Track the sample clock before detection so that a discontinuity at
+     * the start of this buffer invalidates pulses that straddle it */
+    unsigned clockFlags = 0;
+    UInt32 timeFlags = kAudioTimeStampSampleTimeValid | kAudioTimeStampHostTimeValid;
+    if ((inStartTime->mFlags & timeFlags) == timeFlags) {
+        clockFlags = sample_clock_update(sampleClock, pulse_detector_samples(detector),
+                                         inStartTime->mSampleTime, inStartTime->mHostTime, numSamples);
+        if (clockFlags & SAMPLE_CLOCK_GAP) {
+            pulse_detector_gap(detector, sample_clock_last_gap(sampleClock));
+        }
+    }
     
-    for (UInt32 i = 0; i < numSamples; i++) {
-        float sample = samples[i];
-        if (sample > max_level) max_level = sample;
-        if (sample < min_level) min_level = sample;
-        
-        if (fabsf(sample) > pulseThreshold) {
-            // Calculate precise time including sample offset
-            uint64_t buffer_start_time = inStartTime->mHostTime;
-            
-            // Calculate time offset for this specific sample within the buffer
-            double sample_rate = 48000.0; // Should match the format we set
-            double sample_offset_seconds = (double)i / sample_rate;
-            uint64_t sample_offset_ticks = (uint64_t)(sample_offset_seconds * 
-                                          timebaseInfo.timebase.denom * 1e9 / 
-                                          timebaseInfo.timebase.numer);
-            
-            uint64_t precise_pulse_time = buffer_start_time + sample_offset_ticks;
-            
-            uint64_t time_since_last = precise_pulse_time - last_pulse_time;
-            double seconds_since_last = (double)time_since_last * 
-                                       timebaseInfo.timebase.numer / 
-                                       (timebaseInfo.timebase.denom * 1e9);
-            
-            if (seconds_since_last > 0.5) {
-                struct timeval pulse_time;
-                convert_past_host_time_to_timeval(precise_pulse_time, &pulse_time);
-                
-                /* Calculate offset: system time fractional part minus true time (0.0 at top of second) */
-                double offset = ((double)pulse_time.tv_usec / 1000000.0) - 0.0;
-                
-                /* Send sample to chrony if enabled */
-                if (use_chrony && chrony_client_send_pps(chrony_client, &pulse_time, offset) < 0) {
-                    fprintf(stderr, "Failed to send chrony sample\n");
-                }
-                
-                printf("PPS detected at %ld.%06d (level: %.3f, sample: %u/%u, offset: %.6f)\n", 
-                       pulse_time.tv_sec, pulse_time.tv_usec, sample, i, numSamples, offset);
-                
-                last_pulse_time = precise_pulse_time;
-                pulse_detected = 1;
-                break;
-            }
+    if (snippetRecorder) {
+        pulse_snippet_push(snippetRecorder, samples, numSamples);
+    }
+    
+    pulse_event_t events[4];
+    size_t numEvents = pulse_detector_process(detector, samples, numSamples,
+                                              inStartTime->mHostTime, events, 4);
+    
+    PulseRecord record;
+    memset(&record, 0, sizeof(record));
+    pulse_detector_status(detector, &record.status);
+    record.entered = entered;
+    record.queued = entered;
+    if (clockFlags) {
+        record.kind = RECORD_DISCONTINUITY;
+        record.clock_flags = clockFlags;
+        sample_clock_status(sampleClock, &record.clock);
+        spsc_ring_push(pulseRing, &record);
+    }
+    for (size_t i = 0; i < numEvents; i++) {
+        record.kind = RECORD_PULSE;
+        record.event = events[i];
+        /* Time the pulse from the smoothed sample clock, not the buffer's host time */
+        record.valid = sample_clock_host_time(sampleClock, events[i].sample_pos, &record.event.host_time) == 0;
+        record.queued = timens_now(CLOCK_MONOTONIC);
+        spsc_ring_push(pulseRing, &record);
+    }
+    
+    if (record.status.state != lock_state) {
+        record.kind = RECORD_LOCK;
+        spsc_ring_push(pulseRing, &record);
+        lock_state = record.status.state;
+    }
+    stage_trace_since(stageTrace, STAGE_DETECT, entered);
+    
+    /* Mark snippets after the pulses are queued, so the worker has seen a
+     * pulse by the time its snippet can be complete */
+    if (snippetRecorder) {
+        for (size_t i = 0; i < numEvents; i++) {
+            pulse_snippet_mark(snippetRecorder, PULSE_SNIPPET_DETECTED, events[i].sample_pos,
+                               events[i].seq, events[i].host_time, events[i].level);
+        }
+        if (record.status.missed > missed) {
+            pulse_snippet_mark(snippetRecorder, PULSE_SNIPPET_MISSED, (double)record.status.last_missed, 0, 0, 0.0f);
         }
     }
+    missed = record.status.missed;
     
     if (debugMode && (callback_count % 20 == 0)) {
-        printf("Audio levels: min=%.3f, max=%.3f, samples=%u, threshold=%.3f\n", 
-               min_level, max_level, numSamples, pulseThreshold);
+        record.kind = RECORD_LEVELS;
+        pulse_detector_block_levels(detector, &record.min_level, &record.max_level);
+        record.num_samples = numSamples;
+        spsc_ring_push(pulseRing, &record);
     }
     
     AudioQueueEnqueueBuffer(inAQ, inBuffer, 0, NULL);
 }
 
+/* Runs on the loopback output queue's thread: fill a buffer with silence
+ * and any click that falls in it, and pass on the host time the click
+ * will be played at */
+void loopback_output_callback(void *inUserData, AudioQueueRef inAQ, AudioQueueBufferRef inBuffer) {
+    float *samples = (float *)inBuffer->mAudioData;
+    UInt32 numSamples = inBuffer->mAudioDataBytesCapacity / sizeof(float);
+    uint64_t period = (uint64_t)loopbackRate;
+    uint64_t width = (uint64_t)(LOOPBACK_CLICK_WIDTH * loopbackRate);
+    int64_t clickIndex = -1;
+    
+    for (UInt32 i = 0; i < numSamples; i++) {
+        uint64_t phase = (loopbackSamples + i) % period;
+        samples[i] = phase < width ? LOOPBACK_CLICK_LEVEL : 0.0f;
+        if (phase == 0) {
+            clickIndex = i;
+        }
+    }
+    loopbackSamples += numSamples;
+    inBuffer->mAudioDataByteSize = numSamples * sizeof(float);
+    
+    /* The start time is only known once the queue is running, so a click
+     * in a buffer primed before then is played but not timed */
+    AudioTimeStamp startTime;
+    memset(&startTime, 0, sizeof(startTime));
+    OSStatus status = AudioQueueEnqueueBufferWithParameters(inAQ, inBuffer, 0, NULL, 0, 0, 0, NULL,
+                                                            NULL, &startTime);
+    if (status == noErr && clickIndex >= 0 && (startTime.mFlags & kAudioTimeStampHostTimeValid)) {
+        uint64_t clickTime = startTime.mHostTime
+            + (uint64_t)((double)clickIndex / loopbackRate * timebaseInfo.ticks_per_second);
+        spsc_ring_push(loopbackRing, &clickTime);
+    }
+}
+
+/* Play clicks on the output of the device being listened to
+ * Returns noErr on success
+ */
+OSStatus start_loopback(const AudioStreamBasicDescription *format, const char *deviceUID, int bufferSize) {
+    loopbackRate = format->mSampleRate;
+    loopbackRing = spsc_ring_create(LOOPBACK_RING_CAPACITY, sizeof(uint64_t));
+    if (loopbackRing == NULL) {
+        return -1;
+    }
+    
+    /* No run loop: callbacks come on the queue's own thread */
+    OSStatus status = AudioQueueNewOutput(format, loopback_output_callback, NULL, NULL, NULL, 0, &loopbackQueue);
+    if (status != noErr) {
+        loopbackQueue = NULL;
+        return status;
+    }
+    if (deviceUID) {
+        CFStringRef uidRef = CFStringCreateWithCString(kCFAllocatorDefault, deviceUID, kCFStringEncodingUTF8);
+        if (uidRef) {
+            status = AudioQueueSetProperty(loopbackQueue, kAudioQueueProperty_CurrentDevice,
+                                           &uidRef, sizeof(uidRef));
+            CFRelease(uidRef);
+            if (status != noErr) {
+                return status;
+            }
+        }
+    }
+    for (int i = 0; i < 3; i++) {
+        AudioQueueBufferRef buffer;
+        status = AudioQueueAllocateBuffer(loopbackQueue, bufferSize, &buffer);
+        if (status != noErr) {
+            return status;
+        }
+        loopback_output_callback(NULL, loopbackQueue, buffer);
+    }
+    return AudioQueueStart(loopbackQueue, NULL);
+}
+
+/* Detector status as of the record being handled (worker only) */
+static pulse_detector_status_t workerStatus;
+
+/* Publish a pulse and the health that goes with it to the feed */
+static void publish_pulse(const pulse_journal_record_t *record, const pulse_filter_result_t *filtered) {
+    static pulse_feed_health_t health;
+    pulse_filter_stats_t filterStats;
+    
+    pulse_filter_stats(pulseFilter, &filterStats);
+    health.updated = record->time;
+    health.pulses++;
+    health.accepted = filterStats.accepted;
+    health.rejected = filterStats.rejected_interval + filterStats.rejected_outlier;
+    if (filtered == NULL) {
+        health.discarded++;
+    } else if (filtered->verdict == PULSE_VERDICT_ACCEPT) {
+        health.offset = filtered->offset;
+    }
+    health.missed = workerStatus.missed;
+    health.glitches = workerStatus.glitches;
+    health.residual_rms = filterStats.residual_rms;
+    health.uncertainty_ns = record->uncertainty_ns;
+    health.source = record->source;
+    health.state = workerStatus.state;
+    pulse_feed_set_health(pulseFeed, &health);
+    pulse_feed_publish(pulseFeed, record);
+}
+
+/* Log a pulse to the journal and the feed, if there are any */
+static void journal_pulse(const pulse_event_t *event, timens_t time, double offset,
+                          double uncertainty, const pulse_filter_result_t *filtered) {
+    if (pulseJournal == NULL && pulseFeed == NULL) {
+        return;
+    }
+    pulse_journal_record_t record;
+    memset(&record, 0, sizeof(record));
+    record.host_ticks = event->host_time;
+    record.sample_pos = event->sample_pos;
+    record.time = time;
+    record.offset = offset;
+    record.uncertainty_ns = (float)uncertainty;
+    record.level = event->level;
+    record.source = PULSE_JOURNAL_AUDIO;
+    record.state = event->state;
+    if (filtered) {
+        record.residual_ns = (float)(filtered->residual * 1e9);
+        record.verdict = filtered->verdict;
+    } else {
+        record.flags = PULSE_JOURNAL_DISCARDED;
+    }
+    if (pulseJournal) {
+        pulse_journal_append(pulseJournal, &record);
+    }
+    if (pulseFeed) {
+        publish_pulse(&record, filtered);
+    }
+}
+
+/* Remember what became of a pulse, for its snippet */
+static void note_verdict(const pulse_event_t *event, pulse_snippet_kind_t kind, timens_t time) {
+    SnippetVerdict *verdict = &snippetVerdicts[event->seq % SNIPPET_VERDICTS];
+    verdict->seq = event->seq;
+    verdict->kind = kind;
+    verdict->time = time;
+}
+
+/* Add a calibration pulse, and stop once the window is covered */
+static void calibrate_pulse(timens_t time, double error) {
+    int added = calibration_add(pulseCalibration, time, error);
+    if (added < 0) {
+        fprintf(stderr, "Out of memory for calibration\n");
+    } else if (added > 0 && keepRunning) {
+        printf("Calibration window complete\n");
+        keepRunning = 0;
+    }
+}
+
+/* Match a click heard in loopback with the last one played before it */
+static void handle_loopback_click(const pulse_event_t *event) {
+    static bool havePending = false;
+    static uint64_t pending;
+    bool matched = false;
+    uint64_t played = 0;
+    
+    for (;;) {
+        if (!havePending && !spsc_ring_pop(loopbackRing, &pending)) {
+            break;
+        }
+        havePending = true;
+        if (pending > event->host_time) {
+            break;
+        }
+        played = pending;
+        matched = true;
+        havePending = false;
+    }
+    
+    double latency = matched ? (double)host_ticks_to_ns((int64_t)(event->host_time - played)) / 1e9 : 0.0;
+    if (!matched || latency >= 0.5) {
+        printf("Loopback click (level: %.3f, sample: %u/%u) does not follow a click played\n",
+               event->level, event->block_index, event->block_size);
+        return;
+    }
+    printf("Loopback click (level: %.3f, sample: %u/%u): round trip %.3f ms\n",
+           event->level, event->block_index, event->block_size, latency * 1e3);
+    calibrate_pulse((timens_t)host_ticks_to_ns((int64_t)event->host_time), latency);
+}
+
+void handle_pulse(const PulseRecord *pulseRecord) {
+    const pulse_event_t *event = &pulseRecord->event;
+    timens_t popped = stage_trace_since(stageTrace, STAGE_HANDOFF, pulseRecord->queued);
+    
+    if (!pulseRecord->valid) {
+        note_verdict(event, PULSE_SNIPPET_DISCARDED, 0);
+        journal_pulse(event, 0, 0.0, 0.0, NULL);
+        printf("PPS discarded (level: %.3f, sample: %u/%u): audio discontinuity\n",
+               event->level, event->block_index, event->block_size);
+        return;
+    }
+    if (loopbackMode) {
+        handle_loopback_click(event);
+        return;
+    }
+    
+    timens_t pulse_ns;
+    double uncertainty;
+    if (convert_past_host_time(event->host_time, &pulse_ns, &uncertainty) < 0) {
+        note_verdict(event, PULSE_SNIPPET_DISCARDED, 0);
+        journal_pulse(event, 0, 0.0, 0.0, NULL);
+        fprintf(stderr, "No clock model yet; pulse dropped\n");
+        return;
+    }
+    timens_t converted = stage_trace_since(stageTrace, STAGE_CONVERT, popped);
+    
+    /* Calculate offset: system time fractional part minus true time (0.0 at top of second).
+     * This keeps the full nanosecond precision that the timeval loses. */
+    double offset = (double)timens_subsec(pulse_ns) / 1e9 - 0.0;
+    
+    struct timespec pulse_ts;
+    timens_to_timespec(pulse_ns, &pulse_ts);
+    
+    pulse_filter_result_t filtered;
+    pulse_filter_process(pulseFilter, pulse_ns, offset, &filtered);
+    journal_pulse(event, pulse_ns, offset, uncertainty, &filtered);
+    note_verdict(event, filtered.verdict == PULSE_VERDICT_ACCEPT ? PULSE_SNIPPET_ACCEPTED : PULSE_SNIPPET_REJECTED,
+                 pulse_ns);
+    timens_t processed = stage_trace_since(stageTrace, STAGE_FILTER, converted);
+    if (filtered.verdict != PULSE_VERDICT_ACCEPT) {
+        printf("PPS rejected at %ld.%09ld (level: %.3f, offset: %.9f): %s, %.1f MADs from median %.9f\n",
+               (long)pulse_ts.tv_sec, pulse_ts.tv_nsec, event->level, offset,
+               pulse_filter_verdict_name(filtered.verdict), filtered.deviation, filtered.median);
+        return;
+    }
+    /* Calibrate with the pulse as measured, before smoothing */
+    if (pulseCalibration) {
+        calibrate_pulse(pulse_ns, offset);
+    }
+    offset = filtered.offset;
+    
+    /* Send sample to chrony if enabled */
+    struct timeval pulse_time;
+    timens_to_timeval(pulse_ns, &pulse_time);
+    if (use_chrony && chrony_client_send_pps(chrony_client, &pulse_time, offset) < 0) {
+        fprintf(stderr, "Chrony sample lost\n");
+    }
+    if (ntpShm) {
+        ntp_shm_send_pps(ntpShm, pulse_ns, offset, ntp_shm_precision(uncertainty / 1e9));
+    }
+    timens_t sent = stage_trace_since(stageTrace, STAGE_SEND, processed);
+    stage_trace_record(stageTrace, STAGE_TOTAL, sent - pulseRecord->entered);
+    stage_trace_record(stageTrace, STAGE_AGE,
+                       host_ticks_to_ns((int64_t)(mach_absolute_time() - event->host_time)));
+    
+    printf("PPS detected at %ld.%09ld (level: %.3f, sample: %u/%u, offset: %.9f, residual: %.0fns, clock: +/-%.0fns)\n", 
+           (long)pulse_ts.tv_sec, pulse_ts.tv_nsec, event->level,
+           event->block_index, event->block_size, offset, filtered.residual * 1e9, uncertainty);
+}
+
+static volatile bool workerRunning = true;
+
+void drain_pulse_ring(void) {
+    PulseRecord record;
+    
+    while (spsc_ring_pop(pulseRing, &record)) {
+        workerStatus = record.status;
+        if (record.kind == RECORD_PULSE) {
+            handle_pulse(&record);
+        } else if (record.kind == RECORD_DISCONTINUITY) {
+            printf("Audio discontinuity:%s%s (%llu samples dropped in total)\n",
+                   (record.clock_flags & SAMPLE_CLOCK_GAP) ? " buffers dropped" : "",
+                   (record.clock_flags & SAMPLE_CLOCK_JUMP) ? " timestamps jumped" : "",
+                   (unsigned long long)record.clock.dropped_samples);
+        } else if (record.kind == RECORD_LOCK) {
+            printf("Pulse lock: %s (missed: %llu, glitches: %llu, period: %.3f samples)\n",
+                   pulse_detector_state_name(record.status.state),
+                   (unsigned long long)record.status.missed,
+                   (unsigned long long)record.status.glitches, record.status.period);
+        } else {
+            printf("Audio levels: min=%.3f, max=%.3f, samples=%u, threshold=%.3f\n", 
+                   record.min_level, record.max_level, record.num_samples, pulseThreshold);
+        }
+    }
+}
+
+/* Label completed snippets with their pulse's verdict and save them */
+void drain_snippets(void) {
+    pulse_snippet_t snippet;
+    
+    while (pulse_snippet_pop(snippetRecorder, &snippet, snippetSamples)) {
+        if (snippet.kind == PULSE_SNIPPET_DETECTED) {
+            SnippetVerdict *verdict = &snippetVerdicts[snippet.seq % SNIPPET_VERDICTS];
+            if (verdict->seq != snippet.seq) {
+                /* The pulse was queued before its snippet could complete */
+                drain_pulse_ring();
+            }
+            if (verdict->seq == snippet.seq) {
+                snippet.kind = verdict->kind;
+                snippet.time = verdict->time;
+            }
+        }
+        if (pulse_snippet_file_write(snippetFile, &snippet, snippetSamples) < 0) {
+            perror("Failed to write snippet");
+        }
+    }
+}
+
+void *pulse_worker(void *arg) {
+    uint64_t reportedOverflows = 0;
+    
+    while (workerRunning) {
+        spsc_ring_wait(pulseRing, 1000);
+        drain_pulse_ring();
+        if (snippetRecorder) {
+            drain_snippets();
+        }
+        
+        uint64_t overflows = spsc_ring_overflows(pulseRing);
+        if (overflows != reportedOverflows) {
+            fprintf(stderr, "Pulse worker fell behind: %llu records lost\n",
+                    (unsigned long long)(overflows - reportedOverflows));
+            reportedOverflows = overflows;
+        }
+    }
+    
+    /* The audio queue has stopped, so nothing more can arrive */
+    drain_pulse_ring();
+    if (snippetRecorder) {
+        drain_snippets();
+    }
+    return NULL;
+}
+
 void list_audio_devices(void) {
     AudioObjectPropertyAddress propertyAddress = {
         kAudioHardwarePropertyDevices,
@@ -412,6 +848,32 @@ OSStatus set_input_source(AudioDeviceID deviceID, UInt32 dataSourceID) {
     return status;
 }
 
+/* Print the calibration and save it if asked */
+void report_calibration(const char *path) {
+    calibration_result_t result;
+    if (calibration_result(pulseCalibration, &result) < 0) {
+        fprintf(stderr, "Too few pulses to calibrate\n");
+        return;
+    }
+    
+    /* The round trip is through the output and the input, and only the
+     * input's share is an error in the pulse times */
+    double scale = 1.0;
+    double referenceError = NAN;
+    if (loopbackMode) {
+        scale = 0.5;
+        printf("Offset is half the round trip, assuming the output and input paths are alike\n");
+    } else if (calibration_reference_error(&referenceError) < 0) {
+        fprintf(stderr, "The system clock is not synchronised; the offset is only as good as it is\n");
+        referenceError = NAN;
+    }
+    calibration_print(&result, scale, referenceError, stdout);
+    if (path && calibration_write(path, loopbackMode ? "audiopps loopback" : "audiopps", &result,
+                                  scale, referenceError) < 0) {
+        perror("Failed to write calibration");
+    }
+}
+
 void usage(const char *progname) {
     fprintf(stderr, "Usage: %s [options] [device-UID [input-source]]\n", progname);
     fprintf(stderr, "Options:\n");
@@ -419,20 +881,59 @@ void usage(const char *progname) {
     fprintf(stderr, "  --help            Show this help message\n");
     fprintf(stderr, "  --debug           Show audio levels and detection info\n");
     fprintf(stderr, "  --threshold N     Set pulse detection threshold (default: 0.5)\n");
+    fprintf(stderr, "  --mode M          Edge timing: threshold, cfd or matched (default: threshold)\n");
+    fprintf(stderr, "  --cfd-fraction F  Fraction of the peak that defines the edge (default: 0.5)\n");
+    fprintf(stderr, "  --interp I        CFD interpolation: linear or cubic (default: linear)\n");
+    fprintf(stderr, "  --template F      Load the matched filter template from F\n");
+    fprintf(stderr, "  --save-template F Save the learned template to F on exit\n");
+    fprintf(stderr, "  --no-track        Scan every sample instead of locking on to the pulse train\n");
+    fprintf(stderr, "  --no-filter       Send every pulse to chrony without outlier rejection\n");
+    fprintf(stderr, "  --filter-mad K    Reject offsets more than K MADs from the median (default: 5)\n");
+    fprintf(stderr, "  --smooth N        Smooth offsets with a linear fit over N pulses (default: off)\n");
+    fprintf(stderr, "  --journal F       Log every pulse to a binary journal F (read with ppsjournal)\n");
+    fprintf(stderr, "  --journal-size N  Records kept in the journal (default: %d)\n", PULSE_JOURNAL_DEFAULT_CAPACITY);
+    fprintf(stderr, "  --feed NAME       Publish pulses to shared memory feed NAME (e.g. %s) for ppsfeed\n",
+            PULSE_FEED_DEFAULT_NAME);
+    fprintf(stderr, "  --snippets F      Save the waveform around each pulse and missed pulse to F (read with ppssnip)\n");
+    fprintf(stderr, "  --snippet-samples N  Samples either side of the pulse in a snippet (default: %d)\n",
+            DEFAULT_SNIPPET_SAMPLES);
     fprintf(stderr, "  --chrony          Send timing samples to chrony\n");
     fprintf(stderr, "  --remote-path P   Remote chrony socket path (default: %s)\n", remote_path);
+    fprintf(stderr, "  --shm UNIT        Also publish samples to NTP SHM refclock UNIT (ntpd, chrony, gpsd)\n");
+    fprintf(stderr, "  --chrony-queue N  Samples kept while chrony is unreachable, 0 to drop them (default: %d)\n",
+            CHRONY_CLIENT_DEFAULT_QUEUE);
+    fprintf(stderr, "  --latency         Report per-stage latency at exit (also on SIGUSR1)\n");
+    fprintf(stderr, "  --calibrate       Measure the offset for chrony against the system clock, then exit\n");
+    fprintf(stderr, "  --calibrate-window S  Seconds of pulses to measure (default: 600)\n");
+    fprintf(stderr, "  --calibrate-file F    Save the measured offset to F\n");
+    fprintf(stderr, "  --loopback        Calibrate from clicks played on the device's output and wired to its input\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "Examples:\n");
     fprintf(stderr, "  %s\n", progname);
     fprintf(stderr, "  %s --debug --threshold 0.1\n", progname);
+    fprintf(stderr, "  %s --threshold 0.05 --mode cfd --interp cubic\n", progname);
     fprintf(stderr, "  %s \"AppleUSBAudioEngine:...:2\"\n", progname);
     fprintf(stderr, "  %s \"AppleUSBAudioEngine:...:2\" \"External Line Connector\"\n", progname);
     fprintf(stderr, "  %s --chrony \"AppleUSBAudioEngine:...:2\"\n", progname);
+    fprintf(stderr, "  %s --calibrate --calibrate-file audiopps.cal \"AppleUSBAudioEngine:...:2\"\n", progname);
 }
 
 int main(int argc, char *argv[]) {
     const char *deviceUID = NULL;
     const char *inputSourceName = NULL;
+    pulse_filter_config_t filterConfig;
+    const char *journalPath = NULL;
+    uint64_t journalSize = PULSE_JOURNAL_DEFAULT_CAPACITY;
+    const char *snippetPath = NULL;
+    unsigned snippetHalfWidth = DEFAULT_SNIPPET_SAMPLES;
+    int shmUnit = -1;
+    const char *feedName = NULL;
+    bool calibrate = false;
+    const char *calibratePath = NULL;
+    calibration_config_t calibrationConfig;
+    
+    pulse_filter_default_config(&filterConfig);
+    calibration_default_config(&calibrationConfig);
     
     int argIndex = 1;
     while (argIndex < argc) {
@@ -454,6 +955,139 @@ int main(int argc, char *argv[]) {
                 usage(argv[0]);
                 return 1;
             }
+        } else if (strcmp(argv[argIndex], "--mode") == 0) {
+            if (argIndex + 1 < argc && pulse_detector_parse_mode(argv[argIndex + 1], &pulseMode) == 0) {
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --mode requires threshold, cfd or matched\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--cfd-fraction") == 0) {
+            if (argIndex + 1 < argc) {
+                cfdFraction = atof(argv[argIndex + 1]);
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --cfd-fraction requires a value\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--interp") == 0) {
+            if (argIndex + 1 < argc && pulse_detector_parse_interp(argv[argIndex + 1], &pulseInterp) == 0) {
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --interp requires linear or cubic\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--template") == 0) {
+            if (argIndex + 1 < argc) {
+                templatePath = argv[argIndex + 1];
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --template requires a file\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--save-template") == 0) {
+            if (argIndex + 1 < argc) {
+                saveTemplatePath = argv[argIndex + 1];
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --save-template requires a file\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--latency") == 0) {
+            reportLatency = true;
+            argIndex++;
+        } else if (strcmp(argv[argIndex], "--calibrate") == 0) {
+            calibrate = true;
+            argIndex++;
+        } else if (strcmp(argv[argIndex], "--loopback") == 0) {
+            calibrate = true;
+            loopbackMode = true;
+            argIndex++;
+        } else if (strcmp(argv[argIndex], "--calibrate-window") == 0) {
+            if (argIndex + 1 < argc) {
+                calibrate = true;
+                calibrationConfig.window = atof(argv[argIndex + 1]);
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --calibrate-window requires a value\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--calibrate-file") == 0) {
+            if (argIndex + 1 < argc) {
+                calibrate = true;
+                calibratePath = argv[argIndex + 1];
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --calibrate-file requires a file\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--no-track") == 0) {
+            trackPulses = false;
+            argIndex++;
+        } else if (strcmp(argv[argIndex], "--no-filter") == 0) {
+            filterConfig.enabled = false;
+            argIndex++;
+        } else if (strcmp(argv[argIndex], "--filter-mad") == 0) {
+            if (argIndex + 1 < argc) {
+                filterConfig.mad_threshold = atof(argv[argIndex + 1]);
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --filter-mad requires a value\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--smooth") == 0) {
+            if (argIndex + 1 < argc) {
+                filterConfig.smooth_window = (unsigned)atoi(argv[argIndex + 1]);
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --smooth requires a value\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--journal") == 0) {
+            if (argIndex + 1 < argc) {
+                journalPath = argv[argIndex + 1];
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --journal requires a file\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--journal-size") == 0) {
+            if (argIndex + 1 < argc) {
+                journalSize = strtoull(argv[argIndex + 1], NULL, 10);
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --journal-size requires a value\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--snippets") == 0) {
+            if (argIndex + 1 < argc) {
+                snippetPath = argv[argIndex + 1];
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --snippets requires a file\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--snippet-samples") == 0) {
+            if (argIndex + 1 < argc) {
+                snippetHalfWidth = (unsigned)atoi(argv[argIndex + 1]);
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --snippet-samples requires a value\n");
+                usage(argv[0]);
+                return 1;
+            }
         } else if (strcmp(argv[argIndex], "--chrony") == 0) {
             use_chrony = true;
             argIndex++;
@@ -467,6 +1101,36 @@ int main(int argc, char *argv[]) {
                 usage(argv[0]);
                 return 1;
             }
+        } else if (strcmp(argv[argIndex], "--feed") == 0) {
+            if (argIndex + 1 < argc) {
+                feedName = argv[argIndex + 1];
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --feed requires a name\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--shm") == 0) {
+            if (argIndex + 1 < argc) {
+                if (ntp_shm_parse_unit(argv[argIndex + 1], &shmUnit) < 0) {
+                    fprintf(stderr, "Error: shm unit must be a number, not %s\n", argv[argIndex + 1]);
+                    return 1;
+                }
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --shm requires a unit\n");
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[argIndex], "--chrony-queue") == 0) {
+            if (argIndex + 1 < argc) {
+                chronyQueue = (unsigned)atoi(argv[argIndex + 1]);
+                argIndex += 2;
+            } else {
+                fprintf(stderr, "Error: --chrony-queue requires a value\n");
+                usage(argv[0]);
+                return 1;
+            }
         } else if (argv[argIndex][0] != '-') {
             if (deviceUID == NULL) {
                 deviceUID = argv[argIndex];
@@ -483,8 +1147,43 @@ int main(int argc, char *argv[]) {
     
     setup_timebase_info();
     
+    if (calibrate) {
+        pulseCalibration = calibration_create(&calibrationConfig);
+        if (pulseCalibration == NULL) {
+            fprintf(stderr, "Error: Calibration window must be positive\n");
+            return 1;
+        }
+    }
+    if (journalPath) {
+        pulseJournal = pulse_journal_create(journalPath, journalSize,
+                                            timebaseInfo.timebase.numer, timebaseInfo.timebase.denom);
+        if (pulseJournal == NULL) {
+            perror("Failed to create journal");
+            return 1;
+        }
+    }
+    if (feedName) {
+        pulseFeed = pulse_feed_create(feedName, PULSE_FEED_DEFAULT_CAPACITY);
+        if (pulseFeed == NULL) {
+            perror("Failed to create pulse feed");
+            return 1;
+        }
+    }
+    
+    clock_model_config_t clockConfig;
+    clock_model_default_config(&clockConfig);
+    clockModel = clock_model_create(&clockConfig, read_host_time,
+                                    timebaseInfo.timebase.numer, timebaseInfo.timebase.denom);
+    if (clockModel == NULL) {
+        fprintf(stderr, "Failed to start clock model\n");
+        return 1;
+    }
+    
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGUSR1, latency_signal_handler);
+    
+    stageTrace = stage_trace_create(stageNames, STAGE_COUNT);
     
     AudioStreamBasicDescription format;
     memset(&format, 0, sizeof(format));
@@ -496,6 +1195,53 @@ int main(int argc, char *argv[]) {
     format.mBitsPerChannel = 32;
     format.mBytesPerPacket = format.mBytesPerFrame = 4;
     
+    pulse_detector_config_t detectorConfig;
+    pulse_detector_default_config(&detectorConfig);
+    detectorConfig.sample_rate = format.mSampleRate;
+    detectorConfig.ticks_per_second = timebaseInfo.ticks_per_second;
+    detectorConfig.threshold = pulseThreshold;
+    detectorConfig.mode = pulseMode;
+    detectorConfig.cfd_fraction = cfdFraction;
+    detectorConfig.interp = pulseInterp;
+    detectorConfig.track = trackPulses;
+    detectorConfig.level_stats = debugMode;
+    detector = pulse_detector_create(&detectorConfig);
+    if (detector == NULL) {
+        fprintf(stderr, "Failed to create pulse detector\n");
+        return 1;
+    }
+    
+    sample_clock_config_t sampleClockConfig;
+    sample_clock_default_config(&sampleClockConfig);
+    sampleClockConfig.sample_rate = format.mSampleRate;
+    sampleClockConfig.ticks_per_second = timebaseInfo.ticks_per_second;
+    sampleClock = sample_clock_create(&sampleClockConfig);
+    if (sampleClock == NULL) {
+        fprintf(stderr, "Failed to create sample clock tracker\n");
+        return 1;
+    }
+    pulseFilter = pulse_filter_create(&filterConfig);
+    if (pulseFilter == NULL) {
+        fprintf(stderr, "Invalid pulse filter settings (need --filter-mad > 0 and --smooth of 0 or at least 2)\n");
+        return 1;
+    }
+    if (snippetPath) {
+        /* A second of history covers a missed pulse, which is only reported
+         * once its window has passed */
+        size_t history = (size_t)format.mSampleRate + 2 * (size_t)snippetHalfWidth + 1;
+        snippetRecorder = pulse_snippet_recorder_create(snippetHalfWidth, history);
+        snippetSamples = malloc((2 * (size_t)snippetHalfWidth + 1) * sizeof(float));
+        snippetFile = pulse_snippet_file_create(snippetPath, format.mSampleRate);
+        if (snippetRecorder == NULL || snippetSamples == NULL || snippetFile == NULL) {
+            perror("Failed to create snippet file");
+            return 1;
+        }
+    }
+    if (templatePath && pulse_detector_load_template(detector, templatePath) < 0) {
+        fprintf(stderr, "Failed to load template %s (templates need --mode matched)\n", templatePath);
+        return 1;
+    }
+    
     AudioDeviceID selectedDevice = 0;
     
     if (deviceUID) {
@@ -570,16 +1316,59 @@ int main(int argc, char *argv[]) {
     /* Set up chrony client if requested */
     if (use_chrony) {
         chrony_client = chrony_client_create(NULL, remote_path);
-        if (chrony_client == NULL) {
+        if (chrony_client == NULL || chrony_client_set_queue(chrony_client, chronyQueue, CHRONY_CLIENT_DEFAULT_MAX_AGE) < 0) {
             fprintf(stderr, "Failed to setup chrony client\n");
             AudioQueueDispose(audioQueue, true);
             return 1;
         }
     }
     
+    if (shmUnit >= 0) {
+        ntpShm = ntp_shm_create(shmUnit);
+        if (ntpShm == NULL) {
+            perror("Failed to attach NTP SHM segment");
+            AudioQueueDispose(audioQueue, true);
+            return 1;
+        }
+    }
+    
+    pulseRing = spsc_ring_create(PULSE_RING_CAPACITY, sizeof(PulseRecord));
+    if (pulseRing == NULL) {
+        fprintf(stderr, "Failed to create pulse ring\n");
+        AudioQueueDispose(audioQueue, true);
+        return 1;
+    }
+    
+    /* The worker matches clicks heard against the loopback ring, so the
+     * output must be playing before the worker and the input start */
+    if (loopbackMode) {
+        status = start_loopback(&format, deviceUID, kBufferSize);
+        if (status != noErr) {
+            fprintf(stderr, "Error starting loopback output: %d\n", (int)status);
+            if (loopbackQueue) {
+                AudioQueueDispose(loopbackQueue, true);
+            }
+            AudioQueueDispose(audioQueue, true);
+            return 1;
+        }
+    }
+    
+    pthread_t workerThread;
+    if (pthread_create(&workerThread, NULL, pulse_worker, NULL) != 0) {
+        fprintf(stderr, "Failed to start pulse worker thread\n");
+        if (loopbackQueue) {
+            AudioQueueDispose(loopbackQueue, true);
+        }
+        AudioQueueDispose(audioQueue, true);
+        return 1;
+    }
+    
     status = AudioQueueStart(audioQueue, NULL);
     if (status != noErr) {
         fprintf(stderr, "Error starting audio queue: %d\n", (int)status);
+        if (loopbackQueue) {
+            AudioQueueDispose(loopbackQueue, true);
+        }
         AudioQueueDispose(audioQueue, true);
         return 1;
     }
@@ -596,21 +1385,113 @@ int main(int argc, char *argv[]) {
     } else {
         printf("Chrony integration disabled\n");
     }
+    if (ntpShm) {
+        printf("NTP SHM unit: %d\n", ntp_shm_unit(ntpShm));
+    }
+    if (loopbackMode) {
+        printf("Calibrating over %.0f s from clicks played on the output\n", calibrationConfig.window);
+    } else if (pulseCalibration) {
+        printf("Calibrating over %.0f s against the system clock\n", calibrationConfig.window);
+    }
     
     runLoop = CFRunLoopGetCurrent();
     while (keepRunning) {
         CFRunLoopRunInMode(kCFRunLoopDefaultMode, 0.1, false);
+        if (latencyRequested) {
+            latencyRequested = 0;
+            stage_trace_print(stageTrace, stdout);
+        }
     }
     
     printf("\nShutting down...\n");
     
+    if (loopbackQueue) {
+        AudioQueueStop(loopbackQueue, true);
+        AudioQueueDispose(loopbackQueue, true);
+    }
     AudioQueueStop(audioQueue, true);
     AudioQueueDispose(audioQueue, true);
     
+    /* Let the worker drain the ring and exit */
+    workerRunning = false;
+    spsc_ring_wake(pulseRing);
+    pthread_join(workerThread, NULL);
+    printf("Pulse ring: %llu records lost, at most %zu queued\n",
+           (unsigned long long)spsc_ring_overflows(pulseRing), spsc_ring_high_water(pulseRing));
+    spsc_ring_destroy(pulseRing);
+    if (pulseCalibration) {
+        report_calibration(calibratePath);
+        calibration_destroy(pulseCalibration);
+    }
+    spsc_ring_destroy(loopbackRing);
+    if (reportLatency) {
+        stage_trace_print(stageTrace, stdout);
+    }
+    stage_trace_destroy(stageTrace);
+    
+    pulse_detector_status_t lockStatus;
+    pulse_detector_status(detector, &lockStatus);
+    printf("Pulse lock: %s, %llu missed, %llu glitches, lost %llu times\n",
+           pulse_detector_state_name(lockStatus.state), (unsigned long long)lockStatus.missed,
+           (unsigned long long)lockStatus.glitches, (unsigned long long)lockStatus.lost);
+    
+    sample_clock_status_t sampleClockStatus;
+    sample_clock_status(sampleClock, &sampleClockStatus);
+    printf("Sample clock: %.3f Hz (%+.2f ppm), buffer jitter %.0f ns, %llu gaps, %llu samples dropped, %llu jumps\n",
+           sampleClockStatus.rate, sampleClockStatus.rate_ppm, sampleClockStatus.jitter_ns,
+           (unsigned long long)sampleClockStatus.gaps, (unsigned long long)sampleClockStatus.dropped_samples,
+           (unsigned long long)sampleClockStatus.jumps);
+    sample_clock_destroy(sampleClock);
+    
+    pulse_filter_stats_t filterStats;
+    pulse_filter_stats(pulseFilter, &filterStats);
+    printf("Pulse filter: %llu accepted, %llu bad intervals, %llu outliers, smoothing residual %.0f ns RMS\n",
+           (unsigned long long)filterStats.accepted, (unsigned long long)filterStats.rejected_interval,
+           (unsigned long long)filterStats.rejected_outlier, filterStats.residual_rms * 1e9);
+    pulse_filter_destroy(pulseFilter);
+    pulse_journal_close(pulseJournal);
+    pulse_feed_close(pulseFeed);
+    
+    if (snippetRecorder) {
+        pulse_snippet_stats_t snippetStats;
+        pulse_snippet_stats(snippetRecorder, &snippetStats);
+        printf("Snippets: %llu saved, %llu dropped\n",
+               (unsigned long long)snippetStats.snippets, (unsigned long long)snippetStats.dropped);
+        pulse_snippet_recorder_destroy(snippetRecorder);
+        pulse_snippet_file_close(snippetFile);
+        free(snippetSamples);
+    }
+    
+    clock_model_stats_t clockStats;
+    clock_model_stats(clockModel, &clockStats);
+    printf("Clock model: %u points, rate %+.3f ppm, +/-%.0f ns, %llu resets\n",
+           clockStats.fit_points, clockStats.rate_ppm, clockStats.uncertainty_ns,
+           (unsigned long long)clockStats.resets);
+    clock_model_destroy(clockModel);
+    
+    if (ntpShm) {
+        ntp_shm_stats_t shmStats;
+        ntp_shm_stats(ntpShm, &shmStats);
+        printf("NTP SHM unit %d: %llu sent, %llu not read by the consumer\n", ntp_shm_unit(ntpShm),
+               (unsigned long long)shmStats.sent, (unsigned long long)shmStats.unread);
+        ntp_shm_destroy(ntpShm);
+    }
+    
     /* Cleanup chrony client */
     if (chrony_client) {
+        chrony_client_stats_t chronyStats;
+        chrony_client_stats(chrony_client, &chronyStats);
+        printf("Chrony: %llu sent, %llu queued, %llu expired, %llu overflowed, %llu lost, %llu reconnects\n",
+               (unsigned long long)chronyStats.sent, (unsigned long long)chronyStats.queued,
+               (unsigned long long)chronyStats.expired, (unsigned long long)chronyStats.overflows,
+               (unsigned long long)chronyStats.lost, (unsigned long long)chronyStats.reconnects);
         chrony_client_destroy(chrony_client);
     }
     
+    if (saveTemplatePath && pulse_detector_save_template(detector, saveTemplatePath) < 0) {
+        fprintf(stderr, "No template to save to %s\n", saveTemplatePath);
+    }
+    pulse_detector_destroy(detector);
+    
     return 0;
 }
\ No newline at end of file
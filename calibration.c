@@ -0,0 +1,257 @@
+#include "calibration.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+#include <sys/timex.h>
+
+/* MAD of a normal distribution in standard deviations */
+#define MAD_SCALE 1.4826
+
+struct calibration {
+    calibration_config_t config;
+    timens_t *times;
+    double *errors;
+    size_t count;
+    size_t capacity;
+};
+
+void calibration_default_config(calibration_config_t *config) {
+    config->window = 600.0;
+    config->confidence = 0.95;
+    config->reject_mad = 10.0;
+    config->batches = 10;
+}
+
+calibration_t *calibration_create(const calibration_config_t *config) {
+    if (config->window <= 0.0 || config->confidence <= 0.0 || config->confidence >= 1.0
+        || config->reject_mad <= 0.0 || config->batches < 2) {
+        return NULL;
+    }
+    calibration_t *cal = calloc(1, sizeof(calibration_t));
+    if (cal == NULL) {
+        return NULL;
+    }
+    cal->config = *config;
+    return cal;
+}
+
+int calibration_add(calibration_t *cal, timens_t time, double error) {
+    if (cal->count == cal->capacity) {
+        size_t capacity = cal->capacity ? 2 * cal->capacity : 1024;
+        timens_t *times = realloc(cal->times, capacity * sizeof(timens_t));
+        if (times == NULL) {
+            return -1;
+        }
+        cal->times = times;
+        double *errors = realloc(cal->errors, capacity * sizeof(double));
+        if (errors == NULL) {
+            return -1;
+        }
+        cal->errors = errors;
+        cal->capacity = capacity;
+    }
+    cal->times[cal->count] = time;
+    cal->errors[cal->count] = error - round(error);
+    cal->count++;
+    return (double)(time - cal->times[0]) / 1e9 >= cal->config.window ? 1 : 0;
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double sorted_median(const double *sorted, size_t n) {
+    return n % 2 ? sorted[n / 2] : 0.5 * (sorted[n / 2 - 1] + sorted[n / 2]);
+}
+
+/* Standard normal quantile, by bisection of the CDF */
+static double normal_quantile(double p) {
+    double lo = -10.0, hi = 10.0;
+    for (int i = 0; i < 100; i++) {
+        double mid = 0.5 * (lo + hi);
+        if (0.5 * erfc(-mid / M_SQRT2) < p) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    return 0.5 * (lo + hi);
+}
+
+/* Student's t quantile for nu degrees of freedom, from the normal one by
+ * the Cornish-Fisher expansion (Abramowitz and Stegun 26.7.5); good to
+ * better than 1% from 3 degrees of freedom */
+static double t_quantile(double p, double nu) {
+    double z = normal_quantile(p);
+    double z2 = z * z;
+    double g1 = (z2 + 1.0) * z / 4.0;
+    double g2 = ((5.0 * z2 + 16.0) * z2 + 3.0) * z / 96.0;
+    double g3 = (((3.0 * z2 + 19.0) * z2 + 17.0) * z2 - 15.0) * z / 384.0;
+    double g4 = ((((79.0 * z2 + 776.0) * z2 + 1482.0) * z2 - 1920.0) * z2 - 945.0) * z / 92160.0;
+    return z + g1 / nu + g2 / (nu * nu) + g3 / (nu * nu * nu) + g4 / (nu * nu * nu * nu);
+}
+
+int calibration_result(const calibration_t *cal, calibration_result_t *result) {
+    const calibration_config_t *c = &cal->config;
+    size_t n = cal->count;
+    if (n < 2 * (size_t)c->batches) {
+        return -1;
+    }
+
+    double *sorted = malloc(n * sizeof(double));
+    if (sorted == NULL) {
+        return -1;
+    }
+    memcpy(sorted, cal->errors, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_doubles);
+    double median = sorted_median(sorted, n);
+    for (size_t i = 0; i < n; i++) {
+        sorted[i] = fabs(cal->errors[i] - median);
+    }
+    qsort(sorted, n, sizeof(double), compare_doubles);
+    double limit = c->reject_mad * MAD_SCALE * sorted_median(sorted, n);
+    free(sorted);
+
+    /* Moments and the linear trend of the errors that are kept, in order */
+    memset(result, 0, sizeof(*result));
+    double sum = 0.0, sum_sq = 0.0, sum_t = 0.0, sum_tt = 0.0, sum_te = 0.0;
+    size_t kept = 0;
+    for (size_t i = 0; i < n; i++) {
+        double e = cal->errors[i];
+        if (limit > 0.0 && fabs(e - median) > limit) {
+            result->rejected++;
+            continue;
+        }
+        double t = (double)(cal->times[i] - cal->times[0]) / 1e9;
+        sum += e;
+        sum_sq += e * e;
+        sum_t += t;
+        sum_tt += t * t;
+        sum_te += t * e;
+        kept++;
+    }
+    if (kept < 2 * (size_t)c->batches) {
+        return -1;
+    }
+    double mean = sum / (double)kept;
+    double var = (sum_sq - sum * mean) / (double)(kept - 1);
+    double denom = (double)kept * sum_tt - sum_t * sum_t;
+
+    /* Means of consecutive batches of the pulses that are kept */
+    double batch_sum = 0.0, batch_sum_sq = 0.0;
+    size_t index = 0, batch = 0, in_batch = 0;
+    double batch_total = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        double e = cal->errors[i];
+        if (limit > 0.0 && fabs(e - median) > limit) {
+            continue;
+        }
+        batch_total += e;
+        in_batch++;
+        index++;
+        if (index == (batch + 1) * kept / c->batches) {
+            double m = batch_total / (double)in_batch;
+            batch_sum += m;
+            batch_sum_sq += m * m;
+            batch_total = 0.0;
+            in_batch = 0;
+            batch++;
+        }
+    }
+    double batches = (double)c->batches;
+    double batch_mean = batch_sum / batches;
+    double batch_var = (batch_sum_sq - batch_sum * batch_mean) / (batches - 1.0);
+    double half_width = t_quantile(0.5 + c->confidence / 2.0, batches - 1.0)
+        * sqrt(batch_var > 0.0 ? batch_var / batches : 0.0);
+
+    result->pulses = kept;
+    result->span = (double)(cal->times[n - 1] - cal->times[0]) / 1e9;
+    result->mean = mean;
+    result->median = median;
+    result->stddev = sqrt(var > 0.0 ? var : 0.0);
+    result->confidence = c->confidence;
+    result->lower = mean - half_width;
+    result->upper = mean + half_width;
+    result->trend = denom > 0.0 ? ((double)kept * sum_te - sum_t * sum) / denom : 0.0;
+    return 0;
+}
+
+int calibration_reference_error(double *error) {
+    struct timex tx;
+    memset(&tx, 0, sizeof(tx));
+    int state = ntp_adjtime(&tx);
+    if (state < 0 || state == TIME_ERROR) {
+        return -1;
+    }
+    *error = (double)tx.esterror / 1e6;
+    return 0;
+}
+
+/* Bounds of the offset: the scaled bounds of the mean, widened by the
+ * reference error in quadrature */
+static void offset_bounds(const calibration_result_t *result, double scale, double reference_error,
+                          double *offset, double *lower, double *upper) {
+    double half_width = fabs(scale) * (result->upper - result->lower) / 2.0;
+    if (!isnan(reference_error)) {
+        half_width = sqrt(half_width * half_width + reference_error * reference_error);
+    }
+    *offset = scale * result->mean;
+    *lower = *offset - half_width;
+    *upper = *offset + half_width;
+}
+
+void calibration_print(const calibration_result_t *result, double scale, double reference_error, FILE *out) {
+    double offset, lower, upper;
+    offset_bounds(result, scale, reference_error, &offset, &lower, &upper);
+
+    fprintf(out, "Calibration: %llu pulses over %.0f s, %llu outliers left out\n",
+            (unsigned long long)result->pulses, result->span, (unsigned long long)result->rejected);
+    fprintf(out, "Error: mean %.3f us, median %.3f us, SD %.3f us, trend %+.3f us/hour\n",
+            result->mean * 1e6, result->median * 1e6, result->stddev * 1e6, result->trend * 3600.0 * 1e6);
+    fprintf(out, "Mean error: %.3f us, %.0f%% bounds %.3f to %.3f us\n", result->mean * 1e6,
+            result->confidence * 100.0, result->lower * 1e6, result->upper * 1e6);
+    if (!isnan(reference_error)) {
+        fprintf(out, "System clock: estimated error +/-%.3f us\n", reference_error * 1e6);
+    }
+    fprintf(out, "Offset: %.3e (%.3f to %.3f us)\n", offset, lower * 1e6, upper * 1e6);
+}
+
+int calibration_write(const char *path, const char *label, const calibration_result_t *result,
+                      double scale, double reference_error) {
+    double offset, lower, upper;
+    offset_bounds(result, scale, reference_error, &offset, &lower, &upper);
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL) {
+        return -1;
+    }
+    char when[64];
+    time_t now = time(NULL);
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S UTC", gmtime(&now));
+    fprintf(file, "# %s calibration at %s\n", label, when);
+    fprintf(file, "offset %.9f\n", offset);
+    fprintf(file, "lower %.9f\n", lower);
+    fprintf(file, "upper %.9f\n", upper);
+    fprintf(file, "confidence %.3f\n", result->confidence);
+    fprintf(file, "pulses %llu\n", (unsigned long long)result->pulses);
+    fprintf(file, "rejected %llu\n", (unsigned long long)result->rejected);
+    fprintf(file, "span %.3f\n", result->span);
+    fprintf(file, "stddev %.9f\n", result->stddev);
+    fprintf(file, "trend %.3e\n", result->trend);
+    if (!isnan(reference_error)) {
+        fprintf(file, "reference_error %.9f\n", reference_error);
+    }
+    return fclose(file) == 0 ? 0 : -1;
+}
+
+void calibration_destroy(calibration_t *cal) {
+    if (cal == NULL) {
+        return;
+    }
+    free(cal->times);
+    free(cal->errors);
+    free(cal);
+}
@@ -0,0 +1,90 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "timens.h"
+
+/* Estimate of the constant error of a pulse source, for chrony's refclock
+ * offset.
+ *
+ * Each pulse gives an error: how far its system time is from the second it
+ * marks, when the system clock is disciplined by something else, or the
+ * round trip of a click in a loopback test. Over the window the errors are
+ * reduced to a mean, with outliers more than a number of MADs from the
+ * median left out. The errors of successive pulses are correlated (the
+ * system clock wanders, and the sample clock and poll schedule have
+ * memory), so the confidence bounds come from the means of consecutive
+ * batches of pulses, with Student's t, rather than from the spread of
+ * single pulses.
+ */
+
+typedef struct calibration calibration_t;
+
+typedef struct {
+    double window;             /* seconds of pulses to measure */
+    double confidence;         /* two-sided confidence level of the bounds */
+    double reject_mad;         /* leave out errors more than this many MADs from the median */
+    unsigned batches;          /* batches of pulses for the confidence bounds */
+} calibration_config_t;
+
+typedef struct {
+    uint64_t pulses;           /* pulses used */
+    uint64_t rejected;         /* pulses left out as outliers */
+    double span;               /* seconds from the first pulse to the last */
+    double mean;               /* mean error (seconds) */
+    double median;             /* median error (seconds) */
+    double stddev;             /* standard deviation of a single error (seconds) */
+    double confidence;         /* confidence level of the bounds */
+    double lower;              /* confidence bounds on the mean (seconds) */
+    double upper;
+    double trend;              /* slope of the errors over the window (seconds per second) */
+} calibration_result_t;
+
+/* Fill in the default configuration (10 minutes, 95% bounds from 10
+ * batches, outliers at 10 MADs) */
+void calibration_default_config(calibration_config_t *config);
+
+/* Create a calibration
+ * Returns NULL on error
+ */
+calibration_t *calibration_create(const calibration_config_t *config);
+
+/* Add the error of a pulse
+ * time: system time of the pulse
+ * error: seconds, taken modulo one second to within half a second of zero
+ * Returns 1 once the pulses cover the window, 0 before, -1 on error
+ */
+int calibration_add(calibration_t *cal, timens_t time, double error);
+
+/* Work out the result from the pulses so far
+ * Returns 0 on success, -1 if there are too few pulses for the batches
+ */
+int calibration_result(const calibration_t *cal, calibration_result_t *result);
+
+/* Get the kernel's estimate of the system clock's error (seconds), as set
+ * by chronyd or ntpd
+ * Returns 0 on success, -1 if the clock is not synchronised
+ */
+int calibration_reference_error(double *error);
+
+/* Print a result and the offset to use
+ * scale: the offset is scale times the mean error (1 for pulses timed
+ *   against the system clock)
+ * reference_error: error of the system clock (seconds), combined with the
+ *   bounds of the offset in quadrature, or NAN
+ */
+void calibration_print(const calibration_result_t *result, double scale, double reference_error, FILE *out);
+
+/* Save the offset to use and its bounds, as "name value" lines
+ * label: goes in the comment at the top
+ * scale, reference_error: as for calibration_print
+ * Returns 0 on success, -1 on error
+ */
+int calibration_write(const char *path, const char *label, const calibration_result_t *result,
+                      double scale, double reference_error);
+
+/* Destroy a calibration */
+void calibration_destroy(calibration_t *cal);
+
+#endif /* CALIBRATION_H */
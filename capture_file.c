@@ -0,0 +1,282 @@
+#include "capture_file.h"
+#include "timens.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <math.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define WAVE_FORMAT_PCM 1
+#define WAVE_FORMAT_IEEE_FLOAT 3
+#define WAVE_FORMAT_EXTENSIBLE 0xfffe
+
+struct capture_file {
+    FILE *fp;
+    double sample_rate;
+    unsigned channels;
+    unsigned bytes_per_sample;
+    bool is_float;
+    uint64_t frames;
+    uint64_t frames_read;
+    unsigned char *raw;
+    size_t raw_frames;
+    long data_offset;
+    void *map;
+    size_t map_size;
+};
+
+static uint16_t get_le16(const unsigned char *p) {
+    return (uint16_t)(p[0] | (p[1] << 8));
+}
+
+static uint32_t get_le32(const unsigned char *p) {
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/* Parse the rest of a RIFF/WAVE header after the "RIFF" magic,
+ * leaving fp at the start of the data chunk */
+static int parse_wav(capture_file_t *f) {
+    unsigned char hdr[8];
+    if (fread(hdr, 1, sizeof(hdr), f->fp) != sizeof(hdr) || memcmp(hdr + 4, "WAVE", 4) != 0) {
+        fprintf(stderr, "Not a WAVE file\n");
+        return -1;
+    }
+
+    bool have_fmt = false;
+    for (;;) {
+        unsigned char chunk[8];
+        if (fread(chunk, 1, sizeof(chunk), f->fp) != sizeof(chunk)) {
+            fprintf(stderr, "WAVE file has no data chunk\n");
+            return -1;
+        }
+        uint32_t size = get_le32(chunk + 4);
+
+        if (memcmp(chunk, "fmt ", 4) == 0) {
+            unsigned char fmt[40];
+            size_t n = size < sizeof(fmt) ? size : sizeof(fmt);
+            if (n < 16 || fread(fmt, 1, n, f->fp) != n) {
+                fprintf(stderr, "Bad WAVE fmt chunk\n");
+                return -1;
+            }
+            unsigned tag = get_le16(fmt);
+            f->channels = get_le16(fmt + 2);
+            f->sample_rate = get_le32(fmt + 4);
+            unsigned bits = get_le16(fmt + 14);
+            if (tag == WAVE_FORMAT_EXTENSIBLE && n >= 26) {
+                tag = get_le16(fmt + 24);
+            }
+            if (tag == WAVE_FORMAT_IEEE_FLOAT && bits == 32) {
+                f->is_float = true;
+            } else if (tag == WAVE_FORMAT_PCM && bits == 16) {
+                f->is_float = false;
+            } else {
+                fprintf(stderr, "Unsupported WAVE format %u with %u bits\n", tag, bits);
+                return -1;
+            }
+            f->bytes_per_sample = bits / 8;
+            if (f->channels == 0 || f->sample_rate <= 0.0) {
+                fprintf(stderr, "Bad WAVE fmt chunk\n");
+                return -1;
+            }
+            if (fseek(f->fp, (long)(size - n + (size & 1)), SEEK_CUR) < 0) {
+                return -1;
+            }
+            have_fmt = true;
+        } else if (memcmp(chunk, "data", 4) == 0) {
+            if (!have_fmt) {
+                fprintf(stderr, "WAVE data chunk precedes fmt chunk\n");
+                return -1;
+            }
+            f->frames = size / (f->channels * f->bytes_per_sample);
+            return 0;
+        } else if (fseek(f->fp, (long)(size + (size & 1)), SEEK_CUR) < 0) {
+            return -1;
+        }
+    }
+}
+
+capture_file_t *capture_file_open(const char *path, double raw_sample_rate) {
+    capture_file_t *f = calloc(1, sizeof(capture_file_t));
+    if (f == NULL) {
+        return NULL;
+    }
+
+    f->fp = fopen(path, "rb");
+    if (f->fp == NULL) {
+        perror(path);
+        free(f);
+        return NULL;
+    }
+
+    char magic[4];
+    if (fread(magic, 1, sizeof(magic), f->fp) == sizeof(magic) && memcmp(magic, "RIFF", 4) == 0) {
+        if (parse_wav(f) < 0) {
+            capture_file_close(f);
+            return NULL;
+        }
+        f->data_offset = ftell(f->fp);
+    } else {
+        /* Headerless mono float32 */
+        f->sample_rate = raw_sample_rate;
+        f->channels = 1;
+        f->bytes_per_sample = sizeof(float);
+        f->is_float = true;
+        if (fseek(f->fp, 0, SEEK_END) < 0) {
+            perror(path);
+            capture_file_close(f);
+            return NULL;
+        }
+        f->frames = (uint64_t)ftell(f->fp) / sizeof(float);
+        rewind(f->fp);
+    }
+
+    return f;
+}
+
+double capture_file_sample_rate(const capture_file_t *f) {
+    return f->sample_rate;
+}
+
+uint64_t capture_file_frames(const capture_file_t *f) {
+    return f->frames;
+}
+
+size_t capture_file_read(capture_file_t *f, float *buf, size_t count) {
+    size_t frame_bytes = f->channels * f->bytes_per_sample;
+
+    if (count > f->frames - f->frames_read) {
+        count = (size_t)(f->frames - f->frames_read);
+    }
+    if (count > f->raw_frames) {
+        unsigned char *raw = realloc(f->raw, count * frame_bytes);
+        if (raw == NULL) {
+            return 0;
+        }
+        f->raw = raw;
+        f->raw_frames = count;
+    }
+
+    size_t n = fread(f->raw, frame_bytes, count, f->fp);
+    for (size_t i = 0; i < n; i++) {
+        const unsigned char *p = f->raw + i * frame_bytes;
+        if (f->is_float) {
+            memcpy(&buf[i], p, sizeof(float));
+        } else {
+            buf[i] = (int16_t)get_le16(p) / 32768.0f;
+        }
+    }
+    f->frames_read += n;
+    return n;
+}
+
+static void sleep_until_ns(timens_t deadline) {
+#ifdef __linux__
+    struct timespec ts;
+    timens_to_timespec(deadline, &ts);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+#else
+    timens_t delta = deadline - timens_now(CLOCK_MONOTONIC);
+    if (delta > 0) {
+        struct timespec ts;
+        timens_to_timespec(delta, &ts);
+        nanosleep(&ts, NULL);
+    }
+#endif
+}
+
+/* Host time of a frame, rounded to the nearest nanosecond */
+static timens_t frame_time(timens_t start, uint64_t frames, double sample_rate) {
+    return start + (timens_t)llround((double)frames * 1e9 / sample_rate);
+}
+
+int capture_file_replay(capture_file_t *f, size_t block_size, bool realtime,
+                        capture_block_fn fn, void *ctx, volatile sig_atomic_t *stop) {
+    if (block_size == 0) {
+        return -1;
+    }
+
+    float *block = malloc(block_size * sizeof(float));
+    if (block == NULL) {
+        return -1;
+    }
+
+    timens_t start = realtime ? timens_now(CLOCK_MONOTONIC) : 0;
+    uint64_t frames = 0;
+    size_t n;
+
+    while ((stop == NULL || !*stop) && (n = capture_file_read(f, block, block_size)) > 0) {
+        uint64_t host_time = (uint64_t)frame_time(start, frames, f->sample_rate);
+        frames += n;
+        if (realtime) {
+            /* A live block is delivered once its last sample has arrived */
+            sleep_until_ns(frame_time(start, frames, f->sample_rate));
+        }
+        fn(ctx, block, n, host_time);
+    }
+
+    free(block);
+    return ferror(f->fp) ? -1 : 0;
+}
+
+int capture_file_map(capture_file_t *f, capture_view_t *view) {
+    if (f->map == NULL) {
+        struct stat st;
+        if (fstat(fileno(f->fp), &st) < 0 || st.st_size <= f->data_offset) {
+            return -1;
+        }
+        void *map = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fileno(f->fp), 0);
+        if (map == MAP_FAILED) {
+            return -1;
+        }
+        madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+        f->map = map;
+        f->map_size = (size_t)st.st_size;
+    }
+
+    /* Don't trust the header beyond the end of the file */
+    size_t frame_bytes = f->channels * f->bytes_per_sample;
+    uint64_t available = (f->map_size - (size_t)f->data_offset) / frame_bytes;
+
+    view->data = (const unsigned char *)f->map + f->data_offset;
+    view->frames = f->frames < available ? f->frames : available;
+    view->sample_rate = f->sample_rate;
+    view->channels = f->channels;
+    view->bytes_per_sample = f->bytes_per_sample;
+    view->is_float = f->is_float;
+    return 0;
+}
+
+const float *capture_view_samples(const capture_view_t *view, uint64_t frame, size_t count, float *buf) {
+    size_t frame_bytes = view->channels * view->bytes_per_sample;
+    const unsigned char *p = view->data + frame * frame_bytes;
+
+    if (view->is_float && view->channels == 1 && (uintptr_t)p % _Alignof(float) == 0) {
+        return (const float *)p;
+    }
+    for (size_t i = 0; i < count; i++, p += frame_bytes) {
+        if (view->is_float) {
+            memcpy(&buf[i], p, sizeof(float));
+        } else {
+            buf[i] = (int16_t)get_le16(p) / 32768.0f;
+        }
+    }
+    return buf;
+}
+
+void capture_file_close(capture_file_t *f) {
+    if (f == NULL) {
+        return;
+    }
+    if (f->map) {
+        munmap(f->map, f->map_size);
+    }
+    if (f->fp) {
+        fclose(f->fp);
+    }
+    free(f->raw);
+    free(f);
+}
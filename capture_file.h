@@ -0,0 +1,79 @@
+#ifndef CAPTURE_FILE_H
+#define CAPTURE_FILE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+
+/* File replay capture backend.
+ *
+ * Reads a recorded capture and delivers it in blocks, the same way the
+ * audio queue delivers live input. Supported formats are WAV (16-bit PCM or
+ * 32-bit float, any channel count; channel 0 is used) and headerless mono
+ * float32 in native byte order.
+ */
+
+typedef struct capture_file capture_file_t;
+
+/* Called once per block
+ * samples, count: mono float samples
+ * host_time: time of the first sample in nanoseconds
+ */
+typedef void (*capture_block_fn)(void *ctx, const float *samples, size_t count, uint64_t host_time);
+
+/* Open a capture file
+ * path: WAV file, or raw float32 file
+ * raw_sample_rate: sample rate to assume when the file has no header
+ * Returns NULL on error
+ */
+capture_file_t *capture_file_open(const char *path, double raw_sample_rate);
+
+/* Get the sample rate of the capture */
+double capture_file_sample_rate(const capture_file_t *f);
+
+/* Get the number of frames in the capture */
+uint64_t capture_file_frames(const capture_file_t *f);
+
+/* Read up to count frames of channel 0 into buf
+ * Returns the number of frames read, 0 at end of file
+ */
+size_t capture_file_read(capture_file_t *f, float *buf, size_t count);
+
+/* Feed the whole capture to fn in blocks of block_size frames
+ * realtime: pace delivery to the sample rate, with host times taken from
+ *           CLOCK_MONOTONIC; otherwise run at maximum speed with host times
+ *           synthesized from the frame count, starting at 0
+ * stop: if not NULL, replay ends early when *stop becomes non-zero
+ * Returns 0 on success, -1 on error
+ */
+int capture_file_replay(capture_file_t *f, size_t block_size, bool realtime,
+                        capture_block_fn fn, void *ctx, volatile sig_atomic_t *stop);
+
+/* A capture mapped into memory, for access from several threads at once */
+typedef struct {
+    const unsigned char *data; /* first frame */
+    uint64_t frames;
+    double sample_rate;
+    unsigned channels;
+    unsigned bytes_per_sample;
+    bool is_float;
+} capture_view_t;
+
+/* Map the whole capture into memory; the mapping lasts until the file is
+ * closed
+ * Returns 0 on success, -1 on error
+ */
+int capture_file_map(capture_file_t *f, capture_view_t *view);
+
+/* Get count mono samples of channel 0 starting at frame from a mapped
+ * capture. Mono float32 captures are returned straight from the mapping;
+ * anything else is converted into buf, which must hold count samples.
+ * Returns a pointer to the samples
+ */
+const float *capture_view_samples(const capture_view_t *view, uint64_t frame, size_t count, float *buf);
+
+/* Close the capture file */
+void capture_file_close(capture_file_t *f);
+
+#endif /* CAPTURE_FILE_H */
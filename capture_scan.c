@@ -0,0 +1,283 @@
+#include "capture_scan.h"
+#include "timens.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <pthread.h>
+
+#define MAX_EVENTS 16
+
+/* Chunks per thread when the size is picked automatically, so that a
+ * slow chunk doesn't leave the other threads idle at the end */
+#define CHUNKS_PER_THREAD 4
+
+/* Smallest automatic chunk, in multiples of the pre-roll, to keep the
+ * extra work at chunk boundaries small */
+#define MIN_CHUNK_PREROLLS 16
+
+typedef struct {
+    pulse_event_t *events;
+    size_t count;
+    size_t capacity;
+    uint64_t dropped;
+} chunk_result_t;
+
+typedef struct {
+    const capture_scan_config_t *config;
+    capture_view_t view;
+    const float *template_pulse;
+    size_t template_len;
+    double template_origin;
+    uint64_t chunk_frames;
+    uint64_t preroll;
+    uint64_t tail;
+    size_t chunks;
+    chunk_result_t *results;
+    volatile sig_atomic_t *stop;
+    _Atomic size_t next;
+    _Atomic bool failed;
+} scan_t;
+
+void capture_scan_default_config(capture_scan_config_t *config) {
+    memset(config, 0, sizeof(*config));
+    pulse_detector_default_config(&config->detector);
+    config->detector.level_stats = false;
+    config->threads = 4;
+    config->block_size = 4096;
+}
+
+/* Host time of a frame, rounded to the nearest nanosecond, as capture_file_replay */
+static uint64_t frame_time(uint64_t frames, double sample_rate) {
+    return (uint64_t)llround((double)frames * 1e9 / sample_rate);
+}
+
+static int add_event(chunk_result_t *r, const pulse_event_t *event) {
+    if (r->count == r->capacity) {
+        size_t capacity = r->capacity ? r->capacity * 2 : 256;
+        pulse_event_t *events = realloc(r->events, capacity * sizeof(pulse_event_t));
+        if (events == NULL) {
+            return -1;
+        }
+        r->events = events;
+        r->capacity = capacity;
+    }
+    r->events[r->count++] = *event;
+    return 0;
+}
+
+static pulse_detector_t *make_detector(const scan_t *scan) {
+    pulse_detector_t *det = pulse_detector_create(&scan->config->detector);
+    if (det == NULL || scan->template_pulse == NULL) {
+        return det;
+    }
+    if (pulse_detector_set_template(det, scan->template_pulse, scan->template_len) < 0 ||
+        pulse_detector_set_template_origin(det, scan->template_origin) < 0) {
+        pulse_detector_destroy(det);
+        return NULL;
+    }
+    return det;
+}
+
+static int scan_chunk(scan_t *scan, pulse_detector_t *det, float *buf, size_t k) {
+    const capture_view_t *view = &scan->view;
+    size_t block_size = scan->config->block_size;
+    uint64_t begin = k * scan->chunk_frames;
+    uint64_t end = begin + scan->chunk_frames < view->frames ? begin + scan->chunk_frames : view->frames;
+    /* Start on a block boundary of the sequential pass, so that blocks and
+     * the indexes of pulses within them come out the same */
+    uint64_t from = begin > scan->preroll ? begin - scan->preroll : 0;
+    from -= from % block_size;
+    uint64_t to = end + scan->tail < view->frames ? end + scan->tail : view->frames;
+    chunk_result_t *r = &scan->results[k];
+    pulse_event_t events[MAX_EVENTS];
+
+    pulse_detector_reset(det);
+    for (uint64_t pos = from; pos < to; pos += block_size) {
+        if (scan->stop && *scan->stop) {
+            break;
+        }
+        size_t n = to - pos < block_size ? (size_t)(to - pos) : block_size;
+        const float *samples = capture_view_samples(view, pos, n, buf);
+        size_t count = pulse_detector_process(det, samples, n, frame_time(pos, view->sample_rate),
+                                              events, MAX_EVENTS);
+        for (size_t i = 0; i < count; i++) {
+            /* The detector counts samples from where this chunk started */
+            events[i].sample_pos += (double)from;
+            if (events[i].sample_pos >= (double)begin && events[i].sample_pos < (double)end &&
+                add_event(r, &events[i]) < 0) {
+                return -1;
+            }
+        }
+    }
+    r->dropped = pulse_detector_dropped(det);
+    return 0;
+}
+
+static void *worker(void *arg) {
+    scan_t *scan = arg;
+    pulse_detector_t *det = make_detector(scan);
+    float *buf = malloc(scan->config->block_size * sizeof(float));
+
+    if (det == NULL || buf == NULL) {
+        atomic_store(&scan->failed, true);
+    } else {
+        size_t k;
+        while (!atomic_load(&scan->failed) && (k = atomic_fetch_add(&scan->next, 1)) < scan->chunks) {
+            if (scan_chunk(scan, det, buf, k) < 0) {
+                atomic_store(&scan->failed, true);
+            }
+        }
+    }
+    free(buf);
+    pulse_detector_destroy(det);
+    return NULL;
+}
+
+/* Learn a matched filter template from the start of the capture */
+static int learn_template(scan_t *scan, float **pulse) {
+    const capture_view_t *view = &scan->view;
+    size_t block_size = scan->config->block_size;
+    size_t len = scan->config->detector.template_len;
+    pulse_event_t events[MAX_EVENTS];
+    int result = -1;
+
+    pulse_detector_t *det = pulse_detector_create(&scan->config->detector);
+    float *buf = malloc(block_size * sizeof(float));
+    *pulse = malloc(len * sizeof(float));
+    if (det == NULL || buf == NULL || *pulse == NULL) {
+        goto done;
+    }
+    for (uint64_t pos = 0; pos < view->frames && !pulse_detector_template_ready(det); pos += block_size) {
+        if (scan->stop && *scan->stop) {
+            goto done;
+        }
+        size_t n = view->frames - pos < block_size ? (size_t)(view->frames - pos) : block_size;
+        pulse_detector_process(det, capture_view_samples(view, pos, n, buf), n,
+                               frame_time(pos, view->sample_rate), events, MAX_EVENTS);
+    }
+    if (pulse_detector_get_template(det, *pulse, len) == len) {
+        scan->template_pulse = *pulse;
+        scan->template_len = len;
+        scan->template_origin = pulse_detector_template_origin(det);
+        result = 0;
+    }
+done:
+    free(buf);
+    pulse_detector_destroy(det);
+    return result;
+}
+
+int capture_scan(capture_file_t *capture, const capture_scan_config_t *config,
+                 capture_scan_result_t *result, volatile sig_atomic_t *stop) {
+    const pulse_detector_config_t *dc = &config->detector;
+    scan_t scan;
+    float *learned = NULL;
+
+    if (config->threads == 0 || config->block_size == 0) {
+        return -1;
+    }
+    memset(&scan, 0, sizeof(scan));
+    memset(result, 0, sizeof(*result));
+    scan.config = config;
+    scan.stop = stop;
+    scan.template_pulse = config->template_pulse;
+    scan.template_len = config->template_len;
+    scan.template_origin = config->template_origin;
+    atomic_init(&scan.next, 0);
+    atomic_init(&scan.failed, false);
+
+    if (capture_file_map(capture, &scan.view) < 0) {
+        return -1;
+    }
+    if (dc->mode == PULSE_MODE_MATCHED && scan.template_pulse == NULL && learn_template(&scan, &learned) < 0) {
+        free(learned);
+        return -1;
+    }
+
+    /* Enough audio before each chunk to see the previous pulse and its
+     * holdoff, and to lock on when tracking; enough after it to finish a
+     * pulse that starts at the very end */
+    double preroll = dc->holdoff + dc->period;
+    if (dc->track) {
+        preroll += (dc->acquire_pulses + 1) * dc->period;
+    }
+    scan.preroll = (uint64_t)ceil(preroll * scan.view.sample_rate);
+    scan.tail = dc->pre_trigger + dc->pulse_window + dc->template_len + 2 * config->block_size;
+
+    scan.chunk_frames = config->chunk_frames;
+    if (scan.chunk_frames == 0) {
+        scan.chunk_frames = scan.view.frames / (config->threads * CHUNKS_PER_THREAD) + 1;
+        if (scan.chunk_frames < MIN_CHUNK_PREROLLS * scan.preroll) {
+            scan.chunk_frames = MIN_CHUNK_PREROLLS * scan.preroll;
+        }
+    }
+    scan.chunks = (size_t)((scan.view.frames + scan.chunk_frames - 1) / scan.chunk_frames);
+    scan.results = calloc(scan.chunks ? scan.chunks : 1, sizeof(chunk_result_t));
+    if (scan.results == NULL) {
+        free(learned);
+        return -1;
+    }
+
+    unsigned threads = config->threads < scan.chunks ? config->threads : (unsigned)scan.chunks;
+    pthread_t *ids = calloc(threads ? threads : 1, sizeof(pthread_t));
+    unsigned started = 0;
+    if (ids != NULL) {
+        for (; started + 1 < threads; started++) {
+            if (pthread_create(&ids[started], NULL, worker, &scan) != 0) {
+                break;
+            }
+        }
+    }
+    worker(&scan);
+    for (unsigned t = 0; t < started; t++) {
+        pthread_join(ids[t], NULL);
+    }
+    free(ids);
+    free(learned);
+
+    /* Chunks are in order, so the merged pulses are too */
+    size_t total = 0;
+    for (size_t k = 0; k < scan.chunks; k++) {
+        total += scan.results[k].count;
+    }
+    bool failed = atomic_load(&scan.failed);
+    if (!failed && total > 0) {
+        result->events = malloc(total * sizeof(pulse_event_t));
+        failed = result->events == NULL;
+    }
+    for (size_t k = 0; k < scan.chunks; k++) {
+        chunk_result_t *r = &scan.results[k];
+        if (!failed) {
+            for (size_t i = 0; i < r->count; i++) {
+                result->events[result->count] = r->events[i];
+                result->events[result->count].seq = result->count + 1;
+                result->count++;
+            }
+            result->dropped += r->dropped;
+        }
+        free(r->events);
+    }
+    free(scan.results);
+    if (failed) {
+        capture_scan_free(result);
+        return -1;
+    }
+
+    for (size_t k = 0; k < scan.chunks; k++) {
+        uint64_t begin = k * scan.chunk_frames;
+        uint64_t end = begin + scan.chunk_frames < scan.view.frames ? begin + scan.chunk_frames : scan.view.frames;
+        result->overlap_frames += (begin > scan.preroll ? scan.preroll : begin)
+                                + (end + scan.tail < scan.view.frames ? scan.tail : scan.view.frames - end);
+    }
+    result->frames = scan.view.frames;
+    result->chunks = scan.chunks;
+    return 0;
+}
+
+void capture_scan_free(capture_scan_result_t *result) {
+    free(result->events);
+    result->events = NULL;
+    result->count = 0;
+}
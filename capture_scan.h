@@ -0,0 +1,59 @@
+#ifndef CAPTURE_SCAN_H
+#define CAPTURE_SCAN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <signal.h>
+#include "capture_file.h"
+#include "pulse_detector.h"
+
+/* Parallel pulse detection over a whole capture.
+ *
+ * The capture is memory mapped and cut into chunks, which worker threads
+ * take in turn. Each chunk is run through its own detector, starting
+ * early enough before the chunk for the detector to settle (and lock on,
+ * when tracking) and running on past the end until any pulse that started
+ * inside the chunk is complete. A pulse belongs to the chunk its edge
+ * falls in, so pulses near a boundary are neither lost nor reported
+ * twice. The pulses of all chunks are merged in order and numbered as a
+ * single detector would number them.
+ *
+ * In matched mode the template is learned first, from the start of the
+ * capture, and shared with every chunk, unless one has been set already.
+ */
+
+typedef struct {
+    pulse_detector_config_t detector;
+    unsigned threads;          /* worker threads */
+    size_t block_size;         /* samples per detector block */
+    size_t chunk_frames;       /* frames per chunk (0 picks a size from the capture and thread count) */
+    const float *template_pulse;  /* matched mode template, or NULL to learn one */
+    size_t template_len;
+    double template_origin;
+} capture_scan_config_t;
+
+typedef struct {
+    pulse_event_t *events;     /* pulses in order */
+    size_t count;
+    uint64_t frames;           /* frames scanned */
+    uint64_t overlap_frames;   /* frames scanned more than once */
+    size_t chunks;
+    uint64_t dropped;          /* pulses that did not fit in a detector's event array */
+} capture_scan_result_t;
+
+/* Fill in the default configuration (default detector, 4 threads, 4096
+ * sample blocks, automatic chunk size) */
+void capture_scan_default_config(capture_scan_config_t *config);
+
+/* Scan a capture
+ * stop: if not NULL, the scan ends early when *stop becomes non-zero
+ * Returns 0 on success, -1 on error; on success result must be freed
+ * with capture_scan_free
+ */
+int capture_scan(capture_file_t *capture, const capture_scan_config_t *config,
+                 capture_scan_result_t *result, volatile sig_atomic_t *stop);
+
+/* Free the pulses of a scan */
+void capture_scan_free(capture_scan_result_t *result);
+
+#endif /* CAPTURE_SCAN_H */
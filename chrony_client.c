@@ -1,77 +1,188 @@
 #include "chrony_client.h"
+#include "timens.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdbool.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/stat.h>
 #include <errno.h>
 
 #define DEFAULT_LOCAL_PATH_FORMAT "/tmp/pps-chrony%d.sock"
-#define SOCK_MAGIC 0x534f434b
-
-struct sock_sample {
-    struct timeval tv;
-    double offset;
-    int pulse;
-    int leap;
-    int _pad;
-    int magic;
-};
+
+/* Reconnection backoff, doubling from the first to the last */
+#define MIN_BACKOFF_NS (250 * TIMENS_PER_MSEC)
+#define MAX_BACKOFF_NS (8 * TIMENS_PER_SEC)
+
+typedef struct {
+    struct sock_sample sample;
+    timens_t queued_at;        /* CLOCK_MONOTONIC */
+} queued_sample_t;
 
 struct chrony_client {
     int sock_fd;
     char local_path[256];
     char remote_path[256];
+    struct sockaddr_un remote_addr;
+    bool connected;
+    bool ever_connected;
+    timens_t retry_at;         /* CLOCK_MONOTONIC time of the next connection attempt */
+    timens_t backoff;
+    queued_sample_t queue[CHRONY_CLIENT_MAX_QUEUE];
+    unsigned depth;
+    unsigned queue_head;       /* oldest queued sample */
+    unsigned queue_count;
+    timens_t max_age;
+    chrony_client_stats_t stats;
 };
 
+/* Errors that mean chronyd's socket is not there or not being read */
+static bool peer_gone(int err) {
+    return err == ENOENT || err == ECONNREFUSED || err == ECONNRESET || err == ENOTCONN ||
+           err == EPIPE || err == EDESTADDRREQ;
+}
+
+static void schedule_retry(chrony_client_t *client, timens_t now) {
+    client->retry_at = now + client->backoff;
+    client->backoff *= 2;
+    if (client->backoff > MAX_BACKOFF_NS) {
+        client->backoff = MAX_BACKOFF_NS;
+    }
+}
+
+static void try_connect(chrony_client_t *client, timens_t now) {
+    if (connect(client->sock_fd, (struct sockaddr *)&client->remote_addr, sizeof(client->remote_addr)) == 0) {
+        if (client->ever_connected) {
+            client->stats.reconnects++;
+            fprintf(stderr, "Reconnected to chrony socket %s\n", client->remote_path);
+        }
+        client->connected = true;
+        client->ever_connected = true;
+        client->backoff = MIN_BACKOFF_NS;
+        return;
+    }
+    /* Only say so once per outage */
+    if (client->backoff == MIN_BACKOFF_NS) {
+        fprintf(stderr, "Chrony socket %s unavailable (%s); retrying\n", client->remote_path, strerror(errno));
+    }
+    schedule_retry(client, now);
+}
+
+/* Returns 0 if sent, -1 if not */
+static int send_sample(chrony_client_t *client, const struct sock_sample *sample, timens_t now) {
+    if (send(client->sock_fd, sample, sizeof(*sample), 0) == (ssize_t)sizeof(*sample)) {
+        client->stats.sent++;
+        return 0;
+    }
+    int err = errno;
+    if (peer_gone(err)) {
+        client->connected = false;
+        client->backoff = MIN_BACKOFF_NS;
+        /* Try again on the next sample, then back off */
+        client->retry_at = now;
+    } else if (err != EAGAIN && err != EWOULDBLOCK && err != ENOBUFS) {
+        perror("send");
+    }
+    return -1;
+}
+
+/* Send queued samples, oldest first, dropping any that have expired */
+static void flush_queue(chrony_client_t *client, timens_t now) {
+    while (client->queue_count > 0 && client->connected) {
+        queued_sample_t *q = &client->queue[client->queue_head];
+        if (now - q->queued_at > client->max_age) {
+            client->stats.expired++;
+        } else if (send_sample(client, &q->sample, now) < 0) {
+            return;
+        }
+        client->queue_head = (client->queue_head + 1) % CHRONY_CLIENT_MAX_QUEUE;
+        client->queue_count--;
+    }
+}
+
+static void enqueue(chrony_client_t *client, const struct sock_sample *sample, timens_t now) {
+    if (client->queue_count == client->depth) {
+        client->queue_head = (client->queue_head + 1) % CHRONY_CLIENT_MAX_QUEUE;
+        client->queue_count--;
+        client->stats.overflows++;
+    }
+    queued_sample_t *q = &client->queue[(client->queue_head + client->queue_count) % CHRONY_CLIENT_MAX_QUEUE];
+    q->sample = *sample;
+    q->queued_at = now;
+    client->queue_count++;
+    client->stats.queued++;
+}
+
 chrony_client_t *chrony_client_create(const char *local_path_format, const char *remote_path) {
     if (remote_path == NULL) {
         return NULL;
     }
-    
-    chrony_client_t *client = malloc(sizeof(chrony_client_t));
+    /* A truncated path would name some other socket */
+    if (strlen(remote_path) >= sizeof(((struct sockaddr_un *)0)->sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
+    chrony_client_t *client = calloc(1, sizeof(chrony_client_t));
     if (client == NULL) {
         return NULL;
     }
-    
+
     client->sock_fd = -1;
     client->local_path[0] = '\0';
-    strncpy(client->remote_path, remote_path, sizeof(client->remote_path) - 1);
-    client->remote_path[sizeof(client->remote_path) - 1] = '\0';
-    
+    strcpy(client->remote_path, remote_path);
+    client->remote_addr.sun_family = AF_UNIX;
+    strcpy(client->remote_addr.sun_path, client->remote_path);
+    client->backoff = MIN_BACKOFF_NS;
+    client->depth = CHRONY_CLIENT_DEFAULT_QUEUE;
+    client->max_age = (timens_t)(CHRONY_CLIENT_DEFAULT_MAX_AGE * TIMENS_PER_SEC);
+
     if (local_path_format == NULL) {
         local_path_format = DEFAULT_LOCAL_PATH_FORMAT;
     }
-    
+
     pid_t pid = getpid();
-    snprintf(client->local_path, sizeof(client->local_path), local_path_format, pid);
-    
+    int len = snprintf(client->local_path, sizeof(client->local_path), local_path_format, pid);
+    if (len < 0 || (size_t)len >= sizeof(client->remote_addr.sun_path)) {
+        free(client);
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+
     /* Remove any existing socket */
     unlink(client->local_path);
-    
-    /* Create socket */
+
+    /* Create socket; sends must never hold up the caller */
     client->sock_fd = socket(AF_UNIX, SOCK_DGRAM, 0);
     if (client->sock_fd < 0) {
         perror("socket");
         free(client);
         return NULL;
     }
-    
+    int flags = fcntl(client->sock_fd, F_GETFL);
+    if (flags < 0 || fcntl(client->sock_fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("fcntl");
+        close(client->sock_fd);
+        free(client);
+        return NULL;
+    }
+
     /* Bind to local path */
     struct sockaddr_un local_addr;
     memset(&local_addr, 0, sizeof(local_addr));
     local_addr.sun_family = AF_UNIX;
-    strncpy(local_addr.sun_path, client->local_path, sizeof(local_addr.sun_path) - 1);
-    
+    strcpy(local_addr.sun_path, client->local_path);
+
     if (bind(client->sock_fd, (struct sockaddr *)&local_addr, sizeof(local_addr)) < 0) {
         perror("bind");
         close(client->sock_fd);
         free(client);
         return NULL;
     }
-    
+
     /* Set permissions */
     if (chmod(client->local_path, 0660) < 0) {
         perror("chmod");
@@ -80,15 +191,31 @@ chrony_client_t *chrony_client_create(const char *local_path_format, const char
         free(client);
         return NULL;
     }
-    
+
+    /* chronyd may not be up yet; sending will keep trying */
+    try_connect(client, timens_now(CLOCK_MONOTONIC));
     return client;
 }
 
+int chrony_client_set_queue(chrony_client_t *client, unsigned depth, double max_age) {
+    if (client == NULL || depth > CHRONY_CLIENT_MAX_QUEUE || max_age < 0.0) {
+        return -1;
+    }
+    while (client->queue_count > depth) {
+        client->queue_head = (client->queue_head + 1) % CHRONY_CLIENT_MAX_QUEUE;
+        client->queue_count--;
+        client->stats.overflows++;
+    }
+    client->depth = depth;
+    client->max_age = (timens_t)(max_age * TIMENS_PER_SEC);
+    return 0;
+}
+
 int chrony_client_send_pps(chrony_client_t *client, const struct timeval *tv, double offset) {
     if (client == NULL || client->sock_fd < 0 || tv == NULL) {
         return -1;
     }
-    
+
     struct sock_sample sample;
     memset(&sample, 0, sizeof(sample));
     sample.tv = *tv;
@@ -96,20 +223,28 @@ int chrony_client_send_pps(chrony_client_t *client, const struct timeval *tv, do
     sample.pulse = 1;  /* This is a PPS signal */
     sample.leap = 0;   /* No leap second info */
     sample.magic = SOCK_MAGIC;
-    
-    struct sockaddr_un remote_addr;
-    memset(&remote_addr, 0, sizeof(remote_addr));
-    remote_addr.sun_family = AF_UNIX;
-    strncpy(remote_addr.sun_path, client->remote_path, sizeof(remote_addr.sun_path) - 1);
-    
-    ssize_t sent = sendto(client->sock_fd, &sample, sizeof(sample), 0,
-                         (struct sockaddr *)&remote_addr, sizeof(remote_addr));
-    if (sent < 0) {
-        perror("sendto");
+
+    timens_t now = timens_now(CLOCK_MONOTONIC);
+    if (!client->connected && now >= client->retry_at) {
+        try_connect(client, now);
+    }
+    if (client->connected) {
+        flush_queue(client, now);
+        if (client->queue_count == 0 && send_sample(client, &sample, now) == 0) {
+            return 0;
+        }
+    }
+
+    if (client->depth == 0) {
+        client->stats.lost++;
         return -1;
     }
-    
-    return 0;
+    enqueue(client, &sample, now);
+    return 1;
+}
+
+void chrony_client_stats(const chrony_client_t *client, chrony_client_stats_t *stats) {
+    *stats = client->stats;
 }
 
 const char *chrony_client_remote_path(chrony_client_t *client) {
@@ -124,14 +259,14 @@ void chrony_client_destroy(chrony_client_t *client) {
     if (client == NULL) {
         return;
     }
-    
+
     if (client->sock_fd >= 0) {
         close(client->sock_fd);
     }
-    
+
     if (strlen(client->local_path) > 0) {
         unlink(client->local_path);
     }
-    
+
     free(client);
-}
\ No newline at end of file
+}
@@ -1,25 +1,75 @@
 #ifndef CHRONY_CLIENT_H
 #define CHRONY_CLIENT_H
 
+#include <stdint.h>
 #include <sys/time.h>
 
+/* Client for chronyd's SOCK refclock.
+ *
+ * The socket is connected to chronyd once and samples are sent without
+ * blocking. If chronyd is not listening (it hasn't started, or has been
+ * restarted), the client reconnects with exponential backoff, keeping the
+ * last few samples in a queue to send once it is back, as long as they
+ * are not too old by then.
+ */
+
+#define SOCK_MAGIC 0x534f434b
+
+/* Sample sent to a SOCK refclock, as defined by chrony */
+struct sock_sample {
+    struct timeval tv;
+    double offset;
+    int pulse;
+    int leap;
+    int _pad;
+    int magic;
+};
+
 typedef struct chrony_client chrony_client_t;
 
+typedef struct {
+    uint64_t sent;             /* samples delivered */
+    uint64_t queued;           /* samples that had to wait in the queue */
+    uint64_t expired;          /* queued samples dropped for being too old */
+    uint64_t overflows;        /* queued samples pushed out by newer ones */
+    uint64_t lost;             /* samples that could not be sent or queued */
+    uint64_t reconnects;       /* times the connection was restored */
+} chrony_client_stats_t;
+
+#define CHRONY_CLIENT_DEFAULT_QUEUE 4
+#define CHRONY_CLIENT_DEFAULT_MAX_AGE 4.0
+#define CHRONY_CLIENT_MAX_QUEUE 64
+
 /* Create a new chrony client
  * local_path_format: format string for local socket path (must contain %d for PID)
- * remote_path: path to chrony socket
- * Returns NULL on error
+ * remote_path: path to chrony socket; chronyd need not be listening yet
+ * Returns NULL on error, with errno ENAMETOOLONG if either path does not
+ * fit in a socket address
  */
 chrony_client_t *chrony_client_create(const char *local_path_format, const char *remote_path);
 
-/* Send a PPS sample to chrony
- * client: chrony client instance
- * tv: system time when pulse was detected
- * offset: offset between true time and system time (in seconds)
+/* Set how many samples are kept while chronyd is unreachable, and how
+ * old (in seconds) a queued sample may get before it is dropped
+ * depth: 0 disables the queue; at most CHRONY_CLIENT_MAX_QUEUE
+ *   (default CHRONY_CLIENT_DEFAULT_QUEUE samples up to
+ *   CHRONY_CLIENT_DEFAULT_MAX_AGE seconds old)
  * Returns 0 on success, -1 on error
  */
+int chrony_client_set_queue(chrony_client_t *client, unsigned depth, double max_age);
+
+/* Send a PPS sample to chrony, after any queued samples
+ * client: chrony client instance
+ * tv: system time when pulse was detected (the protocol only has microseconds)
+ * offset: offset between true time and system time (in seconds); a double
+ *   less than a second carries full nanosecond precision
+ * Returns 0 if the sample was sent, 1 if it was queued to send later,
+ *   -1 if it was lost
+ */
 int chrony_client_send_pps(chrony_client_t *client, const struct timeval *tv, double offset);
 
+/* Get the delivery counters */
+void chrony_client_stats(const chrony_client_t *client, chrony_client_stats_t *stats);
+
 /* Get the remote socket path */
 const char *chrony_client_remote_path(chrony_client_t *client);
 
@@ -29,4 +79,4 @@ const char *chrony_client_local_path(chrony_client_t *client);
 /* Destroy chrony client and cleanup sockets */
 void chrony_client_destroy(chrony_client_t *client);
 
-#endif /* CHRONY_CLIENT_H */
\ No newline at end of file
+#endif /* CHRONY_CLIENT_H */
@@ -0,0 +1,294 @@
+#include "clock_model.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <pthread.h>
+
+#define CACHE_LINE 64
+
+/* The narrowest sandwich of a burst */
+typedef struct {
+    uint64_t host;             /* midpoint of the two host clock reads */
+    timens_t real;             /* realtime */
+    double width_ns;           /* time between the two host clock reads */
+} sandwich_t;
+
+/* Everything readers see, published under the sequence lock */
+typedef struct {
+    bool valid;
+    uint64_t host_ref;
+    timens_t real_ref;
+    double ns_per_tick;
+    double uncertainty_ns;
+    clock_model_stats_t stats;
+} published_t;
+
+struct clock_model {
+    /* Odd while the writer is updating published */
+    _Alignas(CACHE_LINE) _Atomic unsigned seq;
+    published_t published;
+
+    /* Only used by the model thread */
+    _Alignas(CACHE_LINE) clock_model_config_t config;
+    clock_model_host_fn read_host;
+    uint32_t numer;
+    uint32_t denom;
+    double nominal_ns_per_tick;
+    sandwich_t *points;
+    unsigned count;
+    unsigned next;
+    published_t current;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool stopping;
+};
+
+void clock_model_default_config(clock_model_config_t *config) {
+    config->burst = 16;
+    config->interval_ms = 250;
+    config->window = 64;
+    config->step_threshold = 0.001;
+}
+
+static sandwich_t take_burst(clock_model_t *model) {
+    sandwich_t best = { 0, 0, INFINITY };
+
+    for (unsigned k = 0; k < model->config.burst; k++) {
+        struct timespec ts;
+        uint64_t before = model->read_host();
+        clock_gettime(CLOCK_REALTIME, &ts);
+        uint64_t after = model->read_host();
+
+        double width = (double)timens_from_ticks(after - before, model->numer, model->denom);
+        if (width < best.width_ns) {
+            best.host = before + (after - before) / 2;
+            best.real = timens_from_timespec(&ts);
+            best.width_ns = width;
+        }
+    }
+    return best;
+}
+
+static void publish(clock_model_t *model) {
+    unsigned seq = atomic_load_explicit(&model->seq, memory_order_relaxed);
+    atomic_store_explicit(&model->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    model->published = model->current;
+    atomic_store_explicit(&model->seq, seq + 2, memory_order_release);
+}
+
+/* Least squares fit of realtime against host time over the window,
+ * relative to the newest point so that doubles keep full precision */
+static void fit(clock_model_t *model) {
+    unsigned n = model->count;
+    unsigned size = model->config.window;
+    const sandwich_t *ref = &model->points[(model->next + size - 1) % size];
+    double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0, width = 0.0;
+
+    for (unsigned k = 0; k < n; k++) {
+        const sandwich_t *p = &model->points[k];
+        double x = (double)(int64_t)(p->host - ref->host);
+        double y = (double)(p->real - ref->real);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+        width += p->width_ns;
+    }
+
+    double mx = sx / n, my = sy / n;
+    double vxx = sxx - sx * mx;
+    double slope = model->nominal_ns_per_tick;
+    if (n >= 2 && vxx > 0.0) {
+        slope = (sxy - sx * my) / vxx;
+    }
+    double intercept = my - slope * mx;
+
+    double residual = 0.0;
+    for (unsigned k = 0; k < n; k++) {
+        const sandwich_t *p = &model->points[k];
+        double x = (double)(int64_t)(p->host - ref->host);
+        double e = (double)(p->real - ref->real) - (intercept + slope * x);
+        residual += e * e;
+    }
+    double rms = n > 2 ? sqrt(residual / (n - 2)) : 0.0;
+    double half_width = width / n / 2.0;
+
+    published_t *cur = &model->current;
+    cur->valid = true;
+    cur->host_ref = ref->host;
+    cur->real_ref = ref->real + (int64_t)llround(intercept);
+    cur->ns_per_tick = slope;
+    cur->uncertainty_ns = sqrt(rms * rms + half_width * half_width);
+    cur->stats.fit_points = n;
+    cur->stats.rate_ppm = (slope / model->nominal_ns_per_tick - 1.0) * 1e6;
+    cur->stats.width_ns = ref->width_ns;
+    cur->stats.uncertainty_ns = cur->uncertainty_ns;
+}
+
+static void add_point(clock_model_t *model) {
+    sandwich_t point = take_burst(model);
+    published_t *cur = &model->current;
+
+    /* A point far off the fit means the realtime clock was stepped */
+    if (cur->valid) {
+        double x = (double)(int64_t)(point.host - cur->host_ref);
+        double predicted = (double)(cur->real_ref - point.real) + x * cur->ns_per_tick;
+        if (fabs(predicted) > model->config.step_threshold * 1e9) {
+            model->count = 0;
+            model->next = 0;
+            cur->stats.resets++;
+        }
+    }
+
+    model->points[model->next] = point;
+    model->next = (model->next + 1) % model->config.window;
+    if (model->count < model->config.window) {
+        model->count++;
+    }
+    cur->stats.points++;
+
+    fit(model);
+    publish(model);
+}
+
+/* Wait on the condition until a CLOCK_MONOTONIC deadline, so that steps
+ * of the system clock this model follows don't stretch or cut the interval
+ * Returns 0 when woken, ETIMEDOUT at the deadline
+ */
+static int wait_until(clock_model_t *model, timens_t deadline) {
+    struct timespec ts;
+#ifdef __APPLE__
+    /* No pthread_condattr_setclock, so wait for the time left */
+    timens_t left = deadline - timens_now(CLOCK_MONOTONIC);
+    if (left <= 0) {
+        return ETIMEDOUT;
+    }
+    timens_to_timespec(left, &ts);
+    return pthread_cond_timedwait_relative_np(&model->cond, &model->lock, &ts);
+#else
+    timens_to_timespec(deadline, &ts);
+    return pthread_cond_timedwait(&model->cond, &model->lock, &ts);
+#endif
+}
+
+static void *model_thread(void *arg) {
+    clock_model_t *model = arg;
+
+    pthread_mutex_lock(&model->lock);
+    while (!model->stopping) {
+        timens_t deadline = timens_now(CLOCK_MONOTONIC) + (timens_t)model->config.interval_ms * TIMENS_PER_MSEC;
+        int rc = 0;
+        while (!model->stopping && rc != ETIMEDOUT) {
+            rc = wait_until(model, deadline);
+        }
+        if (model->stopping) {
+            break;
+        }
+        pthread_mutex_unlock(&model->lock);
+        add_point(model);
+        pthread_mutex_lock(&model->lock);
+    }
+    pthread_mutex_unlock(&model->lock);
+    return NULL;
+}
+
+clock_model_t *clock_model_create(const clock_model_config_t *config, clock_model_host_fn read_host,
+                                  uint32_t numer, uint32_t denom) {
+    if (config->burst == 0 || config->window == 0 || config->interval_ms == 0 || numer == 0 || denom == 0) {
+        return NULL;
+    }
+
+    clock_model_t *model = aligned_alloc(CACHE_LINE, (sizeof(clock_model_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    if (model == NULL) {
+        return NULL;
+    }
+    memset(model, 0, sizeof(*model));
+    atomic_init(&model->seq, 0);
+    model->config = *config;
+    model->read_host = read_host;
+    model->numer = numer;
+    model->denom = denom;
+    model->nominal_ns_per_tick = (double)numer / (double)denom;
+
+    model->points = calloc(config->window, sizeof(sandwich_t));
+    if (model->points == NULL) {
+        free(model);
+        return NULL;
+    }
+
+    add_point(model);
+
+    pthread_mutex_init(&model->lock, NULL);
+#ifdef __APPLE__
+    pthread_cond_init(&model->cond, NULL);
+#else
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&model->cond, &attr);
+    pthread_condattr_destroy(&attr);
+#endif
+    if (pthread_create(&model->thread, NULL, model_thread, model) != 0) {
+        pthread_cond_destroy(&model->cond);
+        pthread_mutex_destroy(&model->lock);
+        free(model->points);
+        free(model);
+        return NULL;
+    }
+    return model;
+}
+
+/* Copy the published model, retrying if the writer was part way through */
+static void read_published(clock_model_t *model, published_t *out) {
+    unsigned before, after;
+    do {
+        before = atomic_load_explicit(&model->seq, memory_order_acquire);
+        *out = model->published;
+        atomic_thread_fence(memory_order_acquire);
+        after = atomic_load_explicit(&model->seq, memory_order_relaxed);
+    } while ((before & 1) || before != after);
+}
+
+int clock_model_convert(clock_model_t *model, uint64_t host, timens_t *real_ns, double *uncertainty_ns) {
+    published_t p;
+    read_published(model, &p);
+    if (!p.valid) {
+        return -1;
+    }
+
+    double offset = (double)(int64_t)(host - p.host_ref) * p.ns_per_tick;
+    *real_ns = p.real_ref + (timens_t)llround(offset);
+    if (uncertainty_ns) {
+        *uncertainty_ns = p.uncertainty_ns;
+    }
+    return 0;
+}
+
+void clock_model_stats(clock_model_t *model, clock_model_stats_t *stats) {
+    published_t p;
+    read_published(model, &p);
+    *stats = p.stats;
+}
+
+void clock_model_destroy(clock_model_t *model) {
+    if (model == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&model->lock);
+    model->stopping = true;
+    pthread_cond_signal(&model->cond);
+    pthread_mutex_unlock(&model->lock);
+    pthread_join(model->thread, NULL);
+
+    pthread_cond_destroy(&model->cond);
+    pthread_mutex_destroy(&model->lock);
+    free(model->points);
+    free(model);
+}
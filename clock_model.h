@@ -0,0 +1,65 @@
+#ifndef CLOCK_MODEL_H
+#define CLOCK_MODEL_H
+
+#include <stdint.h>
+#include "timens.h"
+
+/* Model of the realtime clock as a linear function of a host clock.
+ *
+ * A background thread periodically takes a burst of host/realtime/host
+ * "sandwiches", keeps the narrowest one of each burst and fits an offset
+ * and rate to the most recent of them. Conversions read the published
+ * model without locking or making system calls, so they are cheap enough
+ * for the pulse path. If the realtime clock is stepped the fit starts
+ * again from the new point.
+ */
+
+typedef struct clock_model clock_model_t;
+
+/* Reads the host clock, e.g. mach_absolute_time */
+typedef uint64_t (*clock_model_host_fn)(void);
+
+typedef struct {
+    unsigned burst;            /* sandwiches per burst */
+    unsigned interval_ms;      /* time between bursts */
+    unsigned window;           /* number of bursts in the fit */
+    double step_threshold;     /* fit error (seconds) treated as a step of the realtime clock */
+} clock_model_config_t;
+
+typedef struct {
+    uint64_t points;           /* bursts taken */
+    uint64_t resets;           /* times the fit was restarted after a step */
+    unsigned fit_points;       /* bursts in the current fit */
+    double rate_ppm;           /* fitted rate relative to the nominal host clock rate */
+    double width_ns;           /* width of the narrowest sandwich of the last burst */
+    double uncertainty_ns;     /* estimated uncertainty of a conversion */
+} clock_model_stats_t;
+
+/* Fill in the default configuration (16 sandwiches every 250ms, fitted
+ * over the last 64 bursts, steps over 1ms) */
+void clock_model_default_config(clock_model_config_t *config);
+
+/* Create a model and start its thread. The first burst is taken before
+ * returning, so conversions work straight away.
+ * read_host: function reading the host clock
+ * numer, denom: nominal host clock timebase; ticks * numer / denom is
+ *   nanoseconds (as mach_timebase_info)
+ * Returns NULL on error
+ */
+clock_model_t *clock_model_create(const clock_model_config_t *config, clock_model_host_fn read_host,
+                                  uint32_t numer, uint32_t denom);
+
+/* Convert a host clock time to realtime
+ * real_ns: nanoseconds since the epoch
+ * uncertainty_ns: estimated uncertainty of the result (may be NULL)
+ * Returns 0 on success, -1 if there is no model yet
+ */
+int clock_model_convert(clock_model_t *model, uint64_t host, timens_t *real_ns, double *uncertainty_ns);
+
+/* Get statistics about the fit */
+void clock_model_stats(clock_model_t *model, clock_model_stats_t *stats);
+
+/* Stop the thread and destroy the model */
+void clock_model_destroy(clock_model_t *model);
+
+#endif /* CLOCK_MODEL_H */
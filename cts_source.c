@@ -0,0 +1,329 @@
+#include "cts_source.h"
+#include "timens.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+
+#define TRACE_HEADER "# pollpps trace v1: monotonic_ns realtime_ns since_ns status"
+
+struct cts_source {
+    cts_source_kind_t kind;
+    int fd;
+    poll_schedule_t *sched;
+    int64_t wake_latency;
+
+    bool have_status;
+    int status;
+    int64_t last_time;
+
+    FILE *trace;
+    bool realtime;
+    int64_t replay_offset;
+    bool pending;              /* next holds a change read from the trace */
+    cts_sample_t next;
+
+    FILE *record;
+};
+
+static cts_source_t *source_new(cts_source_kind_t kind) {
+    cts_source_t *src = calloc(1, sizeof(cts_source_t));
+    if (src == NULL) {
+        return NULL;
+    }
+    src->kind = kind;
+    src->fd = -1;
+    return src;
+}
+
+cts_source_t *cts_source_open_poll(int fd, poll_schedule_t *sched) {
+    cts_source_t *src = source_new(CTS_SOURCE_POLL);
+    if (src == NULL) {
+        return NULL;
+    }
+    src->fd = fd;
+    src->sched = sched;
+    return src;
+}
+
+cts_source_t *cts_source_open_wait(int fd, timens_t wake_latency) {
+#ifdef TIOCMIWAIT
+    if (wake_latency <= 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    cts_source_t *src = source_new(CTS_SOURCE_WAIT);
+    if (src == NULL) {
+        return NULL;
+    }
+    src->fd = fd;
+    src->wake_latency = wake_latency;
+    return src;
+#else
+    (void)fd;
+    (void)wake_latency;
+    errno = ENOTSUP;
+    return NULL;
+#endif
+}
+
+cts_source_t *cts_source_open_trace(const char *path, bool realtime) {
+    FILE *trace = fopen(path, "r");
+    if (trace == NULL) {
+        return NULL;
+    }
+    cts_source_t *src = source_new(CTS_SOURCE_TRACE);
+    if (src == NULL) {
+        fclose(trace);
+        return NULL;
+    }
+    src->trace = trace;
+    src->realtime = realtime;
+    return src;
+}
+
+int cts_source_parse_kind(const char *name, cts_source_kind_t *kind) {
+    if (strcmp(name, "poll") == 0) {
+        *kind = CTS_SOURCE_POLL;
+    } else if (strcmp(name, "wait") == 0) {
+        *kind = CTS_SOURCE_WAIT;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+cts_source_kind_t cts_source_kind(const cts_source_t *src) {
+    return src->kind;
+}
+
+int cts_source_record(cts_source_t *src, const char *path) {
+    FILE *record = fopen(path, "w");
+    if (record == NULL) {
+        return -1;
+    }
+    cts_source_write_header(record);
+    if (src->record) {
+        fclose(src->record);
+    }
+    src->record = record;
+    return 0;
+}
+
+/* Report status if CTS differs from the last status reported */
+static bool changed(cts_source_t *src, int status) {
+    if (src->have_status && ((status ^ src->status) & TIOCM_CTS) == 0) {
+        return false;
+    }
+    src->have_status = true;
+    src->status = status;
+    return true;
+}
+
+/* Write a change to the trace being recorded, if any */
+static void record_sample(cts_source_t *src, const cts_sample_t *sample) {
+    if (src->record) {
+        cts_source_write_sample(src->record, sample);
+        fflush(src->record);
+    }
+}
+
+/* Poll once at the time planned by the schedule */
+static int step_poll(cts_source_t *src, cts_sample_t *sample) {
+    int64_t time = poll_schedule_begin(src->sched);
+    int64_t real = timens_now(CLOCK_REALTIME);
+    int status;
+
+    if (ioctl(src->fd, TIOCMGET, &status) < 0) {
+        return -1;
+    }
+    int64_t read_at = poll_schedule_now();
+    poll_schedule_polled(src->sched, read_at);
+
+    int64_t since = src->have_status ? src->last_time : time;
+    src->last_time = time;
+    if (changed(src, status)) {
+        sample->time = time;
+        sample->real = real;
+        sample->since = since;
+        sample->status = status;
+        sample->read_at = read_at;
+        return 1;
+    }
+    return 0;
+}
+
+static int read_wait(cts_source_t *src, cts_sample_t *sample, volatile sig_atomic_t *stop) {
+#ifdef TIOCMIWAIT
+    while (!*stop) {
+        /* The first status is read straight away */
+        if (src->have_status && ioctl(src->fd, TIOCMIWAIT, TIOCM_CTS) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        int64_t time = poll_schedule_now();
+        int64_t real = timens_now(CLOCK_REALTIME);
+        int status;
+
+        if (ioctl(src->fd, TIOCMGET, &status) < 0) {
+            return -1;
+        }
+        int64_t read_at = poll_schedule_now();
+
+        /* The change reached us some USB transfer and wake-up after it
+         * happened, so that is the bound on its time */
+        if (changed(src, status)) {
+            sample->time = time;
+            sample->real = real;
+            sample->since = time - src->wake_latency;
+            sample->status = status;
+            sample->read_at = read_at;
+            return 1;
+        }
+        /* CTS changed back before it could be read: the pulse is lost */
+    }
+    return 0;
+#else
+    (void)src;
+    (void)sample;
+    (void)stop;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+/* Read the next change from the trace, unless it has been read already */
+static int next_trace(cts_source_t *src) {
+    char line[256];
+
+    if (src->pending) {
+        return 1;
+    }
+    while (fgets(line, sizeof(line), src->trace)) {
+        if (line[0] == '#' || line[0] == '\n') {
+            continue;
+        }
+        cts_sample_t *next = &src->next;
+        if (sscanf(line, "%" SCNd64 " %" SCNd64 " %" SCNd64 " %d",
+                   &next->time, &next->real, &next->since, &next->status) != 4) {
+            errno = EINVAL;
+            return -1;
+        }
+        next->read_at = next->time;
+        if (src->realtime && !src->have_status) {
+            src->replay_offset = poll_schedule_now() - next->time;
+        }
+        src->pending = true;
+        return 1;
+    }
+    if (ferror(src->trace)) {
+        return -1;
+    }
+    return 0;
+}
+
+int cts_source_due(cts_source_t *src, timens_t *due) {
+    switch (src->kind) {
+    case CTS_SOURCE_POLL:
+        *due = poll_schedule_next(src->sched, NULL);
+        return 1;
+    case CTS_SOURCE_TRACE: {
+        int result = next_trace(src);
+        if (result > 0) {
+            *due = src->realtime ? src->next.time + src->replay_offset : poll_schedule_now();
+        }
+        return result;
+    }
+    default:
+        errno = ENOTSUP;
+        return -1;
+    }
+}
+
+int cts_source_step(cts_source_t *src, cts_sample_t *sample) {
+    int result;
+
+    switch (src->kind) {
+    case CTS_SOURCE_POLL:
+        result = step_poll(src, sample);
+        break;
+    case CTS_SOURCE_TRACE:
+        if (!src->pending) {
+            return 0;
+        }
+        *sample = src->next;
+        src->pending = false;
+        src->have_status = true;
+        src->status = sample->status;
+        result = 1;
+        break;
+    default:
+        errno = ENOTSUP;
+        return -1;
+    }
+
+    if (result > 0) {
+        record_sample(src, sample);
+    }
+    return result;
+}
+
+int cts_source_read(cts_source_t *src, cts_sample_t *sample, volatile sig_atomic_t *stop) {
+    if (src->kind == CTS_SOURCE_WAIT) {
+        int result = read_wait(src, sample, stop);
+        if (result > 0) {
+            record_sample(src, sample);
+        }
+        return result;
+    }
+
+    while (!*stop) {
+        timens_t due;
+        int result = cts_source_due(src, &due);
+        if (result <= 0) {
+            return result;
+        }
+        if (due > poll_schedule_now()) {
+            poll_schedule_sleep_until(due);
+        }
+        result = cts_source_step(src, sample);
+        if (result != 0) {
+            return result;
+        }
+    }
+    return 0;
+}
+
+void cts_source_edge(const cts_sample_t *sample, timens_t *edge, timens_t *edge_real, timens_t *resolution) {
+    *edge = sample->since + (sample->time - sample->since) / 2;
+    *edge_real = sample->real - (sample->time - *edge);
+    *resolution = sample->time - *edge;
+}
+
+void cts_source_write_header(FILE *trace) {
+    fprintf(trace, "%s\n", TRACE_HEADER);
+}
+
+void cts_source_write_sample(FILE *trace, const cts_sample_t *sample) {
+    fprintf(trace, "%" PRId64 " %" PRId64 " %" PRId64 " %d\n",
+            sample->time, sample->real, sample->since, sample->status);
+}
+
+void cts_source_close(cts_source_t *src) {
+    if (src == NULL) {
+        return;
+    }
+    if (src->trace) {
+        fclose(src->trace);
+    }
+    if (src->record) {
+        fclose(src->record);
+    }
+    free(src);
+}
@@ -0,0 +1,113 @@
+#ifndef CTS_SOURCE_H
+#define CTS_SOURCE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <signal.h>
+#include "poll_schedule.h"
+#include "timens.h"
+
+/* Sources of modem status changes for pollpps.
+ *
+ * The poll source calls TIOCMGET on the poll schedule. The wait source
+ * blocks in TIOCMIWAIT and timestamps the change as soon as it wakes up,
+ * taking it to have happened up to a wake-up latency before; it is only
+ * available on Linux. The trace source replays changes
+ * recorded from either of the others, so edge handling can be exercised
+ * without an adapter attached.
+ */
+
+typedef struct cts_source cts_source_t;
+
+/* Time a CTS change can take to wake TIOCMIWAIT: the adapter reports the
+ * modem status with its next USB transfer, then the waiter is scheduled */
+#define CTS_SOURCE_DEFAULT_WAKE_LATENCY_US 1000
+
+typedef enum {
+    CTS_SOURCE_POLL,
+    CTS_SOURCE_WAIT,
+    CTS_SOURCE_TRACE
+} cts_source_kind_t;
+
+typedef struct {
+    timens_t time;             /* CLOCK_MONOTONIC when the change was seen */
+    timens_t real;             /* CLOCK_REALTIME at the same moment */
+    timens_t since;            /* CLOCK_MONOTONIC of the previous observation; the
+                                  change happened in (since, time] */
+    int status;                /* TIOCM_* modem status bits */
+    timens_t read_at;          /* CLOCK_MONOTONIC when the status had been read */
+} cts_sample_t;
+
+/* Poll fd with TIOCMGET at the times given by sched, which stays owned
+ * by the caller
+ * Returns NULL on error
+ */
+cts_source_t *cts_source_open_poll(int fd, poll_schedule_t *sched);
+
+/* Wait for CTS changes on fd with TIOCMIWAIT
+ * wake_latency: nanoseconds a change can take to wake the wait (> 0); the
+ *   change is taken to have happened in that time before the wake-up
+ * Returns NULL on error; errno is ENOTSUP where TIOCMIWAIT is not available
+ */
+cts_source_t *cts_source_open_wait(int fd, timens_t wake_latency);
+
+/* Replay a trace written by cts_source_record
+ * realtime: reproduce the recorded spacing of changes instead of
+ * replaying as fast as possible
+ * Returns NULL on error
+ */
+cts_source_t *cts_source_open_trace(const char *path, bool realtime);
+
+/* Parse a source name ("poll" or "wait") */
+int cts_source_parse_kind(const char *name, cts_source_kind_t *kind);
+
+/* Get the kind of a source */
+cts_source_kind_t cts_source_kind(const cts_source_t *src);
+
+/* Write every change read from now on to a trace file
+ * Returns 0 on success, -1 on error
+ */
+int cts_source_record(cts_source_t *src, const char *path);
+
+/* Wait for the next change of modem status
+ * The first status read is always reported as a change.
+ * stop: reading gives up when this becomes non-zero
+ * Returns 1 if sample was filled in, 0 at the end of a trace or when
+ * stopped, -1 on error with errno set
+ */
+int cts_source_read(cts_source_t *src, cts_sample_t *sample, volatile sig_atomic_t *stop);
+
+/* Find when a poll or trace source next needs to be stepped, for callers
+ * with their own event loop; cts_source_read is a loop of this, a sleep
+ * and cts_source_step
+ * due: CLOCK_MONOTONIC time to call cts_source_step
+ * Returns 1 if due was set, 0 at the end of a trace, -1 on error with
+ * errno set (ENOTSUP for the wait source)
+ */
+int cts_source_due(cts_source_t *src, timens_t *due);
+
+/* Poll once, or take the next change from a trace, once it is due
+ * Returns 1 if the status changed and sample was filled in, 0 if not,
+ * -1 on error with errno set
+ */
+int cts_source_step(cts_source_t *src, cts_sample_t *sample);
+
+/* Estimate when the edge reported by a change happened: halfway through
+ * (since, time], give or take half of that
+ * edge: CLOCK_MONOTONIC of the edge
+ * edge_real: CLOCK_REALTIME of the edge
+ * resolution: half the width of the interval
+ */
+void cts_source_edge(const cts_sample_t *sample, timens_t *edge, timens_t *edge_real, timens_t *resolution);
+
+/* Write the header of a trace file */
+void cts_source_write_header(FILE *trace);
+
+/* Write a change to a trace file, in the format cts_source_open_trace reads */
+void cts_source_write_sample(FILE *trace, const cts_sample_t *sample);
+
+/* Close the source and any trace being recorded */
+void cts_source_close(cts_source_t *src);
+
+#endif /* CTS_SOURCE_H */
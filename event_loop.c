@@ -0,0 +1,265 @@
+#include "event_loop.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#else
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#endif
+
+#define MAX_FDS 32
+#define MAX_EVENTS 16
+#define NO_DEADLINE INT64_MAX
+
+typedef struct {
+    bool active;
+    int fd;
+    event_loop_fn fn;
+    void *arg;
+} watch_t;
+
+typedef struct {
+    bool used;
+    timens_t deadline;         /* NO_DEADLINE when disarmed */
+    event_loop_fn fn;
+    void *arg;
+} loop_timer_t;
+
+struct event_loop {
+    int poll_fd;               /* epoll or kqueue */
+#ifdef __linux__
+    int timer_fd;
+    timens_t timer_armed;      /* deadline set in timer_fd */
+#endif
+    watch_t watches[MAX_FDS];
+    loop_timer_t timers[EVENT_LOOP_MAX_TIMERS];
+    bool stopped;
+};
+
+event_loop_t *event_loop_create(void) {
+    event_loop_t *loop = calloc(1, sizeof(event_loop_t));
+    if (loop == NULL) {
+        return NULL;
+    }
+#ifdef __linux__
+    loop->poll_fd = epoll_create1(EPOLL_CLOEXEC);
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    loop->timer_armed = NO_DEADLINE;
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    if (loop->poll_fd < 0 || loop->timer_fd < 0 ||
+        epoll_ctl(loop->poll_fd, EPOLL_CTL_ADD, loop->timer_fd, &ev) < 0) {
+        int saved = errno;
+        if (loop->poll_fd >= 0) {
+            close(loop->poll_fd);
+        }
+        if (loop->timer_fd >= 0) {
+            close(loop->timer_fd);
+        }
+        free(loop);
+        errno = saved;
+        return NULL;
+    }
+#else
+    loop->poll_fd = kqueue();
+    if (loop->poll_fd < 0) {
+        free(loop);
+        return NULL;
+    }
+#endif
+    return loop;
+}
+
+int event_loop_add_fd(event_loop_t *loop, int fd, event_loop_fn fn, void *arg) {
+    watch_t *watch = NULL;
+    for (int i = 0; i < MAX_FDS; i++) {
+        if (!loop->watches[i].active) {
+            watch = &loop->watches[i];
+            break;
+        }
+    }
+    if (watch == NULL) {
+        errno = ENOSPC;
+        return -1;
+    }
+#ifdef __linux__
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = watch;
+    if (epoll_ctl(loop->poll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        return -1;
+    }
+#else
+    struct kevent ev;
+    EV_SET(&ev, fd, EVFILT_READ, EV_ADD, 0, 0, watch);
+    if (kevent(loop->poll_fd, &ev, 1, NULL, 0, NULL) < 0) {
+        return -1;
+    }
+#endif
+    watch->active = true;
+    watch->fd = fd;
+    watch->fn = fn;
+    watch->arg = arg;
+    return 0;
+}
+
+void event_loop_remove_fd(event_loop_t *loop, int fd) {
+    for (int i = 0; i < MAX_FDS; i++) {
+        watch_t *watch = &loop->watches[i];
+        if (watch->active && watch->fd == fd) {
+#ifdef __linux__
+            epoll_ctl(loop->poll_fd, EPOLL_CTL_DEL, fd, NULL);
+#else
+            struct kevent ev;
+            EV_SET(&ev, fd, EVFILT_READ, EV_DELETE, 0, 0, NULL);
+            kevent(loop->poll_fd, &ev, 1, NULL, 0, NULL);
+#endif
+            /* Events already fetched for it are skipped */
+            watch->active = false;
+        }
+    }
+}
+
+int event_loop_add_timer(event_loop_t *loop, event_loop_fn fn, void *arg) {
+    for (int i = 0; i < EVENT_LOOP_MAX_TIMERS; i++) {
+        loop_timer_t *timer = &loop->timers[i];
+        if (!timer->used) {
+            timer->used = true;
+            timer->deadline = NO_DEADLINE;
+            timer->fn = fn;
+            timer->arg = arg;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void event_loop_set_timer(event_loop_t *loop, int timer, timens_t deadline) {
+    loop->timers[timer].deadline = deadline;
+}
+
+void event_loop_cancel_timer(event_loop_t *loop, int timer) {
+    loop->timers[timer].deadline = NO_DEADLINE;
+}
+
+void event_loop_stop(event_loop_t *loop) {
+    loop->stopped = true;
+}
+
+/* Call every timer that is due, and return the earliest deadline left */
+static timens_t run_timers(event_loop_t *loop) {
+    timens_t now = timens_now(CLOCK_MONOTONIC);
+    timens_t next = NO_DEADLINE;
+
+    for (int i = 0; i < EVENT_LOOP_MAX_TIMERS && !loop->stopped; i++) {
+        loop_timer_t *timer = &loop->timers[i];
+        if (timer->used && timer->deadline <= now) {
+            timer->deadline = NO_DEADLINE;
+            timer->fn(timer->arg);
+        }
+    }
+    for (int i = 0; i < EVENT_LOOP_MAX_TIMERS; i++) {
+        if (loop->timers[i].used && loop->timers[i].deadline < next) {
+            next = loop->timers[i].deadline;
+        }
+    }
+    return next;
+}
+
+static void dispatch(event_loop_t *loop, watch_t *watch) {
+    if (watch->active && !loop->stopped) {
+        watch->fn(watch->arg);
+    }
+}
+
+/* Wait until input arrives or the deadline passes */
+static int wait_events(event_loop_t *loop, timens_t deadline) {
+#ifdef __linux__
+    if (deadline != loop->timer_armed) {
+        struct itimerspec spec;
+        memset(&spec, 0, sizeof(spec));
+        if (deadline != NO_DEADLINE) {
+            /* A zero it_value disarms, so the earliest possible expiry is 1ns */
+            timens_to_timespec(deadline > 0 ? deadline : 1, &spec.it_value);
+        }
+        if (timerfd_settime(loop->timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+            return -1;
+        }
+        loop->timer_armed = deadline;
+    }
+
+    struct epoll_event events[MAX_EVENTS];
+    int n = epoll_wait(loop->poll_fd, events, MAX_EVENTS, -1);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        if (events[i].data.ptr == NULL) {
+            uint64_t expirations;
+            if (read(loop->timer_fd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+                return -1;
+            }
+            loop->timer_armed = NO_DEADLINE;
+        } else {
+            dispatch(loop, events[i].data.ptr);
+        }
+    }
+#else
+    struct timespec timeout;
+    struct timespec *timeout_ptr = NULL;
+    if (deadline != NO_DEADLINE) {
+        /* kqueue only has relative timeouts; the deadline is still
+         * absolute, so waking late does not accumulate */
+        timens_t delta = deadline - timens_now(CLOCK_MONOTONIC);
+        timens_to_timespec(delta > 0 ? delta : 0, &timeout);
+        timeout_ptr = &timeout;
+    }
+
+    struct kevent events[MAX_EVENTS];
+    int n = kevent(loop->poll_fd, NULL, 0, events, MAX_EVENTS, timeout_ptr);
+    if (n < 0) {
+        return errno == EINTR ? 0 : -1;
+    }
+    for (int i = 0; i < n; i++) {
+        dispatch(loop, events[i].udata);
+    }
+#endif
+    return 0;
+}
+
+int event_loop_run(event_loop_t *loop, volatile sig_atomic_t *stop) {
+    while (!*stop && !loop->stopped) {
+        timens_t next = run_timers(loop);
+        if (*stop || loop->stopped) {
+            break;
+        }
+        if (next != NO_DEADLINE && next <= timens_now(CLOCK_MONOTONIC)) {
+            continue;
+        }
+        if (wait_events(loop, next) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void event_loop_destroy(event_loop_t *loop) {
+    if (loop == NULL) {
+        return;
+    }
+#ifdef __linux__
+    close(loop->timer_fd);
+#endif
+    close(loop->poll_fd);
+    free(loop);
+}
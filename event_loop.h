@@ -0,0 +1,60 @@
+#ifndef EVENT_LOOP_H
+#define EVENT_LOOP_H
+
+#include <signal.h>
+#include "timens.h"
+
+/* Single-threaded event loop over file descriptors and timers.
+ *
+ * Descriptors are watched for input with epoll on Linux and kqueue
+ * elsewhere. Timers are one-shot, at absolute times on CLOCK_MONOTONIC,
+ * with nanosecond resolution: on Linux the earliest one is kept in a
+ * timerfd, and with kqueue it becomes the timeout of kevent. A timer that
+ * is already due runs without waiting, so a source that has to be polled
+ * can be stepped as often as it needs, and the loop sleeps in the kernel
+ * whenever nothing is due.
+ */
+
+typedef struct event_loop event_loop_t;
+
+typedef void (*event_loop_fn)(void *arg);
+
+#define EVENT_LOOP_MAX_TIMERS 32
+
+/* Create a loop
+ * Returns NULL on error
+ */
+event_loop_t *event_loop_create(void);
+
+/* Call fn whenever fd has input
+ * Returns 0 on success, -1 on error
+ */
+int event_loop_add_fd(event_loop_t *loop, int fd, event_loop_fn fn, void *arg);
+
+/* Stop watching fd */
+void event_loop_remove_fd(event_loop_t *loop, int fd);
+
+/* Create a timer that calls fn when it expires; it starts disarmed
+ * Returns the timer, or -1 if there are EVENT_LOOP_MAX_TIMERS already
+ */
+int event_loop_add_timer(event_loop_t *loop, event_loop_fn fn, void *arg);
+
+/* Arm a timer to expire at deadline (CLOCK_MONOTONIC), replacing any
+ * earlier setting; a timer is disarmed before its function is called */
+void event_loop_set_timer(event_loop_t *loop, int timer, timens_t deadline);
+
+/* Disarm a timer */
+void event_loop_cancel_timer(event_loop_t *loop, int timer);
+
+/* Run until stop becomes non-zero or event_loop_stop is called
+ * Returns 0 when stopped, -1 on error
+ */
+int event_loop_run(event_loop_t *loop, volatile sig_atomic_t *stop);
+
+/* Make event_loop_run return once the current callback finishes */
+void event_loop_stop(event_loop_t *loop);
+
+/* Destroy the loop; descriptors are left open */
+void event_loop_destroy(event_loop_t *loop);
+
+#endif /* EVENT_LOOP_H */
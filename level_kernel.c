@@ -0,0 +1,326 @@
+#include "level_kernel.h"
+#include <string.h>
+#include <math.h>
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define HAVE_X86_KERNELS 1
+#include <immintrin.h>
+#endif
+
+#if defined(__aarch64__)
+#define HAVE_NEON_KERNELS 1
+#include <arm_neon.h>
+#endif
+
+typedef struct {
+    const char *name;
+    int (*supported)(void);
+    void (*stats)(const float *samples, size_t count, float threshold, level_stats_t *stats);
+    size_t (*find_over)(const float *samples, size_t count, float threshold);
+} level_kernel_t;
+
+/* Running statistics, updated with the same comparisons in every
+ * implementation so that the results are identical */
+typedef struct {
+    float min;
+    float max;
+    float abs_max;
+    size_t first_over;
+} accum_t;
+
+static void accum_scalar(accum_t *acc, const float *samples, size_t start, size_t count, float threshold) {
+    for (size_t i = start; i < count; i++) {
+        float sample = samples[i];
+        if (sample < acc->min) acc->min = sample;
+        if (sample > acc->max) acc->max = sample;
+        float level = fabsf(sample);
+        if (level > acc->abs_max) acc->abs_max = level;
+        if (level > threshold && i < acc->first_over) acc->first_over = i;
+    }
+}
+
+/* Fold the lanes of a vector accumulator into acc */
+static void accum_lanes(accum_t *acc, const float *min, const float *max, const float *abs_max, size_t lanes) {
+    for (size_t k = 0; k < lanes; k++) {
+        if (min[k] < acc->min) acc->min = min[k];
+        if (max[k] > acc->max) acc->max = max[k];
+        if (abs_max[k] > acc->abs_max) acc->abs_max = abs_max[k];
+    }
+}
+
+static void accum_init(accum_t *acc, size_t count) {
+    acc->min = 0.0f;
+    acc->max = 0.0f;
+    acc->abs_max = 0.0f;
+    acc->first_over = count;
+}
+
+static void accum_store(const accum_t *acc, level_stats_t *stats) {
+    stats->min = acc->min;
+    stats->max = acc->max;
+    stats->abs_max = acc->abs_max;
+    stats->first_over = acc->first_over;
+}
+
+static int scalar_supported(void) {
+    return 1;
+}
+
+static void scalar_stats(const float *samples, size_t count, float threshold, level_stats_t *stats) {
+    accum_t acc;
+    accum_init(&acc, count);
+    accum_scalar(&acc, samples, 0, count, threshold);
+    accum_store(&acc, stats);
+}
+
+static size_t scalar_find_over(const float *samples, size_t count, float threshold) {
+    for (size_t i = 0; i < count; i++) {
+        if (fabsf(samples[i]) > threshold) {
+            return i;
+        }
+    }
+    return count;
+}
+
+#ifdef HAVE_X86_KERNELS
+
+/* The operand order of minps/maxps matters: when either input is NaN the
+ * second operand is returned, so keeping the accumulator second makes NaN
+ * samples drop out exactly as the scalar comparisons do. */
+
+static int sse2_supported(void) {
+    return 1;
+}
+
+static void sse2_stats(const float *samples, size_t count, float threshold, level_stats_t *stats) {
+    accum_t acc;
+    accum_init(&acc, count);
+
+    __m128 vmin = _mm_setzero_ps();
+    __m128 vmax = _mm_setzero_ps();
+    __m128 vabs = _mm_setzero_ps();
+    __m128 vthr = _mm_set1_ps(threshold);
+    __m128 sign = _mm_set1_ps(-0.0f);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        __m128 v = _mm_loadu_ps(samples + i);
+        __m128 a = _mm_andnot_ps(sign, v);
+        vmin = _mm_min_ps(v, vmin);
+        vmax = _mm_max_ps(v, vmax);
+        vabs = _mm_max_ps(a, vabs);
+        if (acc.first_over == count) {
+            int mask = _mm_movemask_ps(_mm_cmpgt_ps(a, vthr));
+            if (mask) {
+                acc.first_over = i + __builtin_ctz(mask);
+            }
+        }
+    }
+
+    float lmin[4], lmax[4], labs[4];
+    _mm_storeu_ps(lmin, vmin);
+    _mm_storeu_ps(lmax, vmax);
+    _mm_storeu_ps(labs, vabs);
+    accum_lanes(&acc, lmin, lmax, labs, 4);
+    accum_scalar(&acc, samples, i, count, threshold);
+    accum_store(&acc, stats);
+}
+
+static size_t sse2_find_over(const float *samples, size_t count, float threshold) {
+    __m128 vthr = _mm_set1_ps(threshold);
+    __m128 sign = _mm_set1_ps(-0.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m128 a0 = _mm_andnot_ps(sign, _mm_loadu_ps(samples + i));
+        __m128 a1 = _mm_andnot_ps(sign, _mm_loadu_ps(samples + i + 4));
+        int mask = _mm_movemask_ps(_mm_cmpgt_ps(a0, vthr)) | (_mm_movemask_ps(_mm_cmpgt_ps(a1, vthr)) << 4);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scalar_find_over(samples + i, count - i, threshold);
+}
+
+static int avx2_supported(void) {
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+__attribute__((target("avx2")))
+static void avx2_stats(const float *samples, size_t count, float threshold, level_stats_t *stats) {
+    accum_t acc;
+    accum_init(&acc, count);
+
+    __m256 vmin = _mm256_setzero_ps();
+    __m256 vmax = _mm256_setzero_ps();
+    __m256 vabs = _mm256_setzero_ps();
+    __m256 vthr = _mm256_set1_ps(threshold);
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        __m256 v = _mm256_loadu_ps(samples + i);
+        __m256 a = _mm256_andnot_ps(sign, v);
+        vmin = _mm256_min_ps(v, vmin);
+        vmax = _mm256_max_ps(v, vmax);
+        vabs = _mm256_max_ps(a, vabs);
+        if (acc.first_over == count) {
+            int mask = _mm256_movemask_ps(_mm256_cmp_ps(a, vthr, _CMP_GT_OQ));
+            if (mask) {
+                acc.first_over = i + __builtin_ctz(mask);
+            }
+        }
+    }
+
+    float lmin[8], lmax[8], labs[8];
+    _mm256_storeu_ps(lmin, vmin);
+    _mm256_storeu_ps(lmax, vmax);
+    _mm256_storeu_ps(labs, vabs);
+    accum_lanes(&acc, lmin, lmax, labs, 8);
+    accum_scalar(&acc, samples, i, count, threshold);
+    accum_store(&acc, stats);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_find_over(const float *samples, size_t count, float threshold) {
+    __m256 vthr = _mm256_set1_ps(threshold);
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    size_t i = 0;
+
+    for (; i + 16 <= count; i += 16) {
+        __m256 a0 = _mm256_andnot_ps(sign, _mm256_loadu_ps(samples + i));
+        __m256 a1 = _mm256_andnot_ps(sign, _mm256_loadu_ps(samples + i + 8));
+        int mask = _mm256_movemask_ps(_mm256_cmp_ps(a0, vthr, _CMP_GT_OQ)) |
+                   (_mm256_movemask_ps(_mm256_cmp_ps(a1, vthr, _CMP_GT_OQ)) << 8);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return i + scalar_find_over(samples + i, count - i, threshold);
+}
+
+#endif /* HAVE_X86_KERNELS */
+
+#ifdef HAVE_NEON_KERNELS
+
+/* vminnm/vmaxnm return the number when one input is NaN, matching the
+ * scalar comparisons */
+
+static int neon_supported(void) {
+    return 1;
+}
+
+/* Index of the first set lane of a comparison result, or 4 */
+static size_t neon_first_lane(uint32x4_t mask) {
+    uint32_t lanes[4];
+    vst1q_u32(lanes, mask);
+    for (size_t k = 0; k < 4; k++) {
+        if (lanes[k]) {
+            return k;
+        }
+    }
+    return 4;
+}
+
+static void neon_stats(const float *samples, size_t count, float threshold, level_stats_t *stats) {
+    accum_t acc;
+    accum_init(&acc, count);
+
+    float32x4_t vmin = vdupq_n_f32(0.0f);
+    float32x4_t vmax = vdupq_n_f32(0.0f);
+    float32x4_t vabs = vdupq_n_f32(0.0f);
+    float32x4_t vthr = vdupq_n_f32(threshold);
+    size_t i = 0;
+
+    for (; i + 4 <= count; i += 4) {
+        float32x4_t v = vld1q_f32(samples + i);
+        float32x4_t a = vabsq_f32(v);
+        vmin = vminnmq_f32(vmin, v);
+        vmax = vmaxnmq_f32(vmax, v);
+        vabs = vmaxnmq_f32(vabs, a);
+        if (acc.first_over == count) {
+            uint32x4_t over = vcgtq_f32(a, vthr);
+            if (vmaxvq_u32(over)) {
+                acc.first_over = i + neon_first_lane(over);
+            }
+        }
+    }
+
+    float lmin[4], lmax[4], labs[4];
+    vst1q_f32(lmin, vmin);
+    vst1q_f32(lmax, vmax);
+    vst1q_f32(labs, vabs);
+    accum_lanes(&acc, lmin, lmax, labs, 4);
+    accum_scalar(&acc, samples, i, count, threshold);
+    accum_store(&acc, stats);
+}
+
+static size_t neon_find_over(const float *samples, size_t count, float threshold) {
+    float32x4_t vthr = vdupq_n_f32(threshold);
+    size_t i = 0;
+
+    for (; i + 8 <= count; i += 8) {
+        uint32x4_t o0 = vcgtq_f32(vabsq_f32(vld1q_f32(samples + i)), vthr);
+        uint32x4_t o1 = vcgtq_f32(vabsq_f32(vld1q_f32(samples + i + 4)), vthr);
+        if (vmaxvq_u32(vorrq_u32(o0, o1))) {
+            size_t k = neon_first_lane(o0);
+            return k < 4 ? i + k : i + 4 + neon_first_lane(o1);
+        }
+    }
+    return i + scalar_find_over(samples + i, count - i, threshold);
+}
+
+#endif /* HAVE_NEON_KERNELS */
+
+/* In order of preference */
+static const level_kernel_t kernels[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx2", avx2_supported, avx2_stats, avx2_find_over },
+    { "sse2", sse2_supported, sse2_stats, sse2_find_over },
+#endif
+#ifdef HAVE_NEON_KERNELS
+    { "neon", neon_supported, neon_stats, neon_find_over },
+#endif
+    { "scalar", scalar_supported, scalar_stats, scalar_find_over },
+};
+
+static const level_kernel_t *active = NULL;
+
+static const level_kernel_t *kernel(void) {
+    if (active == NULL) {
+        /* Racing first calls all pick the same entry */
+        for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+            if (kernels[k].supported()) {
+                active = &kernels[k];
+                break;
+            }
+        }
+    }
+    return active;
+}
+
+void level_stats(const float *samples, size_t count, float threshold, level_stats_t *stats) {
+    kernel()->stats(samples, count, threshold, stats);
+}
+
+size_t level_find_over(const float *samples, size_t count, float threshold) {
+    return kernel()->find_over(samples, count, threshold);
+}
+
+int level_kernel_select(const char *name) {
+    for (size_t k = 0; k < sizeof(kernels) / sizeof(kernels[0]); k++) {
+        if (strcmp(kernels[k].name, name) == 0) {
+            if (!kernels[k].supported()) {
+                return -1;
+            }
+            active = &kernels[k];
+            return 0;
+        }
+    }
+    return -1;
+}
+
+const char *level_kernel_name(void) {
+    return kernel()->name;
+}
@@ -0,0 +1,38 @@
+#ifndef LEVEL_KERNEL_H
+#define LEVEL_KERNEL_H
+
+#include <stddef.h>
+
+/* Block level kernels for the audio callback.
+ *
+ * Vectorized with SSE2 or AVX2 on x86 (chosen at run time) and NEON on
+ * 64-bit ARM, with a scalar fallback. All implementations give identical results;
+ * NaN samples are ignored by the min/max tracking and never exceed the
+ * threshold, as with the scalar code.
+ */
+
+typedef struct {
+    float min;                 /* minimum sample, or 0 if all samples are positive */
+    float max;                 /* maximum sample, or 0 if all samples are negative */
+    float abs_max;             /* maximum absolute sample */
+    size_t first_over;         /* index of the first sample with |sample| > threshold,
+                                  or count if there is none */
+} level_stats_t;
+
+/* Compute the level statistics of a block in one pass */
+void level_stats(const float *samples, size_t count, float threshold, level_stats_t *stats);
+
+/* Find the first sample with |sample| > threshold
+ * Returns its index, or count if there is none
+ */
+size_t level_find_over(const float *samples, size_t count, float threshold);
+
+/* Select an implementation by name ("scalar", "sse2", "avx2", "neon")
+ * Returns 0 on success, -1 if it is unknown or not supported by this CPU
+ */
+int level_kernel_select(const char *name);
+
+/* Get the name of the implementation in use */
+const char *level_kernel_name(void);
+
+#endif /* LEVEL_KERNEL_H */
@@ -0,0 +1,129 @@
+#include "ntp_shm.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdatomic.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+
+struct ntp_shm {
+    int unit;
+    int shmid;
+    struct shmTime *seg;
+    ntp_shm_stats_t stats;
+};
+
+int ntp_shm_parse_unit(const char *text, int *unit) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno != 0 || value < 0 || value > INT_MAX) {
+        return -1;
+    }
+    *unit = (int)value;
+    return 0;
+}
+
+ntp_shm_t *ntp_shm_create(int unit) {
+    if (unit < 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    ntp_shm_t *shm = calloc(1, sizeof(ntp_shm_t));
+    if (shm == NULL) {
+        return NULL;
+    }
+    shm->unit = unit;
+
+    int perm = unit <= 1 ? 0600 : 0666;
+    shm->shmid = shmget((key_t)(NTP_SHM_KEY + unit), sizeof(struct shmTime), IPC_CREAT | perm);
+    if (shm->shmid < 0) {
+        free(shm);
+        return NULL;
+    }
+    void *seg = shmat(shm->shmid, NULL, 0);
+    if (seg == (void *)-1) {
+        free(shm);
+        return NULL;
+    }
+    shm->seg = seg;
+
+    /* The consumer may have created the segment already; only the
+     * writer's own fields are reset */
+    shm->seg->mode = 1;
+    shm->seg->nsamples = 3;
+    return shm;
+}
+
+void ntp_shm_send_pps(ntp_shm_t *shm, timens_t time, double offset, int precision) {
+    struct shmTime *seg = shm->seg;
+
+    /* The pulse marks the nearest second; the offset, wrapped to within
+     * half a second, places the system time relative to it, so a
+     * smoothed offset carries through */
+    timens_t true_time = timens_round_div(time, TIMENS_PER_SEC) * TIMENS_PER_SEC;
+    timens_t receive_time = true_time + llround((offset - round(offset)) * 1e9);
+    timens_t receive_sec = timens_floor_div(receive_time, TIMENS_PER_SEC);
+    unsigned receive_nsec = (unsigned)(receive_time - receive_sec * TIMENS_PER_SEC);
+
+    if (seg->valid) {
+        shm->stats.unread++;
+    }
+    seg->valid = 0;
+    seg->count++;
+    atomic_thread_fence(memory_order_seq_cst);
+    seg->mode = 1;
+    seg->clockTimeStampSec = (time_t)(true_time / TIMENS_PER_SEC);
+    seg->clockTimeStampUSec = 0;
+    seg->clockTimeStampNSec = 0;
+    seg->receiveTimeStampSec = (time_t)receive_sec;
+    seg->receiveTimeStampUSec = (int)(receive_nsec / 1000);
+    seg->receiveTimeStampNSec = receive_nsec;
+    seg->leap = 0;
+    seg->precision = precision;
+    atomic_thread_fence(memory_order_seq_cst);
+    seg->count++;
+    seg->valid = 1;
+    shm->stats.sent++;
+}
+
+int ntp_shm_read(ntp_shm_t *shm, struct shmTime *sample) {
+    struct shmTime *seg = shm->seg;
+    if (!seg->valid) {
+        return 0;
+    }
+    int count = seg->count;
+    atomic_thread_fence(memory_order_seq_cst);
+    memcpy(sample, seg, sizeof(*sample));
+    atomic_thread_fence(memory_order_seq_cst);
+    if (seg->count != count) {
+        return -1;
+    }
+    seg->valid = 0;
+    return 1;
+}
+
+void ntp_shm_stats(const ntp_shm_t *shm, ntp_shm_stats_t *stats) {
+    *stats = shm->stats;
+}
+
+int ntp_shm_precision(double resolution) {
+    if (resolution <= 0.0) {
+        return -30;
+    }
+    return (int)ceil(log2(resolution));
+}
+
+int ntp_shm_unit(const ntp_shm_t *shm) {
+    return shm->unit;
+}
+
+void ntp_shm_destroy(ntp_shm_t *shm) {
+    if (shm == NULL) {
+        return;
+    }
+    shmdt(shm->seg);
+    free(shm);
+}
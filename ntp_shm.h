@@ -0,0 +1,85 @@
+#ifndef NTP_SHM_H
+#define NTP_SHM_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include "timens.h"
+
+/* Output to an NTP shared memory (SHM) refclock.
+ *
+ * Samples are written to the System V shared memory segment that ntpd's
+ * SHM driver, chrony's SHM refclock and gpsd use, with key
+ * NTP_SHM_KEY + unit, using mode 1: the writer bumps count before and
+ * after changing the sample and sets valid when it is done, so a reader
+ * can tell a torn read. Sending a sample is a few memory writes, with no
+ * system call.
+ *
+ * Units 0 and 1 are created readable by root only, as ntpd expects;
+ * higher units are readable by anyone.
+ */
+
+#define NTP_SHM_KEY 0x4e545030     /* "NTP0" */
+
+/* Segment layout, as defined by ntpd */
+struct shmTime {
+    int mode;                  /* 1: use count to detect a torn read */
+    volatile int count;
+    time_t clockTimeStampSec;  /* true time of the sample */
+    int clockTimeStampUSec;
+    time_t receiveTimeStampSec;  /* system time of the sample */
+    int receiveTimeStampUSec;
+    int leap;
+    int precision;             /* log2 of the precision in seconds */
+    int nsamples;
+    volatile int valid;
+    unsigned clockTimeStampNSec;
+    unsigned receiveTimeStampNSec;
+    int dummy[8];
+};
+
+typedef struct ntp_shm ntp_shm_t;
+
+typedef struct {
+    uint64_t sent;             /* samples written */
+    uint64_t unread;           /* samples overwritten before the consumer took them */
+} ntp_shm_stats_t;
+
+/* Parse a unit number; anything else is rejected rather than read as 0,
+ * which is the root-only unit ntpd's first refclock reads
+ * Returns 0 on success, -1 if text is not a non-negative number
+ */
+int ntp_shm_parse_unit(const char *text, int *unit);
+
+/* Attach to the segment for a unit, creating it if needed
+ * Returns NULL on error with errno set
+ */
+ntp_shm_t *ntp_shm_create(int unit);
+
+/* Publish a PPS sample
+ * time: system time of the pulse
+ * offset: fractional second of the system time at the pulse, as sent to
+ *   chrony; the true time is taken as the nearest second
+ * precision: log2 of the timing precision in seconds
+ */
+void ntp_shm_send_pps(ntp_shm_t *shm, timens_t time, double offset, int precision);
+
+/* Read the latest sample (for testing consumers)
+ * Returns 1 if a new sample was read and marked taken, 0 if there was none,
+ *   -1 if it changed while being read
+ */
+int ntp_shm_read(ntp_shm_t *shm, struct shmTime *sample);
+
+/* Get the counters */
+void ntp_shm_stats(const ntp_shm_t *shm, ntp_shm_stats_t *stats);
+
+/* Get the precision for a timing resolution in seconds */
+int ntp_shm_precision(double resolution);
+
+/* Get the unit */
+int ntp_shm_unit(const ntp_shm_t *shm);
+
+/* Detach from the segment; it is left for the consumer */
+void ntp_shm_destroy(ntp_shm_t *shm);
+
+#endif /* NTP_SHM_H */
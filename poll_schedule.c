@@ -0,0 +1,335 @@
+#include "poll_schedule.h"
+#include "timens.h"
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
+#include <math.h>
+
+struct poll_schedule {
+    poll_schedule_config_t config;
+
+    bool locked;
+    bool have_edge;
+    int64_t last_edge;
+    int64_t period;
+    unsigned good_intervals;
+    int64_t predicted;
+    unsigned consecutive_missed;
+
+    int64_t start;
+    int64_t deadline;
+    int64_t interval;
+    bool after_sleep;
+    bool slept;
+    int64_t planned_at;
+    int64_t poll_time;
+
+    uint64_t polls;
+    uint64_t busy_polls;
+    uint64_t missed;
+    uint64_t early;
+    uint64_t acquisitions;
+    uint64_t lost;
+    int64_t asleep;
+
+    uint64_t sleeps;
+    int64_t oversleep_sum;
+    int64_t oversleep_max;
+    uint64_t timed_polls;
+    int64_t poll_sum;
+    int64_t poll_max;
+
+    /* Adjustment window for auto_interval, from one edge to another */
+    unsigned window_edges;
+    int64_t window_start;
+    int64_t window_cpu;
+    uint64_t window_sleeps;
+    int64_t window_oversleep;
+    uint64_t window_polls;
+    int64_t window_poll;
+    double cpu;
+};
+
+int64_t poll_schedule_now(void) {
+    return timens_now(CLOCK_MONOTONIC);
+}
+
+void poll_schedule_sleep_until(int64_t deadline) {
+#ifdef __linux__
+    struct timespec ts;
+    timens_to_timespec(deadline, &ts);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+#else
+    /* No absolute sleeps on macOS; the deadline is still absolute, so
+     * oversleeping does not accumulate */
+    int64_t delta = deadline - poll_schedule_now();
+    if (delta > 0) {
+        struct timespec ts;
+        timens_to_timespec(delta, &ts);
+        nanosleep(&ts, NULL);
+    }
+#endif
+}
+
+void poll_schedule_default_config(poll_schedule_config_t *config) {
+    config->enabled = true;
+    config->period = TIMENS_PER_SEC;
+    config->interval = 100000;
+    config->guard = 5000000;
+    config->busy = 300000;
+    config->tolerance = 2000000;
+    config->acquire_edges = 2;
+    config->max_missed = 3;
+    config->auto_interval = false;
+    config->cpu_budget = 0.01;
+    config->min_interval = 10000;
+    config->max_interval = 1000000;
+    config->adapt_edges = 8;
+}
+
+poll_schedule_t *poll_schedule_create(const poll_schedule_config_t *config) {
+    if (config->period <= 0 || config->interval <= 0 || config->guard < config->busy ||
+        config->guard * 2 >= config->period) {
+        return NULL;
+    }
+    if (config->auto_interval && (config->cpu_budget <= 0.0 || config->min_interval <= 0 ||
+                                  config->min_interval > config->max_interval || config->adapt_edges == 0)) {
+        return NULL;
+    }
+
+    poll_schedule_t *sched = calloc(1, sizeof(poll_schedule_t));
+    if (sched == NULL) {
+        return NULL;
+    }
+    sched->config = *config;
+    sched->period = config->period;
+    sched->start = poll_schedule_now();
+    sched->deadline = sched->start;
+    sched->interval = config->interval;
+    if (config->auto_interval) {
+        if (sched->interval < config->min_interval) {
+            sched->interval = config->min_interval;
+        } else if (sched->interval > config->max_interval) {
+            sched->interval = config->max_interval;
+        }
+    }
+    return sched;
+}
+
+static void drop_lock(poll_schedule_t *sched) {
+    sched->locked = false;
+    sched->have_edge = false;
+    sched->good_intervals = 0;
+    sched->consecutive_missed = 0;
+    sched->lost++;
+    sched->window_edges = 0;
+}
+
+/* Start a new adjustment window at an edge */
+static void start_window(poll_schedule_t *sched, int64_t now) {
+    sched->window_edges = 1;
+    sched->window_start = now;
+    sched->window_cpu = timens_now(CLOCK_THREAD_CPUTIME_ID);
+    sched->window_sleeps = 0;
+    sched->window_oversleep = 0;
+    sched->window_polls = 0;
+    sched->window_poll = 0;
+}
+
+/* Lengthen the interval when over the CPU budget and shorten it when well
+ * under, but not below what a sleep and a poll take together */
+static void adapt_interval(poll_schedule_t *sched, int64_t now) {
+    if (sched->window_edges == 0) {
+        start_window(sched, now);
+        return;
+    }
+    if (sched->window_edges++ < sched->config.adapt_edges) {
+        return;
+    }
+
+    int64_t cpu = timens_now(CLOCK_THREAD_CPUTIME_ID);
+    sched->cpu = (double)(cpu - sched->window_cpu) / (double)(now - sched->window_start);
+
+    int64_t floor = 0;
+    if (sched->window_sleeps > 0) {
+        floor += sched->window_oversleep / (int64_t)sched->window_sleeps;
+    }
+    if (sched->window_polls > 0) {
+        floor += sched->window_poll / (int64_t)sched->window_polls;
+    }
+
+    int64_t interval = sched->interval;
+    if (sched->cpu > sched->config.cpu_budget) {
+        interval += interval / 4;
+    } else if (sched->cpu < sched->config.cpu_budget / 2) {
+        interval -= interval / 5;
+    }
+    if (interval < floor) {
+        interval = floor;
+    }
+    if (interval < sched->config.min_interval) {
+        interval = sched->config.min_interval;
+    } else if (interval > sched->config.max_interval) {
+        interval = sched->config.max_interval;
+    }
+    sched->interval = interval;
+    start_window(sched, now);
+}
+
+/* Move the prediction past windows that have closed without an edge */
+static void check_missed(poll_schedule_t *sched, int64_t now) {
+    while (sched->locked && now > sched->predicted + sched->config.guard) {
+        sched->missed++;
+        if (++sched->consecutive_missed > sched->config.max_missed) {
+            drop_lock(sched);
+            break;
+        }
+        sched->predicted += sched->period;
+    }
+}
+
+int64_t poll_schedule_next(poll_schedule_t *sched, poll_phase_t *phase) {
+    int64_t now = poll_schedule_now();
+    int64_t deadline = sched->deadline + sched->interval;
+    poll_phase_t p = POLL_PHASE_CONTINUOUS;
+
+    check_missed(sched, now);
+    sched->after_sleep = false;
+
+    if (sched->locked) {
+        int64_t guard_start = sched->predicted - sched->config.guard;
+        int64_t busy_start = sched->predicted - sched->config.busy;
+        int64_t busy_end = sched->predicted + sched->config.busy;
+
+        p = POLL_PHASE_GUARD;
+        if (deadline < guard_start) {
+            deadline = guard_start;
+            sched->after_sleep = true;
+        } else if (now >= busy_start && now < busy_end) {
+            deadline = now;
+            p = POLL_PHASE_BUSY;
+        } else if (now < busy_start && deadline > busy_start) {
+            deadline = busy_start;
+        }
+    }
+
+    sched->slept = deadline > now;
+    if (!sched->slept) {
+        /* Behind schedule: poll now rather than catching up with a burst */
+        deadline = now;
+        sched->busy_polls++;
+    }
+    sched->deadline = deadline;
+    sched->planned_at = now;
+    if (phase) {
+        *phase = p;
+    }
+    return deadline;
+}
+
+int64_t poll_schedule_begin(poll_schedule_t *sched) {
+    int64_t poll_time = poll_schedule_now();
+    if (sched->after_sleep) {
+        sched->asleep += poll_time - sched->planned_at;
+    }
+    if (sched->slept) {
+        int64_t oversleep = poll_time - sched->deadline;
+        sched->sleeps++;
+        sched->oversleep_sum += oversleep;
+        if (oversleep > sched->oversleep_max) {
+            sched->oversleep_max = oversleep;
+        }
+        sched->window_sleeps++;
+        sched->window_oversleep += oversleep;
+    }
+    sched->poll_time = poll_time;
+    sched->polls++;
+    return poll_time;
+}
+
+int64_t poll_schedule_wait(poll_schedule_t *sched, poll_phase_t *phase) {
+    int64_t deadline = poll_schedule_next(sched, phase);
+    if (sched->slept) {
+        poll_schedule_sleep_until(deadline);
+    }
+    return poll_schedule_begin(sched);
+}
+
+void poll_schedule_polled(poll_schedule_t *sched, int64_t done) {
+    int64_t duration = done - sched->poll_time;
+    sched->timed_polls++;
+    sched->poll_sum += duration;
+    if (duration > sched->poll_max) {
+        sched->poll_max = duration;
+    }
+    sched->window_polls++;
+    sched->window_poll += duration;
+}
+
+void poll_schedule_edge(poll_schedule_t *sched, int64_t edge) {
+    if (!sched->config.enabled) {
+        return;
+    }
+
+    /* An edge seen straight after sleeping happened while asleep */
+    if (sched->locked && (sched->after_sleep || edge < sched->predicted - sched->config.guard)) {
+        sched->early++;
+        drop_lock(sched);
+    }
+
+    if (sched->have_edge) {
+        int64_t interval = edge - sched->last_edge;
+        if (!sched->locked) {
+            if (llabs(interval - sched->config.period) <= sched->config.tolerance) {
+                sched->period = interval;
+                if (++sched->good_intervals >= sched->config.acquire_edges) {
+                    sched->locked = true;
+                    sched->acquisitions++;
+                }
+            } else {
+                sched->good_intervals = 0;
+            }
+        } else {
+            /* The interval spans any edges missed in between */
+            double periods = round((double)interval / (double)sched->period);
+            if (periods >= 1.0) {
+                sched->period += (int64_t)(((double)interval / periods - (double)sched->period) / 8.0);
+            }
+            sched->consecutive_missed = 0;
+        }
+    }
+    sched->have_edge = true;
+    sched->last_edge = edge;
+    sched->predicted = edge + sched->period;
+
+    if (sched->locked && sched->config.auto_interval) {
+        adapt_interval(sched, poll_schedule_now());
+    }
+}
+
+void poll_schedule_stats(const poll_schedule_t *sched, poll_schedule_stats_t *stats) {
+    stats->locked = sched->locked;
+    stats->period = sched->period;
+    stats->polls = sched->polls;
+    stats->busy_polls = sched->busy_polls;
+    stats->missed = sched->missed;
+    stats->early = sched->early;
+    stats->acquisitions = sched->acquisitions;
+    stats->lost = sched->lost;
+    stats->elapsed = poll_schedule_now() - sched->start;
+    stats->asleep = sched->asleep;
+    stats->interval = sched->interval;
+    stats->sleeps = sched->sleeps;
+    stats->oversleep_mean = sched->sleeps > 0 ? (double)sched->oversleep_sum / (double)sched->sleeps : 0.0;
+    stats->oversleep_max = sched->oversleep_max;
+    stats->timed_polls = sched->timed_polls;
+    stats->poll_mean = sched->timed_polls > 0 ? (double)sched->poll_sum / (double)sched->timed_polls : 0.0;
+    stats->poll_max = sched->poll_max;
+    stats->cpu = sched->cpu;
+}
+
+void poll_schedule_destroy(poll_schedule_t *sched) {
+    free(sched);
+}
@@ -0,0 +1,120 @@
+#ifndef POLL_SCHEDULE_H
+#define POLL_SCHEDULE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Deadline-based schedule for polling a periodic signal.
+ *
+ * Until the edges are locked on to, polls are spaced evenly at the poll
+ * interval. Once a few edges have arrived one period apart, the schedule
+ * sleeps until a guard window before the predicted next edge, polls at the
+ * poll interval inside the window and polls without sleeping for the last
+ * stretch either side of the prediction. All sleeps are to absolute
+ * deadlines on CLOCK_MONOTONIC, so they do not accumulate drift. Missing
+ * too many edges falls back to continuous polling.
+ *
+ * The schedule also measures how late each sleep wakes up and how long
+ * each poll takes. With auto_interval, every adapt_edges edges while
+ * locked it compares the CPU time of the calling thread with cpu_budget
+ * and lengthens or shortens the poll interval, but never below the time
+ * a poll actually takes, since polls closer together than that only run
+ * back to back.
+ *
+ * Times are nanoseconds on CLOCK_MONOTONIC.
+ */
+
+typedef struct poll_schedule poll_schedule_t;
+
+typedef struct {
+    bool enabled;              /* false polls continuously at the poll interval */
+    int64_t period;            /* nominal time between edges */
+    int64_t interval;          /* time between polls when not sleeping */
+    int64_t guard;             /* half width of the window polled around a predicted edge */
+    int64_t busy;              /* half width of the part of the window polled without sleeping */
+    int64_t tolerance;         /* allowed error in an edge interval while acquiring */
+    unsigned acquire_edges;    /* consecutive good intervals needed to lock */
+    unsigned max_missed;       /* consecutive missed edges before lock is dropped */
+    bool auto_interval;        /* adjust the interval to the CPU budget */
+    double cpu_budget;         /* fraction of a CPU to use with auto_interval */
+    int64_t min_interval;      /* bounds on the interval with auto_interval */
+    int64_t max_interval;
+    unsigned adapt_edges;      /* edges between interval adjustments */
+} poll_schedule_config_t;
+
+typedef enum {
+    POLL_PHASE_CONTINUOUS,     /* not locked */
+    POLL_PHASE_GUARD,          /* locked, inside the guard window */
+    POLL_PHASE_BUSY            /* locked, close to the predicted edge */
+} poll_phase_t;
+
+typedef struct {
+    bool locked;
+    int64_t period;            /* estimated time between edges */
+    uint64_t polls;
+    uint64_t busy_polls;       /* polls made without sleeping first */
+    uint64_t missed;           /* predicted edges that did not arrive */
+    uint64_t early;            /* edges that arrived before their window */
+    uint64_t acquisitions;
+    uint64_t lost;
+    int64_t elapsed;           /* time since the schedule was created */
+    int64_t asleep;            /* time spent in sleeps until a guard window */
+    int64_t interval;          /* current time between polls */
+    uint64_t sleeps;           /* polls made after sleeping */
+    double oversleep_mean;     /* how late sleeps woke up */
+    int64_t oversleep_max;
+    uint64_t timed_polls;      /* polls reported with poll_schedule_polled */
+    double poll_mean;          /* time from poll_schedule_wait returning to the poll completing */
+    int64_t poll_max;
+    double cpu;                /* fraction of a CPU used in the last adjustment window */
+} poll_schedule_stats_t;
+
+/* Fill in the default configuration (1s period, 100us polls, 5ms guard,
+ * 300us busy; auto_interval off with a 1% budget and 10us to 1ms polls) */
+void poll_schedule_default_config(poll_schedule_config_t *config);
+
+/* Create a new schedule
+ * Returns NULL on error
+ */
+poll_schedule_t *poll_schedule_create(const poll_schedule_config_t *config);
+
+/* Sleep until the next poll is due
+ * Returns the time of the poll, which is taken just before returning
+ */
+int64_t poll_schedule_wait(poll_schedule_t *sched, poll_phase_t *phase);
+
+/* Plan the next poll without sleeping, for callers with their own event
+ * loop; poll_schedule_wait is poll_schedule_next, a sleep until the time
+ * it returns and poll_schedule_begin
+ * Returns the time the poll is due
+ */
+int64_t poll_schedule_next(poll_schedule_t *sched, poll_phase_t *phase);
+
+/* Start the poll planned by poll_schedule_next, once it is due
+ * Returns the time of the poll
+ */
+int64_t poll_schedule_begin(poll_schedule_t *sched);
+
+/* Report that the poll returned by the last poll_schedule_wait completed
+ * done: time it completed
+ */
+void poll_schedule_polled(poll_schedule_t *sched, int64_t done);
+
+/* Report an edge seen by the last poll
+ * edge: best estimate of the time of the edge
+ */
+void poll_schedule_edge(poll_schedule_t *sched, int64_t edge);
+
+/* Get the lock state and counters */
+void poll_schedule_stats(const poll_schedule_t *sched, poll_schedule_stats_t *stats);
+
+/* Get the current time on CLOCK_MONOTONIC in nanoseconds */
+int64_t poll_schedule_now(void);
+
+/* Sleep until an absolute time on CLOCK_MONOTONIC */
+void poll_schedule_sleep_until(int64_t deadline);
+
+/* Destroy the schedule */
+void poll_schedule_destroy(poll_schedule_t *sched);
+
+#endif /* POLL_SCHEDULE_H */
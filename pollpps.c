@@ -9,7 +9,19 @@
 #include <signal.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <math.h>
 #include "chrony_client.h"
+#include "ntp_shm.h"
+#include "poll_schedule.h"
+#include "cts_source.h"
+#include "pulse_filter.h"
+#include "pulse_journal.h"
+#include "pulse_feed.h"
+#include "pulse_detector.h"
+#include "stage_trace.h"
+#include "rt_profile.h"
+#include "calibration.h"
+#include "timens.h"
 
 #define DEFAULT_REMOTE_PATH "/var/run/chrony.pollpps.sock"
 
@@ -17,21 +29,176 @@ static volatile sig_atomic_t interrupted = 0;
 static chrony_client_t *chrony_client = NULL;
 static char remote_path[256] = DEFAULT_REMOTE_PATH;
 static bool use_chrony = false;
+static ntp_shm_t *shm = NULL;
+static unsigned stats_every = 0;
+static pulse_journal_t *journal = NULL;
+static pulse_feed_t *feed = NULL;
+static volatile sig_atomic_t latency_requested = 0;
+
+/* Stages of the path from seeing CTS change to handing the pulse on */
+enum {
+    STAGE_TIOCMGET,            /* wake or poll time until TIOCMGET returned */
+    STAGE_PROCESS,             /* TIOCMGET returned until the pulse was filtered and logged */
+    STAGE_SEND,                /* sending to chrony and SHM */
+    STAGE_TOTAL,               /* wake or poll time until sent */
+    STAGE_AGE,                 /* estimated edge time until sent */
+    STAGE_COUNT
+};
+static const char *const stage_names[STAGE_COUNT] = { "tiocmget", "process", "send", "total", "age" };
 
 void handle_signal(int sig) {
     interrupted = 1;
 }
 
+void handle_latency_signal(int sig) {
+    latency_requested = 1;
+}
+
 void print_usage(const char *prog) {
     fprintf(stderr, "usage: %s [options] <device>\n", prog);
+    fprintf(stderr, "       %s [options] --replay FILE\n", prog);
     fprintf(stderr, "options:\n");
     fprintf(stderr, "  -c, --chrony             Send samples to chrony\n");
     fprintf(stderr, "  -r, --remote-path PATH   Remote chrony socket path (default: %s)\n", DEFAULT_REMOTE_PATH);
+    fprintf(stderr, "      --chrony-queue N     Samples kept while chrony is unreachable, 0 to drop them (default: %d)\n",
+            CHRONY_CLIENT_DEFAULT_QUEUE);
+    fprintf(stderr, "      --shm UNIT           Also publish samples to NTP SHM refclock UNIT (ntpd, chrony, gpsd)\n");
+    fprintf(stderr, "  -m, --mode MODE          How to watch CTS: poll or wait (TIOCMIWAIT, Linux only) (default: poll)\n");
+    fprintf(stderr, "      --wake-latency US    Bound on the time from a CTS change to waking in wait mode (default: %d)\n",
+            CTS_SOURCE_DEFAULT_WAKE_LATENCY_US);
+    fprintf(stderr, "      --record FILE        Record CTS changes to FILE\n");
+    fprintf(stderr, "      --replay FILE        Replay CTS changes recorded with --record instead of using a device\n");
+    fprintf(stderr, "      --realtime           Replay with the recorded timing instead of as fast as possible\n");
+    fprintf(stderr, "  -i, --interval US        Time between polls near an edge (default: 100)\n");
+    fprintf(stderr, "  -g, --guard US           Poll from this long before a predicted edge (default: 5000)\n");
+    fprintf(stderr, "  -b, --busy US            Poll without sleeping this close to a predicted edge (default: 300)\n");
+    fprintf(stderr, "      --continuous         Poll continuously instead of sleeping between edges\n");
+    fprintf(stderr, "      --auto-interval      Pick the poll interval from the measured poll times and CPU budget\n");
+    fprintf(stderr, "      --cpu-budget PCT     CPU to use with --auto-interval (default: 1)\n");
+    fprintf(stderr, "      --rt                 Run with real-time scheduling and locked memory, and set up the\n"
+                    "                           serial port for low latency (Linux)\n");
+    fprintf(stderr, "      --rt-priority N      SCHED_FIFO priority with --rt (default: 50)\n");
+    fprintf(stderr, "      --cpu N              Pin to CPU N (Linux)\n");
+    fprintf(stderr, "      --latency-timer MS   FTDI latency timer with --rt, 0 to leave it (default: 1)\n");
+    fprintf(stderr, "      --no-filter          Send every pulse to chrony without outlier rejection\n");
+    fprintf(stderr, "      --filter-mad K       Reject offsets more than K MADs from the median (default: 5)\n");
+    fprintf(stderr, "      --smooth N           Smooth offsets with a linear fit over N pulses (default: off)\n");
+    fprintf(stderr, "      --journal FILE       Log every pulse to a binary journal (read with ppsjournal)\n");
+    fprintf(stderr, "      --journal-size N     Records kept in the journal (default: %d)\n", PULSE_JOURNAL_DEFAULT_CAPACITY);
+    fprintf(stderr, "      --feed NAME          Publish pulses to shared memory feed NAME (e.g. %s) for ppsfeed\n",
+            PULSE_FEED_DEFAULT_NAME);
+    fprintf(stderr, "  -s, --stats N            Report polling statistics every N pulses\n");
+    fprintf(stderr, "      --latency            Report per-stage latency at exit (also on SIGUSR1)\n");
+    fprintf(stderr, "      --calibrate          Measure the offset for chrony against the system clock, then exit\n");
+    fprintf(stderr, "      --calibrate-window S Seconds of pulses to measure (default: 600)\n");
+    fprintf(stderr, "      --calibrate-file F   Save the measured offset to F\n");
     fprintf(stderr, "  -h, --help              Show this help\n");
 }
 
+/* Publish a pulse and the health that goes with it to the feed */
+static void publish_pulse(pulse_feed_t *feed, const pulse_journal_record_t *record,
+                          const pulse_filter_result_t *filtered, const pulse_filter_t *filter,
+                          const poll_schedule_t *sched) {
+    static pulse_feed_health_t health;
+    pulse_filter_stats_t filter_stats;
+
+    pulse_filter_stats(filter, &filter_stats);
+    health.updated = record->time;
+    health.pulses++;
+    health.accepted = filter_stats.accepted;
+    health.rejected = filter_stats.rejected_interval + filter_stats.rejected_outlier;
+    if (filtered->verdict == PULSE_VERDICT_ACCEPT) {
+        health.offset = filtered->offset;
+    }
+    health.residual_rms = filter_stats.residual_rms;
+    health.uncertainty_ns = record->uncertainty_ns;
+    health.source = record->source;
+    health.state = record->state;
+    if (sched) {
+        poll_schedule_stats_t sched_stats;
+        poll_schedule_stats(sched, &sched_stats);
+        health.missed = sched_stats.missed;
+    }
+    /* Health goes first, so that readers woken by the pulse see it */
+    pulse_feed_set_health(feed, &health);
+    pulse_feed_publish(feed, record);
+}
+
+/* Report how much of the time was spent polling rather than asleep */
+static void print_stats(const poll_schedule_t *sched, int64_t cpu_start, int64_t start) {
+    if (sched == NULL) {
+        double elapsed = (double)(poll_schedule_now() - start);
+        printf("CPU %.2f%%\n", elapsed > 0 ? 100.0 * (timens_now(CLOCK_PROCESS_CPUTIME_ID) - cpu_start) / elapsed : 0.0);
+        return;
+    }
+
+    poll_schedule_stats_t stats;
+    poll_schedule_stats(sched, &stats);
+    double elapsed = stats.elapsed > 0 ? (double)stats.elapsed : 1.0;
+
+    printf("Polling %s: %llu polls (%llu without sleeping), asleep %.1f%%, CPU %.2f%%, "
+           "missed %llu, early %llu, lost lock %llu times, period %.3f us\n",
+           stats.locked ? "locked" : "continuously",
+           (unsigned long long)stats.polls, (unsigned long long)stats.busy_polls,
+           100.0 * stats.asleep / elapsed, 100.0 * (timens_now(CLOCK_PROCESS_CPUTIME_ID) - cpu_start) / elapsed,
+           (unsigned long long)stats.missed, (unsigned long long)stats.early,
+           (unsigned long long)stats.lost, stats.period / 1000.0);
+    printf("Poll timing: interval %.1f us, oversleep mean %.1f us max %.1f us, "
+           "TIOCMGET mean %.1f us max %.1f us, CPU %.2f%% when last adjusted\n",
+           stats.interval / 1000.0, stats.oversleep_mean / 1000.0, stats.oversleep_max / 1000.0,
+           stats.poll_mean / 1000.0, stats.poll_max / 1000.0, 100.0 * stats.cpu);
+}
+
+/* Apply as much of the real-time profile as the system allows */
+static void setup_realtime(const rt_profile_config_t *config, int fd, const char *device, int latency_timer) {
+    if (rt_profile_set_scheduling(config) < 0) {
+        perror("Warning: Failed to set real-time scheduling");
+    }
+    if (rt_profile_lock_memory() < 0) {
+        perror("Warning: Failed to lock memory");
+    }
+    if (fd < 0) {
+        return;
+    }
+    if (rt_profile_serial_low_latency(fd) < 0 && errno != ENOTSUP) {
+        perror("Warning: Failed to set ASYNC_LOW_LATENCY");
+    }
+    if (latency_timer > 0 && rt_profile_ftdi_latency_timer(device, latency_timer) < 0) {
+        if (errno == ENOENT) {
+            fprintf(stderr, "Warning: No FTDI latency timer for %s\n", device);
+        } else if (errno != ENOTSUP) {
+            perror("Warning: Failed to set FTDI latency timer");
+        }
+    }
+}
+
 int main(int argc, char *argv[]) {
     const char *device = NULL;
+    const char *record_path = NULL;
+    const char *replay_path = NULL;
+    bool realtime = false;
+    const char *journal_path = NULL;
+    uint64_t journal_size = PULSE_JOURNAL_DEFAULT_CAPACITY;
+    unsigned chrony_queue = CHRONY_CLIENT_DEFAULT_QUEUE;
+    int shm_unit = -1;
+    const char *feed_name = NULL;
+    bool report_latency = false;
+    bool use_rt = false;
+    bool calibrate = false;
+    const char *calibrate_path = NULL;
+    calibration_config_t calibration_config;
+    int cpu = -1;
+    int latency_timer = 1;
+    rt_profile_config_t rt_config;
+    cts_source_kind_t kind = CTS_SOURCE_POLL;
+    long wake_latency = CTS_SOURCE_DEFAULT_WAKE_LATENCY_US;
+    poll_schedule_config_t sched_config;
+    pulse_filter_config_t filter_config;
+    
+    poll_schedule_default_config(&sched_config);
+    pulse_filter_default_config(&filter_config);
+    rt_profile_default_config(&rt_config);
+    calibration_default_config(&calibration_config);
     
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--chrony") == 0) {
@@ -44,6 +211,151 @@ int main(int argc, char *argv[]) {
             }
             strncpy(remote_path, argv[++i], sizeof(remote_path) - 1);
             remote_path[sizeof(remote_path) - 1] = '\0';
+        } else if (strcmp(argv[i], "--chrony-queue") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            chrony_queue = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--feed") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            feed_name = argv[++i];
+        } else if (strcmp(argv[i], "--shm") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (ntp_shm_parse_unit(argv[++i], &shm_unit) < 0) {
+                fprintf(stderr, "Error: shm unit must be a number, not %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mode") == 0) {
+            if (i + 1 >= argc || cts_source_parse_kind(argv[i + 1], &kind) < 0) {
+                fprintf(stderr, "Error: %s requires poll or wait\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--wake-latency") == 0) {
+            char *end;
+            if (i + 1 >= argc || (wake_latency = strtol(argv[i + 1], &end, 10)) <= 0 || *end != '\0') {
+                fprintf(stderr, "Error: %s requires a positive number of microseconds\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--record") == 0 || strcmp(argv[i], "--replay") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "--record") == 0) {
+                record_path = argv[++i];
+            } else {
+                replay_path = argv[++i];
+            }
+        } else if (strcmp(argv[i], "--realtime") == 0) {
+            realtime = true;
+        } else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--interval") == 0 ||
+                   strcmp(argv[i], "-g") == 0 || strcmp(argv[i], "--guard") == 0 ||
+                   strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--busy") == 0 ||
+                   strcmp(argv[i], "-s") == 0 || strcmp(argv[i], "--stats") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            char opt = argv[i][1] == '-' ? argv[i][2] : argv[i][1];
+            long value = strtol(argv[++i], NULL, 10);
+            if (value < 0) {
+                fprintf(stderr, "Error: %s must not be negative\n", argv[i - 1]);
+                return 1;
+            }
+            if (opt == 'i') {
+                sched_config.interval = value * 1000;
+            } else if (opt == 'g') {
+                sched_config.guard = value * 1000;
+            } else if (opt == 'b') {
+                sched_config.busy = value * 1000;
+            } else {
+                stats_every = (unsigned)value;
+            }
+        } else if (strcmp(argv[i], "--no-filter") == 0) {
+            filter_config.enabled = false;
+        } else if (strcmp(argv[i], "--filter-mad") == 0 || strcmp(argv[i], "--smooth") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "--smooth") == 0) {
+                filter_config.smooth_window = (unsigned)strtoul(argv[++i], NULL, 10);
+            } else {
+                filter_config.mad_threshold = strtod(argv[++i], NULL);
+            }
+        } else if (strcmp(argv[i], "--journal") == 0 || strcmp(argv[i], "--journal-size") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "--journal") == 0) {
+                journal_path = argv[++i];
+            } else {
+                journal_size = strtoull(argv[++i], NULL, 10);
+            }
+        } else if (strcmp(argv[i], "--continuous") == 0) {
+            sched_config.enabled = false;
+        } else if (strcmp(argv[i], "--auto-interval") == 0) {
+            sched_config.auto_interval = true;
+        } else if (strcmp(argv[i], "--cpu-budget") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            sched_config.cpu_budget = atof(argv[++i]) / 100.0;
+        } else if (strcmp(argv[i], "--rt") == 0) {
+            use_rt = true;
+        } else if (strcmp(argv[i], "--rt-priority") == 0 || strcmp(argv[i], "--cpu") == 0 ||
+                   strcmp(argv[i], "--latency-timer") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            int value = atoi(argv[i + 1]);
+            if (strcmp(argv[i], "--rt-priority") == 0) {
+                rt_config.priority = value;
+            } else if (strcmp(argv[i], "--cpu") == 0) {
+                cpu = value;
+            } else {
+                latency_timer = value;
+            }
+            i++;
+        } else if (strcmp(argv[i], "--latency") == 0) {
+            report_latency = true;
+        } else if (strcmp(argv[i], "--calibrate") == 0) {
+            calibrate = true;
+        } else if (strcmp(argv[i], "--calibrate-window") == 0 || strcmp(argv[i], "--calibrate-file") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            calibrate = true;
+            if (strcmp(argv[i], "--calibrate-window") == 0) {
+                calibration_config.window = strtod(argv[++i], NULL);
+            } else {
+                calibrate_path = argv[++i];
+            }
         } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
             print_usage(argv[0]);
             return 0;
@@ -60,75 +372,207 @@ int main(int argc, char *argv[]) {
         }
     }
     
-    if (device == NULL) {
-        fprintf(stderr, "Error: Device argument required\n");
+    if ((device == NULL) == (replay_path == NULL)) {
+        fprintf(stderr, "Error: Either a device or --replay is required\n");
         print_usage(argv[0]);
         return 1;
     }
     
-    /* Open serial port */
-    int fd = open(device, O_RDWR | O_NOCTTY);
-    if (fd < 0) {
-        perror("Failed to open device");
+    pulse_filter_t *filter = pulse_filter_create(&filter_config);
+    if (filter == NULL) {
+        fprintf(stderr, "Error: Invalid pulse filter (need --filter-mad > 0 and --smooth of 0 or at least 2)\n");
         return 1;
     }
-
-    /* Save original terminal settings */
-    struct termios orig_tios;
-    if (tcgetattr(fd, &orig_tios) < 0) {
-        perror("tcgetattr");
-        close(fd);
-        return 1;
+    
+    calibration_t *calibration = NULL;
+    if (calibrate) {
+        calibration = calibration_create(&calibration_config);
+        if (calibration == NULL) {
+            fprintf(stderr, "Error: Calibration window must be positive\n");
+            return 1;
+        }
     }
+    
+    /* Monotonic nanoseconds are the host clock for CTS pulses */
+    if (journal_path) {
+        journal = pulse_journal_create(journal_path, journal_size, 1, 1);
+        if (journal == NULL) {
+            perror("Failed to create journal");
+            return 1;
+        }
+    }
+    if (feed_name) {
+        feed = pulse_feed_create(feed_name, PULSE_FEED_DEFAULT_CAPACITY);
+        if (feed == NULL) {
+            perror("Failed to create pulse feed");
+            return 1;
+        }
+    }
+    
+    poll_schedule_t *sched = NULL;
+    if (replay_path == NULL && kind == CTS_SOURCE_POLL) {
+        sched = poll_schedule_create(&sched_config);
+        if (sched == NULL) {
+            fprintf(stderr, "Error: Invalid polling schedule (need interval > 0, busy <= guard < 0.5s "
+                    "and a CPU budget > 0)\n");
+            return 1;
+        }
+    }
+    
+    int fd = -1;
+    struct termios orig_tios;
+    cts_source_t *source;
+    
+    if (replay_path) {
+        source = cts_source_open_trace(replay_path, realtime);
+        if (source == NULL) {
+            perror("Failed to open trace");
+            return 1;
+        }
+    } else {
+        /* Open serial port */
+        fd = open(device, O_RDWR | O_NOCTTY);
+        if (fd < 0) {
+            perror("Failed to open device");
+            return 1;
+        }
+
+        /* Save original terminal settings */
+        if (tcgetattr(fd, &orig_tios) < 0) {
+            perror("tcgetattr");
+            close(fd);
+            return 1;
+        }
 
-    /* Set up raw mode */
-    struct termios raw_tios = orig_tios;
-    cfmakeraw(&raw_tios);
+        /* Set up raw mode */
+        struct termios raw_tios = orig_tios;
+        cfmakeraw(&raw_tios);
+        
+        if (tcsetattr(fd, TCSANOW, &raw_tios) < 0) {
+            perror("tcsetattr");
+            close(fd);
+            return 1;
+        }
+
+        source = kind == CTS_SOURCE_WAIT ? cts_source_open_wait(fd, (timens_t)wake_latency * TIMENS_PER_USEC) : cts_source_open_poll(fd, sched);
+        if (source == NULL) {
+            perror(kind == CTS_SOURCE_WAIT ? "Failed to set up TIOCMIWAIT" : "Failed to set up polling");
+            tcsetattr(fd, TCSANOW, &orig_tios);
+            close(fd);
+            return 1;
+        }
+    }
     
-    if (tcsetattr(fd, TCSANOW, &raw_tios) < 0) {
-        perror("tcsetattr");
-        close(fd);
+    if (record_path && cts_source_record(source, record_path) < 0) {
+        perror("Failed to create trace");
+        cts_source_close(source);
+        if (fd >= 0) {
+            tcsetattr(fd, TCSANOW, &orig_tios);
+            close(fd);
+        }
         return 1;
     }
 
     /* Set up chrony client if requested */
     if (use_chrony) {
         chrony_client = chrony_client_create(NULL, remote_path);
-        if (chrony_client == NULL) {
+        if (chrony_client == NULL || chrony_client_set_queue(chrony_client, chrony_queue, CHRONY_CLIENT_DEFAULT_MAX_AGE) < 0) {
             fprintf(stderr, "Failed to setup chrony client\n");
-            tcsetattr(fd, TCSANOW, &orig_tios);
-            close(fd);
+            cts_source_close(source);
+            if (fd >= 0) {
+                tcsetattr(fd, TCSANOW, &orig_tios);
+                close(fd);
+            }
             return 1;
         }
     }
+    if (shm_unit >= 0) {
+        shm = ntp_shm_create(shm_unit);
+        if (shm == NULL) {
+            perror("Failed to attach NTP SHM segment");
+            chrony_client_destroy(chrony_client);
+            cts_source_close(source);
+            if (fd >= 0) {
+                tcsetattr(fd, TCSANOW, &orig_tios);
+                close(fd);
+            }
+            return 1;
+        }
+    }
+
+    /* Set up signal handler; without SA_RESTART so that a blocked
+     * TIOCMIWAIT returns */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    sa.sa_handler = handle_latency_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGUSR1, &sa, NULL);
+
+    if (use_rt) {
+        setup_realtime(&rt_config, fd, device, latency_timer);
+    }
+    if (cpu >= 0 && rt_profile_pin_cpu(cpu) < 0) {
+        perror("Warning: Failed to pin to CPU");
+    }
 
-    /* Set up signal handler */
-    signal(SIGINT, handle_signal);
-    signal(SIGTERM, handle_signal);
+    stage_trace_t *trace = stage_trace_create(stage_names, STAGE_COUNT);
 
-    printf("Monitoring PPS on CTS line of %s\n", device);
+    if (replay_path) {
+        printf("Replaying CTS trace %s\n", replay_path);
+    } else {
+        printf("Monitoring PPS on CTS line of %s by %s\n", device,
+               kind == CTS_SOURCE_WAIT ? "waiting for changes" : "polling");
+    }
     if (use_chrony) {
         printf("Local socket: %s\n", chrony_client_local_path(chrony_client));
         printf("Remote socket: %s\n", chrony_client_remote_path(chrony_client));
     } else {
         printf("Chrony integration disabled\n");
     }
+    if (shm) {
+        printf("NTP SHM unit: %d\n", ntp_shm_unit(shm));
+    }
+    if (calibration) {
+        printf("Calibrating over %.0f s\n", calibration_config.window);
+    }
 
     bool last_cts = false;
+    bool calibrated = false;
     int pps_count = 0;
-    int status;
+    int64_t cpu_start = timens_now(CLOCK_PROCESS_CPUTIME_ID);
+    int64_t start = poll_schedule_now();
+    cts_sample_t sample;
+    int result;
 
-    while (!interrupted) {
-        /* Get modem status */
-        if (ioctl(fd, TIOCMGET, &status) < 0) {
-            perror("ioctl(TIOCMGET)");
+    while ((result = cts_source_read(source, &sample, &interrupted)) != 0) {
+        if (result < 0) {
+            perror("Failed to read modem status");
+            if (replay_path) {
+                break;
+            }
             struct timespec sleep_time = { 0, 100000 };
             nanosleep(&sleep_time, NULL);  /* 0.1ms on error */
             continue;
         }
+        if (latency_requested) {
+            latency_requested = 0;
+            stage_trace_print(trace, stdout);
+        }
+
+        /* A replayed sample's times are from the trace, so only the time
+         * spent here can be measured */
+        bool live = replay_path == NULL;
+        timens_t received = live ? sample.read_at : timens_now(CLOCK_MONOTONIC);
+        if (live) {
+            stage_trace_record(trace, STAGE_TIOCMGET, sample.read_at - sample.time);
+        }
 
         /* Check if CTS flag is set */
-        bool cts = (status & TIOCM_CTS) != 0;
+        bool cts = (sample.status & TIOCM_CTS) != 0;
 
         /* Check for transition from flag being on to off.
          * This is the opposite of what you might expect.
@@ -141,57 +585,180 @@ int main(int argc, char *argv[]) {
          * which corresponds to CTS flag going from on to off.
          */
         if (!cts && last_cts) {
+            /* The edge happened between the previous observation and this one */
+            timens_t edge, edge_real, resolution;
+            cts_source_edge(&sample, &edge, &edge_real, &resolution);
+            if (sched) {
+                poll_schedule_edge(sched, edge);
+            }
+
             struct timespec ts;
-            clock_gettime(CLOCK_REALTIME, &ts);
+            timens_to_timespec(edge_real, &ts);
             
             pps_count++;
             
-            /* Calculate offset: system time fractional part minus true time (0.0 at top of second) */
-            double offset = ((double)ts.tv_nsec / 1000000000.0) - 0.0;
-            
-            /* Convert timespec to timeval for chrony */
-            struct timeval tv;
-            tv.tv_sec = ts.tv_sec;
-            tv.tv_usec = ts.tv_nsec / 1000;
-            
-            /* Send sample to chrony if enabled */
-            if (use_chrony && chrony_client_send_pps(chrony_client, &tv, offset) < 0) {
-                fprintf(stderr, "Failed to send chrony sample\n");
-            }
+            /* Calculate offset: system time fractional part minus true time (0.0 at top of second).
+             * This keeps the full nanosecond precision that the timeval loses. */
+            double offset = (double)timens_subsec(edge_real) / 1e9 - 0.0;
             
             /* Format time for debug output */
             struct tm *tm = localtime(&ts.tv_sec);
             char time_buf[64];
             strftime(time_buf, sizeof(time_buf), "%H:%M:%S", tm);
             
-            printf("PPS #%d at %s.%09ld (%ld.%09ld) offset=%.6f\n",
-                   pps_count,
-                   time_buf,
-                   ts.tv_nsec,
-                   ts.tv_sec, ts.tv_nsec,
-                   offset);
+            pulse_filter_result_t filtered;
+            pulse_filter_process(filter, edge_real, offset, &filtered);
+            
+            if (journal || feed) {
+                pulse_journal_record_t record;
+                memset(&record, 0, sizeof(record));
+                record.host_ticks = (uint64_t)edge;
+                record.time = edge_real;
+                record.offset = offset;
+                record.residual_ns = (float)(filtered.residual * 1e9);
+                record.uncertainty_ns = (float)resolution;
+                record.source = PULSE_JOURNAL_CTS;
+                record.state = PULSE_STATE_ACQUIRE;
+                if (sched) {
+                    poll_schedule_stats_t sched_stats;
+                    poll_schedule_stats(sched, &sched_stats);
+                    record.state = sched_stats.locked ? PULSE_STATE_TRACK : PULSE_STATE_ACQUIRE;
+                }
+                record.verdict = filtered.verdict;
+                if (journal) {
+                    pulse_journal_append(journal, &record);
+                }
+                if (feed) {
+                    publish_pulse(feed, &record, &filtered, filter, sched);
+                }
+            }
+            timens_t processed = stage_trace_since(trace, STAGE_PROCESS, received);
+            
+            if (filtered.verdict != PULSE_VERDICT_ACCEPT) {
+                printf("PPS #%d at %s.%09ld (%ld.%09ld) offset=%.9f rejected: %s, %.1f MADs from median %.9f\n",
+                       pps_count,
+                       time_buf,
+                       ts.tv_nsec,
+                       ts.tv_sec, ts.tv_nsec,
+                       offset, pulse_filter_verdict_name(filtered.verdict),
+                       filtered.deviation, filtered.median);
+            } else {
+                /* Calibrate with the pulse as measured, before smoothing */
+                if (calibration) {
+                    int added = calibration_add(calibration, edge_real, offset);
+                    if (added < 0) {
+                        fprintf(stderr, "Warning: Out of memory for calibration\n");
+                    }
+                    calibrated = added > 0;
+                }
+                offset = filtered.offset;
+                
+                /* Convert to the nearest microsecond for chrony */
+                struct timeval tv;
+                timens_to_timeval(edge_real, &tv);
+                
+                /* Send sample to chrony if enabled */
+                if (use_chrony && chrony_client_send_pps(chrony_client, &tv, offset) < 0) {
+                    fprintf(stderr, "Chrony sample lost\n");
+                }
+                if (shm) {
+                    ntp_shm_send_pps(shm, edge_real, offset, ntp_shm_precision(resolution / 1e9));
+                }
+                timens_t sent = stage_trace_since(trace, STAGE_SEND, processed);
+                if (live) {
+                    stage_trace_record(trace, STAGE_TOTAL, sent - sample.time);
+                    stage_trace_record(trace, STAGE_AGE, sent - edge);
+                }
+                
+                printf("PPS #%d at %s.%09ld (%ld.%09ld) offset=%.9f +/-%.1fus residual=%.1fus\n",
+                       pps_count,
+                       time_buf,
+                       ts.tv_nsec,
+                       ts.tv_sec, ts.tv_nsec,
+                       offset, resolution / 1000.0, filtered.residual * 1e6);
+            }
+
+            if (stats_every > 0 && pps_count % stats_every == 0) {
+                print_stats(sched, cpu_start, start);
+            }
         }
 
         last_cts = cts;
-        
-        /* Poll every 0.1ms (100 microseconds) using nanosleep */
-        struct timespec sleep_time = {
-            .tv_sec = 0,
-            .tv_nsec = 100000  /* 100 microseconds = 100,000 nanoseconds */
-        };
-        nanosleep(&sleep_time, NULL);
+        if (calibrated) {
+            break;
+        }
+    }
+
+    if (calibrated) {
+        printf("Calibration window complete: %d pulses\n", pps_count);
+    } else if (interrupted) {
+        printf("\nReceived interrupt, shutting down...\n");
+    } else {
+        printf("End of trace: %d pulses\n", pps_count);
+    }
+    print_stats(sched, cpu_start, start);
+    if (report_latency) {
+        stage_trace_print(trace, stdout);
+    }
+    stage_trace_destroy(trace);
+    
+    pulse_filter_stats_t filter_stats;
+    pulse_filter_stats(filter, &filter_stats);
+    printf("Pulse filter: %llu accepted, %llu bad intervals, %llu outliers, smoothing residual %.1f us RMS\n",
+           (unsigned long long)filter_stats.accepted, (unsigned long long)filter_stats.rejected_interval,
+           (unsigned long long)filter_stats.rejected_outlier, filter_stats.residual_rms * 1e6);
+    pulse_filter_destroy(filter);
+    
+    if (calibration) {
+        /* A replayed trace was timed against the clock of the machine that
+         * recorded it, so the error of this one's clock is no guide */
+        double reference_error = NAN;
+        if (replay_path == NULL && calibration_reference_error(&reference_error) < 0) {
+            fprintf(stderr, "Warning: The system clock is not synchronised; the offset is only as good as it is\n");
+            reference_error = NAN;
+        }
+        calibration_result_t result;
+        if (calibration_result(calibration, &result) < 0) {
+            fprintf(stderr, "Error: Too few pulses to calibrate\n");
+        } else {
+            calibration_print(&result, 1.0, reference_error, stdout);
+            if (calibrate_path && calibration_write(calibrate_path, "pollpps", &result, 1.0, reference_error) < 0) {
+                perror("Failed to write calibration");
+            }
+        }
+        calibration_destroy(calibration);
+    }
+    pulse_journal_close(journal);
+    pulse_feed_close(feed);
+    cts_source_close(source);
+    if (sched) {
+        poll_schedule_destroy(sched);
     }
 
-    printf("\nReceived interrupt, shutting down...\n");
+    if (shm) {
+        ntp_shm_stats_t shm_stats;
+        ntp_shm_stats(shm, &shm_stats);
+        printf("NTP SHM unit %d: %llu sent, %llu not read by the consumer\n", ntp_shm_unit(shm),
+               (unsigned long long)shm_stats.sent, (unsigned long long)shm_stats.unread);
+        ntp_shm_destroy(shm);
+    }
 
     /* Cleanup chrony client */
     if (chrony_client) {
+        chrony_client_stats_t chrony_stats;
+        chrony_client_stats(chrony_client, &chrony_stats);
+        printf("Chrony: %llu sent, %llu queued, %llu expired, %llu overflowed, %llu lost, %llu reconnects\n",
+               (unsigned long long)chrony_stats.sent, (unsigned long long)chrony_stats.queued,
+               (unsigned long long)chrony_stats.expired, (unsigned long long)chrony_stats.overflows,
+               (unsigned long long)chrony_stats.lost, (unsigned long long)chrony_stats.reconnects);
         chrony_client_destroy(chrony_client);
     }
 
     /* Restore original terminal settings */
-    tcsetattr(fd, TCSANOW, &orig_tios);
-    close(fd);
+    if (fd >= 0) {
+        tcsetattr(fd, TCSANOW, &orig_tios);
+        close(fd);
+    }
 
     return 0;
-}
\ No newline at end of file
+}
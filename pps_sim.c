@@ -0,0 +1,380 @@
+#include "pps_sim.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+
+/* CLOCK_MONOTONIC of the start, as reported in CTS changes */
+#define MONO_START (1000 * TIMENS_PER_SEC)
+
+/* Pulses are computed out to this many decay time constants */
+#define TAIL_CONSTANTS 20.0
+
+/* Stray pulses decay faster than real ones */
+#define GLITCH_DECAY 100e-6
+
+/* Stray CTS pulses stay clear of real ones by this much (seconds) */
+#define GLITCH_CLEARANCE 0.01
+
+/* Most changes generated for one second */
+#define MAX_CHANGES 16
+
+typedef struct {
+    double time;               /* seconds since the start */
+    int status;
+} change_t;
+
+struct pps_sim {
+    pps_sim_config_t config;
+    uint64_t rng;
+    bool have_spare;
+    double spare;
+    pps_sim_stats_t stats;
+
+    int64_t pulse;             /* pulse whose amplitude is cached */
+    bool pulse_present;
+    double pulse_level;
+
+    double rate;               /* true codec sample rate */
+    uint64_t next_sample;      /* codec sample time of the next buffer */
+
+    double next_glitch;        /* time of the next stray pulse */
+    double glitch_at;          /* start of the stray pulse in progress, or -1 */
+    double glitch_amplitude;
+
+    bool cts_started;
+    int64_t second;            /* next second to generate changes for */
+    change_t changes[MAX_CHANGES];
+    unsigned change_count;
+    unsigned change_next;
+    double elapsed;
+};
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+    z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return z ^ (z >> 31);
+}
+
+static double uniform(uint64_t *state) {
+    return (double)(splitmix64(state) >> 11) * 0x1.0p-53;
+}
+
+static double gauss_pair(uint64_t *state, double *spare) {
+    double u = uniform(state);
+    double v = uniform(state);
+    double r = sqrt(-2.0 * log(1.0 - u));
+    *spare = r * sin(2.0 * M_PI * v);
+    return r * cos(2.0 * M_PI * v);
+}
+
+static double gauss(pps_sim_t *sim) {
+    if (sim->have_spare) {
+        sim->have_spare = false;
+        return sim->spare;
+    }
+    sim->have_spare = true;
+    return gauss_pair(&sim->rng, &sim->spare);
+}
+
+static double exponential(pps_sim_t *sim, double mean) {
+    return -mean * log(1.0 - uniform(&sim->rng));
+}
+
+/* Whether pulse j is there and how big it is; the same every time it is
+ * asked for, without keeping any state */
+static bool pulse_amplitude(const pps_sim_t *sim, int64_t j, double *amplitude) {
+    uint64_t state = sim->config.seed ^ ((uint64_t)j * UINT64_C(0xd1b54a32d192ed03));
+    double spare;
+    if (uniform(&state) < sim->config.miss_rate) {
+        return false;
+    }
+    *amplitude = sim->config.amplitude * (1.0 + sim->config.amplitude_jitter * gauss_pair(&state, &spare));
+    return true;
+}
+
+static double schedule_glitch(pps_sim_t *sim, double after) {
+    if (sim->config.glitch_rate <= 0.0) {
+        return INFINITY;
+    }
+    return after + exponential(sim, 1.0 / sim->config.glitch_rate);
+}
+
+void pps_sim_default_config(pps_sim_config_t *config) {
+    memset(config, 0, sizeof(*config));
+    config->start = INT64_C(1700000000) * TIMENS_PER_SEC;
+    config->phase = 0.25;
+    config->miss_rate = 0.0;
+    config->glitch_rate = 0.0;
+    config->seed = 1;
+
+    config->sample_rate = 48000.0;
+    config->block_size = 1024;
+    config->amplitude = 0.8;
+    config->amplitude_jitter = 0.05;
+    config->rise_time = 20e-6;
+    config->decay_time = 2e-3;
+    config->width = 0.1;
+    config->noise = 0.005;
+    config->drift_ppm = 20.0;
+    config->host_jitter = 50e-6;
+    config->input_latency = 0.0;
+    config->drop_rate = 1e-4;
+
+    config->poll_interval = 100e-6;
+    config->poll_jitter = 20e-6;
+    config->usb_latency = 1e-3;
+    config->usb_jitter = 1e-3;
+}
+
+pps_sim_t *pps_sim_create(const pps_sim_config_t *config) {
+    if (config->sample_rate <= 0.0 || config->block_size == 0 || config->rise_time <= 0.0
+        || config->decay_time <= 0.0 || config->phase < 0.0 || config->phase >= 1.0
+        || config->width < 0.0 || config->width >= 0.5 || config->poll_interval <= 0.0) {
+        return NULL;
+    }
+    pps_sim_t *sim = calloc(1, sizeof(pps_sim_t));
+    if (sim == NULL) {
+        return NULL;
+    }
+    sim->config = *config;
+    sim->rng = config->seed;
+    sim->rate = config->sample_rate * (1.0 + config->drift_ppm * 1e-6);
+    sim->glitch_at = -1.0;
+    sim->pulse = -1;
+    sim->next_glitch = schedule_glitch(sim, 0.0);
+    return sim;
+}
+
+/* Level of an RC-shaped pulse dt seconds after its edge, through AC coupling */
+static double pulse_shape(double dt, double rise, double decay) {
+    if (dt < 0.0 || dt > TAIL_CONSTANTS * decay) {
+        return 0.0;
+    }
+    return (1.0 - exp(-dt / rise)) * exp(-dt / decay);
+}
+
+static double signal_level(pps_sim_t *sim, double t) {
+    const pps_sim_config_t *c = &sim->config;
+    double level = 0.0;
+
+    int64_t j = (int64_t)floor(t - c->phase);
+    if (j != sim->pulse) {
+        sim->pulse = j;
+        sim->pulse_present = j >= 0 && pulse_amplitude(sim, j, &sim->pulse_level);
+    }
+    if (sim->pulse_present) {
+        double amplitude = sim->pulse_level;
+        double dt = t - ((double)j + c->phase);
+        level += amplitude * pulse_shape(dt, c->rise_time, c->decay_time);
+        if (c->width > 0.0) {
+            level -= amplitude * pulse_shape(dt - c->width, c->rise_time, c->decay_time);
+        }
+    }
+
+    if (t >= sim->next_glitch) {
+        sim->glitch_at = sim->next_glitch;
+        sim->glitch_amplitude = c->amplitude * (0.6 + 0.6 * uniform(&sim->rng));
+        if (uniform(&sim->rng) < 0.5) {
+            sim->glitch_amplitude = -sim->glitch_amplitude;
+        }
+        sim->stats.glitches++;
+        sim->next_glitch = schedule_glitch(sim, sim->next_glitch);
+    }
+    if (sim->glitch_at >= 0.0) {
+        double dt = t - sim->glitch_at;
+        if (dt > TAIL_CONSTANTS * GLITCH_DECAY) {
+            sim->glitch_at = -1.0;
+        } else {
+            level += sim->glitch_amplitude * pulse_shape(dt, c->rise_time, GLITCH_DECAY);
+        }
+    }
+    return level;
+}
+
+/* Count the pulses whose edges fall in [from, to) */
+static uint64_t count_edges(const pps_sim_t *sim, double from, double to, uint64_t *missing) {
+    uint64_t count = 0;
+    int64_t j = (int64_t)ceil(from - sim->config.phase);
+    if (j < 0) {
+        j = 0;
+    }
+    for (; (double)j + sim->config.phase < to; j++) {
+        double amplitude;
+        if (pulse_amplitude(sim, j, &amplitude)) {
+            count++;
+        } else if (missing) {
+            (*missing)++;
+        }
+    }
+    return count;
+}
+
+size_t pps_sim_audio_block(pps_sim_t *sim, float *samples, pps_sim_block_t *block) {
+    const pps_sim_config_t *c = &sim->config;
+    size_t count = c->block_size;
+    double duration = (double)count / sim->rate;
+
+    /* Dropped buffers never arrive; their samples still pass on the codec */
+    unsigned dropped = 0;
+    while (c->drop_rate > 0.0 && uniform(&sim->rng) < c->drop_rate) {
+        double t0 = (double)sim->next_sample / sim->rate;
+        sim->stats.dropped_edges += count_edges(sim, t0, t0 + duration, NULL);
+        sim->next_sample += count;
+        sim->stats.dropped_blocks++;
+        dropped++;
+        while (sim->next_glitch < t0 + duration) {
+            sim->next_glitch = schedule_glitch(sim, sim->next_glitch);
+        }
+    }
+
+    double t0 = (double)sim->next_sample / sim->rate;
+    block->sample_time = (double)sim->next_sample;
+    /* A buffer is stamped when it leaves the converter, which is later
+     * than its samples were taken */
+    block->host_time = (uint64_t)(c->start + llround((t0 + c->input_latency + c->host_jitter * gauss(sim)) * 1e9));
+    block->count = count;
+    block->dropped = dropped;
+
+    for (size_t i = 0; i < count; i++) {
+        double t = (double)(sim->next_sample + i) / sim->rate;
+        samples[i] = (float)(signal_level(sim, t) + c->noise * gauss(sim));
+    }
+
+    sim->stats.edges += count_edges(sim, t0, t0 + duration, &sim->stats.missing);
+    sim->stats.samples += count;
+    sim->next_sample += count;
+    sim->elapsed = (double)sim->next_sample / sim->rate;
+    return count;
+}
+
+static void add_change(pps_sim_t *sim, double time, int status) {
+    if (sim->change_count < MAX_CHANGES) {
+        sim->changes[sim->change_count].time = time;
+        sim->changes[sim->change_count].status = status;
+        sim->change_count++;
+    }
+}
+
+/* Work out the changes for the next second, in the order they are seen.
+ * CTS is on while the PPS signal is low, so a pulse turns it off. */
+static void generate_second(pps_sim_t *sim) {
+    const pps_sim_config_t *c = &sim->config;
+    double from = (double)sim->second;
+    double to = from + 1.0;
+    double edge = from + c->phase;
+    double amplitude;
+    bool present = pulse_amplitude(sim, sim->second, &amplitude);
+
+    sim->change_count = 0;
+    sim->change_next = 0;
+    if (present) {
+        add_change(sim, edge, 0);
+        add_change(sim, edge + c->width, TIOCM_CTS);
+        sim->stats.edges++;
+    } else {
+        sim->stats.missing++;
+    }
+
+    double last_end = from;
+    while (sim->next_glitch < to) {
+        double start = sim->next_glitch;
+        double length = c->poll_interval * (0.5 + 2.5 * uniform(&sim->rng));
+        sim->next_glitch = schedule_glitch(sim, start);
+        bool clear = start > last_end && start + length < to
+            && (start + length < edge - GLITCH_CLEARANCE || start > edge + c->width + GLITCH_CLEARANCE);
+        if (clear && sim->change_count + 2 <= MAX_CHANGES) {
+            add_change(sim, start, 0);
+            add_change(sim, start + length, TIOCM_CTS);
+            sim->stats.glitches++;
+            last_end = start + length;
+        }
+    }
+
+    for (unsigned i = 1; i < sim->change_count; i++) {
+        change_t change = sim->changes[i];
+        unsigned k = i;
+        while (k > 0 && sim->changes[k - 1].time > change.time) {
+            sim->changes[k] = sim->changes[k - 1];
+            k--;
+        }
+        sim->changes[k] = change;
+    }
+
+    /* Each change is seen some time after it happens, but the adapter
+     * reports them in order */
+    for (unsigned i = 0; i < sim->change_count; i++) {
+        double seen = sim->changes[i].time + c->usb_latency + c->usb_jitter * uniform(&sim->rng);
+        if (i > 0 && seen < sim->changes[i - 1].time) {
+            seen = sim->changes[i - 1].time;
+        }
+        sim->changes[i].time = seen;
+    }
+    sim->second++;
+}
+
+static timens_t seconds_to_ns(double t) {
+    return llround(t * 1e9);
+}
+
+void pps_sim_cts_change(pps_sim_t *sim, cts_sample_t *sample) {
+    const pps_sim_config_t *c = &sim->config;
+
+    if (!sim->cts_started) {
+        sim->cts_started = true;
+        sample->time = MONO_START;
+        sample->since = MONO_START;
+        sample->real = c->start;
+        sample->status = TIOCM_CTS;
+        sample->read_at = sample->time;
+        sim->stats.changes++;
+        return;
+    }
+
+    for (;;) {
+        while (sim->change_next >= sim->change_count) {
+            generate_second(sim);
+        }
+        change_t *change = &sim->changes[sim->change_next++];
+
+        /* The change lands somewhere between two polls */
+        double gap = c->poll_interval + (c->poll_jitter > 0.0 ? exponential(sim, c->poll_jitter) : 0.0);
+        double since = change->time - gap * uniform(&sim->rng);
+        double time = since + gap;
+
+        /* A change undone before the poll that would have seen it is lost */
+        if (sim->change_next < sim->change_count && sim->changes[sim->change_next].time <= time) {
+            sim->change_next++;
+            continue;
+        }
+
+        sample->time = MONO_START + seconds_to_ns(time);
+        sample->since = MONO_START + seconds_to_ns(since);
+        sample->real = c->start + seconds_to_ns(time);
+        sample->status = change->status;
+        sample->read_at = sample->time;
+        sim->stats.changes++;
+        sim->elapsed = time;
+        return;
+    }
+}
+
+timens_t pps_sim_nearest_edge(const pps_sim_t *sim, timens_t time) {
+    timens_t phase = seconds_to_ns(sim->config.phase);
+    timens_t k = timens_round_div(time - sim->config.start - phase, TIMENS_PER_SEC);
+    return sim->config.start + phase + k * TIMENS_PER_SEC;
+}
+
+timens_t pps_sim_elapsed(const pps_sim_t *sim) {
+    return seconds_to_ns(sim->elapsed);
+}
+
+void pps_sim_stats(const pps_sim_t *sim, pps_sim_stats_t *stats) {
+    *stats = sim->stats;
+}
+
+void pps_sim_destroy(pps_sim_t *sim) {
+    free(sim);
+}
@@ -0,0 +1,107 @@
+#ifndef PPS_SIM_H
+#define PPS_SIM_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "timens.h"
+#include "cts_source.h"
+
+/* Synthetic PPS signal with known edge times, for measuring accuracy.
+ *
+ * True time is CLOCK_REALTIME as it should be, and pulses start at a fixed
+ * phase past each second. The audio side generates buffers as CoreAudio
+ * delivers them: samples of an RC-shaped, AC-coupled pulse with varying
+ * amplitude and added noise, stamped with a sample time from a codec clock
+ * that drifts and a host time (nanoseconds of true time) with jitter.
+ * Buffers can be dropped, leaving a gap in sample time, and stray pulses
+ * added. The CTS side generates the modem status changes pollpps would
+ * see when polling a USB adapter that reports changes late.
+ *
+ * Everything random comes from the seed, so a run can be repeated exactly.
+ */
+
+typedef struct pps_sim pps_sim_t;
+
+typedef struct {
+    timens_t start;            /* true time at the start, a whole second */
+    double phase;              /* time of the pulse edges past the second (seconds) */
+    double miss_rate;          /* probability that a pulse is missing */
+    double glitch_rate;        /* stray pulses per second */
+    uint64_t seed;
+
+    /* Audio */
+    double sample_rate;        /* nominal sample rate */
+    size_t block_size;         /* samples per buffer */
+    double amplitude;          /* peak level of a pulse */
+    double amplitude_jitter;   /* RMS variation of the amplitude, relative */
+    double rise_time;          /* RC time constant of the leading edge (seconds) */
+    double decay_time;         /* time constant of the AC coupling (seconds) */
+    double width;              /* pulse width; the trailing edge gives a negative pulse (seconds) */
+    double noise;              /* RMS noise level */
+    double drift_ppm;          /* codec clock error */
+    double host_jitter;        /* RMS error of buffer host times (seconds) */
+    double input_latency;      /* delay through the converter, left out of the host times (seconds) */
+    double drop_rate;          /* probability that a buffer is dropped */
+
+    /* CTS */
+    double poll_interval;      /* time between polls (seconds) */
+    double poll_jitter;        /* mean extra delay of each poll (seconds) */
+    double usb_latency;        /* delay before the adapter reports a change (seconds) */
+    double usb_jitter;         /* further delay, uniformly distributed (seconds) */
+} pps_sim_config_t;
+
+/* A buffer, with the timestamps CoreAudio would give it */
+typedef struct {
+    double sample_time;        /* codec sample time of the first sample (mSampleTime) */
+    uint64_t host_time;        /* host time of the first sample in ns (mHostTime) */
+    size_t count;              /* samples in the buffer */
+    unsigned dropped;          /* buffers dropped just before this one */
+} pps_sim_block_t;
+
+typedef struct {
+    uint64_t edges;            /* pulses generated in delivered buffers or as changes */
+    uint64_t missing;          /* pulses left out */
+    uint64_t dropped_blocks;   /* buffers dropped */
+    uint64_t dropped_edges;    /* pulses lost in dropped buffers */
+    uint64_t glitches;         /* stray pulses generated */
+    uint64_t samples;          /* samples delivered */
+    uint64_t changes;          /* CTS changes generated */
+} pps_sim_stats_t;
+
+/* Fill in the default configuration: a 100ms pulse at 0.25s past the
+ * second, 48kHz in 1024 sample buffers, amplitude 0.8 +/- 5%, 20us rise,
+ * 2ms decay, noise 0.005 RMS, 20ppm drift, 50us host jitter, no input
+ * latency, one buffer in 10000 dropped and no missing or stray pulses; 100us polls with 20us
+ * jitter and 1ms +/- 1ms of USB latency */
+void pps_sim_default_config(pps_sim_config_t *config);
+
+/* Create a simulation
+ * Returns NULL on error
+ */
+pps_sim_t *pps_sim_create(const pps_sim_config_t *config);
+
+/* Generate the next audio buffer
+ * samples: receives block_size samples
+ * Returns the number of samples generated
+ */
+size_t pps_sim_audio_block(pps_sim_t *sim, float *samples, pps_sim_block_t *block);
+
+/* Generate the next CTS change, as a poll source would report it
+ * The first status is reported straight away.
+ */
+void pps_sim_cts_change(pps_sim_t *sim, cts_sample_t *sample);
+
+/* Get the true time of the pulse edge nearest to time */
+timens_t pps_sim_nearest_edge(const pps_sim_t *sim, timens_t time);
+
+/* Get the true time simulated so far */
+timens_t pps_sim_elapsed(const pps_sim_t *sim);
+
+/* Get the counters */
+void pps_sim_stats(const pps_sim_t *sim, pps_sim_stats_t *stats);
+
+/* Destroy the simulation */
+void pps_sim_destroy(pps_sim_t *sim);
+
+#endif /* PPS_SIM_H */
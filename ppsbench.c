@@ -0,0 +1,630 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/utsname.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include "chrony_client.h"
+#include "clock_model.h"
+#include "cts_source.h"
+#include "pps_sim.h"
+#include "pulse_detector.h"
+#include "pulse_filter.h"
+#include "sample_clock.h"
+#include "spsc_ring.h"
+#include "timens.h"
+
+#define SAMPLE_RATE 48000
+#define WARMUP_SECONDS 5
+#define CONVERSION_BATCH 1000
+#define RECEIVE_TIMEOUT_MS 2000
+
+static const size_t block_sizes[] = { 64, 128, 256, 512, 1024, 2048, 4096 };
+
+typedef struct {
+    unsigned seconds;          /* seconds of audio per detector run */
+    unsigned conversions;      /* batches of host time conversions */
+    unsigned sends;            /* datagrams sent to the local receiver */
+    unsigned pulses;           /* pulses timed end to end */
+} bench_sizes_t;
+
+typedef struct {
+    FILE *json;
+    bool first;
+} bench_output_t;
+
+/* Local stand-in for chronyd's socket */
+typedef struct {
+    int fd;
+    char path[108];
+    chrony_client_t *client;
+} receiver_t;
+
+typedef struct {
+    spsc_ring_t *ring;
+    clock_model_t *model;
+    pulse_filter_t *filter;
+    chrony_client_t *client;
+    atomic_bool running;
+} audio_worker_t;
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "Measure the cost of the pulse timing path\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -o, --output FILE        Also write the results to FILE as JSON\n");
+    fprintf(stderr, "      --json               Print the results as JSON instead of a table\n");
+    fprintf(stderr, "      --quick              Run for a fraction of the usual time\n");
+    fprintf(stderr, "  -h, --help               Show this help\n");
+}
+
+static int compare_times(const void *a, const void *b) {
+    timens_t x = *(const timens_t *)a;
+    timens_t y = *(const timens_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(const timens_t *sorted, size_t count, double p) {
+    if (count == 0) {
+        return 0.0;
+    }
+    size_t rank = (size_t)ceil(p / 100.0 * (double)count);
+    return (double)sorted[rank > 0 ? rank - 1 : 0];
+}
+
+/* Print one result as a table row and a JSON object
+ * params: extra JSON members, without braces, or ""
+ * scale: divides each time, for times of batches
+ * per_sample: nanoseconds per audio sample, or 0
+ */
+static void report(bench_output_t *out, const char *name, const char *params, timens_t *times,
+                   size_t count, double scale, double per_sample) {
+    qsort(times, count, sizeof(timens_t), compare_times);
+    double sum = 0.0;
+    for (size_t i = 0; i < count; i++) {
+        sum += (double)times[i];
+    }
+    double mean = count ? sum / (double)count / scale : 0.0;
+    double p50 = percentile(times, count, 50.0) / scale;
+    double p90 = percentile(times, count, 90.0) / scale;
+    double p99 = percentile(times, count, 99.0) / scale;
+    double p999 = percentile(times, count, 99.9) / scale;
+    double max = count ? (double)times[count - 1] / scale : 0.0;
+
+    if (out->json != stdout) {
+        /* "block": 64, "track": true -> block=64 track=true */
+        char label[96];
+        size_t len = (size_t)snprintf(label, sizeof(label), "%s", name);
+        for (const char *p = params; *p && len + 2 < sizeof(label); p++) {
+            if (p == params) {
+                label[len++] = ' ';
+            }
+            if (*p == '"' || (*p == ' ' && p > params && (p[-1] == ':' || p[-1] == ','))) {
+                continue;
+            }
+            label[len++] = *p == ':' ? '=' : *p == ',' ? ' ' : *p;
+        }
+        label[len] = '\0';
+        printf("%-44s %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n", label, count, mean, p50, p99, p999, max);
+        fflush(stdout);
+    }
+    if (out->json) {
+        fprintf(out->json, "%s    {\"name\": \"%s\", %s%s\"count\": %zu, \"unit\": \"ns\", \"mean\": %.1f, "
+                "\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, \"p999\": %.1f, \"max\": %.1f",
+                out->first ? "" : ",\n", name, params, params[0] ? ", " : "", count,
+                mean, p50, p90, p99, p999, max);
+        if (per_sample > 0.0) {
+            fprintf(out->json, ", \"per_sample_ns\": %.3f", per_sample);
+        }
+        fprintf(out->json, "}");
+        out->first = false;
+    }
+}
+
+/* One second of the simulated signal; it repeats exactly every second */
+static float *make_second(void) {
+    pps_sim_config_t config;
+    pps_sim_default_config(&config);
+    config.sample_rate = SAMPLE_RATE;
+    config.block_size = SAMPLE_RATE;
+    config.drift_ppm = 0.0;
+    config.amplitude_jitter = 0.0;
+    config.host_jitter = 0.0;
+    config.drop_rate = 0.0;
+
+    pps_sim_t *sim = pps_sim_create(&config);
+    float *second = malloc(SAMPLE_RATE * sizeof(float));
+    if (sim && second) {
+        pps_sim_block_t block;
+        pps_sim_audio_block(sim, second, &block);
+    }
+    pps_sim_destroy(sim);
+    return second;
+}
+
+static void copy_block(const float *second, uint64_t pos, float *block, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        block[i] = second[(pos + i) % SAMPLE_RATE];
+    }
+}
+
+/* Host time of a stream position; the simulated codec runs at exactly
+ * the nominal rate */
+static uint64_t position_host_time(uint64_t base, uint64_t pos) {
+    return base + (uint64_t)(pos * TIMENS_PER_SEC / SAMPLE_RATE);
+}
+
+static uint64_t monotonic_host(void) {
+    return (uint64_t)timens_now(CLOCK_MONOTONIC);
+}
+
+static pulse_detector_t *make_detector(bool track) {
+    pulse_detector_config_t config;
+    pulse_detector_default_config(&config);
+    config.sample_rate = SAMPLE_RATE;
+    config.ticks_per_second = 1e9;
+    config.track = track;
+    return pulse_detector_create(&config);
+}
+
+static sample_clock_t *make_sample_clock(void) {
+    sample_clock_config_t config;
+    sample_clock_default_config(&config);
+    config.sample_rate = SAMPLE_RATE;
+    return sample_clock_create(&config);
+}
+
+/* What audio_input_callback does with a buffer: track the sample clock,
+ * detect, time the pulses and queue them
+ * Returns the number of pulses queued */
+static size_t callback(pulse_detector_t *detector, sample_clock_t *clock, spsc_ring_t *ring,
+                       const float *block, size_t count, uint64_t pos, uint64_t base) {
+    pulse_event_t events[4];
+    sample_clock_update(clock, pulse_detector_samples(detector), (double)pos,
+                        position_host_time(base, pos), count);
+    size_t n = pulse_detector_process(detector, block, count, position_host_time(base, pos), events, 4);
+    size_t queued = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (sample_clock_host_time(clock, events[i].sample_pos, &events[i].host_time) == 0
+            && spsc_ring_push(ring, &events[i])) {
+            queued++;
+        }
+    }
+    return queued;
+}
+
+static int bench_timer(bench_output_t *out, unsigned count) {
+    timens_t *times = malloc(count * sizeof(timens_t));
+    if (times == NULL) {
+        return -1;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        timens_t a = timens_now(CLOCK_MONOTONIC);
+        timens_t b = timens_now(CLOCK_MONOTONIC);
+        times[i] = b - a;
+    }
+    report(out, "timer", "", times, count, 1.0, 0.0);
+    free(times);
+    return 0;
+}
+
+static int bench_callback(bench_output_t *out, const float *second, size_t block_size, bool track,
+                          unsigned seconds) {
+    size_t blocks = (size_t)seconds * SAMPLE_RATE / block_size;
+    timens_t *times = malloc(blocks * sizeof(timens_t));
+    float *block = malloc(block_size * sizeof(float));
+    pulse_detector_t *detector = make_detector(track);
+    sample_clock_t *clock = make_sample_clock();
+    spsc_ring_t *ring = spsc_ring_create(64, sizeof(pulse_event_t));
+    int result = -1;
+
+    if (times && block && detector && clock && ring) {
+        uint64_t base = (uint64_t)timens_now(CLOCK_MONOTONIC);
+        uint64_t pos = 0;
+        size_t warmup = (size_t)WARMUP_SECONDS * SAMPLE_RATE / block_size;
+        pulse_event_t event;
+
+        for (size_t i = 0; i < warmup + blocks; i++) {
+            copy_block(second, pos, block, block_size);
+            timens_t start = timens_now(CLOCK_MONOTONIC);
+            callback(detector, clock, ring, block, block_size, pos, base);
+            timens_t end = timens_now(CLOCK_MONOTONIC);
+            if (i >= warmup) {
+                times[i - warmup] = end - start;
+            }
+            while (spsc_ring_pop(ring, &event)) {
+            }
+            pos += block_size;
+        }
+
+        double total = 0.0;
+        for (size_t i = 0; i < blocks; i++) {
+            total += (double)times[i];
+        }
+        char params[64];
+        snprintf(params, sizeof(params), "\"block\": %zu, \"track\": %s", block_size, track ? "true" : "false");
+        report(out, "callback", params, times, blocks, 1.0, total / ((double)blocks * (double)block_size));
+        result = 0;
+    }
+    spsc_ring_destroy(ring);
+    sample_clock_destroy(clock);
+    pulse_detector_destroy(detector);
+    free(block);
+    free(times);
+    return result;
+}
+
+static int bench_conversion(bench_output_t *out, unsigned batches) {
+    timens_t *times = malloc(batches * sizeof(timens_t));
+    sample_clock_t *clock = make_sample_clock();
+    clock_model_config_t model_config;
+    clock_model_default_config(&model_config);
+    clock_model_t *model = clock_model_create(&model_config, monotonic_host, 1, 1);
+    int result = -1;
+
+    if (times && clock && model) {
+        /* Settle the sample clock on a minute of buffers */
+        uint64_t base = (uint64_t)timens_now(CLOCK_MONOTONIC);
+        for (uint64_t pos = 0; pos < 60 * SAMPLE_RATE; pos += 512) {
+            sample_clock_update(clock, pos, (double)pos, position_host_time(base, pos), 512);
+        }
+        volatile uint64_t sink = 0;
+        for (unsigned b = 0; b < batches; b++) {
+            timens_t start = timens_now(CLOCK_MONOTONIC);
+            for (unsigned i = 0; i < CONVERSION_BATCH; i++) {
+                uint64_t host;
+                sample_clock_host_time(clock, 59.0 * SAMPLE_RATE + i * 0.25, &host);
+                sink += host;
+            }
+            times[b] = timens_now(CLOCK_MONOTONIC) - start;
+        }
+        report(out, "host_time", "\"stage\": \"sample_clock\"", times, batches, CONVERSION_BATCH, 0.0);
+
+        uint64_t host = monotonic_host();
+        for (unsigned b = 0; b < batches; b++) {
+            timens_t start = timens_now(CLOCK_MONOTONIC);
+            for (unsigned i = 0; i < CONVERSION_BATCH; i++) {
+                timens_t real;
+                double uncertainty;
+                clock_model_convert(model, host + i, &real, &uncertainty);
+                sink += (uint64_t)real;
+            }
+            times[b] = timens_now(CLOCK_MONOTONIC) - start;
+        }
+        report(out, "host_time", "\"stage\": \"clock_model\"", times, batches, CONVERSION_BATCH, 0.0);
+        (void)sink;
+        result = 0;
+    }
+    clock_model_destroy(model);
+    sample_clock_destroy(clock);
+    free(times);
+    return result;
+}
+
+static int receiver_open(receiver_t *rx) {
+    memset(rx, 0, sizeof(*rx));
+    snprintf(rx->path, sizeof(rx->path), "/tmp/ppsbench.%d.sock", (int)getpid());
+    unlink(rx->path);
+
+    rx->fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (rx->fd < 0) {
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    int len = snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", rx->path);
+    if (len < 0 || (size_t)len >= sizeof(addr.sun_path)) {
+        close(rx->fd);
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    struct timeval timeout = { RECEIVE_TIMEOUT_MS / 1000, (RECEIVE_TIMEOUT_MS % 1000) * 1000 };
+    if (bind(rx->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0
+        || setsockopt(rx->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+        close(rx->fd);
+        return -1;
+    }
+    rx->client = chrony_client_create("/tmp/ppsbench-client.%d.sock", rx->path);
+    if (rx->client == NULL) {
+        close(rx->fd);
+        unlink(rx->path);
+        return -1;
+    }
+    return 0;
+}
+
+static bool receiver_wait(receiver_t *rx) {
+    struct sock_sample sample;
+    return recv(rx->fd, &sample, sizeof(sample), 0) == (ssize_t)sizeof(sample);
+}
+
+static void receiver_close(receiver_t *rx) {
+    chrony_client_destroy(rx->client);
+    close(rx->fd);
+    unlink(rx->path);
+}
+
+static int bench_send(bench_output_t *out, unsigned count) {
+    receiver_t rx;
+    if (receiver_open(&rx) < 0) {
+        perror("Failed to set up the local receiver");
+        return -1;
+    }
+    timens_t *times = malloc(count * sizeof(timens_t));
+    if (times == NULL) {
+        receiver_close(&rx);
+        return -1;
+    }
+
+    unsigned sent = 0;
+    for (unsigned i = 0; i < count; i++) {
+        struct timeval tv;
+        gettimeofday(&tv, NULL);
+        timens_t start = timens_now(CLOCK_MONOTONIC);
+        int result = chrony_client_send_pps(rx.client, &tv, 0.25);
+        timens_t end = timens_now(CLOCK_MONOTONIC);
+        if (result == 0 && receiver_wait(&rx)) {
+            times[sent++] = end - start;
+        }
+    }
+    report(out, "chrony_send", "", times, sent, 1.0, 0.0);
+    free(times);
+    receiver_close(&rx);
+    return sent == count ? 0 : -1;
+}
+
+/* What pulse_worker does with a queued pulse */
+static void *audio_worker(void *arg) {
+    audio_worker_t *worker = arg;
+    pulse_event_t event;
+
+    while (atomic_load(&worker->running)) {
+        spsc_ring_wait(worker->ring, 100);
+        while (spsc_ring_pop(worker->ring, &event)) {
+            timens_t time;
+            double uncertainty;
+            if (clock_model_convert(worker->model, event.host_time, &time, &uncertainty) < 0) {
+                continue;
+            }
+            double offset = (double)timens_subsec(time) / 1e9;
+            pulse_filter_result_t filtered;
+            pulse_filter_process(worker->filter, time, offset, &filtered);
+            struct timeval tv;
+            timens_to_timeval(time, &tv);
+            chrony_client_send_pps(worker->client, &tv, filtered.offset);
+        }
+    }
+    return NULL;
+}
+
+static int bench_audio_end_to_end(bench_output_t *out, const float *second, size_t block_size,
+                                  unsigned pulses) {
+    receiver_t rx;
+    if (receiver_open(&rx) < 0) {
+        perror("Failed to set up the local receiver");
+        return -1;
+    }
+    timens_t *times = malloc(pulses * sizeof(timens_t));
+    float *block = malloc(block_size * sizeof(float));
+    pulse_detector_t *detector = make_detector(true);
+    sample_clock_t *clock = make_sample_clock();
+    clock_model_config_t model_config;
+    clock_model_default_config(&model_config);
+    pulse_filter_config_t filter_config;
+    pulse_filter_default_config(&filter_config);
+
+    audio_worker_t worker;
+    worker.ring = spsc_ring_create(64, sizeof(pulse_event_t));
+    worker.model = clock_model_create(&model_config, monotonic_host, 1, 1);
+    worker.filter = pulse_filter_create(&filter_config);
+    worker.client = rx.client;
+    atomic_init(&worker.running, true);
+
+    int result = -1;
+    pthread_t thread;
+    if (times && block && detector && clock && worker.ring && worker.model && worker.filter
+        && pthread_create(&thread, NULL, audio_worker, &worker) == 0) {
+        /* Host times follow the stream, starting now, so they convert
+         * like live ones; blocks are fed as fast as they are handled */
+        uint64_t base = (uint64_t)timens_now(CLOCK_MONOTONIC);
+        uint64_t pos = 0;
+        unsigned timed = 0;
+        unsigned lost = 0;
+        unsigned seen = 0;
+
+        while (timed + lost < pulses) {
+            copy_block(second, pos, block, block_size);
+            timens_t start = timens_now(CLOCK_MONOTONIC);
+            size_t queued = callback(detector, clock, worker.ring, block, block_size, pos, base);
+            pos += block_size;
+            if (queued == 0) {
+                continue;
+            }
+            /* The first few pulses are before the filter has a history */
+            bool delivered = receiver_wait(&rx);
+            timens_t end = timens_now(CLOCK_MONOTONIC);
+            if (++seen <= WARMUP_SECONDS) {
+                continue;
+            }
+            if (delivered) {
+                times[timed++] = end - start;
+            } else {
+                lost++;
+            }
+        }
+        atomic_store(&worker.running, false);
+        spsc_ring_wake(worker.ring);
+        pthread_join(thread, NULL);
+
+        char params[64];
+        snprintf(params, sizeof(params), "\"block\": %zu", block_size);
+        report(out, "audio_end_to_end", params, times, timed, 1.0, 0.0);
+        if (lost > 0) {
+            fprintf(stderr, "audio_end_to_end: %u pulses were not delivered\n", lost);
+        }
+        result = 0;
+    }
+    pulse_filter_destroy(worker.filter);
+    clock_model_destroy(worker.model);
+    spsc_ring_destroy(worker.ring);
+    sample_clock_destroy(clock);
+    pulse_detector_destroy(detector);
+    free(block);
+    free(times);
+    receiver_close(&rx);
+    return result;
+}
+
+static int bench_cts_end_to_end(bench_output_t *out, unsigned pulses) {
+    receiver_t rx;
+    if (receiver_open(&rx) < 0) {
+        perror("Failed to set up the local receiver");
+        return -1;
+    }
+    timens_t *times = malloc(pulses * sizeof(timens_t));
+    pps_sim_config_t sim_config;
+    pps_sim_default_config(&sim_config);
+    pps_sim_t *sim = pps_sim_create(&sim_config);
+    pulse_filter_config_t filter_config;
+    pulse_filter_default_config(&filter_config);
+    pulse_filter_t *filter = pulse_filter_create(&filter_config);
+
+    int result = -1;
+    if (times && sim && filter) {
+        unsigned timed = 0;
+        bool last_cts = false;
+        cts_sample_t sample;
+
+        /* From the poll that saw the change to the sample reaching chronyd,
+         * as in pollpps's main loop */
+        while (timed < pulses) {
+            pps_sim_cts_change(sim, &sample);
+            timens_t start = timens_now(CLOCK_MONOTONIC);
+            bool cts = (sample.status & TIOCM_CTS) != 0;
+            if (cts || !last_cts) {
+                last_cts = cts;
+                continue;
+            }
+            last_cts = cts;
+
+            timens_t edge, edge_real, resolution;
+            cts_source_edge(&sample, &edge, &edge_real, &resolution);
+            double offset = (double)timens_subsec(edge_real) / 1e9;
+            pulse_filter_result_t filtered;
+            pulse_filter_process(filter, edge_real, offset, &filtered);
+            struct timeval tv;
+            timens_to_timeval(edge_real, &tv);
+            if (chrony_client_send_pps(rx.client, &tv, filtered.offset) == 0 && receiver_wait(&rx)) {
+                times[timed++] = timens_now(CLOCK_MONOTONIC) - start;
+            }
+        }
+        report(out, "cts_end_to_end", "", times, timed, 1.0, 0.0);
+        result = 0;
+    }
+    pulse_filter_destroy(filter);
+    pps_sim_destroy(sim);
+    free(times);
+    receiver_close(&rx);
+    return result;
+}
+
+int main(int argc, char *argv[]) {
+    const char *output_path = NULL;
+    bool json = false;
+    bool quick = false;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "--quick") == 0) {
+            quick = true;
+        } else if (strcmp(argv[i], "-o") == 0 || strcmp(argv[i], "--output") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            output_path = argv[++i];
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    bench_sizes_t sizes = { 600, 10000, 100000, 2000 };
+    if (quick) {
+        sizes = (bench_sizes_t){ 30, 500, 5000, 200 };
+    }
+
+    bench_output_t out = { NULL, true };
+    if (json) {
+        out.json = stdout;
+    } else if (output_path) {
+        out.json = fopen(output_path, "w");
+        if (out.json == NULL) {
+            perror("Failed to open output file");
+            return 1;
+        }
+    }
+
+    float *second = make_second();
+    if (second == NULL) {
+        fprintf(stderr, "Error: Failed to generate the test signal\n");
+        return 1;
+    }
+
+    if (out.json) {
+        struct utsname uts;
+        uname(&uts);
+        char date[32];
+        time_t now = time(NULL);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+        fprintf(out.json, "{\n  \"version\": 1,\n  \"date\": \"%s\",\n  \"system\": \"%s %s %s\",\n"
+                "  \"host\": \"%s\",\n  \"compiler\": \"%s\",\n  \"quick\": %s,\n  \"results\": [\n",
+                date, uts.sysname, uts.release, uts.machine, uts.nodename, __VERSION__,
+                quick ? "true" : "false");
+    }
+    if (out.json != stdout) {
+        printf("%-44s %8s %10s %10s %10s %10s %10s\n", "benchmark (ns)", "count", "mean", "p50", "p99", "p99.9", "max");
+    }
+
+    int failed = 0;
+    failed |= bench_timer(&out, sizes.sends * 10);
+    for (size_t i = 0; i < sizeof(block_sizes) / sizeof(block_sizes[0]); i++) {
+        failed |= bench_callback(&out, second, block_sizes[i], true, sizes.seconds);
+        failed |= bench_callback(&out, second, block_sizes[i], false, sizes.seconds);
+    }
+    failed |= bench_conversion(&out, sizes.conversions);
+    failed |= bench_send(&out, sizes.sends);
+    failed |= bench_audio_end_to_end(&out, second, 512, sizes.pulses);
+    failed |= bench_cts_end_to_end(&out, sizes.pulses * 10);
+
+    if (out.json) {
+        fprintf(out.json, "\n  ]\n}\n");
+        if (out.json != stdout) {
+            fclose(out.json);
+        }
+    }
+    free(second);
+    if (failed) {
+        fprintf(stderr, "Some benchmarks failed\n");
+        return 1;
+    }
+    return 0;
+}
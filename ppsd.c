@@ -0,0 +1,903 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <stdbool.h>
+#include "event_loop.h"
+#include "cts_source.h"
+#include "poll_schedule.h"
+#include "pulse_filter.h"
+#include "pulse_journal.h"
+#include "pulse_detector.h"
+#include "chrony_client.h"
+#include "ntp_shm.h"
+#include "timens.h"
+#ifdef __APPLE__
+#include <mach/mach_time.h>
+#include "audio_source.h"
+#include "clock_model.h"
+#endif
+
+/* PPS daemon: any number of pulse sources, each with its own processing
+ * stages, feeding any number of sinks, all on one event loop. */
+
+#define MAX_SOURCES 8
+#define MAX_SINKS 16
+#define MAX_TOKENS 32
+#define MAX_NAME 32
+#define DEFAULT_STATS_EVERY 60
+
+typedef enum {
+    SOURCE_CTS,
+    SOURCE_REPLAY,
+    SOURCE_AUDIO
+} source_kind_t;
+
+typedef struct {
+    char name[MAX_NAME];
+    source_kind_t kind;
+    const char *path;          /* device or trace */
+    poll_schedule_config_t sched_config;
+    pulse_filter_config_t filter_config;
+    bool realtime;
+    const char *journal_path;
+    uint64_t journal_size;
+
+    int fd;
+    struct termios orig_tios;
+    poll_schedule_t *sched;
+    cts_source_t *cts;
+    int timer;
+    bool last_cts;
+#ifdef __APPLE__
+    audio_source_config_t audio_config;
+    audio_source_t *audio;
+#endif
+    bool started;
+    bool ended;
+    pulse_filter_t *filter;
+    pulse_journal_t *journal;
+
+    uint64_t pulses;
+    uint64_t accepted;
+    uint64_t rejected;
+    uint64_t discarded;
+    uint64_t missed;
+    double offset;             /* last accepted offset */
+} source_t;
+
+typedef enum {
+    SINK_CHRONY,
+    SINK_SHM,
+    SINK_STATS
+} sink_kind_t;
+
+typedef struct {
+    sink_kind_t kind;
+    source_t *source;          /* the only source it takes pulses from, or NULL for all (stats,
+                                  or any sink when there is one source) */
+    const char *path;
+    unsigned queue;
+    chrony_client_t *chrony;
+    int unit;
+    ntp_shm_t *shm;
+    int64_t every;
+    int timer;
+} sink_t;
+
+static volatile sig_atomic_t interrupted = 0;
+static event_loop_t *loop = NULL;
+static source_t sources[MAX_SOURCES];
+static unsigned num_sources = 0;
+static unsigned active_sources = 0;
+static sink_t sinks[MAX_SINKS];
+static unsigned num_sinks = 0;
+static bool verbose = false;
+#ifdef __APPLE__
+static clock_model_t *clock_model = NULL;
+static mach_timebase_info_data_t timebase;
+#endif
+
+void handle_signal(int sig) {
+    interrupted = 1;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options] [--source ...] [--stage ...] [--sink ...]\n", prog);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -c, --config FILE        Read directives from FILE, one per line\n");
+    fprintf(stderr, "  -v, --verbose            Print every pulse\n");
+    fprintf(stderr, "  -h, --help               Show this help\n");
+    fprintf(stderr, "directives (on the command line, start each with --):\n");
+    fprintf(stderr, "  source NAME cts DEVICE [interval US] [guard US] [busy US] [continuous]\n");
+    fprintf(stderr, "                         [auto-interval] [cpu-budget PCT]\n");
+    fprintf(stderr, "  source NAME replay FILE [realtime]\n");
+    fprintf(stderr, "  source NAME audio [device UID] [threshold N] [mode threshold|cfd|matched]\n");
+    fprintf(stderr, "                         [cfd-fraction F] [interp linear|cubic] [no-track]   (macOS)\n");
+    fprintf(stderr, "  stage filter NAME [off] [mad K] [smooth N]\n");
+    fprintf(stderr, "  stage journal NAME FILE [size N]\n");
+    fprintf(stderr, "  sink chrony PATH [queue N] [from NAME]   (from needed with more than one source)\n");
+    fprintf(stderr, "  sink shm UNIT [from NAME]                (from needed with more than one source)\n");
+    fprintf(stderr, "  sink stats [every SECONDS] [from NAME]\n");
+    fprintf(stderr, "example:\n");
+    fprintf(stderr, "  %s --source gps cts /dev/ttyUSB0 --sink chrony /var/run/chrony.gps.sock --sink stats\n", prog);
+}
+
+static source_t *find_source(const char *name) {
+    for (unsigned i = 0; i < num_sources; i++) {
+        if (strcmp(sources[i].name, name) == 0) {
+            return &sources[i];
+        }
+    }
+    return NULL;
+}
+
+/* Take the value after tokens[*i], or report that it is missing */
+static const char *take_value(char **tokens, int count, int *i, const char *where) {
+    if (*i + 1 >= count) {
+        fprintf(stderr, "Error: %s: %s needs a value\n", where, tokens[*i]);
+        return NULL;
+    }
+    return tokens[++*i];
+}
+
+static int parse_source(char **tokens, int count, const char *where) {
+    if (count < 3) {
+        fprintf(stderr, "Error: %s: source needs a name and a kind\n", where);
+        return -1;
+    }
+    if (num_sources >= MAX_SOURCES) {
+        fprintf(stderr, "Error: %s: at most %d sources\n", where, MAX_SOURCES);
+        return -1;
+    }
+    if (strlen(tokens[1]) >= MAX_NAME || find_source(tokens[1])) {
+        fprintf(stderr, "Error: %s: source name %s is too long or already used\n", where, tokens[1]);
+        return -1;
+    }
+
+    source_t *src = &sources[num_sources];
+    memset(src, 0, sizeof(*src));
+    strcpy(src->name, tokens[1]);
+    src->fd = -1;
+    src->timer = -1;
+    poll_schedule_default_config(&src->sched_config);
+    pulse_filter_default_config(&src->filter_config);
+    src->journal_size = PULSE_JOURNAL_DEFAULT_CAPACITY;
+
+    int i = 3;
+    if (strcmp(tokens[2], "cts") == 0 || strcmp(tokens[2], "replay") == 0) {
+        src->kind = strcmp(tokens[2], "cts") == 0 ? SOURCE_CTS : SOURCE_REPLAY;
+        if (count < 4) {
+            fprintf(stderr, "Error: %s: %s source needs a path\n", where, tokens[2]);
+            return -1;
+        }
+        src->path = tokens[i++];
+    } else if (strcmp(tokens[2], "audio") == 0) {
+#ifdef __APPLE__
+        src->kind = SOURCE_AUDIO;
+        audio_source_default_config(&src->audio_config);
+#else
+        fprintf(stderr, "Error: %s: audio sources are only available on macOS\n", where);
+        return -1;
+#endif
+    } else {
+        fprintf(stderr, "Error: %s: unknown source kind %s (cts, replay or audio)\n", where, tokens[2]);
+        return -1;
+    }
+
+    for (; i < count; i++) {
+        const char *key = tokens[i];
+        const char *value;
+        if (src->kind == SOURCE_CTS && (strcmp(key, "interval") == 0 || strcmp(key, "guard") == 0 ||
+                                        strcmp(key, "busy") == 0)) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            int64_t us = strtoll(value, NULL, 10) * TIMENS_PER_USEC;
+            if (key[0] == 'i') {
+                src->sched_config.interval = us;
+            } else if (key[0] == 'g') {
+                src->sched_config.guard = us;
+            } else {
+                src->sched_config.busy = us;
+            }
+        } else if (src->kind == SOURCE_CTS && strcmp(key, "continuous") == 0) {
+            src->sched_config.enabled = false;
+        } else if (src->kind == SOURCE_CTS && strcmp(key, "auto-interval") == 0) {
+            src->sched_config.auto_interval = true;
+        } else if (src->kind == SOURCE_CTS && strcmp(key, "cpu-budget") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            src->sched_config.cpu_budget = atof(value) / 100.0;
+        } else if (src->kind == SOURCE_REPLAY && strcmp(key, "realtime") == 0) {
+            src->realtime = true;
+#ifdef __APPLE__
+        } else if (src->kind == SOURCE_AUDIO && strcmp(key, "device") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            src->audio_config.device_uid = value;
+        } else if (src->kind == SOURCE_AUDIO && strcmp(key, "threshold") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            src->audio_config.detector.threshold = (float)atof(value);
+        } else if (src->kind == SOURCE_AUDIO && strcmp(key, "cfd-fraction") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            src->audio_config.detector.cfd_fraction = (float)atof(value);
+        } else if (src->kind == SOURCE_AUDIO && strcmp(key, "mode") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            if (pulse_detector_parse_mode(value, &src->audio_config.detector.mode) < 0) {
+                fprintf(stderr, "Error: %s: mode must be threshold, cfd or matched\n", where);
+                return -1;
+            }
+        } else if (src->kind == SOURCE_AUDIO && strcmp(key, "interp") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            if (pulse_detector_parse_interp(value, &src->audio_config.detector.interp) < 0) {
+                fprintf(stderr, "Error: %s: interp must be linear or cubic\n", where);
+                return -1;
+            }
+        } else if (src->kind == SOURCE_AUDIO && strcmp(key, "no-track") == 0) {
+            src->audio_config.detector.track = false;
+#endif
+        } else {
+            fprintf(stderr, "Error: %s: unknown %s source option %s\n", where, tokens[2], key);
+            return -1;
+        }
+    }
+    num_sources++;
+    return 0;
+}
+
+static int parse_stage(char **tokens, int count, const char *where) {
+    if (count < 3) {
+        fprintf(stderr, "Error: %s: stage needs a kind and a source\n", where);
+        return -1;
+    }
+    source_t *src = find_source(tokens[2]);
+    if (src == NULL) {
+        fprintf(stderr, "Error: %s: unknown source %s (sources must come first)\n", where, tokens[2]);
+        return -1;
+    }
+
+    int i = 3;
+    if (strcmp(tokens[1], "journal") == 0) {
+        if (count < 4) {
+            fprintf(stderr, "Error: %s: journal needs a file\n", where);
+            return -1;
+        }
+        src->journal_path = tokens[i++];
+    } else if (strcmp(tokens[1], "filter") != 0) {
+        fprintf(stderr, "Error: %s: unknown stage %s (filter or journal)\n", where, tokens[1]);
+        return -1;
+    }
+
+    for (; i < count; i++) {
+        const char *key = tokens[i];
+        const char *value;
+        if (tokens[1][0] == 'f' && strcmp(key, "off") == 0) {
+            src->filter_config.enabled = false;
+        } else if (tokens[1][0] == 'f' && strcmp(key, "mad") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            src->filter_config.mad_threshold = atof(value);
+        } else if (tokens[1][0] == 'f' && strcmp(key, "smooth") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            src->filter_config.smooth_window = (unsigned)strtoul(value, NULL, 10);
+        } else if (tokens[1][0] == 'j' && strcmp(key, "size") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            src->journal_size = strtoull(value, NULL, 10);
+        } else {
+            fprintf(stderr, "Error: %s: unknown %s option %s\n", where, tokens[1], key);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int parse_sink(char **tokens, int count, const char *where) {
+    if (count < 2) {
+        fprintf(stderr, "Error: %s: sink needs a kind\n", where);
+        return -1;
+    }
+    if (num_sinks >= MAX_SINKS) {
+        fprintf(stderr, "Error: %s: at most %d sinks\n", where, MAX_SINKS);
+        return -1;
+    }
+
+    sink_t *sink = &sinks[num_sinks];
+    memset(sink, 0, sizeof(*sink));
+    sink->queue = CHRONY_CLIENT_DEFAULT_QUEUE;
+    sink->every = DEFAULT_STATS_EVERY * TIMENS_PER_SEC;
+    sink->timer = -1;
+
+    int i = 2;
+    if (strcmp(tokens[1], "chrony") == 0 || strcmp(tokens[1], "shm") == 0) {
+        if (count < 3) {
+            fprintf(stderr, "Error: %s: %s sink needs a %s\n", where, tokens[1],
+                    tokens[1][0] == 'c' ? "socket path" : "unit");
+            return -1;
+        }
+        sink->kind = tokens[1][0] == 'c' ? SINK_CHRONY : SINK_SHM;
+        sink->path = tokens[i];
+        if (sink->kind == SINK_SHM && ntp_shm_parse_unit(tokens[i], &sink->unit) < 0) {
+            fprintf(stderr, "Error: %s: shm unit must be a number, not %s\n", where, tokens[i]);
+            return -1;
+        }
+        i++;
+    } else if (strcmp(tokens[1], "stats") == 0) {
+        sink->kind = SINK_STATS;
+    } else {
+        fprintf(stderr, "Error: %s: unknown sink %s (chrony, shm or stats)\n", where, tokens[1]);
+        return -1;
+    }
+
+    for (; i < count; i++) {
+        const char *key = tokens[i];
+        const char *value;
+        if (strcmp(key, "from") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            sink->source = find_source(value);
+            if (sink->source == NULL) {
+                fprintf(stderr, "Error: %s: unknown source %s (sources must come first)\n", where, value);
+                return -1;
+            }
+        } else if (sink->kind == SINK_CHRONY && strcmp(key, "queue") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            sink->queue = (unsigned)strtoul(value, NULL, 10);
+        } else if (sink->kind == SINK_STATS && strcmp(key, "every") == 0) {
+            if ((value = take_value(tokens, count, &i, where)) == NULL) {
+                return -1;
+            }
+            sink->every = (int64_t)(atof(value) * TIMENS_PER_SEC);
+            if (sink->every <= 0) {
+                fprintf(stderr, "Error: %s: every must be positive\n", where);
+                return -1;
+            }
+        } else {
+            fprintf(stderr, "Error: %s: unknown %s sink option %s\n", where, tokens[1], key);
+            return -1;
+        }
+    }
+    num_sinks++;
+    return 0;
+}
+
+static int parse_directive(char **tokens, int count, const char *where) {
+    if (strcmp(tokens[0], "source") == 0) {
+        return parse_source(tokens, count, where);
+    } else if (strcmp(tokens[0], "stage") == 0) {
+        return parse_stage(tokens, count, where);
+    } else if (strcmp(tokens[0], "sink") == 0) {
+        return parse_sink(tokens, count, where);
+    }
+    fprintf(stderr, "Error: %s: unknown directive %s (source, stage or sink)\n", where, tokens[0]);
+    return -1;
+}
+
+/* Read a config file of directives, one per line, with # comments. The
+ * tokens are kept for the life of the process. */
+static int read_config(const char *path) {
+    FILE *f = fopen(path, "r");
+    if (f == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    char line[1024];
+    unsigned line_no = 0;
+    int result = 0;
+    while (result == 0 && fgets(line, sizeof(line), f)) {
+        line_no++;
+        char *comment = strchr(line, '#');
+        if (comment) {
+            *comment = '\0';
+        }
+        char *tokens[MAX_TOKENS];
+        int count = 0;
+        for (char *token = strtok(line, " \t\r\n"); token; token = strtok(NULL, " \t\r\n")) {
+            if (count == MAX_TOKENS) {
+                fprintf(stderr, "Error: %s line %u: too many words\n", path, line_no);
+                fclose(f);
+                return -1;
+            }
+            tokens[count] = strdup(token);
+            if (tokens[count] == NULL) {
+                fclose(f);
+                return -1;
+            }
+            count++;
+        }
+        if (count > 0) {
+            char where[300];
+            snprintf(where, sizeof(where), "%s line %u", path, line_no);
+            result = parse_directive(tokens, count, where);
+        }
+    }
+    fclose(f);
+    return result;
+}
+
+static void end_source(source_t *src) {
+    if (src->ended) {
+        return;
+    }
+    src->ended = true;
+    if (src->timer >= 0) {
+        event_loop_cancel_timer(loop, src->timer);
+    }
+#ifdef __APPLE__
+    if (src->audio) {
+        event_loop_remove_fd(loop, audio_source_fd(src->audio));
+    }
+#endif
+    if (--active_sources == 0) {
+        event_loop_stop(loop);
+    }
+}
+
+static void send_pulse(sink_t *sink, const pulse_journal_record_t *record, double offset) {
+    if (sink->kind == SINK_CHRONY) {
+        /* Convert to the nearest microsecond for chrony */
+        struct timeval tv;
+        timens_to_timeval(record->time, &tv);
+        if (chrony_client_send_pps(sink->chrony, &tv, offset) < 0) {
+            fprintf(stderr, "Chrony sample lost (%s)\n", sink->path);
+        }
+    } else if (sink->kind == SINK_SHM) {
+        ntp_shm_send_pps(sink->shm, record->time, offset, ntp_shm_precision(record->uncertainty_ns / 1e9));
+    }
+}
+
+/* Run a pulse through the source's stages and on to the sinks */
+static void handle_pulse(source_t *src, pulse_journal_record_t *record, bool timed) {
+    pulse_filter_result_t filtered;
+
+    src->pulses++;
+    if (timed) {
+        pulse_filter_process(src->filter, record->time, record->offset, &filtered);
+        record->residual_ns = (float)(filtered.residual * 1e9);
+        record->verdict = filtered.verdict;
+    } else {
+        record->flags = PULSE_JOURNAL_DISCARDED;
+    }
+    if (src->journal) {
+        pulse_journal_append(src->journal, record);
+    }
+
+    if (!timed) {
+        src->discarded++;
+        if (verbose) {
+            printf("%s: PPS discarded: could not be timed\n", src->name);
+        }
+        return;
+    }
+    if (filtered.verdict != PULSE_VERDICT_ACCEPT) {
+        src->rejected++;
+        if (verbose) {
+            printf("%s: PPS at %lld.%09lld offset=%.9f rejected: %s, %.1f MADs from median %.9f\n",
+                   src->name, (long long)timens_floor_div(record->time, TIMENS_PER_SEC),
+                   (long long)timens_subsec(record->time), record->offset,
+                   pulse_filter_verdict_name(filtered.verdict), filtered.deviation, filtered.median);
+        }
+        return;
+    }
+
+    src->accepted++;
+    src->offset = filtered.offset;
+    for (unsigned i = 0; i < num_sinks; i++) {
+        if (sinks[i].source == NULL || sinks[i].source == src) {
+            send_pulse(&sinks[i], record, filtered.offset);
+        }
+    }
+    if (verbose) {
+        printf("%s: PPS at %lld.%09lld offset=%.9f +/-%.1fus residual=%.1fus\n",
+               src->name, (long long)timens_floor_div(record->time, TIMENS_PER_SEC),
+               (long long)timens_subsec(record->time), filtered.offset, record->uncertainty_ns / 1000.0,
+               filtered.residual * 1e6);
+    }
+}
+
+static void handle_cts_sample(source_t *src, const cts_sample_t *sample) {
+    /* A PPS leading edge is CTS going from on to off (see pollpps) */
+    bool cts = (sample->status & TIOCM_CTS) != 0;
+    if (!cts && src->last_cts) {
+        timens_t edge, edge_real, resolution;
+        cts_source_edge(sample, &edge, &edge_real, &resolution);
+        if (src->sched) {
+            poll_schedule_edge(src->sched, edge);
+        }
+
+        pulse_journal_record_t record;
+        memset(&record, 0, sizeof(record));
+        record.host_ticks = (uint64_t)edge;
+        record.time = edge_real;
+        record.offset = (double)timens_subsec(edge_real) / 1e9;
+        record.uncertainty_ns = (float)resolution;
+        record.source = PULSE_JOURNAL_CTS;
+        record.state = PULSE_STATE_ACQUIRE;
+        if (src->sched) {
+            poll_schedule_stats_t stats;
+            poll_schedule_stats(src->sched, &stats);
+            record.state = stats.locked ? PULSE_STATE_TRACK : PULSE_STATE_ACQUIRE;
+            src->missed = stats.missed;
+        }
+        handle_pulse(src, &record, true);
+    }
+    src->last_cts = cts;
+}
+
+/* Arm the source's timer for its next poll or change */
+static void schedule_cts(source_t *src) {
+    timens_t due;
+    int result = cts_source_due(src->cts, &due);
+    if (result > 0) {
+        event_loop_set_timer(loop, src->timer, due);
+        return;
+    }
+    if (result < 0) {
+        fprintf(stderr, "%s: Failed to read %s: %s\n", src->name, src->path, strerror(errno));
+    } else {
+        printf("%s: End of trace: %llu pulses\n", src->name, (unsigned long long)src->pulses);
+    }
+    end_source(src);
+}
+
+static void step_cts(void *arg) {
+    source_t *src = arg;
+    cts_sample_t sample;
+
+    int result = cts_source_step(src->cts, &sample);
+    if (result < 0) {
+        fprintf(stderr, "%s: Failed to read modem status: %s\n", src->name, strerror(errno));
+        end_source(src);
+        return;
+    }
+    if (result > 0) {
+        handle_cts_sample(src, &sample);
+    }
+    schedule_cts(src);
+}
+
+#ifdef __APPLE__
+static void read_audio(void *arg) {
+    source_t *src = arg;
+    audio_source_pulse_t pulse;
+
+    while (audio_source_read(src->audio, &pulse) > 0) {
+        pulse_journal_record_t record;
+        memset(&record, 0, sizeof(record));
+        record.host_ticks = pulse.event.host_time;
+        record.sample_pos = pulse.event.sample_pos;
+        record.level = pulse.event.level;
+        record.source = PULSE_JOURNAL_AUDIO;
+        record.state = pulse.event.state;
+        src->missed = pulse.status.missed;
+
+        double uncertainty = 0.0;
+        bool timed = pulse.valid &&
+                     clock_model_convert(clock_model, pulse.event.host_time, &record.time, &uncertainty) == 0;
+        if (timed) {
+            record.offset = (double)timens_subsec(record.time) / 1e9;
+            record.uncertainty_ns = (float)uncertainty;
+        }
+        handle_pulse(src, &record, timed);
+    }
+}
+
+static uint64_t read_host_time(void) {
+    return mach_absolute_time();
+}
+#endif
+
+static void print_source_stats(const source_t *src) {
+    pulse_filter_stats_t filter_stats;
+    pulse_filter_stats(src->filter, &filter_stats);
+    printf("%s: %llu pulses, %llu accepted, %llu rejected, %llu discarded, %llu missed, "
+           "offset %.9f, residual %.1f us RMS\n",
+           src->name, (unsigned long long)src->pulses, (unsigned long long)src->accepted,
+           (unsigned long long)src->rejected, (unsigned long long)src->discarded,
+           (unsigned long long)src->missed, src->offset, filter_stats.residual_rms * 1e6);
+}
+
+static void report_stats(void *arg) {
+    sink_t *sink = arg;
+    for (unsigned i = 0; i < num_sources; i++) {
+        if (sink->source == NULL || sink->source == &sources[i]) {
+            print_source_stats(&sources[i]);
+        }
+    }
+    fflush(stdout);
+    event_loop_set_timer(loop, sink->timer, timens_now(CLOCK_MONOTONIC) + sink->every);
+}
+
+static int open_source(source_t *src) {
+    src->filter = pulse_filter_create(&src->filter_config);
+    if (src->filter == NULL) {
+        fprintf(stderr, "%s: Invalid pulse filter (need mad > 0 and smooth of 0 or at least 2)\n", src->name);
+        return -1;
+    }
+
+    uint32_t numer = 1, denom = 1;
+#ifdef __APPLE__
+    if (src->kind == SOURCE_AUDIO) {
+        numer = timebase.numer;
+        denom = timebase.denom;
+    }
+#endif
+    if (src->journal_path) {
+        src->journal = pulse_journal_create(src->journal_path, src->journal_size, numer, denom);
+        if (src->journal == NULL) {
+            fprintf(stderr, "%s: Failed to create journal %s: %s\n", src->name, src->journal_path, strerror(errno));
+            return -1;
+        }
+    }
+
+    if (src->kind == SOURCE_REPLAY) {
+        src->cts = cts_source_open_trace(src->path, src->realtime);
+        if (src->cts == NULL) {
+            fprintf(stderr, "%s: Failed to open trace %s: %s\n", src->name, src->path, strerror(errno));
+            return -1;
+        }
+    } else if (src->kind == SOURCE_CTS) {
+        src->sched = poll_schedule_create(&src->sched_config);
+        if (src->sched == NULL) {
+            fprintf(stderr, "%s: Invalid polling schedule (need interval > 0, busy <= guard < 0.5s "
+                    "and a CPU budget > 0)\n", src->name);
+            return -1;
+        }
+        src->fd = open(src->path, O_RDWR | O_NOCTTY);
+        if (src->fd < 0 || tcgetattr(src->fd, &src->orig_tios) < 0) {
+            fprintf(stderr, "%s: Failed to open %s: %s\n", src->name, src->path, strerror(errno));
+            if (src->fd >= 0) {
+                close(src->fd);
+                src->fd = -1;
+            }
+            return -1;
+        }
+        struct termios raw_tios = src->orig_tios;
+        cfmakeraw(&raw_tios);
+        if (tcsetattr(src->fd, TCSANOW, &raw_tios) < 0) {
+            fprintf(stderr, "%s: Failed to set up %s: %s\n", src->name, src->path, strerror(errno));
+            return -1;
+        }
+        src->cts = cts_source_open_poll(src->fd, src->sched);
+        if (src->cts == NULL) {
+            fprintf(stderr, "%s: Failed to set up polling\n", src->name);
+            return -1;
+        }
+    } else {
+#ifdef __APPLE__
+        /* One clock model serves every audio source */
+        if (clock_model == NULL) {
+            clock_model_config_t clock_config;
+            clock_model_default_config(&clock_config);
+            clock_model = clock_model_create(&clock_config, read_host_time, timebase.numer, timebase.denom);
+            if (clock_model == NULL) {
+                fprintf(stderr, "Failed to start clock model\n");
+                return -1;
+            }
+        }
+        src->audio = audio_source_open(&src->audio_config);
+        if (src->audio == NULL ||
+            event_loop_add_fd(loop, audio_source_fd(src->audio), read_audio, src) < 0) {
+            fprintf(stderr, "%s: Failed to start audio capture: %s\n", src->name, strerror(errno));
+            return -1;
+        }
+#endif
+    }
+
+    if (src->cts) {
+        src->timer = event_loop_add_timer(loop, step_cts, src);
+        if (src->timer < 0) {
+            fprintf(stderr, "%s: Too many timers\n", src->name);
+            return -1;
+        }
+    }
+    src->started = true;
+    active_sources++;
+    if (src->cts) {
+        schedule_cts(src);
+    }
+    return 0;
+}
+
+static int open_sink(sink_t *sink, unsigned index) {
+    if (sink->kind == SINK_CHRONY) {
+        /* Each client needs its own local socket */
+        char local_format[64];
+        snprintf(local_format, sizeof(local_format), "/tmp/ppsd%%d-%u.sock", index);
+        sink->chrony = chrony_client_create(local_format, sink->path);
+        if (sink->chrony == NULL ||
+            chrony_client_set_queue(sink->chrony, sink->queue, CHRONY_CLIENT_DEFAULT_MAX_AGE) < 0) {
+            fprintf(stderr, "Failed to set up chrony client for %s\n", sink->path);
+            return -1;
+        }
+        printf("Chrony sink: %s\n", chrony_client_remote_path(sink->chrony));
+    } else if (sink->kind == SINK_SHM) {
+        sink->shm = ntp_shm_create(sink->unit);
+        if (sink->shm == NULL) {
+            fprintf(stderr, "Failed to attach NTP SHM segment %d: %s\n", sink->unit, strerror(errno));
+            return -1;
+        }
+        printf("NTP SHM sink: unit %d\n", ntp_shm_unit(sink->shm));
+    } else {
+        sink->timer = event_loop_add_timer(loop, report_stats, sink);
+        if (sink->timer < 0) {
+            fprintf(stderr, "Too many timers\n");
+            return -1;
+        }
+        event_loop_set_timer(loop, sink->timer, timens_now(CLOCK_MONOTONIC) + sink->every);
+    }
+    return 0;
+}
+
+static void close_all(void) {
+    for (unsigned i = 0; i < num_sources; i++) {
+        source_t *src = &sources[i];
+        if (src->started) {
+            print_source_stats(src);
+        }
+        cts_source_close(src->cts);
+        if (src->sched) {
+            poll_schedule_destroy(src->sched);
+        }
+        if (src->fd >= 0) {
+            tcsetattr(src->fd, TCSANOW, &src->orig_tios);
+            close(src->fd);
+        }
+#ifdef __APPLE__
+        audio_source_close(src->audio);
+#endif
+        pulse_filter_destroy(src->filter);
+        pulse_journal_close(src->journal);
+    }
+#ifdef __APPLE__
+    if (clock_model) {
+        clock_model_destroy(clock_model);
+    }
+#endif
+
+    for (unsigned i = 0; i < num_sinks; i++) {
+        sink_t *sink = &sinks[i];
+        if (sink->chrony) {
+            chrony_client_stats_t stats;
+            chrony_client_stats(sink->chrony, &stats);
+            printf("Chrony %s: %llu sent, %llu queued, %llu expired, %llu overflowed, %llu lost, %llu reconnects\n",
+                   sink->path, (unsigned long long)stats.sent, (unsigned long long)stats.queued,
+                   (unsigned long long)stats.expired, (unsigned long long)stats.overflows,
+                   (unsigned long long)stats.lost, (unsigned long long)stats.reconnects);
+            chrony_client_destroy(sink->chrony);
+        }
+        if (sink->shm) {
+            ntp_shm_stats_t stats;
+            ntp_shm_stats(sink->shm, &stats);
+            printf("NTP SHM unit %d: %llu sent, %llu not read by the consumer\n", ntp_shm_unit(sink->shm),
+                   (unsigned long long)stats.sent, (unsigned long long)stats.unread);
+            ntp_shm_destroy(sink->shm);
+        }
+    }
+    event_loop_destroy(loop);
+}
+
+int main(int argc, char *argv[]) {
+    for (int i = 1; i < argc;) {
+        if (strcmp(argv[i], "-c") == 0 || strcmp(argv[i], "--config") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (read_config(argv[i + 1]) < 0) {
+                return 1;
+            }
+            i += 2;
+        } else if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+            i++;
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (strcmp(argv[i], "--source") == 0 || strcmp(argv[i], "--stage") == 0 ||
+                   strcmp(argv[i], "--sink") == 0) {
+            /* A directive runs up to the next argument starting with -- */
+            char *tokens[MAX_TOKENS];
+            int count = 0;
+            tokens[count++] = argv[i] + 2;
+            for (i++; i < argc && strncmp(argv[i], "--", 2) != 0; i++) {
+                if (count == MAX_TOKENS) {
+                    fprintf(stderr, "Error: command line: too many words in --%s\n", tokens[0]);
+                    return 1;
+                }
+                tokens[count++] = argv[i];
+            }
+            if (parse_directive(tokens, count, "command line") < 0) {
+                return 1;
+            }
+        } else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (num_sources == 0) {
+        fprintf(stderr, "Error: No sources\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    /* chronyd and ntpd take a refclock's pulses as one source, so a time
+     * sink must not mix them */
+    for (unsigned i = 0; i < num_sinks; i++) {
+        if (sinks[i].kind != SINK_STATS && sinks[i].source == NULL && num_sources > 1) {
+            fprintf(stderr, "Error: %s sink %s needs from NAME with more than one source\n",
+                    sinks[i].kind == SINK_CHRONY ? "chrony" : "shm", sinks[i].path);
+            return 1;
+        }
+    }
+
+#ifdef __APPLE__
+    mach_timebase_info(&timebase);
+#endif
+    loop = event_loop_create();
+    if (loop == NULL) {
+        perror("Failed to create event loop");
+        return 1;
+    }
+    for (unsigned i = 0; i < num_sinks; i++) {
+        if (open_sink(&sinks[i], i) < 0) {
+            close_all();
+            return 1;
+        }
+    }
+    for (unsigned i = 0; i < num_sources; i++) {
+        if (open_source(&sources[i]) < 0) {
+            close_all();
+            return 1;
+        }
+        printf("Source %s: %s%s%s\n", sources[i].name,
+               sources[i].kind == SOURCE_CTS ? "polling CTS of " :
+               sources[i].kind == SOURCE_REPLAY ? "replaying " : "audio input",
+               sources[i].path ? sources[i].path : "", sources[i].realtime ? " in real time" : "");
+    }
+
+    /* Without SA_RESTART, so that the loop's wait returns */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int result = event_loop_run(loop, &interrupted);
+    if (result < 0) {
+        perror("Event loop failed");
+    }
+    if (interrupted) {
+        printf("\nReceived interrupt, shutting down...\n");
+    }
+    close_all();
+    return result < 0 ? 1 : 0;
+}
@@ -0,0 +1,159 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include "pulse_feed.h"
+#include "pulse_journal.h"
+#include "pulse_detector.h"
+#include "pulse_filter.h"
+
+#define WAIT_TIMEOUT_MS 1000
+
+static volatile sig_atomic_t interrupted = 0;
+
+void handle_signal(int sig) {
+    interrupted = 1;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "Follow the live pulse feed published by pollpps or audiopps --feed, as CSV\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -n, --name NAME          Feed name (default: %s)\n", PULSE_FEED_DEFAULT_NAME);
+    fprintf(stderr, "  --health                 Add the writer's health to each pulse\n");
+    fprintf(stderr, "  --poll MS                Poll every MS milliseconds instead of waiting\n");
+    fprintf(stderr, "  -h, --help               Show this help\n");
+}
+
+static void print_pulse(uint64_t seq, const pulse_journal_record_t *r, timens_t now) {
+    timens_t sec = timens_floor_div(r->time, TIMENS_PER_SEC);
+    printf("%" PRIu64 ",%s,%" PRId64 ".%09" PRId64 ",%.9f,%.0f,%s,%s,%.1f",
+           seq, pulse_journal_source_name(r->source),
+           sec, r->time - sec * TIMENS_PER_SEC, r->offset, r->uncertainty_ns,
+           pulse_detector_state_name(r->state),
+           (r->flags & PULSE_JOURNAL_DISCARDED) ? "discarded" : pulse_filter_verdict_name(r->verdict),
+           (double)(now - r->time) / TIMENS_PER_USEC);
+}
+
+static void print_health(const pulse_feed_health_t *h) {
+    printf(",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%.9f,%.0f",
+           h->pulses, h->accepted, h->rejected, h->discarded, h->missed, h->glitches,
+           h->offset, h->residual_rms);
+}
+
+int main(int argc, char *argv[]) {
+    const char *name = PULSE_FEED_DEFAULT_NAME;
+    bool health = false;
+    unsigned poll_ms = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--health") == 0) {
+            health = true;
+        } else if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--name") == 0
+                   || strcmp(argv[i], "--poll") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            if (strcmp(argv[i], "--poll") == 0) {
+                poll_ms = (unsigned)strtoul(argv[++i], NULL, 10);
+                if (poll_ms == 0) {
+                    fprintf(stderr, "Error: --poll must be at least 1 ms\n");
+                    return 1;
+                }
+            } else {
+                name = argv[++i];
+            }
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    pulse_feed_t *feed = pulse_feed_open(name);
+    if (feed == NULL) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "Error: %s is not a pulse feed\n", name);
+        } else {
+            perror("Failed to open feed");
+        }
+        return 1;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    /* Start with the next pulse */
+    uint64_t seq = pulse_feed_head(feed);
+    uint64_t lost = 0;
+    pulse_journal_record_t record;
+    pulse_feed_health_t snapshot;
+
+    printf("seq,source,time,offset,uncertainty_ns,state,verdict,latency_us");
+    if (health) {
+        printf(",pulses,accepted,rejected,discarded,missed,glitches,last_offset,residual_rms");
+    }
+    printf("\n");
+    fflush(stdout);
+
+    while (!interrupted) {
+        if (poll_ms > 0) {
+            if (pulse_feed_head(feed) <= seq) {
+                struct timespec sleep_time = { poll_ms / 1000, (long)(poll_ms % 1000) * 1000000L };
+                nanosleep(&sleep_time, NULL);
+                continue;
+            }
+        } else if (!pulse_feed_wait(feed, seq, WAIT_TIMEOUT_MS)) {
+            continue;
+        }
+
+        uint64_t head = pulse_feed_head(feed);
+        while (seq < head && !interrupted) {
+            int result = pulse_feed_read(feed, seq + 1, &record);
+            timens_t now = timens_now(CLOCK_REALTIME);
+            if (result < 0) {
+                /* Overwritten: skip to the oldest pulse kept */
+                head = pulse_feed_head(feed);
+                uint64_t oldest = head - pulse_feed_capacity(feed) + 1;
+                if (oldest <= seq + 1) {
+                    oldest = seq + 2;
+                }
+                lost += oldest - (seq + 1);
+                seq = oldest - 1;
+                continue;
+            }
+            if (result == 0) {
+                break;
+            }
+            seq++;
+            print_pulse(seq, &record, now);
+            if (health) {
+                if (pulse_feed_health(feed, &snapshot) == 0) {
+                    print_health(&snapshot);
+                } else {
+                    printf(",,,,,,,,");
+                }
+            }
+            printf("\n");
+        }
+        fflush(stdout);
+    }
+
+    if (lost > 0) {
+        fprintf(stderr, "%" PRIu64 " pulses were overwritten before they could be read\n", lost);
+    }
+    pulse_feed_close(feed);
+    return 0;
+}
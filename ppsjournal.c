@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <time.h>
+#include "pulse_journal.h"
+#include "pulse_detector.h"
+#include "pulse_filter.h"
+
+#define FOLLOW_INTERVAL_MS 100
+
+static volatile sig_atomic_t interrupted = 0;
+
+void handle_signal(int sig) {
+    interrupted = 1;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options] <journal-file>\n", prog);
+    fprintf(stderr, "Dump a pulse journal written by pollpps or audiopps --journal as CSV\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -n, --last N             Start from the last N records (default: all)\n");
+    fprintf(stderr, "  -f, --follow             Keep printing records as they are written\n");
+    fprintf(stderr, "  -h, --help               Show this help\n");
+}
+
+static void print_record(uint64_t seq, const pulse_journal_record_t *r) {
+    timens_t sec = timens_floor_div(r->time, TIMENS_PER_SEC);
+    printf("%" PRIu64 ",%s,%" PRIu64 ",%.3f,%" PRId64 ".%09" PRId64 ",%.9f,%.0f,%.0f,%.4f,%s,%s\n",
+           seq, pulse_journal_source_name(r->source), r->host_ticks, r->sample_pos,
+           sec, r->time - sec * TIMENS_PER_SEC, r->offset, r->residual_ns, r->uncertainty_ns,
+           r->level, pulse_detector_state_name(r->state),
+           (r->flags & PULSE_JOURNAL_DISCARDED) ? "discarded" : pulse_filter_verdict_name(r->verdict));
+}
+
+/* Print records from seq up to the head; returns the next seq to print */
+static uint64_t dump(const pulse_journal_t *journal, uint64_t seq, uint64_t *lost) {
+    uint64_t head = pulse_journal_head(journal);
+    pulse_journal_record_t record;
+
+    for (; seq <= head && !interrupted; seq++) {
+        int result = pulse_journal_read(journal, seq, &record);
+        if (result < 0) {
+            /* Overwritten before we got to it: skip to the oldest record kept */
+            head = pulse_journal_head(journal);
+            uint64_t oldest = head - pulse_journal_capacity(journal) + 1;
+            if (oldest <= seq) {
+                oldest = seq + 1;
+            }
+            *lost += oldest - seq;
+            seq = oldest - 1;
+            continue;
+        }
+        if (result == 0) {
+            break;
+        }
+        print_record(seq, &record);
+    }
+    return seq;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    bool follow = false;
+    uint64_t last = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-f") == 0 || strcmp(argv[i], "--follow") == 0) {
+            follow = true;
+        } else if (strcmp(argv[i], "-n") == 0 || strcmp(argv[i], "--last") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            last = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] == '-') {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "Error: Too many arguments\n");
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (path == NULL) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    pulse_journal_t *journal = pulse_journal_open(path);
+    if (journal == NULL) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "Error: %s is not a pulse journal\n", path);
+        } else {
+            perror("Failed to open journal");
+        }
+        return 1;
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    uint64_t head = pulse_journal_head(journal);
+    uint64_t capacity = pulse_journal_capacity(journal);
+    uint64_t keep = last > 0 && last < capacity ? last : capacity;
+    uint64_t seq = head > keep ? head - keep + 1 : 1;
+    uint64_t lost = 0;
+
+    printf("seq,source,host_ticks,sample_pos,time,offset,residual_ns,uncertainty_ns,level,state,verdict\n");
+    seq = dump(journal, seq, &lost);
+    while (follow && !interrupted) {
+        fflush(stdout);
+        struct timespec sleep_time = { 0, FOLLOW_INTERVAL_MS * 1000000L };
+        nanosleep(&sleep_time, NULL);
+        seq = dump(journal, seq, &lost);
+    }
+
+    if (lost > 0) {
+        fprintf(stderr, "%" PRIu64 " records were overwritten before they could be read\n", lost);
+    }
+    pulse_journal_close(journal);
+    return 0;
+}
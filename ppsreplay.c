@@ -0,0 +1,379 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include "capture_file.h"
+#include "capture_scan.h"
+#include "pulse_detector.h"
+#include "pulse_snippet.h"
+#include "level_kernel.h"
+
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_RAW_RATE 48000.0
+#define DEFAULT_SNIPPET_SAMPLES 64
+
+static volatile sig_atomic_t interrupted = 0;
+
+typedef struct {
+    pulse_detector_t *detector;
+    bool quiet;
+    uint64_t pulses;
+    pulse_state_t lock_state;
+    uint64_t missed;
+    pulse_snippet_recorder_t *snippets;
+    pulse_snippet_file_t *snippet_file;
+    float *snippet_samples;
+    bool snippet_error;
+} replay_state_t;
+
+void handle_signal(int sig) {
+    interrupted = 1;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options] <capture-file>\n", prog);
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -t, --threshold N        Pulse detection threshold (default: 0.5)\n");
+    fprintf(stderr, "  -m, --mode MODE          Edge timing: threshold, cfd or matched (default: threshold)\n");
+    fprintf(stderr, "  -f, --cfd-fraction F     Fraction of the peak that defines the edge (default: 0.5)\n");
+    fprintf(stderr, "  -i, --interp METHOD      CFD interpolation: linear or cubic (default: linear)\n");
+    fprintf(stderr, "      --template FILE      Load the matched filter template from FILE\n");
+    fprintf(stderr, "      --save-template FILE Save the learned template to FILE\n");
+    fprintf(stderr, "  -b, --block N            Samples per block (default: %d)\n", DEFAULT_BLOCK_SIZE);
+    fprintf(stderr, "  -s, --sample-rate R      Sample rate of raw float32 files (default: %.0f)\n", DEFAULT_RAW_RATE);
+    fprintf(stderr, "      --no-track           Scan every sample instead of locking on to the pulse train\n");
+    fprintf(stderr, "  -k, --kernel NAME        Level kernel: avx2, sse2, neon or scalar (default: best available)\n");
+    fprintf(stderr, "      --realtime           Replay at real-time speed instead of maximum speed\n");
+    fprintf(stderr, "      --snippets FILE      Save the waveform around each detected or missed pulse to FILE\n");
+    fprintf(stderr, "      --snippet-samples N  Samples either side of the pulse in a snippet (default: %d)\n",
+            DEFAULT_SNIPPET_SAMPLES);
+    fprintf(stderr, "  -j, --threads N          Scan the memory-mapped capture in chunks on N threads\n");
+    fprintf(stderr, "  -q, --quiet              Only print the summary\n");
+    fprintf(stderr, "  -h, --help               Show this help\n");
+}
+
+static void print_event(const pulse_event_t *event) {
+    printf("PPS #%" PRIu64 " at %" PRIu64 ".%09" PRIu64 " (level: %.3f, sample: %.3f, block: %u/%u)\n",
+           event->seq,
+           event->host_time / 1000000000u, event->host_time % 1000000000u,
+           event->level, event->sample_pos,
+           event->block_index, event->block_size);
+}
+
+/* Mark the pulses and missed pulses of a block and save any snippets
+ * that are complete */
+static void record_snippets(replay_state_t *state, const pulse_event_t *events, size_t n,
+                            const pulse_detector_status_t *status) {
+    for (size_t i = 0; i < n; i++) {
+        pulse_snippet_mark(state->snippets, PULSE_SNIPPET_DETECTED, events[i].sample_pos,
+                           events[i].seq, events[i].host_time, events[i].level);
+    }
+    if (status->missed > state->missed) {
+        pulse_snippet_mark(state->snippets, PULSE_SNIPPET_MISSED, (double)status->last_missed, 0, 0, 0.0f);
+    }
+
+    pulse_snippet_t snippet;
+    while (pulse_snippet_pop(state->snippets, &snippet, state->snippet_samples)) {
+        if (!state->snippet_error && pulse_snippet_file_write(state->snippet_file, &snippet, state->snippet_samples) < 0) {
+            perror("Error writing snippet");
+            state->snippet_error = true;
+        }
+    }
+}
+
+static void on_block(void *ctx, const float *samples, size_t count, uint64_t host_time) {
+    replay_state_t *state = ctx;
+    pulse_event_t events[8];
+
+    if (state->snippets) {
+        pulse_snippet_push(state->snippets, samples, count);
+    }
+    size_t n = pulse_detector_process(state->detector, samples, count, host_time, events, 8);
+
+    pulse_detector_status_t status;
+    pulse_detector_status(state->detector, &status);
+    if (state->snippets) {
+        record_snippets(state, events, n, &status);
+    }
+    state->missed = status.missed;
+    if (status.state != state->lock_state) {
+        if (!state->quiet) {
+            printf("Lock state %s -> %s (missed: %" PRIu64 ")\n",
+                   pulse_detector_state_name(state->lock_state), pulse_detector_state_name(status.state),
+                   status.missed);
+        }
+        state->lock_state = status.state;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        state->pulses++;
+        if (!state->quiet) {
+            print_event(&events[i]);
+        }
+    }
+}
+
+static double elapsed_seconds(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+/* Scan the capture on several threads instead of replaying it */
+static int scan_capture(capture_file_t *capture, const pulse_detector_config_t *config,
+                        pulse_detector_t *template_source, size_t block_size, unsigned threads, bool quiet) {
+    capture_scan_config_t scan_config;
+    capture_scan_default_config(&scan_config);
+    scan_config.detector = *config;
+    scan_config.threads = threads;
+    scan_config.block_size = block_size;
+
+    float *pulse = NULL;
+    if (pulse_detector_template_ready(template_source)) {
+        pulse = malloc(config->template_len * sizeof(float));
+        if (pulse == NULL) {
+            return -1;
+        }
+        scan_config.template_len = pulse_detector_get_template(template_source, pulse, config->template_len);
+        scan_config.template_pulse = pulse;
+        scan_config.template_origin = pulse_detector_template_origin(template_source);
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    capture_scan_result_t result;
+    int rc = capture_scan(capture, &scan_config, &result, &interrupted);
+    double wall = elapsed_seconds(&start);
+    free(pulse);
+    if (rc < 0) {
+        return -1;
+    }
+
+    if (!quiet) {
+        for (size_t i = 0; i < result.count; i++) {
+            print_event(&result.events[i]);
+        }
+    }
+
+    double audio = result.frames / config->sample_rate;
+    printf("Scanned %.1f s of audio in %.3f s on %u threads (%zu chunks, %.2f%% overlap) with the %s kernel: "
+           "%zu pulses, %" PRIu64 " dropped\n",
+           audio, wall, threads, result.chunks, result.frames ? 100.0 * result.overlap_frames / result.frames : 0.0,
+           level_kernel_name(), result.count, result.dropped);
+    if (wall > 0.0) {
+        printf("Throughput: %.1f Msamples/s, %.2f hours of audio per second\n",
+               result.frames / wall / 1e6, audio / 3600.0 / wall);
+    }
+    capture_scan_free(&result);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    const char *template_path = NULL;
+    const char *save_template_path = NULL;
+    size_t block_size = DEFAULT_BLOCK_SIZE;
+    double raw_rate = DEFAULT_RAW_RATE;
+    bool realtime = false;
+    unsigned threads = 0;
+    const char *snippet_path = NULL;
+    unsigned snippet_samples = DEFAULT_SNIPPET_SAMPLES;
+    replay_state_t state = { 0 };
+    pulse_detector_config_t config;
+
+    pulse_detector_default_config(&config);
+    config.level_stats = false;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "-t") == 0 || strcmp(arg, "--threshold") == 0) {
+            if (!has_value) goto missing;
+            config.threshold = atof(argv[++i]);
+        } else if (strcmp(arg, "-m") == 0 || strcmp(arg, "--mode") == 0) {
+            if (!has_value) goto missing;
+            if (pulse_detector_parse_mode(argv[++i], &config.mode) < 0) {
+                fprintf(stderr, "Error: Unknown mode %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(arg, "-f") == 0 || strcmp(arg, "--cfd-fraction") == 0) {
+            if (!has_value) goto missing;
+            config.cfd_fraction = atof(argv[++i]);
+        } else if (strcmp(arg, "-i") == 0 || strcmp(arg, "--interp") == 0) {
+            if (!has_value) goto missing;
+            if (pulse_detector_parse_interp(argv[++i], &config.interp) < 0) {
+                fprintf(stderr, "Error: Unknown interpolation %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(arg, "--template") == 0) {
+            if (!has_value) goto missing;
+            template_path = argv[++i];
+        } else if (strcmp(arg, "--save-template") == 0) {
+            if (!has_value) goto missing;
+            save_template_path = argv[++i];
+        } else if (strcmp(arg, "-b") == 0 || strcmp(arg, "--block") == 0) {
+            if (!has_value) goto missing;
+            block_size = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "-s") == 0 || strcmp(arg, "--sample-rate") == 0) {
+            if (!has_value) goto missing;
+            raw_rate = atof(argv[++i]);
+        } else if (strcmp(arg, "--no-track") == 0) {
+            config.track = false;
+        } else if (strcmp(arg, "-k") == 0 || strcmp(arg, "--kernel") == 0) {
+            if (!has_value) goto missing;
+            if (level_kernel_select(argv[++i]) < 0) {
+                fprintf(stderr, "Error: Level kernel %s is not available\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(arg, "--realtime") == 0) {
+            realtime = true;
+        } else if (strcmp(arg, "--snippets") == 0) {
+            if (!has_value) goto missing;
+            snippet_path = argv[++i];
+        } else if (strcmp(arg, "--snippet-samples") == 0) {
+            if (!has_value) goto missing;
+            snippet_samples = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "-j") == 0 || strcmp(arg, "--threads") == 0) {
+            if (!has_value) goto missing;
+            threads = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "-q") == 0 || strcmp(arg, "--quiet") == 0) {
+            state.quiet = true;
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (arg[0] == '-') {
+            fprintf(stderr, "Error: Unknown option %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        } else if (path == NULL) {
+            path = arg;
+        } else {
+            fprintf(stderr, "Error: Too many arguments\n");
+            print_usage(argv[0]);
+            return 1;
+        }
+        continue;
+    missing:
+        fprintf(stderr, "Error: %s requires an argument\n", arg);
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (path == NULL) {
+        fprintf(stderr, "Error: Capture file argument required\n");
+        print_usage(argv[0]);
+        return 1;
+    }
+    if ((template_path || save_template_path) && config.mode != PULSE_MODE_MATCHED) {
+        fprintf(stderr, "Error: Templates are only used in matched mode\n");
+        return 1;
+    }
+    if (threads > 0 && (realtime || save_template_path || snippet_path)) {
+        fprintf(stderr, "Error: --threads cannot be combined with --realtime, --save-template or --snippets\n");
+        return 1;
+    }
+    if (block_size == 0 || raw_rate <= 0.0) {
+        fprintf(stderr, "Error: Block size and sample rate must be positive\n");
+        return 1;
+    }
+
+    capture_file_t *capture = capture_file_open(path, raw_rate);
+    if (capture == NULL) {
+        fprintf(stderr, "Failed to open capture %s\n", path);
+        return 1;
+    }
+
+    config.sample_rate = capture_file_sample_rate(capture);
+    config.ticks_per_second = 1e9;
+    state.detector = pulse_detector_create(&config);
+    if (state.detector == NULL) {
+        fprintf(stderr, "Failed to create pulse detector\n");
+        capture_file_close(capture);
+        return 1;
+    }
+    if (template_path && pulse_detector_load_template(state.detector, template_path) < 0) {
+        fprintf(stderr, "Failed to load template %s\n", template_path);
+        pulse_detector_destroy(state.detector);
+        capture_file_close(capture);
+        return 1;
+    }
+
+    if (snippet_path) {
+        /* Keep a second of history, so a missed pulse reported late in a
+         * long block still has its samples */
+        size_t history = (size_t)config.sample_rate + block_size + 2 * snippet_samples + 1;
+        state.snippets = pulse_snippet_recorder_create(snippet_samples, history);
+        state.snippet_samples = malloc((2 * (size_t)snippet_samples + 1) * sizeof(float));
+        state.snippet_file = pulse_snippet_file_create(snippet_path, config.sample_rate);
+        if (state.snippets == NULL || state.snippet_samples == NULL || state.snippet_file == NULL) {
+            perror(snippet_path);
+            pulse_snippet_file_close(state.snippet_file);
+            free(state.snippet_samples);
+            pulse_snippet_recorder_destroy(state.snippets);
+            pulse_detector_destroy(state.detector);
+            capture_file_close(capture);
+            return 1;
+        }
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    if (threads > 0) {
+        int rc = scan_capture(capture, &config, state.detector, block_size, threads, state.quiet);
+        pulse_detector_destroy(state.detector);
+        capture_file_close(capture);
+        if (rc < 0) {
+            fprintf(stderr, "Error scanning capture %s\n", path);
+            return 1;
+        }
+        return 0;
+    }
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    int result = capture_file_replay(capture, block_size, realtime, on_block, &state, &interrupted);
+
+    double wall = elapsed_seconds(&start);
+    double audio = pulse_detector_samples(state.detector) / config.sample_rate;
+
+    printf("Replayed %.1f s of audio in %.3f s with the %s kernel: %" PRIu64 " pulses, %" PRIu64 " dropped\n",
+           audio, wall, level_kernel_name(), state.pulses, pulse_detector_dropped(state.detector));
+    if (wall > 0.0) {
+        printf("Throughput: %.1f Msamples/s, %.2f hours of audio per second\n",
+               pulse_detector_samples(state.detector) / wall / 1e6, audio / 3600.0 / wall);
+    }
+
+    pulse_detector_status_t status;
+    pulse_detector_status(state.detector, &status);
+    printf("Lock: %s, %" PRIu64 " acquired, %" PRIu64 " lost, %" PRIu64 " missed, %" PRIu64 " glitches, period %.3f samples\n",
+           pulse_detector_state_name(status.state), status.acquisitions, status.lost,
+           status.missed, status.glitches, status.period);
+
+    if (save_template_path && pulse_detector_save_template(state.detector, save_template_path) < 0) {
+        fprintf(stderr, "No template to save to %s\n", save_template_path);
+    }
+
+    if (state.snippets) {
+        pulse_snippet_stats_t stats;
+        pulse_snippet_stats(state.snippets, &stats);
+        printf("Snippets: %" PRIu64 " saved to %s, %" PRIu64 " dropped\n", stats.snippets, snippet_path, stats.dropped);
+        pulse_snippet_file_close(state.snippet_file);
+        free(state.snippet_samples);
+        pulse_snippet_recorder_destroy(state.snippets);
+    }
+
+    pulse_detector_destroy(state.detector);
+    capture_file_close(capture);
+
+    if (result < 0) {
+        fprintf(stderr, "Error reading capture %s\n", path);
+        return 1;
+    }
+    return 0;
+}
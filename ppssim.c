@@ -0,0 +1,565 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <math.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include "pps_sim.h"
+#include "cts_source.h"
+#include "pulse_detector.h"
+#include "pulse_filter.h"
+#include "sample_clock.h"
+#include "calibration.h"
+#include "timens.h"
+
+#define DEFAULT_DURATION 600.0
+#define DEFAULT_MATCH_WINDOW 10e-3
+
+static volatile sig_atomic_t interrupted = 0;
+
+typedef struct {
+    uint64_t count;
+    double sum;
+    double sum_sq;
+    double max_abs;
+} error_stats_t;
+
+typedef struct {
+    const pps_sim_t *sim;
+    pulse_filter_t *filter;
+    double phase;
+    timens_t match_window;
+    int64_t last_edge;         /* second of the last pulse matched */
+    uint64_t matched;
+    uint64_t duplicates;
+    uint64_t stray;            /* pulses nowhere near a true edge */
+    uint64_t stray_accepted;   /* of which the filter let through */
+    uint64_t discarded;        /* real pulses that could not be timed */
+    error_stats_t raw;
+    error_stats_t filtered;
+    calibration_t *calibration;
+    FILE *csv;
+} evaluation_t;
+
+/* A numeric option: argv value times scale goes in value */
+typedef struct {
+    const char *name;
+    double *value;
+    double scale;
+} number_option_t;
+
+void handle_signal(int sig) {
+    interrupted = 1;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options]\n", prog);
+    fprintf(stderr, "Run the pulse timing code on a synthetic PPS signal and measure its error\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "      --cts                Simulate the pollpps CTS path instead of audio\n");
+    fprintf(stderr, "  -d, --duration S         Seconds to simulate (default: %.0f)\n", DEFAULT_DURATION);
+    fprintf(stderr, "      --seed N             Random seed (default: 1)\n");
+    fprintf(stderr, "      --phase S            Time of the pulses past the second (default: 0.25)\n");
+    fprintf(stderr, "      --miss P             Probability that a pulse is missing (default: 0)\n");
+    fprintf(stderr, "      --glitch-rate R      Stray pulses per second (default: 0)\n");
+    fprintf(stderr, "audio signal:\n");
+    fprintf(stderr, "  -s, --sample-rate R      Nominal sample rate (default: 48000)\n");
+    fprintf(stderr, "  -b, --block N            Samples per buffer (default: 1024)\n");
+    fprintf(stderr, "      --amplitude A        Peak level of a pulse (default: 0.8)\n");
+    fprintf(stderr, "      --amplitude-jitter F RMS variation of the amplitude, relative (default: 0.05)\n");
+    fprintf(stderr, "      --rise US            Rise time constant (default: 20)\n");
+    fprintf(stderr, "      --decay MS           AC coupling decay time constant (default: 2)\n");
+    fprintf(stderr, "      --width MS           Pulse width, 0 for no trailing edge (default: 100)\n");
+    fprintf(stderr, "      --noise RMS          Noise level (default: 0.005)\n");
+    fprintf(stderr, "      --drift PPM          Codec clock error (default: 20)\n");
+    fprintf(stderr, "      --host-jitter US     RMS jitter of buffer host times (default: 50)\n");
+    fprintf(stderr, "      --input-latency US   Converter delay left out of the host times (default: 0)\n");
+    fprintf(stderr, "      --drop P             Probability that a buffer is dropped (default: 0.0001)\n");
+    fprintf(stderr, "audio detector:\n");
+    fprintf(stderr, "  -t, --threshold N        Pulse detection threshold (default: 0.5)\n");
+    fprintf(stderr, "  -m, --mode MODE          Edge timing: threshold, cfd or matched (default: threshold)\n");
+    fprintf(stderr, "  -f, --cfd-fraction F     Fraction of the peak that defines the edge (default: 0.5)\n");
+    fprintf(stderr, "  -i, --interp METHOD      CFD interpolation: linear or cubic (default: linear)\n");
+    fprintf(stderr, "      --no-track           Scan every sample instead of locking on to the pulse train\n");
+    fprintf(stderr, "CTS:\n");
+    fprintf(stderr, "      --poll-interval US   Time between polls (default: 100)\n");
+    fprintf(stderr, "      --poll-jitter US     Mean extra delay of a poll (default: 20)\n");
+    fprintf(stderr, "      --usb-latency US     Delay before the adapter reports a change (default: 1000)\n");
+    fprintf(stderr, "      --usb-jitter US      Further delay, uniformly distributed (default: 1000)\n");
+    fprintf(stderr, "      --trace FILE         Also write the changes as a trace for pollpps --replay\n");
+    fprintf(stderr, "output:\n");
+    fprintf(stderr, "      --smooth N           Smooth offsets over N pulses in the filter (default: 0)\n");
+    fprintf(stderr, "      --match-window US    Pulses further than this from a true edge are stray (default: %.0f)\n",
+            DEFAULT_MATCH_WINDOW * 1e6);
+    fprintf(stderr, "      --csv FILE           Write the error of every pulse to FILE\n");
+    fprintf(stderr, "      --json               Print the results as JSON\n");
+    fprintf(stderr, "      --calibrate          Estimate the offset for chrony as audiopps --calibrate would\n");
+    fprintf(stderr, "      --calibrate-file F   Save the estimate to F\n");
+    fprintf(stderr, "      --max-bias US        Fail if the mean error is larger\n");
+    fprintf(stderr, "      --max-rms US         Fail if the RMS error is larger\n");
+    fprintf(stderr, "      --max-error US       Fail if any error is larger\n");
+    fprintf(stderr, "      --max-missed N       Fail if more pulses are missed\n");
+    fprintf(stderr, "  -h, --help               Show this help\n");
+}
+
+static void add_error(error_stats_t *stats, double error) {
+    stats->count++;
+    stats->sum += error;
+    stats->sum_sq += error * error;
+    if (fabs(error) > stats->max_abs) {
+        stats->max_abs = fabs(error);
+    }
+}
+
+static double error_bias(const error_stats_t *stats) {
+    return stats->count ? stats->sum / (double)stats->count : 0.0;
+}
+
+static double error_rms(const error_stats_t *stats) {
+    return stats->count ? sqrt(stats->sum_sq / (double)stats->count) : 0.0;
+}
+
+/* Compare a pulse with the truth and pass it through the filter as
+ * audiopps and pollpps would */
+static void evaluate(evaluation_t *eval, timens_t time) {
+    timens_t edge = pps_sim_nearest_edge(eval->sim, time);
+    timens_t error = time - edge;
+    bool real = llabs(error) <= eval->match_window;
+    int64_t second = timens_floor_div(edge, TIMENS_PER_SEC);
+
+    if (real && eval->matched > 0 && second == eval->last_edge) {
+        eval->duplicates++;
+        real = false;
+    }
+    if (real) {
+        eval->matched++;
+        eval->last_edge = second;
+        add_error(&eval->raw, (double)error);
+    } else {
+        eval->stray++;
+    }
+
+    double offset = (double)timens_subsec(time) / 1e9;
+    pulse_filter_result_t filtered;
+    pulse_filter_process(eval->filter, time, offset, &filtered);
+    double filtered_error = NAN;
+    if (filtered.verdict == PULSE_VERDICT_ACCEPT) {
+        if (eval->calibration && calibration_add(eval->calibration, time, offset - eval->phase) < 0) {
+            fprintf(stderr, "Warning: Out of memory for calibration\n");
+        }
+        if (real) {
+            double d = filtered.offset - eval->phase;
+            filtered_error = (d - round(d)) * 1e9;
+            add_error(&eval->filtered, filtered_error);
+        } else {
+            eval->stray_accepted++;
+        }
+    }
+
+    if (eval->csv) {
+        fprintf(eval->csv, "%" PRId64 ".%09" PRId64 ",%" PRId64 ",%s,%s,%.0f\n",
+                timens_floor_div(time, TIMENS_PER_SEC), timens_subsec(time), error,
+                real ? "real" : "stray", pulse_filter_verdict_name(filtered.verdict), filtered_error);
+    }
+}
+
+/* Note a pulse that was detected but could not be converted to a time */
+static void discard(evaluation_t *eval, timens_t rough_time) {
+    if (llabs(rough_time - pps_sim_nearest_edge(eval->sim, rough_time)) <= eval->match_window) {
+        eval->discarded++;
+    } else {
+        eval->stray++;
+    }
+}
+
+static int run_audio(pps_sim_t *sim, const pps_sim_config_t *sim_config,
+                     const pulse_detector_config_t *det_config, evaluation_t *eval,
+                     double duration, timens_t *busy) {
+    pulse_detector_config_t config = *det_config;
+    config.sample_rate = sim_config->sample_rate;
+    config.ticks_per_second = 1e9;
+    pulse_detector_t *detector = pulse_detector_create(&config);
+
+    sample_clock_config_t clock_config;
+    sample_clock_default_config(&clock_config);
+    clock_config.sample_rate = sim_config->sample_rate;
+    sample_clock_t *clock = sample_clock_create(&clock_config);
+
+    float *samples = malloc(sim_config->block_size * sizeof(float));
+    if (detector == NULL || clock == NULL || samples == NULL) {
+        fprintf(stderr, "Error: Failed to set up the detector\n");
+        pulse_detector_destroy(detector);
+        sample_clock_destroy(clock);
+        free(samples);
+        return -1;
+    }
+
+    timens_t end = (timens_t)(duration * 1e9);
+    pps_sim_block_t block;
+    pulse_event_t events[4];
+    bool valid[4];
+
+    while (pps_sim_elapsed(sim) < end && !interrupted) {
+        size_t count = pps_sim_audio_block(sim, samples, &block);
+
+        /* Only this part is timed: it is what runs in the audio callback */
+        timens_t start = timens_now(CLOCK_MONOTONIC);
+        unsigned clock_flags = sample_clock_update(clock, pulse_detector_samples(detector), block.sample_time,
+                                                   block.host_time, count);
+        if (clock_flags & SAMPLE_CLOCK_GAP) {
+            pulse_detector_gap(detector, sample_clock_last_gap(clock));
+        }
+        size_t n = pulse_detector_process(detector, samples, count, block.host_time, events, 4);
+        for (size_t i = 0; i < n; i++) {
+            uint64_t host_time;
+            valid[i] = sample_clock_host_time(clock, events[i].sample_pos, &host_time) == 0;
+            if (valid[i]) {
+                events[i].host_time = host_time;
+            }
+        }
+        *busy += timens_now(CLOCK_MONOTONIC) - start;
+
+        for (size_t i = 0; i < n; i++) {
+            if (valid[i]) {
+                evaluate(eval, (timens_t)events[i].host_time);
+            } else {
+                discard(eval, (timens_t)events[i].host_time);
+            }
+        }
+    }
+
+    pulse_detector_destroy(detector);
+    sample_clock_destroy(clock);
+    free(samples);
+    return 0;
+}
+
+static int run_cts(pps_sim_t *sim, evaluation_t *eval, double duration, FILE *trace, timens_t *busy) {
+    timens_t end = (timens_t)(duration * 1e9);
+    bool last_cts = false;
+    cts_sample_t sample;
+
+    if (trace) {
+        cts_source_write_header(trace);
+    }
+    while (pps_sim_elapsed(sim) < end && !interrupted) {
+        pps_sim_cts_change(sim, &sample);
+        if (trace) {
+            cts_source_write_sample(trace, &sample);
+        }
+
+        timens_t start = timens_now(CLOCK_MONOTONIC);
+        bool cts = (sample.status & TIOCM_CTS) != 0;
+        bool edge_seen = !cts && last_cts;
+        timens_t edge, edge_real, resolution;
+        if (edge_seen) {
+            cts_source_edge(&sample, &edge, &edge_real, &resolution);
+        }
+        last_cts = cts;
+        *busy += timens_now(CLOCK_MONOTONIC) - start;
+
+        if (edge_seen) {
+            evaluate(eval, edge_real);
+        }
+    }
+    return 0;
+}
+
+static void print_errors(const char *label, const error_stats_t *stats) {
+    printf("%s: bias %.3f us, RMS %.3f us, max %.3f us (%" PRIu64 " pulses)\n", label,
+           error_bias(stats) / 1e3, error_rms(stats) / 1e3, stats->max_abs / 1e3, stats->count);
+}
+
+static void print_json_errors(const char *name, const error_stats_t *stats, bool last) {
+    printf("  \"%s\": {\"pulses\": %" PRIu64 ", \"bias_ns\": %.1f, \"rms_ns\": %.1f, \"max_ns\": %.1f}%s\n",
+           name, stats->count, error_bias(stats), error_rms(stats), stats->max_abs, last ? "" : ",");
+}
+
+int main(int argc, char *argv[]) {
+    pps_sim_config_t sim_config;
+    pps_sim_default_config(&sim_config);
+    pulse_detector_config_t det_config;
+    pulse_detector_default_config(&det_config);
+    pulse_filter_config_t filter_config;
+    pulse_filter_default_config(&filter_config);
+
+    bool cts_mode = false;
+    bool json = false;
+    bool calibrate = false;
+    const char *calibrate_path = NULL;
+    double duration = DEFAULT_DURATION;
+    double sample_rate = sim_config.sample_rate;
+    double block_size = (double)sim_config.block_size;
+    double threshold = det_config.threshold;
+    double cfd_fraction = det_config.cfd_fraction;
+    double smooth = 0.0;
+    double match_window = DEFAULT_MATCH_WINDOW;
+    double max_bias = INFINITY;
+    double max_rms = INFINITY;
+    double max_error = INFINITY;
+    double max_missed = INFINITY;
+    const char *trace_path = NULL;
+    const char *csv_path = NULL;
+
+    number_option_t numbers[] = {
+        { "--duration", &duration, 1.0 },
+        { "-d", &duration, 1.0 },
+        { "--phase", &sim_config.phase, 1.0 },
+        { "--miss", &sim_config.miss_rate, 1.0 },
+        { "--glitch-rate", &sim_config.glitch_rate, 1.0 },
+        { "--sample-rate", &sample_rate, 1.0 },
+        { "-s", &sample_rate, 1.0 },
+        { "--block", &block_size, 1.0 },
+        { "-b", &block_size, 1.0 },
+        { "--amplitude", &sim_config.amplitude, 1.0 },
+        { "--amplitude-jitter", &sim_config.amplitude_jitter, 1.0 },
+        { "--rise", &sim_config.rise_time, 1e-6 },
+        { "--decay", &sim_config.decay_time, 1e-3 },
+        { "--width", &sim_config.width, 1e-3 },
+        { "--noise", &sim_config.noise, 1.0 },
+        { "--drift", &sim_config.drift_ppm, 1.0 },
+        { "--host-jitter", &sim_config.host_jitter, 1e-6 },
+        { "--input-latency", &sim_config.input_latency, 1e-6 },
+        { "--drop", &sim_config.drop_rate, 1.0 },
+        { "--threshold", &threshold, 1.0 },
+        { "-t", &threshold, 1.0 },
+        { "--cfd-fraction", &cfd_fraction, 1.0 },
+        { "-f", &cfd_fraction, 1.0 },
+        { "--poll-interval", &sim_config.poll_interval, 1e-6 },
+        { "--poll-jitter", &sim_config.poll_jitter, 1e-6 },
+        { "--usb-latency", &sim_config.usb_latency, 1e-6 },
+        { "--usb-jitter", &sim_config.usb_jitter, 1e-6 },
+        { "--smooth", &smooth, 1.0 },
+        { "--match-window", &match_window, 1e-6 },
+        { "--max-bias", &max_bias, 1e3 },
+        { "--max-rms", &max_rms, 1e3 },
+        { "--max-error", &max_error, 1e3 },
+        { "--max-missed", &max_missed, 1.0 },
+    };
+    size_t num_numbers = sizeof(numbers) / sizeof(numbers[0]);
+
+    for (int i = 1; i < argc; i++) {
+        number_option_t *number = NULL;
+        for (size_t k = 0; k < num_numbers; k++) {
+            if (strcmp(argv[i], numbers[k].name) == 0) {
+                number = &numbers[k];
+            }
+        }
+        bool takes_arg = number != NULL
+            || strcmp(argv[i], "--seed") == 0 || strcmp(argv[i], "--trace") == 0
+            || strcmp(argv[i], "--csv") == 0 || strcmp(argv[i], "--calibrate-file") == 0
+            || strcmp(argv[i], "-m") == 0
+            || strcmp(argv[i], "--mode") == 0 || strcmp(argv[i], "-i") == 0
+            || strcmp(argv[i], "--interp") == 0;
+        if (takes_arg && i + 1 >= argc) {
+            fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+
+        if (number) {
+            *number->value = strtod(argv[++i], NULL) * number->scale;
+        } else if (strcmp(argv[i], "--cts") == 0) {
+            cts_mode = true;
+        } else if (strcmp(argv[i], "--json") == 0) {
+            json = true;
+        } else if (strcmp(argv[i], "--calibrate") == 0) {
+            calibrate = true;
+        } else if (strcmp(argv[i], "--calibrate-file") == 0) {
+            calibrate = true;
+            calibrate_path = argv[++i];
+        } else if (strcmp(argv[i], "--no-track") == 0) {
+            det_config.track = false;
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            sim_config.seed = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            trace_path = argv[++i];
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            csv_path = argv[++i];
+        } else if (strcmp(argv[i], "-m") == 0 || strcmp(argv[i], "--mode") == 0) {
+            if (pulse_detector_parse_mode(argv[++i], &det_config.mode) < 0) {
+                fprintf(stderr, "Error: Unknown mode %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-i") == 0 || strcmp(argv[i], "--interp") == 0) {
+            if (pulse_detector_parse_interp(argv[++i], &det_config.interp) < 0) {
+                fprintf(stderr, "Error: Unknown interpolation %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    sim_config.sample_rate = sample_rate;
+    sim_config.block_size = (size_t)block_size;
+    det_config.threshold = (float)threshold;
+    det_config.cfd_fraction = (float)cfd_fraction;
+    filter_config.smooth_window = (unsigned)smooth;
+    if (duration <= 0.0) {
+        fprintf(stderr, "Error: Duration must be positive\n");
+        return 1;
+    }
+
+    pps_sim_t *sim = pps_sim_create(&sim_config);
+    pulse_filter_t *filter = pulse_filter_create(&filter_config);
+    if (sim == NULL || filter == NULL) {
+        fprintf(stderr, "Error: Invalid simulation settings\n");
+        return 1;
+    }
+
+    evaluation_t eval;
+    memset(&eval, 0, sizeof(eval));
+    eval.sim = sim;
+    eval.filter = filter;
+    eval.phase = sim_config.phase;
+    eval.match_window = (timens_t)(match_window * 1e9);
+    if (calibrate) {
+        /* Every pulse of the run goes into the one window */
+        calibration_config_t calibration_config;
+        calibration_default_config(&calibration_config);
+        calibration_config.window = duration;
+        eval.calibration = calibration_create(&calibration_config);
+        if (eval.calibration == NULL) {
+            fprintf(stderr, "Error: Failed to set up calibration\n");
+            return 1;
+        }
+    }
+    if (csv_path) {
+        eval.csv = fopen(csv_path, "w");
+        if (eval.csv == NULL) {
+            perror("Failed to open CSV file");
+            return 1;
+        }
+        fprintf(eval.csv, "time,error_ns,kind,verdict,filtered_error_ns\n");
+    }
+    FILE *trace = NULL;
+    if (trace_path) {
+        trace = fopen(trace_path, "w");
+        if (trace == NULL) {
+            perror("Failed to open trace file");
+            return 1;
+        }
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    timens_t busy = 0;
+    int result = cts_mode ? run_cts(sim, &eval, duration, trace, &busy)
+                          : run_audio(sim, &sim_config, &det_config, &eval, duration, &busy);
+    if (trace) {
+        fclose(trace);
+    }
+    if (eval.csv) {
+        fclose(eval.csv);
+    }
+    if (result < 0) {
+        return 1;
+    }
+
+    pps_sim_stats_t stats;
+    pps_sim_stats(sim, &stats);
+    double simulated = (double)pps_sim_elapsed(sim) / 1e9;
+    double busy_sec = (double)busy / 1e9;
+    uint64_t found = eval.matched + eval.discarded;
+    uint64_t missed = stats.edges > found ? stats.edges - found : 0;
+    double units = cts_mode ? (double)stats.changes : (double)stats.samples;
+    double throughput = busy_sec > 0.0 ? units / busy_sec : 0.0;
+    double speed = busy_sec > 0.0 ? simulated / busy_sec : 0.0;
+    calibration_result_t calibration;
+    bool calibrated = eval.calibration && calibration_result(eval.calibration, &calibration) == 0;
+    if (eval.calibration && !calibrated) {
+        fprintf(stderr, "Warning: Too few pulses to calibrate\n");
+    }
+
+    if (json) {
+        printf("{\n");
+        printf("  \"mode\": \"%s\",\n", cts_mode ? "cts" : "audio");
+        printf("  \"seed\": %" PRIu64 ",\n", sim_config.seed);
+        printf("  \"seconds\": %.3f,\n", simulated);
+        printf("  \"edges\": %" PRIu64 ",\n", stats.edges);
+        printf("  \"detected\": %" PRIu64 ",\n", eval.matched);
+        printf("  \"missed\": %" PRIu64 ",\n", missed);
+        printf("  \"discarded\": %" PRIu64 ",\n", eval.discarded);
+        printf("  \"stray\": %" PRIu64 ",\n", eval.stray);
+        printf("  \"stray_accepted\": %" PRIu64 ",\n", eval.stray_accepted);
+        printf("  \"glitches\": %" PRIu64 ",\n", stats.glitches);
+        printf("  \"dropped_blocks\": %" PRIu64 ",\n", stats.dropped_blocks);
+        print_json_errors("error", &eval.raw, false);
+        print_json_errors("filtered", &eval.filtered, false);
+        printf("  \"%s_per_sec\": %.0f,\n", cts_mode ? "changes" : "samples", throughput);
+        if (calibrated) {
+            printf("  \"calibration\": {\"pulses\": %" PRIu64 ", \"offset_ns\": %.1f, \"lower_ns\": %.1f, "
+                   "\"upper_ns\": %.1f},\n", calibration.pulses, calibration.mean * 1e9,
+                   calibration.lower * 1e9, calibration.upper * 1e9);
+        }
+        printf("  \"realtime_factor\": %.1f\n", speed);
+        printf("}\n");
+    } else {
+        if (cts_mode) {
+            printf("Simulated %.0f s of CTS changes (%" PRIu64 " changes, %" PRIu64 " stray pulses)\n",
+                   simulated, stats.changes, stats.glitches);
+        } else {
+            printf("Simulated %.0f s of audio (%" PRIu64 " samples, %" PRIu64 " buffers dropped, %"
+                   PRIu64 " stray pulses)\n", simulated, stats.samples, stats.dropped_blocks, stats.glitches);
+        }
+        printf("Pulses: %" PRIu64 " generated, %" PRIu64 " detected, %" PRIu64 " missed, %" PRIu64
+               " discarded, %" PRIu64 " stray (%" PRIu64 " accepted by the filter)\n",
+               stats.edges, eval.matched, missed, eval.discarded, eval.stray, eval.stray_accepted);
+        print_errors("Error", &eval.raw);
+        print_errors("Filtered", &eval.filtered);
+        if (calibrated) {
+            calibration_print(&calibration, 1.0, NAN, stdout);
+        }
+        if (cts_mode) {
+            printf("Throughput: %.2f M changes/s, %.0fx real time\n", throughput / 1e6, speed);
+        } else {
+            printf("Throughput: %.1f M samples/s, %.0fx real time\n", throughput / 1e6, speed);
+        }
+    }
+
+    int status = 0;
+    if (calibrated && calibrate_path
+        && calibration_write(calibrate_path, "ppssim", &calibration, 1.0, NAN) < 0) {
+        perror("Failed to write calibration");
+        status = 1;
+    }
+    /* The truth should be within the bounds the calibration gives */
+    if (calibrated && (error_bias(&eval.raw) < calibration.lower * 1e9
+                       || error_bias(&eval.raw) > calibration.upper * 1e9)) {
+        fprintf(stderr, "FAIL: bias %.3f us is outside the calibration bounds %.3f to %.3f us\n",
+                error_bias(&eval.raw) / 1e3, calibration.lower * 1e6, calibration.upper * 1e6);
+        status = 2;
+    }
+    if (fabs(error_bias(&eval.raw)) > max_bias) {
+        fprintf(stderr, "FAIL: bias %.3f us is over %.3f us\n", error_bias(&eval.raw) / 1e3, max_bias / 1e3);
+        status = 2;
+    }
+    if (error_rms(&eval.raw) > max_rms) {
+        fprintf(stderr, "FAIL: RMS error %.3f us is over %.3f us\n", error_rms(&eval.raw) / 1e3, max_rms / 1e3);
+        status = 2;
+    }
+    if (eval.raw.max_abs > max_error) {
+        fprintf(stderr, "FAIL: max error %.3f us is over %.3f us\n", eval.raw.max_abs / 1e3, max_error / 1e3);
+        status = 2;
+    }
+    if ((double)missed > max_missed) {
+        fprintf(stderr, "FAIL: %" PRIu64 " pulses missed, more than %.0f\n", missed, max_missed);
+        status = 2;
+    }
+
+    calibration_destroy(eval.calibration);
+    pulse_filter_destroy(filter);
+    pps_sim_destroy(sim);
+    return status;
+}
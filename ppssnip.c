@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include "pulse_snippet.h"
+
+#define MAX_SNIPPET_SAMPLES 1048576
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options] <snippet-file>\n", prog);
+    fprintf(stderr, "List or export the pulse snippets saved by audiopps or ppsreplay --snippets\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "      --csv                Print the samples of each snippet as CSV\n");
+    fprintf(stderr, "      --wav PREFIX         Write each snippet to PREFIX-N-KIND.wav as 32-bit float\n");
+    fprintf(stderr, "      --seq N              Only snippets of pulse N\n");
+    fprintf(stderr, "      --kind KIND          Only snippets of this kind: accepted, rejected, discarded,\n");
+    fprintf(stderr, "                           missed or detected\n");
+    fprintf(stderr, "  -h, --help               Show this help\n");
+}
+
+static void put_le16(unsigned char *p, uint16_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+}
+
+static void put_le32(unsigned char *p, uint32_t v) {
+    p[0] = (unsigned char)v;
+    p[1] = (unsigned char)(v >> 8);
+    p[2] = (unsigned char)(v >> 16);
+    p[3] = (unsigned char)(v >> 24);
+}
+
+/* Write samples as a mono 32-bit float WAV file */
+static int write_wav(const char *path, const float *samples, size_t count, double sample_rate) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == NULL) {
+        return -1;
+    }
+
+    unsigned char hdr[44];
+    uint32_t data_size = (uint32_t)(count * 4);
+    memcpy(hdr, "RIFF", 4);
+    put_le32(hdr + 4, 36 + data_size);
+    memcpy(hdr + 8, "WAVEfmt ", 8);
+    put_le32(hdr + 16, 16);
+    put_le16(hdr + 20, 3);                         /* IEEE float */
+    put_le16(hdr + 22, 1);                         /* channels */
+    put_le32(hdr + 24, (uint32_t)sample_rate);
+    put_le32(hdr + 28, (uint32_t)sample_rate * 4); /* bytes per second */
+    put_le16(hdr + 32, 4);                         /* bytes per frame */
+    put_le16(hdr + 34, 32);                        /* bits per sample */
+    memcpy(hdr + 36, "data", 4);
+    put_le32(hdr + 40, data_size);
+
+    bool ok = fwrite(hdr, sizeof(hdr), 1, fp) == 1;
+    for (size_t i = 0; ok && i < count; i++) {
+        unsigned char b[4];
+        uint32_t bits;
+        memcpy(&bits, &samples[i], sizeof(bits));
+        put_le32(b, bits);
+        ok = fwrite(b, sizeof(b), 1, fp) == 1;
+    }
+    if (fclose(fp) != 0) {
+        ok = false;
+    }
+    return ok ? 0 : -1;
+}
+
+static void print_snippet(uint64_t index, const pulse_snippet_t *s, double sample_rate) {
+    printf("#%" PRIu64 " %s", index, pulse_snippet_kind_name(s->kind));
+    if (s->seq) {
+        printf(" pulse %" PRIu64, s->seq);
+    }
+    printf(" at sample %.3f (%.6f s)", s->center, s->center / sample_rate);
+    if (s->time) {
+        timens_t sec = timens_floor_div(s->time, TIMENS_PER_SEC);
+        printf(", time %" PRId64 ".%09" PRId64, sec, s->time - sec * TIMENS_PER_SEC);
+    }
+    if (s->kind != PULSE_SNIPPET_MISSED) {
+        printf(", level %.3f", s->level);
+    }
+    printf(", %" PRIu32 " samples\n", s->count);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    const char *wav_prefix = NULL;
+    bool csv = false;
+    uint64_t only_seq = 0;
+    bool have_kind = false;
+    pulse_snippet_kind_t only_kind = PULSE_SNIPPET_DETECTED;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "--csv") == 0) {
+            csv = true;
+        } else if (strcmp(arg, "--wav") == 0) {
+            if (!has_value) goto missing;
+            wav_prefix = argv[++i];
+        } else if (strcmp(arg, "--seq") == 0) {
+            if (!has_value) goto missing;
+            only_seq = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--kind") == 0) {
+            if (!has_value) goto missing;
+            if (pulse_snippet_parse_kind(argv[++i], &only_kind) < 0) {
+                fprintf(stderr, "Error: Unknown snippet kind %s\n", argv[i]);
+                return 1;
+            }
+            have_kind = true;
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (arg[0] == '-') {
+            fprintf(stderr, "Error: Unknown option %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        } else if (path == NULL) {
+            path = arg;
+        } else {
+            fprintf(stderr, "Error: Too many arguments\n");
+            print_usage(argv[0]);
+            return 1;
+        }
+        continue;
+    missing:
+        fprintf(stderr, "Error: %s requires an argument\n", arg);
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (path == NULL) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    pulse_snippet_file_t *f = pulse_snippet_file_open(path);
+    if (f == NULL) {
+        if (errno == EINVAL) {
+            fprintf(stderr, "Error: %s is not a snippet file\n", path);
+        } else {
+            perror("Failed to open snippet file");
+        }
+        return 1;
+    }
+    double sample_rate = pulse_snippet_file_sample_rate(f);
+
+    float *samples = malloc(MAX_SNIPPET_SAMPLES * sizeof(float));
+    if (samples == NULL) {
+        pulse_snippet_file_close(f);
+        return 1;
+    }
+
+    if (csv) {
+        printf("snippet,kind,seq,sample,offset,value\n");
+    }
+
+    pulse_snippet_t snippet;
+    uint64_t index = 0;
+    uint64_t shown = 0;
+    int rc = 0;
+    int result;
+    while ((result = pulse_snippet_file_read(f, &snippet, samples, MAX_SNIPPET_SAMPLES)) > 0) {
+        index++;
+        if ((only_seq && snippet.seq != only_seq) || (have_kind && snippet.kind != only_kind)) {
+            continue;
+        }
+        shown++;
+        size_t count = snippet.count < MAX_SNIPPET_SAMPLES ? snippet.count : MAX_SNIPPET_SAMPLES;
+
+        if (csv) {
+            /* offset is the distance of each sample from the event, in samples */
+            for (size_t i = 0; i < count; i++) {
+                uint64_t pos = snippet.first + i;
+                printf("%" PRIu64 ",%s,%" PRIu64 ",%" PRIu64 ",%.3f,%.6f\n",
+                       index, pulse_snippet_kind_name(snippet.kind), snippet.seq, pos,
+                       (double)pos - snippet.center, samples[i]);
+            }
+        } else {
+            print_snippet(index, &snippet, sample_rate);
+        }
+
+        if (wav_prefix) {
+            char wav_path[1024];
+            snprintf(wav_path, sizeof(wav_path), "%s-%" PRIu64 "-%s.wav",
+                     wav_prefix, index, pulse_snippet_kind_name(snippet.kind));
+            if (write_wav(wav_path, samples, count, sample_rate) < 0) {
+                perror(wav_path);
+                rc = 1;
+                break;
+            }
+        }
+    }
+    if (result < 0) {
+        perror("Error reading snippet file");
+        rc = 1;
+    }
+    if (!csv) {
+        printf("%" PRIu64 " of %" PRIu64 " snippets\n", shown, index);
+    }
+
+    free(samples);
+    pulse_snippet_file_close(f);
+    return rc;
+}
@@ -0,0 +1,333 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "chrony_client.h"
+#include "ntp_shm.h"
+#include "timens.h"
+
+#define DEFAULT_SEND_COUNT 10
+#define DEFAULT_SEND_INTERVAL_MS 1000
+#define SHM_POLL_US 100
+
+static volatile sig_atomic_t interrupted = 0;
+
+void handle_signal(int sig) {
+    interrupted = 1;
+}
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options] <socket-path>\n", prog);
+    fprintf(stderr, "       %s --send [options] <socket-path>\n", prog);
+    fprintf(stderr, "       %s --shm UNIT [options]\n", prog);
+    fprintf(stderr, "Stand in for chronyd's SOCK refclock: receive samples on socket-path and report\n");
+    fprintf(stderr, "how long after their timestamp they arrived. With --send, send test samples\n");
+    fprintf(stderr, "stamped with the current time instead. With --shm, read NTP SHM refclock UNIT\n");
+    fprintf(stderr, "the way chronyd and ntpd do.\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -n, --count N            Stop after N samples (default: unlimited; %d with --send)\n",
+            DEFAULT_SEND_COUNT);
+    fprintf(stderr, "      --csv                Print received samples as CSV\n");
+    fprintf(stderr, "  -q, --quiet              Only print the summary\n");
+    fprintf(stderr, "      --send               Send samples with the chrony client instead of receiving\n");
+    fprintf(stderr, "      --shm UNIT           Read samples from NTP SHM refclock UNIT instead of a socket\n");
+    fprintf(stderr, "  -i, --interval MS        Time between samples sent (default: %d)\n", DEFAULT_SEND_INTERVAL_MS);
+    fprintf(stderr, "  -h, --help               Show this help\n");
+}
+
+static int compare_doubles(const void *a, const void *b) {
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y ? 1 : 0;
+}
+
+static double percentile(const double *sorted, size_t n, double p) {
+    size_t i = (size_t)llround(p * (double)(n - 1));
+    return sorted[i];
+}
+
+static int send_samples(const char *path, uint64_t count, unsigned interval_ms) {
+    chrony_client_t *client = chrony_client_create(NULL, path);
+    if (client == NULL) {
+        fprintf(stderr, "Failed to setup chrony client\n");
+        return 1;
+    }
+
+    timens_t next = timens_now(CLOCK_MONOTONIC);
+    for (uint64_t i = 0; i < count && !interrupted; i++) {
+        struct timeval tv;
+        timens_to_timeval(timens_now(CLOCK_REALTIME), &tv);
+        int result = chrony_client_send_pps(client, &tv, 0.0);
+        printf("Sample %" PRIu64 " %s\n", i + 1, result == 0 ? "sent" : result > 0 ? "queued" : "lost");
+        fflush(stdout);
+
+        next += (timens_t)interval_ms * TIMENS_PER_MSEC;
+        timens_t delta = next - timens_now(CLOCK_MONOTONIC);
+        if (delta > 0 && i + 1 < count) {
+            struct timespec ts;
+            timens_to_timespec(delta, &ts);
+            nanosleep(&ts, NULL);
+        }
+    }
+
+    chrony_client_stats_t stats;
+    chrony_client_stats(client, &stats);
+    printf("Chrony: %" PRIu64 " sent, %" PRIu64 " queued, %" PRIu64 " expired, %" PRIu64 " overflowed, "
+           "%" PRIu64 " lost, %" PRIu64 " reconnects\n",
+           stats.sent, stats.queued, stats.expired, stats.overflows, stats.lost, stats.reconnects);
+    chrony_client_destroy(client);
+    return 0;
+}
+
+typedef struct {
+    double *latencies;
+    size_t n;
+    size_t capacity;
+    double offset_sum;
+    double offset_sq;
+    uint64_t bad;
+} receive_stats_t;
+
+/* Record a sample; returns its number, or 0 if it could not be stored */
+static size_t add_sample(receive_stats_t *stats, double latency, double offset) {
+    if (stats->n == stats->capacity) {
+        size_t capacity = stats->capacity ? 2 * stats->capacity : 1024;
+        double *grown = realloc(stats->latencies, capacity * sizeof(double));
+        if (grown == NULL) {
+            return 0;
+        }
+        stats->latencies = grown;
+        stats->capacity = capacity;
+    }
+    stats->latencies[stats->n++] = latency;
+    stats->offset_sum += offset;
+    stats->offset_sq += offset * offset;
+    return stats->n;
+}
+
+static void print_summary(receive_stats_t *stats, FILE *out) {
+    size_t n = stats->n;
+    fprintf(out, "%zu samples, %" PRIu64 " bad\n", n, stats->bad);
+    if (n > 0) {
+        double mean = stats->offset_sum / n;
+        qsort(stats->latencies, n, sizeof(double), compare_doubles);
+        fprintf(out, "Latency: min %.1f us, median %.1f us, 99%% %.1f us, max %.1f us\n",
+                stats->latencies[0], percentile(stats->latencies, n, 0.5), percentile(stats->latencies, n, 0.99),
+                stats->latencies[n - 1]);
+        fprintf(out, "Offset: mean %.9f, std dev %.9f\n", mean, sqrt(fmax(stats->offset_sq / n - mean * mean, 0.0)));
+    }
+    free(stats->latencies);
+}
+
+/* Poll an SHM segment as chronyd does, reporting the time from each
+ * sample's system time to when it was seen */
+static int receive_shm(int unit, uint64_t count, bool csv, bool quiet) {
+    ntp_shm_t *shm = ntp_shm_create(unit);
+    if (shm == NULL) {
+        perror("Failed to attach NTP SHM segment");
+        return 1;
+    }
+    receive_stats_t stats = { 0 };
+
+    if (csv) {
+        printf("seq,clock_time,receive_time,offset,precision,latency_us\n");
+    } else if (!quiet) {
+        printf("Polling NTP SHM unit %d\n", unit);
+    }
+    fflush(stdout);
+
+    while (!interrupted && (count == 0 || stats.n < count)) {
+        struct shmTime sample;
+        int result = ntp_shm_read(shm, &sample);
+        timens_t now = timens_now(CLOCK_REALTIME);
+        if (result == 0) {
+            struct timespec ts = { 0, SHM_POLL_US * 1000L };
+            nanosleep(&ts, NULL);
+            continue;
+        }
+        if (result < 0 || sample.mode != 1) {
+            stats.bad++;
+            continue;
+        }
+
+        timens_t clock = (timens_t)sample.clockTimeStampSec * TIMENS_PER_SEC + sample.clockTimeStampNSec;
+        timens_t receive = (timens_t)sample.receiveTimeStampSec * TIMENS_PER_SEC + sample.receiveTimeStampNSec;
+        double offset = (double)(receive - clock) / 1e9;
+        double latency = (double)(now - receive) / 1e3;
+        size_t seq = add_sample(&stats, latency, offset);
+        if (seq == 0) {
+            break;
+        }
+
+        if (csv) {
+            printf("%zu,%ld.%09u,%ld.%09u,%.9f,%d,%.1f\n", seq,
+                   (long)sample.clockTimeStampSec, sample.clockTimeStampNSec,
+                   (long)sample.receiveTimeStampSec, sample.receiveTimeStampNSec,
+                   offset, sample.precision, latency);
+        } else if (!quiet) {
+            printf("Sample #%zu at %ld.%09u offset=%.9f precision=%d latency=%.1fus\n", seq,
+                   (long)sample.receiveTimeStampSec, sample.receiveTimeStampNSec, offset, sample.precision, latency);
+        }
+        fflush(stdout);
+    }
+
+    print_summary(&stats, csv ? stderr : stdout);
+    ntp_shm_destroy(shm);
+    return 0;
+}
+
+static int receive_samples(const char *path, uint64_t count, bool csv, bool quiet) {
+    /* A truncated path would bind one socket and unlink another file */
+    struct sockaddr_un addr;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        perror(path);
+        return 1;
+    }
+    int fd = socket(AF_UNIX, SOCK_DGRAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return 1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        perror(path);
+        close(fd);
+        return 1;
+    }
+
+    receive_stats_t stats = { 0 };
+
+    if (csv) {
+        printf("seq,time,offset,pulse,leap,latency_us\n");
+    } else if (!quiet) {
+        printf("Listening on %s\n", path);
+    }
+    fflush(stdout);
+
+    while (!interrupted && (count == 0 || stats.n < count)) {
+        struct sock_sample sample;
+        ssize_t len = recv(fd, &sample, sizeof(sample), 0);
+        timens_t now = timens_now(CLOCK_REALTIME);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("recv");
+            break;
+        }
+        if (len != (ssize_t)sizeof(sample) || sample.magic != SOCK_MAGIC) {
+            /* chronyd drops these too */
+            stats.bad++;
+            if (!quiet) {
+                fprintf(stderr, "Bad sample: %zd bytes, magic %#x\n", len, (unsigned)sample.magic);
+            }
+            continue;
+        }
+
+        timens_t stamp = (timens_t)sample.tv.tv_sec * TIMENS_PER_SEC + (timens_t)sample.tv.tv_usec * TIMENS_PER_USEC;
+        double latency = (double)(now - stamp) / 1e3;
+        size_t n = add_sample(&stats, latency, sample.offset);
+        if (n == 0) {
+            break;
+        }
+
+        if (csv) {
+            printf("%zu,%ld.%06ld,%.9f,%d,%d,%.1f\n", n, (long)sample.tv.tv_sec, (long)sample.tv.tv_usec,
+                   sample.offset, sample.pulse, sample.leap, latency);
+        } else if (!quiet) {
+            printf("Sample #%zu at %ld.%06ld offset=%.9f pulse=%d leap=%d latency=%.1fus\n",
+                   n, (long)sample.tv.tv_sec, (long)sample.tv.tv_usec, sample.offset, sample.pulse, sample.leap,
+                   latency);
+        }
+        fflush(stdout);
+    }
+
+    /* The summary goes to stderr when stdout is CSV */
+    print_summary(&stats, csv ? stderr : stdout);
+    close(fd);
+    unlink(path);
+    return 0;
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    uint64_t count = 0;
+    unsigned interval_ms = DEFAULT_SEND_INTERVAL_MS;
+    bool csv = false;
+    bool quiet = false;
+    bool send_mode = false;
+    int shm_unit = -1;
+
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        bool has_value = i + 1 < argc;
+        if (strcmp(arg, "-n") == 0 || strcmp(arg, "--count") == 0) {
+            if (!has_value) goto missing;
+            count = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "-i") == 0 || strcmp(arg, "--interval") == 0) {
+            if (!has_value) goto missing;
+            interval_ms = (unsigned)strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(arg, "--csv") == 0) {
+            csv = true;
+        } else if (strcmp(arg, "-q") == 0 || strcmp(arg, "--quiet") == 0) {
+            quiet = true;
+        } else if (strcmp(arg, "--shm") == 0) {
+            if (!has_value) goto missing;
+            if (ntp_shm_parse_unit(argv[++i], &shm_unit) < 0) {
+                fprintf(stderr, "Error: shm unit must be a number, not %s\n", argv[i]);
+                return 1;
+            }
+        } else if (strcmp(arg, "--send") == 0) {
+            send_mode = true;
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (arg[0] == '-') {
+            fprintf(stderr, "Error: Unknown option %s\n", arg);
+            print_usage(argv[0]);
+            return 1;
+        } else if (path == NULL) {
+            path = arg;
+        } else {
+            fprintf(stderr, "Error: Too many arguments\n");
+            print_usage(argv[0]);
+            return 1;
+        }
+        continue;
+    missing:
+        fprintf(stderr, "Error: %s requires an argument\n", arg);
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    if (path == NULL && shm_unit < 0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    /* No SA_RESTART, so a signal interrupts a blocking recv */
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (shm_unit >= 0) {
+        return receive_shm(shm_unit, count, csv, quiet);
+    }
+    if (send_mode) {
+        return send_samples(path, count ? count : DEFAULT_SEND_COUNT, interval_ms);
+    }
+    return receive_samples(path, count, csv, quiet);
+}
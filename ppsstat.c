@@ -0,0 +1,377 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <math.h>
+#include <unistd.h>
+#include "pulse_journal.h"
+#include "pulse_filter.h"
+#include "stability.h"
+#include "timens.h"
+
+#define DEFAULT_BINS 20
+#define MAX_TAUS 64
+#define HISTOGRAM_WIDTH 50
+
+typedef struct {
+    timens_t *time;
+    double *offset;
+    size_t count;
+    size_t capacity;
+    size_t skipped;            /* rejected or discarded pulses left out */
+    bool have_time;            /* false if times were made up from the period */
+} series_t;
+
+void print_usage(const char *prog) {
+    fprintf(stderr, "usage: %s [options] <pulse-log>\n", prog);
+    fprintf(stderr, "Stability analysis of a pulse log: a journal written with --journal, CSV from ppsjournal,\n");
+    fprintf(stderr, "or text with one pulse per line as \"offset\" or \"time offset\" (seconds)\n");
+    fprintf(stderr, "options:\n");
+    fprintf(stderr, "  -p, --period S           Time between pulses (default: 1)\n");
+    fprintf(stderr, "  -a, --all                Include pulses rejected by the filter\n");
+    fprintf(stderr, "  -j, --threads N          Worker threads (default: number of CPUs)\n");
+    fprintf(stderr, "  -b, --bins N             Histogram bins, 0 for none (default: %d)\n", DEFAULT_BINS);
+    fprintf(stderr, "      --csv                Print only the stability table, as CSV\n");
+    fprintf(stderr, "  -h, --help               Show this help\n");
+}
+
+static int append(series_t *s, timens_t time, double offset) {
+    if (s->count == s->capacity) {
+        size_t capacity = s->capacity ? s->capacity * 2 : 4096;
+        timens_t *t = realloc(s->time, capacity * sizeof(timens_t));
+        if (t == NULL) {
+            return -1;
+        }
+        s->time = t;
+        double *o = realloc(s->offset, capacity * sizeof(double));
+        if (o == NULL) {
+            return -1;
+        }
+        s->offset = o;
+        s->capacity = capacity;
+    }
+    s->time[s->count] = time;
+    s->offset[s->count] = offset;
+    s->count++;
+    return 0;
+}
+
+static int read_journal(pulse_journal_t *journal, bool all, series_t *s) {
+    uint64_t head = pulse_journal_head(journal);
+    uint64_t capacity = pulse_journal_capacity(journal);
+    pulse_journal_record_t record;
+
+    for (uint64_t seq = head > capacity ? head - capacity + 1 : 1; seq <= head; seq++) {
+        if (pulse_journal_read(journal, seq, &record) <= 0) {
+            continue;
+        }
+        if ((record.flags & PULSE_JOURNAL_DISCARDED) || (!all && record.verdict != PULSE_VERDICT_ACCEPT)) {
+            s->skipped++;
+            continue;
+        }
+        if (append(s, record.time, record.offset) < 0) {
+            return -1;
+        }
+    }
+    s->have_time = true;
+    return 0;
+}
+
+/* Parse seconds with up to nanosecond precision, e.g. 1700000000.000123456 */
+static int parse_time(const char *str, timens_t *time) {
+    char *end;
+    long long sec = strtoll(str, &end, 10);
+    if (end == str) {
+        return -1;
+    }
+    timens_t ns = 0;
+    if (*end == '.') {
+        timens_t scale = TIMENS_PER_SEC / 10;
+        for (end++; isdigit((unsigned char)*end); end++) {
+            ns += (*end - '0') * scale;
+            scale /= 10;
+        }
+    }
+    *time = (timens_t)sec * TIMENS_PER_SEC + (str[0] == '-' ? -ns : ns);
+    return 0;
+}
+
+/* Split a line in place on commas or whitespace */
+static int split(char *line, char **fields, int max) {
+    int n = 0;
+    char *save;
+    for (char *tok = strtok_r(line, ", \t\r\n", &save); tok && n < max; tok = strtok_r(NULL, ", \t\r\n", &save)) {
+        fields[n++] = tok;
+    }
+    return n;
+}
+
+static int read_text(FILE *f, double period, bool all, series_t *s) {
+    char line[1024];
+    char *fields[32];
+    int time_col = -1, offset_col = -1, verdict_col = -1;
+    bool header_seen = false;
+    size_t line_no = 0;
+
+    s->have_time = true;
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        if (line[0] == '#') {
+            continue;
+        }
+        int n = split(line, fields, 32);
+        if (n == 0) {
+            continue;
+        }
+
+        /* A ppsjournal CSV header names the columns */
+        if (!header_seen && isalpha((unsigned char)fields[0][0])) {
+            for (int k = 0; k < n; k++) {
+                if (strcmp(fields[k], "time") == 0) {
+                    time_col = k;
+                } else if (strcmp(fields[k], "offset") == 0) {
+                    offset_col = k;
+                } else if (strcmp(fields[k], "verdict") == 0) {
+                    verdict_col = k;
+                }
+            }
+            if (offset_col < 0) {
+                fprintf(stderr, "Error: no offset column in header\n");
+                return -1;
+            }
+            header_seen = true;
+            continue;
+        }
+        header_seen = true;
+
+        timens_t time;
+        double offset;
+        if (offset_col >= 0) {
+            if (offset_col >= n || (time_col >= 0 && (time_col >= n || parse_time(fields[time_col], &time) < 0))) {
+                fprintf(stderr, "Error: line %zu: missing fields\n", line_no);
+                return -1;
+            }
+            if (verdict_col >= 0 && verdict_col < n && !all && strcmp(fields[verdict_col], "accepted") != 0) {
+                s->skipped++;
+                continue;
+            }
+            offset = strtod(fields[offset_col], NULL);
+            if (time_col < 0) {
+                s->have_time = false;
+            }
+        } else if (n >= 2) {
+            if (parse_time(fields[0], &time) < 0) {
+                fprintf(stderr, "Error: line %zu: bad time\n", line_no);
+                return -1;
+            }
+            offset = strtod(fields[1], NULL);
+        } else {
+            offset = strtod(fields[0], NULL);
+            s->have_time = false;
+        }
+        if (!s->have_time) {
+            time = (timens_t)llround(s->count * period * TIMENS_PER_SEC);
+        }
+        if (append(s, time, offset) < 0) {
+            return -1;
+        }
+    }
+    return ferror(f) ? -1 : 0;
+}
+
+static int compare_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void print_percentiles(const char *name, const double *sorted, size_t n) {
+    printf("%-12s p50 %.0f ns, p90 %.0f ns, p99 %.0f ns, p99.9 %.0f ns, max %.0f ns\n", name,
+           stability_percentile(sorted, n, 0.5) * 1e9, stability_percentile(sorted, n, 0.9) * 1e9,
+           stability_percentile(sorted, n, 0.99) * 1e9, stability_percentile(sorted, n, 0.999) * 1e9,
+           sorted[n - 1] * 1e9);
+}
+
+/* Histogram of deviations from the median between the 0.1 and 99.9
+ * percentiles, with anything beyond counted in the end bins */
+static void print_histogram(const double *sorted, size_t n, double median, unsigned bins) {
+    double lo = stability_percentile(sorted, n, 0.001) - median;
+    double hi = stability_percentile(sorted, n, 0.999) - median;
+    if (hi <= lo) {
+        hi = lo + 1e-9;
+    }
+    size_t *counts = calloc(bins, sizeof(size_t));
+    if (counts == NULL) {
+        return;
+    }
+    size_t most = 0;
+    for (size_t i = 0; i < n; i++) {
+        long bin = (long)floor((sorted[i] - median - lo) / (hi - lo) * bins);
+        bin = bin < 0 ? 0 : bin >= (long)bins ? (long)bins - 1 : bin;
+        if (++counts[bin] > most) {
+            most = counts[bin];
+        }
+    }
+    printf("Offset from median (ns):\n");
+    for (unsigned b = 0; b < bins; b++) {
+        int width = (int)((double)counts[b] / most * HISTOGRAM_WIDTH + 0.5);
+        printf("%10.0f %10zu %.*s\n", (lo + (hi - lo) * (b + 0.5) / bins) * 1e9, counts[b], width,
+               "##################################################");
+    }
+    free(counts);
+}
+
+int main(int argc, char *argv[]) {
+    const char *path = NULL;
+    double period = 1.0;
+    bool all = false;
+    bool csv = false;
+    unsigned bins = DEFAULT_BINS;
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    unsigned threads = cpus > 0 ? (unsigned)cpus : 1;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-a") == 0 || strcmp(argv[i], "--all") == 0) {
+            all = true;
+        } else if (strcmp(argv[i], "--csv") == 0) {
+            csv = true;
+        } else if (strcmp(argv[i], "-p") == 0 || strcmp(argv[i], "--period") == 0 ||
+                   strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--threads") == 0 ||
+                   strcmp(argv[i], "-b") == 0 || strcmp(argv[i], "--bins") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(stderr, "Error: %s requires an argument\n", argv[i]);
+                print_usage(argv[0]);
+                return 1;
+            }
+            char opt = argv[i][1] == '-' ? argv[i][2] : argv[i][1];
+            if (opt == 'p') {
+                period = strtod(argv[++i], NULL);
+            } else if (opt == 't' || opt == 'j') {
+                threads = (unsigned)strtoul(argv[++i], NULL, 10);
+            } else {
+                bins = (unsigned)strtoul(argv[++i], NULL, 10);
+            }
+        } else if (strcmp(argv[i], "-h") == 0 || strcmp(argv[i], "--help") == 0) {
+            print_usage(argv[0]);
+            return 0;
+        } else if (argv[i][0] == '-' && argv[i][1] != '\0') {
+            fprintf(stderr, "Error: Unknown option %s\n", argv[i]);
+            print_usage(argv[0]);
+            return 1;
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            fprintf(stderr, "Error: Too many arguments\n");
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (path == NULL || period <= 0.0) {
+        print_usage(argv[0]);
+        return 1;
+    }
+
+    series_t s;
+    memset(&s, 0, sizeof(s));
+    int rc;
+    pulse_journal_t *journal = strcmp(path, "-") == 0 ? NULL : pulse_journal_open(path);
+    if (journal) {
+        rc = read_journal(journal, all, &s);
+        pulse_journal_close(journal);
+    } else {
+        FILE *f = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+        if (f == NULL) {
+            perror("Failed to open pulse log");
+            return 1;
+        }
+        rc = read_text(f, period, all, &s);
+        if (f != stdin) {
+            fclose(f);
+        }
+    }
+    if (rc < 0) {
+        fprintf(stderr, "Failed to read pulse log\n");
+        return 1;
+    }
+    if (s.count < 3) {
+        fprintf(stderr, "Error: need at least 3 pulses, got %zu\n", s.count);
+        return 1;
+    }
+
+    double *x;
+    size_t filled;
+    size_t n = stability_phase_series(s.time, s.offset, s.count, period, &x, &filled);
+    if (n == 0) {
+        fprintf(stderr, "Error: pulse times are not in order\n");
+        return 1;
+    }
+
+    unsigned m[MAX_TAUS];
+    stability_point_t points[MAX_TAUS];
+    size_t count = stability_octave_taus(n, m, MAX_TAUS);
+    for (size_t k = 0; k < count; k++) {
+        points[k].m = m[k];
+    }
+    if (stability_compute(x, n, period, points, count, threads) < 0) {
+        fprintf(stderr, "Failed to compute statistics\n");
+        return 1;
+    }
+
+    if (csv) {
+        printf("tau,terms,adev,tdev,mtie\n");
+        for (size_t k = 0; k < count; k++) {
+            printf("%g,%zu,%.6e,%.6e,%.6e\n", points[k].tau, points[k].terms,
+                   points[k].adev, points[k].tdev, points[k].mtie);
+        }
+        return 0;
+    }
+
+    printf("Pulses: %zu used, %zu skipped; series of %zu periods with %zu interpolated\n",
+           s.count, s.skipped, n, filled);
+
+    /* Offset distribution and pulse-to-pulse jitter */
+    double *sorted = malloc(n * sizeof(double));
+    double *dev = malloc(n * sizeof(double));
+    if (sorted == NULL || dev == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+    memcpy(sorted, x, n * sizeof(double));
+    qsort(sorted, n, sizeof(double), compare_double);
+    double median = stability_percentile(sorted, n, 0.5);
+    double mean = 0.0, sq = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        mean += x[i];
+        dev[i] = fabs(x[i] - median);
+    }
+    mean /= n;
+    for (size_t i = 0; i < n; i++) {
+        sq += (x[i] - mean) * (x[i] - mean);
+    }
+    printf("Offset: median %.9f s, mean %.9f s, RMS about mean %.0f ns\n", median, mean, sqrt(sq / n) * 1e9);
+    qsort(dev, n, sizeof(double), compare_double);
+    print_percentiles("|offset|", dev, n);
+    for (size_t i = 0; i + 1 < n; i++) {
+        dev[i] = fabs(x[i + 1] - x[i]);
+    }
+    qsort(dev, n - 1, sizeof(double), compare_double);
+    print_percentiles("|step|", dev, n - 1);
+    if (bins > 0) {
+        print_histogram(sorted, n, median, bins);
+    }
+    free(sorted);
+    free(dev);
+
+    printf("%10s %10s %12s %12s %12s\n", "tau (s)", "terms", "ADEV", "TDEV (s)", "MTIE (s)");
+    for (size_t k = 0; k < count; k++) {
+        printf("%10g %10zu %12.3e %12.3e %12.3e\n", points[k].tau, points[k].terms,
+               points[k].adev, points[k].tdev, points[k].mtie);
+    }
+
+    free(x);
+    free(s.time);
+    free(s.offset);
+    return 0;
+}
@@ -0,0 +1,965 @@
+#include "pulse_detector.h"
+#include "level_kernel.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+
+/* Matched filtering is done in chunks of at most this many samples */
+#define CORR_CHUNK 1024
+/* Samples before the CFD crossing included in a learned template */
+#define TEMPLATE_LEAD 4
+/* Extra samples either side of a learned template, used to find where the
+ * correlation peaks relative to the CFD crossing */
+#define LEARN_MARGIN 4
+
+struct pulse_detector {
+    pulse_detector_config_t config;
+    double ticks_per_sample;
+    uint64_t holdoff_samples;
+
+    /* Absolute index of the first sample of the next block */
+    uint64_t pos;
+    /* Host time and absolute index of the first sample of the current block */
+    uint64_t block_time;
+    uint64_t block_start;
+
+    bool have_last;
+    uint64_t last_pulse_pos;
+    uint64_t seq;
+
+    /* The last pre_trigger samples of the detection stream before the
+     * current chunk. The detection stream is the raw samples, or the
+     * matched filter output once a template is active. */
+    float *tail;
+    unsigned tail_valid;
+
+    /* Pulse that has triggered but is still being measured.
+     * pulse_buf holds pre_trigger samples, the trigger sample and then
+     * pulse_window samples after it. */
+    bool pending;
+    unsigned pending_remaining;
+    pulse_event_t pending_event;
+    uint64_t pending_gap;      /* samples lost while the pulse was pending */
+    uint64_t pending_ref_time;
+    uint64_t pending_ref_start;
+    float *pulse_buf;
+    unsigned pulse_len;
+
+    /* Matched filter: weights, the raw input (template_len - 1 samples of
+     * history followed by the current chunk) and the filter output */
+    bool matched;
+    float *weights;
+    double template_origin;
+    float *corr_in;
+    unsigned corr_hist_valid;
+    float *corr_out;
+
+    /* Template being learned from pulses timed in CFD mode */
+    float *learn_sum;
+    unsigned learn_count;
+
+    /* Lock state machine. The window is centred on the predicted trigger
+     * position; period is estimated from edge to edge. */
+    pulse_state_t state;
+    double nominal_period;
+    double tolerance;
+    double period;
+    bool have_edge;
+    double last_edge;
+    unsigned good_intervals;
+    uint64_t window_base;
+    uint64_t predicted;
+    uint64_t window_half;
+    bool window_hit;
+    unsigned consecutive_missed;
+    uint64_t missed;
+    uint64_t last_missed;
+    uint64_t glitches;
+    uint64_t acquisitions;
+    uint64_t lost;
+
+    float block_min;
+    float block_max;
+    uint64_t dropped;
+};
+
+void pulse_detector_default_config(pulse_detector_config_t *config) {
+    config->sample_rate = 48000.0;
+    config->ticks_per_second = 1e9;
+    config->threshold = 0.5f;
+    config->holdoff = 0.5;
+    config->pulse_window = 48;
+    config->mode = PULSE_MODE_THRESHOLD;
+    config->cfd_fraction = 0.5f;
+    config->interp = PULSE_INTERP_LINEAR;
+    config->pre_trigger = 16;
+    config->template_len = 32;
+    config->template_learn = 8;
+    config->track = true;
+    config->period = 1.0;
+    config->track_window = 0.0005;
+    config->track_tolerance = 0.001;
+    config->acquire_pulses = 3;
+    config->max_missed = 5;
+    config->sanity_stride = 16;
+    config->level_stats = true;
+}
+
+pulse_detector_t *pulse_detector_create(const pulse_detector_config_t *config) {
+    if (config == NULL || config->sample_rate <= 0.0 || config->ticks_per_second <= 0.0) {
+        return NULL;
+    }
+    if (config->mode != PULSE_MODE_THRESHOLD &&
+        (config->cfd_fraction <= 0.0f || config->cfd_fraction >= 1.0f || config->pulse_window < 2)) {
+        return NULL;
+    }
+    if (config->mode == PULSE_MODE_MATCHED &&
+        (config->template_len < 2 || config->pre_trigger < TEMPLATE_LEAD + LEARN_MARGIN ||
+         config->template_len + 2 * LEARN_MARGIN > config->pulse_window)) {
+        return NULL;
+    }
+
+    pulse_detector_t *det = calloc(1, sizeof(pulse_detector_t));
+    if (det == NULL) {
+        return NULL;
+    }
+
+    det->config = *config;
+    det->ticks_per_sample = config->ticks_per_second / config->sample_rate;
+    det->holdoff_samples = (uint64_t)(config->holdoff * config->sample_rate);
+    det->nominal_period = config->period * config->sample_rate;
+    det->tolerance = config->track_tolerance * config->sample_rate;
+    det->window_base = (uint64_t)(config->track_window * config->sample_rate) + 1;
+
+    det->tail = calloc(config->pre_trigger + 1, sizeof(float));
+    det->pulse_buf = calloc(config->pre_trigger + 1 + config->pulse_window, sizeof(float));
+    if (det->tail == NULL || det->pulse_buf == NULL) {
+        pulse_detector_destroy(det);
+        return NULL;
+    }
+
+    if (config->mode == PULSE_MODE_MATCHED) {
+        det->weights = calloc(config->template_len, sizeof(float));
+        det->corr_in = calloc(config->template_len - 1 + CORR_CHUNK, sizeof(float));
+        det->corr_out = calloc(CORR_CHUNK, sizeof(float));
+        det->learn_sum = calloc(config->template_len + 2 * LEARN_MARGIN, sizeof(float));
+        if (det->weights == NULL || det->corr_in == NULL || det->corr_out == NULL || det->learn_sum == NULL) {
+            pulse_detector_destroy(det);
+            return NULL;
+        }
+    }
+
+    pulse_detector_reset(det);
+    return det;
+}
+
+void pulse_detector_reset(pulse_detector_t *det) {
+    det->pos = 0;
+    det->block_time = 0;
+    det->block_start = 0;
+    det->have_last = false;
+    det->last_pulse_pos = 0;
+    det->seq = 0;
+    det->tail_valid = 0;
+    det->pending = false;
+    det->pending_remaining = 0;
+    det->pending_gap = 0;
+    memset(&det->pending_event, 0, sizeof(det->pending_event));
+    det->pulse_len = 0;
+    det->corr_hist_valid = 0;
+    det->state = PULSE_STATE_ACQUIRE;
+    det->period = det->nominal_period;
+    det->have_edge = false;
+    det->last_edge = 0.0;
+    det->good_intervals = 0;
+    det->predicted = 0;
+    det->window_half = 0;
+    det->window_hit = false;
+    det->consecutive_missed = 0;
+    det->missed = 0;
+    det->last_missed = 0;
+    det->glitches = 0;
+    det->acquisitions = 0;
+    det->lost = 0;
+    det->block_min = 0.0f;
+    det->block_max = 0.0f;
+    det->dropped = 0;
+}
+
+int pulse_detector_parse_mode(const char *name, pulse_mode_t *mode) {
+    if (strcmp(name, "threshold") == 0) {
+        *mode = PULSE_MODE_THRESHOLD;
+    } else if (strcmp(name, "cfd") == 0) {
+        *mode = PULSE_MODE_CFD;
+    } else if (strcmp(name, "matched") == 0) {
+        *mode = PULSE_MODE_MATCHED;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int pulse_detector_parse_interp(const char *name, pulse_interp_t *interp) {
+    if (strcmp(name, "linear") == 0) {
+        *interp = PULSE_INTERP_LINEAR;
+    } else if (strcmp(name, "cubic") == 0) {
+        *interp = PULSE_INTERP_CUBIC;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+/* Index where t[] first reaches fraction of peak, interpolated linearly */
+static double rising_crossing(const float *t, unsigned peak, float target) {
+    unsigned j = peak;
+    while (j > 0 && t[j - 1] >= target) {
+        j--;
+    }
+    if (j == 0) {
+        return 0.0;
+    }
+    return (j - 1) + (target - t[j - 1]) / (double)(t[j] - t[j - 1]);
+}
+
+/* Set the filter weights from a pulse shape, with the origin at its CFD
+ * crossing. Returns -1 if the shape is all zeros. */
+static int set_weights(pulse_detector_t *det, const float *pulse, size_t len) {
+    /* Scale to a positive peak of 1 and weight by 1/energy, so that the
+     * filter output for a matching pulse equals the pulse amplitude */
+    unsigned peak = 0;
+    for (unsigned k = 1; k < len; k++) {
+        if (fabsf(pulse[k]) > fabsf(pulse[peak])) {
+            peak = k;
+        }
+    }
+    if (pulse[peak] == 0.0f) {
+        return -1;
+    }
+    float scale = 1.0f / pulse[peak];
+    double energy = 0.0;
+    for (unsigned k = 0; k < len; k++) {
+        det->weights[k] = pulse[k] * scale;
+        energy += (double)det->weights[k] * det->weights[k];
+    }
+    det->template_origin = rising_crossing(det->weights, peak, det->config.cfd_fraction);
+    for (unsigned k = 0; k < len; k++) {
+        det->weights[k] = (float)(det->weights[k] / energy);
+    }
+    return 0;
+}
+
+/* Switch detection over to the matched filter output */
+static void activate_template(pulse_detector_t *det) {
+    /* Pulses triggered on the raw stream cannot be finished on the
+     * filter output, so start detection afresh */
+    det->matched = true;
+    det->pending = false;
+    if (det->have_last) {
+        det->last_pulse_pos = det->last_pulse_pos > det->pending_gap ? det->last_pulse_pos - det->pending_gap : 0;
+    }
+    det->pending_gap = 0;
+    det->tail_valid = 0;
+    det->learn_count = 0;
+
+    /* Trigger positions on the filter output differ from the raw stream */
+    if (det->state != PULSE_STATE_ACQUIRE) {
+        det->lost++;
+    }
+    det->state = PULSE_STATE_ACQUIRE;
+    det->have_edge = false;
+    det->good_intervals = 0;
+}
+
+int pulse_detector_set_template(pulse_detector_t *det, const float *pulse, size_t len) {
+    if (det->config.mode != PULSE_MODE_MATCHED || len != det->config.template_len) {
+        return -1;
+    }
+    if (set_weights(det, pulse, len) < 0) {
+        return -1;
+    }
+    activate_template(det);
+    return 0;
+}
+
+double pulse_detector_template_origin(const pulse_detector_t *det) {
+    return det->template_origin;
+}
+
+int pulse_detector_set_template_origin(pulse_detector_t *det, double origin) {
+    if (!det->matched) {
+        return -1;
+    }
+    det->template_origin = origin;
+    return 0;
+}
+
+/* Build the template from the averaged pulses. A correlation peak is not
+ * generally at exact alignment when the pulse extends beyond the template
+ * (the RC decay does), so the origin is calibrated by running the filter
+ * over the averaged pulse and measuring where its output peaks relative to
+ * the averaged CFD crossing. */
+static void finish_learning(pulse_detector_t *det) {
+    const float *avg = det->learn_sum;
+    unsigned len = det->config.template_len;
+    unsigned avg_len = len + 2 * LEARN_MARGIN;
+
+    if (set_weights(det, avg + LEARN_MARGIN, len) < 0) {
+        det->learn_count = 0;
+        return;
+    }
+
+    float corr[2 * LEARN_MARGIN + 1];
+    unsigned best = 0;
+    for (unsigned n = 0; n <= 2 * LEARN_MARGIN; n++) {
+        float acc = 0.0f;
+        for (unsigned k = 0; k < len; k++) {
+            acc += det->weights[k] * avg[n + k];
+        }
+        corr[n] = acc;
+        if (corr[n] > corr[best]) {
+            best = n;
+        }
+    }
+    double peak_pos = best;
+    if (best > 0 && best < 2 * LEARN_MARGIN) {
+        double denom = corr[best - 1] - 2.0 * corr[best] + corr[best + 1];
+        if (denom < 0.0) {
+            peak_pos += 0.5 * (corr[best - 1] - corr[best + 1]) / denom;
+        }
+    }
+
+    unsigned avg_peak = 0;
+    for (unsigned k = 1; k < avg_len; k++) {
+        if (avg[k] > avg[avg_peak]) {
+            avg_peak = k;
+        }
+    }
+    double crossing = rising_crossing(avg, avg_peak, det->config.cfd_fraction * avg[avg_peak]);
+    det->template_origin = crossing - peak_pos;
+    activate_template(det);
+}
+
+size_t pulse_detector_get_template(const pulse_detector_t *det, float *pulse, size_t max_len) {
+    if (!det->matched || max_len < det->config.template_len) {
+        return 0;
+    }
+    /* Undo the 1/energy weighting; the weights' own energy is 1/energy */
+    double weight_energy = 0.0;
+    for (unsigned k = 0; k < det->config.template_len; k++) {
+        weight_energy += (double)det->weights[k] * det->weights[k];
+    }
+    for (unsigned k = 0; k < det->config.template_len; k++) {
+        pulse[k] = (float)(det->weights[k] / weight_energy);
+    }
+    return det->config.template_len;
+}
+
+bool pulse_detector_template_ready(const pulse_detector_t *det) {
+    return det->matched;
+}
+
+/* Find where the pulse in pulse_buf first reaches cfd_fraction of its peak,
+ * as a fractional index into pulse_buf. Also returns the peak level. */
+static double cfd_crossing(const pulse_detector_t *det, float *peak_level) {
+    const float *buf = det->pulse_buf;
+    unsigned pre = det->config.pre_trigger;
+    unsigned len = det->pulse_len;
+    float sign = buf[pre] < 0.0f ? -1.0f : 1.0f;
+
+    unsigned peak = pre;
+    for (unsigned k = pre + 1; k < len; k++) {
+        if (sign * buf[k] > sign * buf[peak]) {
+            peak = k;
+        }
+    }
+    *peak_level = sign * buf[peak];
+
+    /* Walk back from the peak to the last sample below the target */
+    float target = det->config.cfd_fraction * *peak_level;
+    unsigned j = peak;
+    while (j > 0 && sign * buf[j - 1] >= target) {
+        j--;
+    }
+    if (j == 0) {
+        /* Crossing happened before the retained history */
+        return 0.0;
+    }
+
+    double y0 = sign * buf[j - 1];
+    double y1 = sign * buf[j];
+    double x = (target - y0) / (y1 - y0);
+
+    if (det->config.interp == PULSE_INTERP_CUBIC && j >= 2 && j + 1 < len) {
+        /* Lagrange cubic through buf[j-2..j+1], with x=0 at j-1 and x=1 at j;
+         * refine the linear estimate with a few Newton steps */
+        double p0 = sign * buf[j - 2], p1 = y0, p2 = y1, p3 = sign * buf[j + 1];
+        double c1 = -p0 / 3.0 - p1 / 2.0 + p2 - p3 / 6.0;
+        double c2 = p0 / 2.0 - p1 + p2 / 2.0;
+        double c3 = -p0 / 6.0 + p1 / 2.0 - p2 / 2.0 + p3 / 6.0;
+        for (int iter = 0; iter < 4; iter++) {
+            double f = p1 + x * (c1 + x * (c2 + x * c3)) - target;
+            double d = c1 + x * (2.0 * c2 + x * 3.0 * c3);
+            if (d <= 0.0) {
+                break;
+            }
+            x -= f / d;
+            if (x < 0.0) x = 0.0;
+            if (x > 1.0) x = 1.0;
+        }
+    }
+
+    return (j - 1) + x;
+}
+
+/* Find the peak of the matched filter output in pulse_buf, with parabolic
+ * interpolation, as a fractional index into pulse_buf */
+static double correlation_peak(const pulse_detector_t *det, float *peak_level) {
+    const float *buf = det->pulse_buf;
+    unsigned pre = det->config.pre_trigger;
+    unsigned len = det->pulse_len;
+    float sign = buf[pre] < 0.0f ? -1.0f : 1.0f;
+
+    unsigned peak = pre;
+    for (unsigned k = pre + 1; k < len; k++) {
+        if (sign * buf[k] > sign * buf[peak]) {
+            peak = k;
+        }
+    }
+    *peak_level = sign * buf[peak];
+
+    if (peak == 0 || peak + 1 >= len) {
+        return peak;
+    }
+    double ym = sign * buf[peak - 1], y0 = sign * buf[peak], yp = sign * buf[peak + 1];
+    double denom = ym - 2.0 * y0 + yp;
+    return denom < 0.0 ? peak + 0.5 * (ym - yp) / denom : peak;
+}
+
+/* Add the pulse in pulse_buf, aligned on its CFD crossing, to the template
+ * being learned */
+static void learn_pulse(pulse_detector_t *det, double crossing) {
+    unsigned len = det->config.template_len + 2 * LEARN_MARGIN;
+    long first = lround(crossing) - TEMPLATE_LEAD - LEARN_MARGIN;
+    if (first < 0 || first + len > det->pulse_len) {
+        return;
+    }
+    float sign = det->pulse_buf[det->config.pre_trigger] < 0.0f ? -1.0f : 1.0f;
+    for (unsigned k = 0; k < len; k++) {
+        det->learn_sum[k] += sign * det->pulse_buf[first + k];
+    }
+    det->learn_count++;
+}
+
+/* Centre the scan window on a predicted trigger position, widening it by
+ * a factor of two for each consecutive missed pulse */
+static void set_window(pulse_detector_t *det, uint64_t predicted, unsigned widen) {
+    uint64_t half = det->window_base << (widen < 8 ? widen : 8);
+    uint64_t limit = (uint64_t)(det->period / 4);
+    det->predicted = predicted;
+    det->window_half = half < limit ? half : limit;
+    det->window_hit = false;
+}
+
+static void drop_lock(pulse_detector_t *det) {
+    det->state = PULSE_STATE_ACQUIRE;
+    det->good_intervals = 0;
+    det->consecutive_missed = 0;
+    det->have_edge = false;
+    det->lost++;
+}
+
+/* Move the stream positions remembered by the tracker back by a gap, so
+ * that they line up with the samples after it */
+static void skip_samples(pulse_detector_t *det, uint64_t samples) {
+    if (det->have_last) {
+        det->last_pulse_pos = det->last_pulse_pos > samples ? det->last_pulse_pos - samples : 0;
+    }
+    if (det->have_edge) {
+        det->last_edge -= (double)samples;
+    }
+    if (!det->config.track || det->state == PULSE_STATE_ACQUIRE) {
+        return;
+    }
+
+    /* Move the window with the signal, on past any pulses that were in
+     * the lost samples */
+    uint64_t period = (uint64_t)llround(det->period);
+    uint64_t predicted = det->predicted;
+    while (predicted < samples || predicted - samples + det->window_half < det->pos) {
+        predicted += period;
+    }
+    det->predicted = predicted - samples;
+}
+
+void pulse_detector_gap(pulse_detector_t *det, uint64_t samples) {
+    /* A pulse being measured was timed before the gap, so the tracker
+     * takes it in first and then skips */
+    if (det->pending) {
+        det->pending_gap += samples;
+    } else if (samples > 0) {
+        skip_samples(det, samples);
+    }
+}
+
+/* Update the lock state with a completed pulse */
+static void track_pulse(pulse_detector_t *det, double edge, uint64_t trigger_pos) {
+    if (!det->config.track) {
+        return;
+    }
+
+    if (det->have_edge) {
+        double interval = edge - det->last_edge;
+        if (det->state == PULSE_STATE_ACQUIRE) {
+            if (fabs(interval - det->nominal_period) <= det->tolerance) {
+                det->period = interval;
+                if (++det->good_intervals >= det->config.acquire_pulses) {
+                    det->state = PULSE_STATE_TRACK;
+                    det->acquisitions++;
+                }
+            } else {
+                det->good_intervals = 0;
+            }
+        } else {
+            /* The interval spans any pulses missed in between */
+            double periods = round(interval / det->period);
+            if (periods >= 1.0) {
+                det->period += (interval / periods - det->period) / 8.0;
+            }
+            det->state = PULSE_STATE_TRACK;
+            det->consecutive_missed = 0;
+        }
+    }
+    det->have_edge = true;
+    det->last_edge = edge;
+
+    if (det->state != PULSE_STATE_ACQUIRE) {
+        set_window(det, trigger_pos + (uint64_t)llround(det->period), 0);
+    }
+}
+
+/* Account for windows that have passed without a pulse, given that the
+ * detection stream has been processed up to position end */
+static void check_window(pulse_detector_t *det, uint64_t end) {
+    while (det->state != PULSE_STATE_ACQUIRE && !det->pending && !det->window_hit &&
+           end > det->predicted + det->window_half) {
+        det->missed++;
+        det->last_missed = det->predicted;
+        if (++det->consecutive_missed > det->config.max_missed) {
+            drop_lock(det);
+            break;
+        }
+        det->state = PULSE_STATE_HOLDOVER;
+        set_window(det, det->predicted + (uint64_t)llround(det->period), det->consecutive_missed);
+    }
+}
+
+static void emit(pulse_detector_t *det, pulse_event_t *events, size_t max_events, size_t *n_events) {
+    pulse_event_t *ev = &det->pending_event;
+    double start = ev->sample_pos - det->config.pre_trigger;
+
+    if (det->matched) {
+        ev->sample_pos = start + correlation_peak(det, &ev->level) + det->template_origin;
+    } else if (det->config.mode != PULSE_MODE_THRESHOLD) {
+        double crossing = cfd_crossing(det, &ev->level);
+        ev->sample_pos = start + crossing;
+        if (det->config.mode == PULSE_MODE_MATCHED) {
+            learn_pulse(det, crossing);
+        }
+    }
+    double offset = (ev->sample_pos - (double)det->pending_ref_start) * det->ticks_per_sample;
+    ev->host_time = det->pending_ref_time + (int64_t)llround(offset);
+
+    det->pending = false;
+    track_pulse(det, ev->sample_pos, det->last_pulse_pos);
+    if (det->pending_gap > 0) {
+        skip_samples(det, det->pending_gap);
+        det->pending_gap = 0;
+    }
+
+    if (*n_events < max_events) {
+        events[(*n_events)++] = *ev;
+    } else {
+        det->dropped++;
+    }
+}
+
+/* Start measuring a pulse that triggered on d[i], where d[0] is at
+ * absolute position d_start of the detection stream */
+static void trigger(pulse_detector_t *det, const float *d, size_t i, uint64_t d_start, size_t block_size) {
+    unsigned pre = det->config.pre_trigger;
+    uint64_t pos = d_start + i;
+
+    pulse_event_t *ev = &det->pending_event;
+    ev->seq = ++det->seq;
+    ev->sample_pos = (double)pos;
+    ev->level = fabsf(d[i]);
+    ev->block_index = pos > det->block_start ? (uint32_t)(pos - det->block_start) : 0;
+    ev->block_size = (uint32_t)block_size;
+    ev->state = det->state;
+    det->pending_ref_time = det->block_time;
+    det->pending_ref_start = det->block_start;
+
+    /* Samples before the trigger come from this chunk or the saved tail */
+    for (unsigned k = 0; k < pre; k++) {
+        size_t back = pre - k;
+        if (back <= i) {
+            det->pulse_buf[k] = d[i - back];
+        } else if (back - i <= det->tail_valid) {
+            det->pulse_buf[k] = det->tail[pre - (back - i)];
+        } else {
+            det->pulse_buf[k] = 0.0f;
+        }
+    }
+    det->pulse_buf[pre] = d[i];
+    det->pulse_len = pre + 1;
+
+    det->pending = true;
+    det->pending_remaining = det->config.pulse_window;
+}
+
+/* Remember the end of the chunk for pulses that trigger early in the next one */
+static void save_tail(pulse_detector_t *det, const float *d, size_t count) {
+    unsigned pre = det->config.pre_trigger;
+    if (pre == 0) {
+        return;
+    }
+    if (count >= pre) {
+        memcpy(det->tail, d + count - pre, pre * sizeof(float));
+        det->tail_valid = pre;
+    } else {
+        memmove(det->tail, det->tail + count, (pre - count) * sizeof(float));
+        memcpy(det->tail + pre - count, d, count * sizeof(float));
+        det->tail_valid += (unsigned)count;
+        if (det->tail_valid > pre) {
+            det->tail_valid = pre;
+        }
+    }
+}
+
+/* Range of chunk indices [*lo, *hi) that fall inside the scan window */
+static void window_range(const pulse_detector_t *det, uint64_t d_start, size_t count, size_t *lo, size_t *hi) {
+    uint64_t ws = det->predicted > det->window_half ? det->predicted - det->window_half : 0;
+    uint64_t we = det->predicted + det->window_half + 1;
+    uint64_t d_end = d_start + count;
+
+    *lo = ws <= d_start ? 0 : ws >= d_end ? count : (size_t)(ws - d_start);
+    *hi = we <= d_start ? 0 : we >= d_end ? count : (size_t)(we - d_start);
+}
+
+/* Run trigger and pulse measurement over a chunk of the detection stream.
+ * While acquiring, first_over is the index of the first sample over the
+ * threshold, or count, and the stream between pulses is skipped with the
+ * vectorized scan. When locked only the window is scanned. */
+static void detect(pulse_detector_t *det, const float *d, size_t count, uint64_t d_start, size_t block_size,
+                   size_t first_over, pulse_event_t *events, size_t max_events, size_t *n_events) {
+    float threshold = det->config.threshold;
+    size_t next_over = first_over;
+
+    for (size_t i = 0; i < count; i++) {
+        if (det->pending) {
+            float level = fabsf(d[i]);
+            det->pulse_buf[det->pulse_len++] = d[i];
+            if (level > det->pending_event.level) {
+                det->pending_event.level = level;
+            }
+            if (--det->pending_remaining == 0) {
+                emit(det, events, max_events, n_events);
+            }
+            continue;
+        }
+
+        if (det->state == PULSE_STATE_ACQUIRE) {
+            /* next_over is exact as long as it has not been passed */
+            if (next_over < i) {
+                next_over = i + level_find_over(d + i, count - i, threshold);
+            }
+        } else {
+            size_t lo, hi;
+            window_range(det, d_start, count, &lo, &hi);
+            if (lo < i) {
+                lo = i;
+            }
+            if (lo >= hi) {
+                break;
+            }
+            next_over = lo + level_find_over(d + lo, hi - lo, threshold);
+            if (next_over >= hi) {
+                break;
+            }
+        }
+        if (next_over >= count) {
+            break;
+        }
+        i = next_over;
+
+        uint64_t pos = d_start + i;
+        if (det->have_last && pos - det->last_pulse_pos < det->holdoff_samples) {
+            continue;
+        }
+
+        det->have_last = true;
+        det->last_pulse_pos = pos;
+        det->window_hit = true;
+
+        trigger(det, d, i, d_start, block_size);
+        if (det->pending_remaining == 0) {
+            emit(det, events, max_events, n_events);
+        }
+    }
+
+    save_tail(det, d, count);
+    check_window(det, d_start + count);
+}
+
+/* Run the matched filter over a chunk of raw samples starting at absolute
+ * position start; output position n is the template aligned at n */
+static void correlate(pulse_detector_t *det, const float *samples, size_t count, uint64_t start,
+                      size_t block_size, pulse_event_t *events, size_t max_events, size_t *n_events) {
+    unsigned len = det->config.template_len;
+    unsigned hist = len - 1;
+
+    memcpy(det->corr_in + hist, samples, count * sizeof(float));
+
+    /* Until the history is full, the first outputs would see zeros */
+    size_t skip = hist - det->corr_hist_valid;
+    if (skip > count) {
+        skip = count;
+    }
+    uint64_t d_start = start - hist + skip;
+    size_t d_count = count - skip;
+
+    /* When locked, only the outputs that detection can look at are
+     * computed: a pulse being measured, the window and the samples
+     * before it that become pre-trigger history */
+    size_t lo = 0, hi = d_count;
+    if (det->state != PULSE_STATE_ACQUIRE && d_count > 0) {
+        size_t wlo, whi;
+        window_range(det, d_start, d_count, &wlo, &whi);
+        size_t margin = det->config.pre_trigger;
+        lo = wlo > margin ? wlo - margin : 0;
+        hi = whi + det->config.pulse_window < d_count ? whi + det->config.pulse_window : d_count;
+        if (det->pending) {
+            lo = 0;
+            if (hi < det->pending_remaining) {
+                hi = det->pending_remaining < d_count ? det->pending_remaining : d_count;
+            }
+        }
+        if (lo > hi) {
+            lo = hi;
+        }
+        memset(det->corr_out + skip, 0, lo * sizeof(float));
+        memset(det->corr_out + skip + hi, 0, (d_count - hi) * sizeof(float));
+    }
+
+    for (size_t n = skip + lo; n < skip + hi; n++) {
+        const float *x = det->corr_in + n;
+        float acc = 0.0f;
+        for (unsigned k = 0; k < len; k++) {
+            acc += det->weights[k] * x[k];
+        }
+        det->corr_out[n] = acc;
+    }
+    if (d_count > 0) {
+        size_t first_over = det->state == PULSE_STATE_ACQUIRE ?
+            level_find_over(det->corr_out + skip, d_count, det->config.threshold) : 0;
+        detect(det, det->corr_out + skip, d_count, d_start, block_size, first_over,
+               events, max_events, n_events);
+    }
+
+    memmove(det->corr_in, det->corr_in + count, hist * sizeof(float));
+    det->corr_hist_valid += (unsigned)count;
+    if (det->corr_hist_valid > hist) {
+        det->corr_hist_valid = hist;
+    }
+}
+
+/* When locked, look for pulse-level samples outside the window with a
+ * strided scan of the block once it has been processed. Samples within
+ * the holdoff after the last trigger belong to that pulse's decay. */
+static void sanity_check(pulse_detector_t *det, const float *samples, size_t count) {
+    unsigned stride = det->config.sanity_stride;
+    if (stride == 0 || det->state == PULSE_STATE_ACQUIRE) {
+        return;
+    }
+
+    size_t lo, hi;
+    window_range(det, det->block_start, count, &lo, &hi);
+    for (size_t i = 0; i < count; i += stride) {
+        if (fabsf(samples[i]) <= det->config.threshold || (i >= lo && i < hi)) {
+            continue;
+        }
+        uint64_t pos = det->block_start + i;
+        if (det->have_last && pos >= det->last_pulse_pos && pos - det->last_pulse_pos < det->holdoff_samples) {
+            continue;
+        }
+        det->glitches++;
+        break;
+    }
+}
+
+size_t pulse_detector_process(pulse_detector_t *det, const float *samples, size_t count,
+                              uint64_t host_time, pulse_event_t *events, size_t max_events) {
+    size_t n_events = 0;
+    size_t first_over = 0;
+
+    det->block_time = host_time;
+    det->block_start = det->pos;
+
+    if (det->config.level_stats) {
+        level_stats_t stats;
+        level_stats(samples, count, det->config.threshold, &stats);
+        det->block_min = stats.min;
+        det->block_max = stats.max;
+        first_over = stats.first_over;
+    } else if (det->state == PULSE_STATE_ACQUIRE && det->config.mode != PULSE_MODE_MATCHED) {
+        first_over = level_find_over(samples, count, det->config.threshold);
+    }
+
+    if (det->config.mode == PULSE_MODE_MATCHED) {
+        for (size_t done = 0; done < count; ) {
+            size_t n = count - done < CORR_CHUNK ? count - done : CORR_CHUNK;
+            if (det->matched) {
+                correlate(det, samples + done, n, det->block_start + done, count, events, max_events, &n_events);
+            } else {
+                /* Learning: time pulses in CFD mode, keeping filter history */
+                size_t chunk_over = det->state == PULSE_STATE_ACQUIRE ?
+                    level_find_over(samples + done, n, det->config.threshold) : 0;
+                detect(det, samples + done, n, det->block_start + done, count, chunk_over,
+                       events, max_events, &n_events);
+                unsigned hist = det->config.template_len - 1;
+                size_t keep = n < hist ? n : hist;
+                memmove(det->corr_in, det->corr_in + keep, (hist - keep) * sizeof(float));
+                memcpy(det->corr_in + hist - keep, samples + done + n - keep, keep * sizeof(float));
+                det->corr_hist_valid += (unsigned)keep;
+                if (det->corr_hist_valid > hist) {
+                    det->corr_hist_valid = hist;
+                }
+                /* Switch over between chunks so no pulse spans both streams */
+                if (det->learn_count >= det->config.template_learn) {
+                    finish_learning(det);
+                }
+            }
+            done += n;
+        }
+    } else {
+        detect(det, samples, count, det->block_start, count, first_over,
+               events, max_events, &n_events);
+    }
+
+    sanity_check(det, samples, count);
+
+    det->pos += count;
+    return n_events;
+}
+
+void pulse_detector_block_levels(const pulse_detector_t *det, float *min_level, float *max_level) {
+    if (min_level) *min_level = det->block_min;
+    if (max_level) *max_level = det->block_max;
+}
+
+uint64_t pulse_detector_samples(const pulse_detector_t *det) {
+    return det->pos;
+}
+
+uint64_t pulse_detector_dropped(const pulse_detector_t *det) {
+    return det->dropped;
+}
+
+void pulse_detector_status(const pulse_detector_t *det, pulse_detector_status_t *status) {
+    status->state = det->state;
+    status->period = det->period;
+    status->consecutive_missed = det->consecutive_missed;
+    status->missed = det->missed;
+    status->last_missed = det->last_missed;
+    status->glitches = det->glitches;
+    status->acquisitions = det->acquisitions;
+    status->lost = det->lost;
+}
+
+const char *pulse_detector_state_name(pulse_state_t state) {
+    switch (state) {
+    case PULSE_STATE_ACQUIRE:
+        return "acquire";
+    case PULSE_STATE_TRACK:
+        return "track";
+    case PULSE_STATE_HOLDOVER:
+        return "holdover";
+    }
+    return "unknown";
+}
+
+int pulse_detector_load_template(pulse_detector_t *det, const char *path) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        perror(path);
+        return -1;
+    }
+
+    float *pulse = calloc(det->config.template_len, sizeof(float));
+    if (pulse == NULL) {
+        fclose(fp);
+        return -1;
+    }
+    size_t len = 0;
+    bool have_origin = false;
+    double origin = 0.0;
+    char line[128];
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        if (sscanf(line, "# origin %lf", &origin) == 1) {
+            have_origin = true;
+        } else if (line[0] != '#' && len < det->config.template_len && sscanf(line, "%f", &pulse[len]) == 1) {
+            len++;
+        }
+    }
+    fclose(fp);
+
+    int result = pulse_detector_set_template(det, pulse, len);
+    if (result < 0) {
+        fprintf(stderr, "%s: expected %u template samples\n", path, det->config.template_len);
+    } else if (have_origin) {
+        pulse_detector_set_template_origin(det, origin);
+    }
+    free(pulse);
+    return result;
+}
+
+int pulse_detector_save_template(const pulse_detector_t *det, const char *path) {
+    float *pulse = calloc(det->config.template_len, sizeof(float));
+    if (pulse == NULL) {
+        return -1;
+    }
+    size_t len = pulse_detector_get_template(det, pulse, det->config.template_len);
+    if (len == 0) {
+        free(pulse);
+        return -1;
+    }
+
+    FILE *fp = fopen(path, "w");
+    if (fp == NULL) {
+        perror(path);
+        free(pulse);
+        return -1;
+    }
+    fprintf(fp, "# origin %.6f\n", det->template_origin);
+    for (size_t k = 0; k < len; k++) {
+        fprintf(fp, "%.7g\n", pulse[k]);
+    }
+    free(pulse);
+    return fclose(fp) == 0 ? 0 : -1;
+}
+
+void pulse_detector_destroy(pulse_detector_t *det) {
+    if (det == NULL) {
+        return;
+    }
+    free(det->tail);
+    free(det->pulse_buf);
+    free(det->weights);
+    free(det->corr_in);
+    free(det->corr_out);
+    free(det->learn_sum);
+    free(det);
+}
@@ -0,0 +1,173 @@
+#ifndef PULSE_DETECTOR_H
+#define PULSE_DETECTOR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Streaming PPS pulse detector.
+ *
+ * The detector is fed consecutive blocks of mono float samples, each with the
+ * host time of its first sample. All state (holdoff, a pulse that is still
+ * being measured) is carried across block boundaries, so a pulse that starts
+ * at the end of one block and peaks in the next is handled correctly.
+ * Nothing in here depends on CoreAudio; it runs equally well on recorded data.
+ */
+
+typedef struct pulse_detector pulse_detector_t;
+
+typedef enum {
+    PULSE_MODE_THRESHOLD,      /* edge is the first sample over the threshold */
+    PULSE_MODE_CFD,            /* edge is where the pulse crosses a fraction of its peak */
+    PULSE_MODE_MATCHED         /* stream is correlated against a pulse template; the edge is
+                                  the template's CFD crossing at the correlation peak */
+} pulse_mode_t;
+
+typedef enum {
+    PULSE_INTERP_LINEAR,       /* straight line between the samples either side of the crossing */
+    PULSE_INTERP_CUBIC         /* cubic through the two samples either side of the crossing */
+} pulse_interp_t;
+
+typedef enum {
+    PULSE_STATE_ACQUIRE,       /* no lock: every sample is scanned */
+    PULSE_STATE_TRACK,         /* locked: only a window around the predicted pulse is scanned */
+    PULSE_STATE_HOLDOVER       /* locked, but recent pulses were missed; the window widens */
+} pulse_state_t;
+
+typedef struct {
+    double sample_rate;        /* samples per second */
+    double ticks_per_second;   /* host clock ticks per second */
+    float threshold;           /* absolute level that triggers a pulse */
+    double holdoff;            /* minimum time between pulses (seconds) */
+    unsigned pulse_window;     /* samples examined after the trigger to measure the pulse */
+    pulse_mode_t mode;
+    float cfd_fraction;        /* fraction of the peak that defines the edge in CFD mode */
+    pulse_interp_t interp;     /* interpolation between samples in CFD mode */
+    unsigned pre_trigger;      /* samples before the trigger kept for CFD mode */
+    unsigned template_len;     /* samples in the matched filter template */
+    unsigned template_learn;   /* pulses averaged into a learned template */
+    bool track;                /* lock on to the pulse train and scan only around predicted pulses */
+    double period;             /* nominal time between pulses (seconds) */
+    double track_window;       /* half width of the window scanned when locked (seconds) */
+    double track_tolerance;    /* allowed error in a pulse interval while acquiring (seconds) */
+    unsigned acquire_pulses;   /* consecutive good intervals needed to lock */
+    unsigned max_missed;       /* consecutive missed pulses before lock is dropped */
+    unsigned sanity_stride;    /* when locked, check every Nth sample outside the window for
+                                  stray pulses (0 disables) */
+    bool level_stats;          /* compute block levels every block, even when locked */
+} pulse_detector_config_t;
+
+typedef struct {
+    pulse_state_t state;
+    double period;             /* estimated samples per pulse period */
+    unsigned consecutive_missed;
+    uint64_t missed;           /* pulses that did not arrive in their window */
+    uint64_t last_missed;      /* predicted position of the most recent missed pulse */
+    uint64_t glitches;         /* blocks with pulse-level signal outside the window */
+    uint64_t acquisitions;     /* times lock has been gained */
+    uint64_t lost;             /* times lock has been dropped */
+} pulse_detector_status_t;
+
+typedef struct {
+    uint64_t seq;              /* pulse sequence number, starting at 1 */
+    double sample_pos;         /* absolute sample position of the edge since the stream started;
+                                  fractional in CFD mode */
+    uint64_t host_time;        /* host time of the edge */
+    float level;               /* peak absolute level of the pulse */
+    uint32_t block_index;      /* index of the trigger sample within its block */
+    uint32_t block_size;       /* number of samples in that block */
+    pulse_state_t state;       /* lock state when the pulse triggered */
+} pulse_event_t;
+
+/* Fill in the default configuration (48kHz, threshold 0.5, 0.5s holdoff,
+ * threshold mode, tracking a 1 PPS signal) */
+void pulse_detector_default_config(pulse_detector_config_t *config);
+
+/* Create a new detector
+ * Returns NULL on error
+ */
+pulse_detector_t *pulse_detector_create(const pulse_detector_config_t *config);
+
+/* Process a block of samples
+ * samples, count: the block
+ * host_time: host time of the first sample of the block
+ * events: array that receives completed pulses
+ * max_events: capacity of events
+ * Returns the number of events stored; pulses that do not fit are counted
+ * as dropped.
+ */
+size_t pulse_detector_process(pulse_detector_t *det, const float *samples, size_t count,
+                              uint64_t host_time, pulse_event_t *events, size_t max_events);
+
+/* Get the minimum and maximum sample value in the last block processed.
+ * Unless level_stats is set, these are not updated while locked. */
+void pulse_detector_block_levels(const pulse_detector_t *det, float *min_level, float *max_level);
+
+/* Get the total number of samples processed */
+uint64_t pulse_detector_samples(const pulse_detector_t *det);
+
+/* Get the number of pulses that did not fit in the caller's event array */
+uint64_t pulse_detector_dropped(const pulse_detector_t *det);
+
+/* Get the lock state and counters */
+void pulse_detector_status(const pulse_detector_t *det, pulse_detector_status_t *status);
+
+/* Get the name of a lock state */
+const char *pulse_detector_state_name(pulse_state_t state);
+
+/* Tell the tracker that samples were lost before the next block, as the
+ * sample clock reports with SAMPLE_CLOCK_GAP. Stream positions only count
+ * samples processed, so later pulses arrive that many samples earlier
+ * than predicted; a pulse that fell in the gap is not counted as missed.
+ */
+void pulse_detector_gap(pulse_detector_t *det, uint64_t samples);
+
+/* Forget all stream state; the next block starts a new stream */
+void pulse_detector_reset(pulse_detector_t *det);
+
+/* Parse a mode or interpolation name ("threshold", "cfd", "matched";
+ * "linear", "cubic")
+ * Returns 0 on success, -1 if the name is not recognized
+ */
+int pulse_detector_parse_mode(const char *name, pulse_mode_t *mode);
+int pulse_detector_parse_interp(const char *name, pulse_interp_t *interp);
+
+/* Matched mode starts by timing pulses in CFD mode while it averages the
+ * first template_learn of them into a template, unless one is set first.
+ * In matched mode the threshold applies to the filter output, which is
+ * scaled so that a pulse matching the template gives its peak amplitude.
+ */
+
+/* Set the matched filter template
+ * pulse, len: pulse shape; len must equal template_len
+ * Returns 0 on success, -1 on error
+ */
+int pulse_detector_set_template(pulse_detector_t *det, const float *pulse, size_t len);
+
+/* Copy the active template, with its peak normalized to 1
+ * Returns the number of samples copied, 0 if no template is active
+ */
+size_t pulse_detector_get_template(const pulse_detector_t *det, float *pulse, size_t max_len);
+
+/* Get or set the template origin: the position within the template, in
+ * samples, reported as the edge when the filter output peaks. It defaults
+ * to the template's CFD crossing; learning calibrates it.
+ * Setting returns -1 if no template is active.
+ */
+double pulse_detector_template_origin(const pulse_detector_t *det);
+int pulse_detector_set_template_origin(pulse_detector_t *det, double origin);
+
+/* Check whether a template has been set or learned */
+bool pulse_detector_template_ready(const pulse_detector_t *det);
+
+/* Load or save a template as a text file with one sample per line,
+ * preceded by an optional "# origin N" line
+ * Returns 0 on success, -1 on error
+ */
+int pulse_detector_load_template(pulse_detector_t *det, const char *path);
+int pulse_detector_save_template(const pulse_detector_t *det, const char *path);
+
+/* Destroy the detector */
+void pulse_detector_destroy(pulse_detector_t *det);
+
+#endif /* PULSE_DETECTOR_H */
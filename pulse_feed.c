@@ -0,0 +1,294 @@
+#include "pulse_feed.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#define FEED_MAGIC "PPSFEED"
+#define FEED_VERSION 1
+
+/* Attempts at copying the health snapshot before giving up */
+#define HEALTH_RETRIES 1000
+
+/* Sleep between checks when waiting without a futex */
+#define WAIT_POLL_MS 5
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t capacity;
+    _Atomic uint64_t head;     /* sequence number of the newest complete pulse */
+    _Atomic uint32_t notify;   /* low bits of head, for futex waits */
+    uint32_t health_size;
+    _Atomic uint64_t health_seq;  /* odd while the snapshot is being written */
+    pulse_feed_health_t health;
+} feed_header_t;
+
+typedef struct {
+    _Atomic uint64_t seq;      /* 0 while being written */
+    pulse_journal_record_t record;
+} feed_slot_t;
+
+_Static_assert(sizeof(feed_header_t) == 128, "feed header must be 128 bytes");
+_Static_assert(sizeof(feed_slot_t) == 64, "feed slot must be 64 bytes");
+
+struct pulse_feed {
+    int fd;
+    size_t size;
+    feed_header_t *header;
+    feed_slot_t *slots;
+    uint64_t capacity;
+    uint64_t next;             /* writer only */
+};
+
+static size_t feed_size(uint64_t capacity) {
+    return sizeof(feed_header_t) + capacity * sizeof(feed_slot_t);
+}
+
+static bool header_ok(const feed_header_t *header, size_t size) {
+    return memcmp(header->magic, FEED_MAGIC, sizeof(FEED_MAGIC)) == 0
+        && header->version == FEED_VERSION
+        && header->slot_size == sizeof(feed_slot_t)
+        && header->health_size == sizeof(pulse_feed_health_t)
+        && header->capacity > 0
+        && header->capacity <= (size - sizeof(feed_header_t)) / sizeof(feed_slot_t);
+}
+
+static pulse_feed_t *map_feed(int fd, size_t size, bool writable) {
+    pulse_feed_t *feed = calloc(1, sizeof(pulse_feed_t));
+    if (feed == NULL) {
+        return NULL;
+    }
+    void *base = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        free(feed);
+        return NULL;
+    }
+    feed->fd = fd;
+    feed->size = size;
+    feed->header = base;
+    feed->slots = (feed_slot_t *)((char *)base + sizeof(feed_header_t));
+    return feed;
+}
+
+/* Whether a segment of the given size holds a feed of this capacity that a
+ * new writer can take over */
+static bool can_take_over(int fd, size_t size, uint64_t capacity) {
+    if (size < feed_size(capacity)) {
+        return false;
+    }
+    const feed_header_t *header = mmap(NULL, sizeof(feed_header_t), PROT_READ, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        return false;
+    }
+    bool ok = header_ok(header, size) && header->capacity == capacity;
+    munmap((void *)header, sizeof(feed_header_t));
+    return ok;
+}
+
+pulse_feed_t *pulse_feed_create(const char *name, uint64_t capacity) {
+    if (capacity == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    /* macOS rounds the size of a segment up to a page, so an earlier
+     * writer's segment can be larger than the feed */
+    size_t size = feed_size(capacity);
+    bool existing = can_take_over(fd, (size_t)st.st_size, capacity);
+    if (!existing && st.st_size != 0) {
+        /* Some systems can only size a shared memory object once */
+        close(fd);
+        shm_unlink(name);
+        fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            return NULL;
+        }
+    }
+    if (!existing && ftruncate(fd, (off_t)size) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    pulse_feed_t *feed = map_feed(fd, size, true);
+    if (feed == NULL) {
+        close(fd);
+        return NULL;
+    }
+    feed_header_t *header = feed->header;
+    feed->capacity = capacity;
+
+    if (existing) {
+        feed->next = atomic_load_explicit(&header->head, memory_order_relaxed) + 1;
+    } else {
+        memset(feed->slots, 0, capacity * sizeof(feed_slot_t));
+        memset(header, 0, sizeof(*header));
+        memcpy(header->magic, FEED_MAGIC, sizeof(FEED_MAGIC));
+        header->version = FEED_VERSION;
+        header->slot_size = sizeof(feed_slot_t);
+        header->capacity = capacity;
+        header->health_size = sizeof(pulse_feed_health_t);
+        atomic_init(&header->head, 0);
+        atomic_init(&header->notify, 0);
+        atomic_init(&header->health_seq, 0);
+        feed->next = 1;
+    }
+    return feed;
+}
+
+pulse_feed_t *pulse_feed_open(const char *name) {
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < feed_size(1)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pulse_feed_t *feed = map_feed(fd, (size_t)st.st_size, false);
+    if (feed == NULL) {
+        close(fd);
+        return NULL;
+    }
+    if (!header_ok(feed->header, feed->size)) {
+        pulse_feed_close(feed);
+        errno = EINVAL;
+        return NULL;
+    }
+    feed->capacity = feed->header->capacity;
+    return feed;
+}
+
+uint64_t pulse_feed_publish(pulse_feed_t *feed, const pulse_journal_record_t *record) {
+    uint64_t seq = feed->next++;
+    feed_slot_t *slot = &feed->slots[(seq - 1) % feed->capacity];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->record = *record;
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+    atomic_store_explicit(&feed->header->head, seq, memory_order_release);
+    atomic_store_explicit(&feed->header->notify, (uint32_t)seq, memory_order_release);
+#ifdef __linux__
+    /* Readers map the feed read-only, so they can't say whether they are
+     * waiting; one wake per pulse is cheap next to a pulse period */
+    syscall(SYS_futex, &feed->header->notify, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+#endif
+    return seq;
+}
+
+void pulse_feed_set_health(pulse_feed_t *feed, const pulse_feed_health_t *health) {
+    feed_header_t *header = feed->header;
+    uint64_t seq = atomic_load_explicit(&header->health_seq, memory_order_relaxed);
+
+    atomic_store_explicit(&header->health_seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    header->health = *health;
+    atomic_store_explicit(&header->health_seq, seq + 2, memory_order_release);
+}
+
+uint64_t pulse_feed_head(const pulse_feed_t *feed) {
+    return atomic_load_explicit(&feed->header->head, memory_order_acquire);
+}
+
+uint64_t pulse_feed_capacity(const pulse_feed_t *feed) {
+    return feed->capacity;
+}
+
+int pulse_feed_read(const pulse_feed_t *feed, uint64_t seq, pulse_journal_record_t *record) {
+    uint64_t head = pulse_feed_head(feed);
+    if (seq == 0 || seq > head) {
+        return 0;
+    }
+    if (head - seq >= feed->capacity) {
+        return -1;
+    }
+
+    feed_slot_t *slot = &feed->slots[(seq - 1) % feed->capacity];
+    uint64_t before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    *record = slot->record;
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    return before == seq && after == seq ? 1 : -1;
+}
+
+int pulse_feed_health(const pulse_feed_t *feed, pulse_feed_health_t *health) {
+    feed_header_t *header = feed->header;
+    for (int i = 0; i < HEALTH_RETRIES; i++) {
+        uint64_t before = atomic_load_explicit(&header->health_seq, memory_order_acquire);
+        if (before & 1) {
+            continue;
+        }
+        *health = header->health;
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&header->health_seq, memory_order_relaxed) == before) {
+            return 0;
+        }
+    }
+    return -1;
+}
+
+bool pulse_feed_wait(const pulse_feed_t *feed, uint64_t seq, unsigned timeout_ms) {
+    timens_t deadline = timens_now(CLOCK_MONOTONIC) + (timens_t)timeout_ms * TIMENS_PER_MSEC;
+
+    for (;;) {
+        uint32_t notify = atomic_load_explicit(&feed->header->notify, memory_order_acquire);
+        if (pulse_feed_head(feed) > seq) {
+            return true;
+        }
+        timens_t remaining = deadline - timens_now(CLOCK_MONOTONIC);
+        if (remaining <= 0) {
+            return false;
+        }
+#ifdef __linux__
+        struct timespec ts;
+        timens_to_timespec(remaining, &ts);
+        /* Returns at once if notify has moved on since it was read */
+        syscall(SYS_futex, &feed->header->notify, FUTEX_WAIT, notify, &ts, NULL, 0);
+#else
+        (void)notify;
+        if (remaining > WAIT_POLL_MS * TIMENS_PER_MSEC) {
+            remaining = WAIT_POLL_MS * TIMENS_PER_MSEC;
+        }
+        struct timespec ts;
+        timens_to_timespec(remaining, &ts);
+        nanosleep(&ts, NULL);
+#endif
+    }
+}
+
+void pulse_feed_close(pulse_feed_t *feed) {
+    if (feed == NULL) {
+        return;
+    }
+    munmap(feed->header, feed->size);
+    close(feed->fd);
+    free(feed);
+}
@@ -0,0 +1,92 @@
+#ifndef PULSE_FEED_H
+#define PULSE_FEED_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "timens.h"
+#include "pulse_journal.h"
+
+/* Live pulse feed in POSIX shared memory, for any number of local readers.
+ *
+ * The writer publishes each pulse into a small ring of slots, laid out
+ * like the journal, and keeps a snapshot of its health (lock state and
+ * counters) next to it. Every slot and the snapshot are protected by a
+ * sequence lock: the writer never waits for readers and does not know how
+ * many there are, and a reader that races with the writer sees that its
+ * copy is torn and tries again. Readers map the segment read-only, so
+ * they cannot disturb the writer or each other.
+ *
+ * Readers can poll the head or block in pulse_feed_wait. On Linux the
+ * writer wakes blocked readers with a futex on the head; elsewhere
+ * waiting falls back to short sleeps.
+ */
+
+typedef struct pulse_feed pulse_feed_t;
+
+#define PULSE_FEED_DEFAULT_NAME "/ppsfeed"
+#define PULSE_FEED_DEFAULT_CAPACITY 256
+
+/* Health of the writer, updated with every pulse */
+typedef struct {
+    timens_t updated;          /* system time of the update */
+    uint64_t pulses;           /* pulses published */
+    uint64_t accepted;         /* pulses the filter passed */
+    uint64_t rejected;         /* pulses the filter rejected */
+    uint64_t discarded;        /* pulses that could not be timed */
+    uint64_t missed;           /* expected pulses that did not arrive */
+    uint64_t glitches;         /* stray pulses outside the detector's window (audio) */
+    double offset;             /* last accepted offset */
+    double residual_rms;       /* RMS smoothing residual */
+    float uncertainty_ns;      /* of the last pulse */
+    uint8_t source;            /* pulse_journal_source_t */
+    uint8_t state;             /* pulse_state_t */
+    uint8_t reserved[2];
+} pulse_feed_health_t;
+
+/* Create the feed, or take over an existing one with the same capacity,
+ * so that readers that have it open carry on across a restart
+ * name: POSIX shared memory name, starting with a slash
+ * capacity: pulses kept for slow readers
+ * Returns NULL on error with errno set
+ */
+pulse_feed_t *pulse_feed_create(const char *name, uint64_t capacity);
+
+/* Open a feed for reading
+ * Returns NULL on error with errno set (EINVAL if it is not a feed)
+ */
+pulse_feed_t *pulse_feed_open(const char *name);
+
+/* Publish a pulse (writer only)
+ * Returns its sequence number, starting at 1
+ */
+uint64_t pulse_feed_publish(pulse_feed_t *feed, const pulse_journal_record_t *record);
+
+/* Replace the health snapshot (writer only) */
+void pulse_feed_set_health(pulse_feed_t *feed, const pulse_feed_health_t *health);
+
+/* Get the sequence number of the newest pulse, 0 if there are none */
+uint64_t pulse_feed_head(const pulse_feed_t *feed);
+
+/* Get the number of pulses the feed keeps */
+uint64_t pulse_feed_capacity(const pulse_feed_t *feed);
+
+/* Copy a pulse
+ * Returns 1 if record was filled in, 0 if seq has not been published yet,
+ * -1 if it has been overwritten
+ */
+int pulse_feed_read(const pulse_feed_t *feed, uint64_t seq, pulse_journal_record_t *record);
+
+/* Copy the health snapshot
+ * Returns 0 on success, -1 if the writer kept changing it
+ */
+int pulse_feed_health(const pulse_feed_t *feed, pulse_feed_health_t *health);
+
+/* Wait until a pulse newer than seq has been published
+ * Returns true if there is one, false on timeout
+ */
+bool pulse_feed_wait(const pulse_feed_t *feed, uint64_t seq, unsigned timeout_ms);
+
+/* Unmap the feed; the segment stays for the next writer */
+void pulse_feed_close(pulse_feed_t *feed);
+
+#endif /* PULSE_FEED_H */
@@ -0,0 +1,257 @@
+#include "pulse_filter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/* Intervals failing this many times in a row mean the last accepted pulse
+ * is no longer a good reference, e.g. after the system clock was stepped */
+#define MAX_INTERVAL_REJECTS 3
+
+/* Scale factor making the MAD estimate a standard deviation for Gaussian noise */
+#define MAD_SCALE 1.4826
+
+struct pulse_filter {
+    pulse_filter_config_t config;
+
+    /* Recent offsets, accepted or not, so that a real step is eventually followed */
+    double *window;
+    unsigned window_count;
+    unsigned window_next;
+    double *scratch;
+
+    bool have_last;
+    timens_t last_time;
+    unsigned interval_rejects;
+
+    /* Recent accepted pulses for smoothing */
+    timens_t *smooth_time;
+    double *smooth_offset;
+    unsigned smooth_count;
+    unsigned smooth_next;
+    double residual_sum2;
+    uint64_t residual_count;
+
+    pulse_filter_stats_t stats;
+};
+
+void pulse_filter_default_config(pulse_filter_config_t *config) {
+    config->enabled = true;
+    config->period = 1.0;
+    config->interval_tolerance = 0.002;
+    config->median_window = 15;
+    config->median_min = 5;
+    config->mad_threshold = 5.0;
+    config->min_mad = 1e-6;
+    config->smooth_window = 0;
+}
+
+pulse_filter_t *pulse_filter_create(const pulse_filter_config_t *config) {
+    if (config->period <= 0.0 || config->interval_tolerance < 0.0 || config->mad_threshold <= 0.0
+        || config->smooth_window == 1) {
+        return NULL;
+    }
+
+    pulse_filter_t *filter = calloc(1, sizeof(pulse_filter_t));
+    if (filter == NULL) {
+        return NULL;
+    }
+    filter->config = *config;
+
+    unsigned n = config->median_window > 0 ? config->median_window : 1;
+    unsigned m = config->smooth_window > 0 ? config->smooth_window : 1;
+    filter->window = calloc(n, sizeof(double));
+    filter->scratch = calloc(n, sizeof(double));
+    filter->smooth_time = calloc(m, sizeof(timens_t));
+    filter->smooth_offset = calloc(m, sizeof(double));
+    if (!filter->window || !filter->scratch || !filter->smooth_time || !filter->smooth_offset) {
+        pulse_filter_destroy(filter);
+        return NULL;
+    }
+    return filter;
+}
+
+/* Offset as a phase from -0.5 to 0.5 seconds */
+static double wrap(double offset) {
+    return offset - floor(offset + 0.5);
+}
+
+/* Median of values, reordering them; the windows are small so an
+ * insertion sort is enough */
+static double median(double *values, unsigned n) {
+    for (unsigned i = 1; i < n; i++) {
+        double v = values[i];
+        unsigned j = i;
+        while (j > 0 && values[j - 1] > v) {
+            values[j] = values[j - 1];
+            j--;
+        }
+        values[j] = v;
+    }
+    return n % 2 ? values[n / 2] : (values[n / 2 - 1] + values[n / 2]) / 2.0;
+}
+
+static bool check_interval(pulse_filter_t *filter, timens_t time) {
+    if (!filter->have_last) {
+        return true;
+    }
+    double interval = (double)(time - filter->last_time) / TIMENS_PER_SEC;
+    double periods = round(interval / filter->config.period);
+    if (periods < 1.0) {
+        return false;
+    }
+    return fabs(interval - periods * filter->config.period) <= filter->config.interval_tolerance;
+}
+
+/* Add phase to the median window and return its distance from the median
+ * of the previous offsets in MADs, or 0 while there are too few */
+static double check_outlier(pulse_filter_t *filter, double phase, double *med) {
+    const pulse_filter_config_t *c = &filter->config;
+    double deviation = 0.0;
+    *med = phase;
+
+    if (c->median_window == 0) {
+        return 0.0;
+    }
+
+    unsigned n = filter->window_count;
+    if (n > 0) {
+        /* Phases are relative to the newest so the median works across the wrap */
+        for (unsigned k = 0; k < n; k++) {
+            filter->scratch[k] = wrap(filter->window[k] - phase);
+        }
+        double m = median(filter->scratch, n);
+        for (unsigned k = 0; k < n; k++) {
+            filter->scratch[k] = fabs(filter->scratch[k] - m);
+        }
+        double mad = MAD_SCALE * median(filter->scratch, n);
+        if (mad < c->min_mad) {
+            mad = c->min_mad;
+        }
+        *med = wrap(phase + m);
+        if (n >= c->median_min) {
+            deviation = fabs(m) / mad;
+        }
+    }
+
+    filter->window[filter->window_next] = phase;
+    filter->window_next = (filter->window_next + 1) % c->median_window;
+    if (filter->window_count < c->median_window) {
+        filter->window_count++;
+    }
+    return deviation;
+}
+
+/* Least squares fit of the accepted phases against time, evaluated at
+ * the newest pulse; phases are relative to the newest across the wrap */
+static double smooth(pulse_filter_t *filter, timens_t time, double phase) {
+    unsigned size = filter->config.smooth_window;
+    filter->smooth_time[filter->smooth_next] = time;
+    filter->smooth_offset[filter->smooth_next] = phase;
+    filter->smooth_next = (filter->smooth_next + 1) % size;
+    if (filter->smooth_count < size) {
+        filter->smooth_count++;
+    }
+
+    unsigned n = filter->smooth_count;
+    double sx = 0.0, sy = 0.0, sxx = 0.0, sxy = 0.0;
+    for (unsigned k = 0; k < n; k++) {
+        double x = (double)(filter->smooth_time[k] - time) / TIMENS_PER_SEC;
+        double y = wrap(filter->smooth_offset[k] - phase);
+        sx += x;
+        sy += y;
+        sxx += x * x;
+        sxy += x * y;
+    }
+
+    double mx = sx / n, my = sy / n;
+    double vxx = sxx - sx * mx;
+    double slope = vxx > 0.0 ? (sxy - sx * my) / vxx : 0.0;
+    return phase + my - slope * mx;
+}
+
+pulse_verdict_t pulse_filter_process(pulse_filter_t *filter, timens_t time, double offset,
+                                     pulse_filter_result_t *result) {
+    const pulse_filter_config_t *c = &filter->config;
+    double phase = wrap(offset);
+
+    result->verdict = PULSE_VERDICT_ACCEPT;
+    result->offset = offset;
+    result->median = phase;
+    result->deviation = 0.0;
+    result->residual = 0.0;
+
+    if (!c->enabled) {
+        filter->stats.accepted++;
+        return PULSE_VERDICT_ACCEPT;
+    }
+
+    /* Every pulse goes into the median window, so check intervals first
+     * but don't let a bad interval keep a pulse out of the window */
+    bool interval_ok = check_interval(filter, time);
+    result->deviation = check_outlier(filter, phase, &result->median);
+
+    if (!interval_ok) {
+        if (++filter->interval_rejects >= MAX_INTERVAL_REJECTS) {
+            filter->last_time = time;
+            filter->interval_rejects = 0;
+            filter->stats.reanchored++;
+        }
+        filter->stats.rejected_interval++;
+        result->verdict = PULSE_VERDICT_INTERVAL;
+        return result->verdict;
+    }
+    if (result->deviation > c->mad_threshold) {
+        /* An outlier still has a sane interval, so it keeps the time reference */
+        filter->have_last = true;
+        filter->last_time = time;
+        filter->interval_rejects = 0;
+        filter->stats.rejected_outlier++;
+        result->verdict = PULSE_VERDICT_OUTLIER;
+        return result->verdict;
+    }
+
+    filter->have_last = true;
+    filter->last_time = time;
+    filter->interval_rejects = 0;
+    filter->stats.accepted++;
+
+    if (c->smooth_window > 0) {
+        double smoothed = smooth(filter, time, phase);
+        result->residual = phase - smoothed;
+        /* Keep the offset within the second like the input */
+        result->offset = offset - result->residual;
+        result->offset -= floor(result->offset);
+        filter->residual_sum2 += result->residual * result->residual;
+        filter->residual_count++;
+    }
+    return PULSE_VERDICT_ACCEPT;
+}
+
+void pulse_filter_stats(const pulse_filter_t *filter, pulse_filter_stats_t *stats) {
+    *stats = filter->stats;
+    stats->residual_rms = filter->residual_count
+        ? sqrt(filter->residual_sum2 / filter->residual_count) : 0.0;
+}
+
+const char *pulse_filter_verdict_name(pulse_verdict_t verdict) {
+    switch (verdict) {
+    case PULSE_VERDICT_ACCEPT:
+        return "accepted";
+    case PULSE_VERDICT_INTERVAL:
+        return "bad interval";
+    case PULSE_VERDICT_OUTLIER:
+        return "outlier";
+    }
+    return "unknown";
+}
+
+void pulse_filter_destroy(pulse_filter_t *filter) {
+    if (filter == NULL) {
+        return;
+    }
+    free(filter->window);
+    free(filter->scratch);
+    free(filter->smooth_time);
+    free(filter->smooth_offset);
+    free(filter);
+}
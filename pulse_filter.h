@@ -0,0 +1,85 @@
+#ifndef PULSE_FILTER_H
+#define PULSE_FILTER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "timens.h"
+
+/* Filter stage between pulse timestamping and chrony.
+ *
+ * Each pulse is checked in turn against:
+ * - the interval since the last accepted pulse, which must be close to a
+ *   whole number of periods (catches glitches and double triggers)
+ * - a sliding median of recent offsets, rejecting offsets more than a
+ *   number of median absolute deviations (MAD) away (catches outliers)
+ * Accepted offsets can optionally be smoothed with a linear fit over a
+ * short window.
+ *
+ * Offsets use the pollpps/audiopps convention: the system time of the
+ * pulse past the second, in seconds. They are compared modulo one second,
+ * so offsets just under 1.0 and just over 0.0 are close.
+ */
+
+typedef struct pulse_filter pulse_filter_t;
+
+typedef enum {
+    PULSE_VERDICT_ACCEPT,
+    PULSE_VERDICT_INTERVAL,    /* not a whole number of periods after the last pulse */
+    PULSE_VERDICT_OUTLIER      /* too far from the median offset */
+} pulse_verdict_t;
+
+typedef struct {
+    bool enabled;              /* false accepts everything unchanged */
+    double period;             /* expected time between pulses (seconds) */
+    double interval_tolerance; /* allowed error in an interval (seconds) */
+    unsigned median_window;    /* offsets in the sliding median (0 disables) */
+    unsigned median_min;       /* offsets needed before outliers are rejected */
+    double mad_threshold;      /* rejection threshold in MADs */
+    double min_mad;            /* floor on the MAD (seconds), so a quiet signal isn't overfitted */
+    unsigned smooth_window;    /* accepted offsets in the linear fit (0 disables smoothing) */
+} pulse_filter_config_t;
+
+typedef struct {
+    pulse_verdict_t verdict;
+    double offset;             /* offset to use: smoothed if enabled, same convention as the input */
+    double median;             /* median offset (seconds, -0.5 to 0.5) */
+    double deviation;          /* distance from the median in MADs */
+    double residual;           /* input minus smoothed offset (seconds), 0 without smoothing */
+} pulse_filter_result_t;
+
+typedef struct {
+    uint64_t accepted;
+    uint64_t rejected_interval;
+    uint64_t rejected_outlier;
+    uint64_t reanchored;       /* times the interval check restarted from a new pulse */
+    double residual_rms;       /* RMS smoothing residual (seconds) */
+} pulse_filter_stats_t;
+
+/* Fill in the default configuration (1s period, 2ms interval tolerance,
+ * median of 15 with rejection at 5 MADs and a 1us MAD floor, no smoothing) */
+void pulse_filter_default_config(pulse_filter_config_t *config);
+
+/* Create a new filter
+ * Returns NULL on error
+ */
+pulse_filter_t *pulse_filter_create(const pulse_filter_config_t *config);
+
+/* Filter a pulse
+ * time: system time of the pulse
+ * offset: offset of the pulse as sent to chrony
+ * result: verdict and details
+ * Returns the verdict
+ */
+pulse_verdict_t pulse_filter_process(pulse_filter_t *filter, timens_t time, double offset,
+                                     pulse_filter_result_t *result);
+
+/* Get the counters */
+void pulse_filter_stats(const pulse_filter_t *filter, pulse_filter_stats_t *stats);
+
+/* Get a short description of a verdict */
+const char *pulse_filter_verdict_name(pulse_verdict_t verdict);
+
+/* Destroy the filter */
+void pulse_filter_destroy(pulse_filter_t *filter);
+
+#endif /* PULSE_FILTER_H */
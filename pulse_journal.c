@@ -0,0 +1,225 @@
+#include "pulse_journal.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define JOURNAL_MAGIC "PPSJRNL"
+#define JOURNAL_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t slot_size;
+    uint64_t capacity;
+    uint32_t numer;
+    uint32_t denom;
+    _Atomic uint64_t head;     /* sequence number of the newest complete record */
+    uint8_t reserved[24];
+} journal_header_t;
+
+typedef struct {
+    _Atomic uint64_t seq;      /* 0 while being written */
+    pulse_journal_record_t record;
+} journal_slot_t;
+
+_Static_assert(sizeof(journal_header_t) == 64, "journal header must be 64 bytes");
+_Static_assert(sizeof(journal_slot_t) == 64, "journal slot must be 64 bytes");
+
+struct pulse_journal {
+    int fd;
+    bool writable;
+    size_t size;
+    journal_header_t *header;
+    journal_slot_t *slots;
+    uint64_t capacity;
+    uint64_t next;             /* writer only */
+};
+
+static size_t journal_size(uint64_t capacity) {
+    return sizeof(journal_header_t) + capacity * sizeof(journal_slot_t);
+}
+
+static bool header_ok(const journal_header_t *header, size_t file_size) {
+    return memcmp(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) == 0
+        && header->version == JOURNAL_VERSION
+        && header->slot_size == sizeof(journal_slot_t)
+        && header->capacity > 0
+        && header->capacity <= (file_size - sizeof(journal_header_t)) / sizeof(journal_slot_t);
+}
+
+static pulse_journal_t *map_journal(int fd, size_t size, bool writable) {
+    pulse_journal_t *journal = calloc(1, sizeof(pulse_journal_t));
+    if (journal == NULL) {
+        return NULL;
+    }
+    void *base = mmap(NULL, size, writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        free(journal);
+        return NULL;
+    }
+    journal->fd = fd;
+    journal->writable = writable;
+    journal->size = size;
+    journal->header = base;
+    journal->slots = (journal_slot_t *)((char *)base + sizeof(journal_header_t));
+    return journal;
+}
+
+pulse_journal_t *pulse_journal_create(const char *path, uint64_t capacity, uint32_t numer, uint32_t denom) {
+    if (capacity == 0 || numer == 0 || denom == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+
+    /* Only an empty file or a journal is ours to (re)write, so that a
+     * mistyped path can't destroy some other file */
+    size_t size = journal_size(capacity);
+    bool existing = false;
+    if (st.st_size != 0) {
+        journal_header_t old;
+        if ((size_t)st.st_size < sizeof(old) || pread(fd, &old, sizeof(old), 0) != (ssize_t)sizeof(old)
+            || !header_ok(&old, (size_t)st.st_size)) {
+            close(fd);
+            errno = EEXIST;
+            return NULL;
+        }
+        existing = (size_t)st.st_size == size && old.capacity == capacity;
+    }
+    if (!existing && (ftruncate(fd, 0) < 0 || ftruncate(fd, (off_t)size) < 0)) {
+        close(fd);
+        return NULL;
+    }
+
+    pulse_journal_t *journal = map_journal(fd, size, true);
+    if (journal == NULL) {
+        close(fd);
+        return NULL;
+    }
+    journal_header_t *header = journal->header;
+    journal->capacity = capacity;
+
+    if (existing) {
+        journal->next = atomic_load_explicit(&header->head, memory_order_relaxed) + 1;
+    } else {
+        /* Writing every slot now means the blocks are allocated and the
+         * pages are mapped before the first pulse */
+        memset(journal->slots, 0, capacity * sizeof(journal_slot_t));
+        memset(header, 0, sizeof(*header));
+        memcpy(header->magic, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC));
+        header->version = JOURNAL_VERSION;
+        header->slot_size = sizeof(journal_slot_t);
+        header->capacity = capacity;
+        atomic_init(&header->head, 0);
+        journal->next = 1;
+    }
+    header->numer = numer;
+    header->denom = denom;
+    return journal;
+}
+
+pulse_journal_t *pulse_journal_open(const char *path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size < journal_size(1)) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+
+    pulse_journal_t *journal = map_journal(fd, (size_t)st.st_size, false);
+    if (journal == NULL) {
+        close(fd);
+        return NULL;
+    }
+    if (!header_ok(journal->header, journal->size)) {
+        pulse_journal_close(journal);
+        errno = EINVAL;
+        return NULL;
+    }
+    journal->capacity = journal->header->capacity;
+    return journal;
+}
+
+uint64_t pulse_journal_append(pulse_journal_t *journal, const pulse_journal_record_t *record) {
+    uint64_t seq = journal->next++;
+    journal_slot_t *slot = &journal->slots[(seq - 1) % journal->capacity];
+
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->record = *record;
+    atomic_store_explicit(&slot->seq, seq, memory_order_release);
+    atomic_store_explicit(&journal->header->head, seq, memory_order_release);
+    return seq;
+}
+
+uint64_t pulse_journal_head(const pulse_journal_t *journal) {
+    return atomic_load_explicit(&journal->header->head, memory_order_acquire);
+}
+
+uint64_t pulse_journal_capacity(const pulse_journal_t *journal) {
+    return journal->capacity;
+}
+
+void pulse_journal_timebase(const pulse_journal_t *journal, uint32_t *numer, uint32_t *denom) {
+    *numer = journal->header->numer;
+    *denom = journal->header->denom;
+}
+
+int pulse_journal_read(const pulse_journal_t *journal, uint64_t seq, pulse_journal_record_t *record) {
+    uint64_t head = pulse_journal_head(journal);
+    if (seq == 0 || seq > head) {
+        return 0;
+    }
+    if (head - seq >= journal->capacity) {
+        return -1;
+    }
+
+    journal_slot_t *slot = &journal->slots[(seq - 1) % journal->capacity];
+    uint64_t before = atomic_load_explicit(&slot->seq, memory_order_acquire);
+    *record = slot->record;
+    atomic_thread_fence(memory_order_acquire);
+    uint64_t after = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    return before == seq && after == seq ? 1 : -1;
+}
+
+const char *pulse_journal_source_name(pulse_journal_source_t source) {
+    switch (source) {
+    case PULSE_JOURNAL_AUDIO:
+        return "audio";
+    case PULSE_JOURNAL_CTS:
+        return "cts";
+    }
+    return "unknown";
+}
+
+void pulse_journal_close(pulse_journal_t *journal) {
+    if (journal == NULL) {
+        return;
+    }
+    munmap(journal->header, journal->size);
+    close(journal->fd);
+    free(journal);
+}
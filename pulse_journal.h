@@ -0,0 +1,93 @@
+#ifndef PULSE_JOURNAL_H
+#define PULSE_JOURNAL_H
+
+#include <stdint.h>
+#include "timens.h"
+
+/* Binary journal of pulses in a memory-mapped ring file.
+ *
+ * The file is a header followed by a fixed number of 64-byte slots; the
+ * record with sequence number n goes in slot (n - 1) % capacity, so once
+ * the file is full the oldest records are overwritten. The file is
+ * created and mapped when the journal is opened, after which appending a
+ * record is a few stores into the mapping: no allocation, locking or
+ * system calls. The kernel writes the pages back in its own time.
+ *
+ * Readers map the same file read-only and can follow a journal while it
+ * is being written. Each slot carries its sequence number, cleared while
+ * the slot is being rewritten, so a reader can tell when a record it is
+ * copying has been overwritten.
+ */
+
+typedef struct pulse_journal pulse_journal_t;
+
+typedef enum {
+    PULSE_JOURNAL_AUDIO,       /* from audiopps */
+    PULSE_JOURNAL_CTS          /* from pollpps */
+} pulse_journal_source_t;
+
+/* Records kept by default: about 18 hours of pulses in 4MB */
+#define PULSE_JOURNAL_DEFAULT_CAPACITY 65536
+
+/* Record flags */
+#define PULSE_JOURNAL_DISCARDED 0x1   /* pulse could not be timed (e.g. audio discontinuity) */
+
+typedef struct {
+    uint64_t host_ticks;       /* host clock time of the pulse: mach ticks for audio,
+                                  CLOCK_MONOTONIC ns for CTS */
+    double sample_pos;         /* fractional sample index of the edge (audio only) */
+    timens_t time;             /* system time of the pulse */
+    double offset;             /* offset before filtering (seconds past the second) */
+    float residual_ns;         /* smoothing residual */
+    float uncertainty_ns;      /* clock conversion uncertainty (audio) or poll resolution (CTS) */
+    float level;               /* pulse level (audio only) */
+    uint8_t source;            /* pulse_journal_source_t */
+    uint8_t state;             /* pulse_state_t; for CTS, track while the poll schedule is locked */
+    uint8_t verdict;           /* pulse_verdict_t */
+    uint8_t flags;             /* PULSE_JOURNAL_* */
+    uint8_t reserved[8];
+} pulse_journal_record_t;
+
+/* Open a journal for appending, creating it if necessary
+ * An existing journal with the same capacity is appended to, and one with
+ * another capacity or an empty file is started afresh; any other file is
+ * left alone and fails with EEXIST.
+ * capacity: number of records kept
+ * numer, denom: host clock timebase of the writer; ticks * numer / denom
+ *   is nanoseconds
+ * Returns NULL on error with errno set
+ */
+pulse_journal_t *pulse_journal_create(const char *path, uint64_t capacity, uint32_t numer, uint32_t denom);
+
+/* Open an existing journal for reading
+ * Returns NULL on error with errno set (EINVAL if it is not a journal)
+ */
+pulse_journal_t *pulse_journal_open(const char *path);
+
+/* Append a record (writer only)
+ * Returns the sequence number of the record, starting at 1
+ */
+uint64_t pulse_journal_append(pulse_journal_t *journal, const pulse_journal_record_t *record);
+
+/* Get the sequence number of the newest record, 0 if there are none */
+uint64_t pulse_journal_head(const pulse_journal_t *journal);
+
+/* Get the number of records the journal keeps */
+uint64_t pulse_journal_capacity(const pulse_journal_t *journal);
+
+/* Get the host clock timebase of the writer */
+void pulse_journal_timebase(const pulse_journal_t *journal, uint32_t *numer, uint32_t *denom);
+
+/* Copy a record
+ * Returns 1 if record was filled in, 0 if seq has not been written yet,
+ * -1 if it has been overwritten
+ */
+int pulse_journal_read(const pulse_journal_t *journal, uint64_t seq, pulse_journal_record_t *record);
+
+/* Get the name of a source */
+const char *pulse_journal_source_name(pulse_journal_source_t source);
+
+/* Unmap and close the journal */
+void pulse_journal_close(pulse_journal_t *journal);
+
+#endif /* PULSE_JOURNAL_H */
@@ -0,0 +1,324 @@
+#include "pulse_snippet.h"
+#include "spsc_ring.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+
+#define SNIPPET_MAGIC "PPSSNIP"
+#define SNIPPET_VERSION 1
+
+/* Events that can wait at once for their samples to arrive */
+#define MAX_PENDING 16
+
+/* Completed snippets that can wait for the consumer */
+#define QUEUE_CAPACITY 64
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;      /* sizeof(pulse_snippet_t) */
+    double sample_rate;
+    uint8_t reserved[8];
+} snippet_header_t;
+
+_Static_assert(sizeof(snippet_header_t) == 32, "snippet header must be 32 bytes");
+_Static_assert(sizeof(pulse_snippet_t) == 56, "snippet record must be 56 bytes");
+
+typedef struct {
+    pulse_snippet_kind_t kind;
+    double center;
+    uint64_t seq;
+    uint64_t host_time;
+    float level;
+} pending_t;
+
+struct pulse_snippet_recorder {
+    unsigned width;            /* 2 * half_width + 1 */
+    unsigned half_width;
+    float *history;
+    size_t mask;               /* history size - 1 */
+    uint64_t pos;              /* samples pushed */
+    pending_t pending[MAX_PENDING];
+    unsigned n_pending;
+    spsc_ring_t *queue;
+    size_t record_size;
+    unsigned char *produce;    /* producer's record being assembled */
+    unsigned char *consume;    /* consumer's record being taken apart */
+    uint64_t snippets;
+    uint64_t dropped;
+};
+
+struct pulse_snippet_file {
+    FILE *fp;
+    double sample_rate;
+};
+
+pulse_snippet_recorder_t *pulse_snippet_recorder_create(unsigned half_width, size_t history) {
+    unsigned width = 2 * half_width + 1;
+    if (history < width) {
+        history = width;
+    }
+    size_t size = 1;
+    while (size < history) {
+        size <<= 1;
+    }
+
+    pulse_snippet_recorder_t *rec = calloc(1, sizeof(pulse_snippet_recorder_t));
+    if (rec == NULL) {
+        return NULL;
+    }
+    rec->width = width;
+    rec->half_width = half_width;
+    rec->mask = size - 1;
+    rec->record_size = sizeof(pulse_snippet_t) + width * sizeof(float);
+    rec->history = calloc(size, sizeof(float));
+    rec->produce = calloc(1, rec->record_size);
+    rec->consume = calloc(1, rec->record_size);
+    rec->queue = spsc_ring_create(QUEUE_CAPACITY, rec->record_size);
+    if (rec->history == NULL || rec->produce == NULL || rec->consume == NULL || rec->queue == NULL) {
+        pulse_snippet_recorder_destroy(rec);
+        return NULL;
+    }
+    return rec;
+}
+
+/* First sample of the window around an event */
+static uint64_t window_first(const pulse_snippet_recorder_t *rec, double center) {
+    uint64_t c = center > 0.0 ? (uint64_t)floor(center) : 0;
+    return c > rec->half_width ? c - rec->half_width : 0;
+}
+
+/* Queue the snippets of pending events whose samples have all arrived */
+static void complete(pulse_snippet_recorder_t *rec) {
+    unsigned kept = 0;
+    for (unsigned i = 0; i < rec->n_pending; i++) {
+        const pending_t *p = &rec->pending[i];
+        uint64_t first = window_first(rec, p->center);
+        if (first + rec->width > rec->pos) {
+            rec->pending[kept++] = *p;
+            continue;
+        }
+        if (rec->pos - first > rec->mask + 1) {
+            /* Already overwritten */
+            rec->dropped++;
+            continue;
+        }
+
+        pulse_snippet_t *snippet = (pulse_snippet_t *)rec->produce;
+        memset(snippet, 0, sizeof(*snippet));
+        snippet->seq = p->seq;
+        snippet->first = first;
+        snippet->center = p->center;
+        snippet->host_time = p->host_time;
+        snippet->level = p->level;
+        snippet->count = rec->width;
+        snippet->kind = (uint8_t)p->kind;
+
+        float *samples = (float *)(rec->produce + sizeof(pulse_snippet_t));
+        size_t start = (size_t)(first & rec->mask);
+        size_t n = rec->mask + 1 - start < rec->width ? rec->mask + 1 - start : rec->width;
+        memcpy(samples, rec->history + start, n * sizeof(float));
+        memcpy(samples + n, rec->history, (rec->width - n) * sizeof(float));
+
+        if (spsc_ring_push(rec->queue, rec->produce)) {
+            rec->snippets++;
+        } else {
+            rec->dropped++;
+        }
+    }
+    rec->n_pending = kept;
+}
+
+void pulse_snippet_push(pulse_snippet_recorder_t *rec, const float *samples, size_t count) {
+    size_t size = rec->mask + 1;
+    if (count > size) {
+        /* Only the end of the block can be kept */
+        rec->pos += count - size;
+        samples += count - size;
+        count = size;
+    }
+    size_t start = (size_t)(rec->pos & rec->mask);
+    size_t n = size - start < count ? size - start : count;
+    memcpy(rec->history + start, samples, n * sizeof(float));
+    memcpy(rec->history, samples + n, (count - n) * sizeof(float));
+    rec->pos += count;
+
+    if (rec->n_pending > 0) {
+        complete(rec);
+    }
+}
+
+void pulse_snippet_mark(pulse_snippet_recorder_t *rec, pulse_snippet_kind_t kind, double center,
+                        uint64_t seq, uint64_t host_time, float level) {
+    if (rec->n_pending == MAX_PENDING) {
+        rec->dropped++;
+        return;
+    }
+    pending_t *p = &rec->pending[rec->n_pending++];
+    p->kind = kind;
+    p->center = center;
+    p->seq = seq;
+    p->host_time = host_time;
+    p->level = level;
+    complete(rec);
+}
+
+bool pulse_snippet_pop(pulse_snippet_recorder_t *rec, pulse_snippet_t *snippet, float *samples) {
+    if (!spsc_ring_pop(rec->queue, rec->consume)) {
+        return false;
+    }
+    memcpy(snippet, rec->consume, sizeof(*snippet));
+    memcpy(samples, rec->consume + sizeof(pulse_snippet_t), rec->width * sizeof(float));
+    return true;
+}
+
+void pulse_snippet_stats(const pulse_snippet_recorder_t *rec, pulse_snippet_stats_t *stats) {
+    stats->snippets = rec->snippets;
+    stats->dropped = rec->dropped;
+}
+
+void pulse_snippet_recorder_destroy(pulse_snippet_recorder_t *rec) {
+    if (rec == NULL) {
+        return;
+    }
+    spsc_ring_destroy(rec->queue);
+    free(rec->history);
+    free(rec->produce);
+    free(rec->consume);
+    free(rec);
+}
+
+static bool read_header(FILE *fp, snippet_header_t *header) {
+    return fread(header, sizeof(*header), 1, fp) == 1
+        && memcmp(header->magic, SNIPPET_MAGIC, sizeof(SNIPPET_MAGIC)) == 0
+        && header->version == SNIPPET_VERSION
+        && header->record_size == sizeof(pulse_snippet_t)
+        && header->sample_rate > 0.0;
+}
+
+pulse_snippet_file_t *pulse_snippet_file_create(const char *path, double sample_rate) {
+    pulse_snippet_file_t *f = calloc(1, sizeof(pulse_snippet_file_t));
+    if (f == NULL) {
+        return NULL;
+    }
+    f->sample_rate = sample_rate;
+
+    f->fp = fopen(path, "ab+");
+    if (f->fp == NULL) {
+        free(f);
+        return NULL;
+    }
+    if (fseek(f->fp, 0, SEEK_END) < 0) {
+        pulse_snippet_file_close(f);
+        return NULL;
+    }
+
+    snippet_header_t header;
+    if (ftell(f->fp) == 0) {
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, SNIPPET_MAGIC, sizeof(SNIPPET_MAGIC));
+        header.version = SNIPPET_VERSION;
+        header.record_size = sizeof(pulse_snippet_t);
+        header.sample_rate = sample_rate;
+        if (fwrite(&header, sizeof(header), 1, f->fp) != 1 || fflush(f->fp) != 0) {
+            pulse_snippet_file_close(f);
+            return NULL;
+        }
+    } else {
+        /* Snippets at a different rate would be misread */
+        rewind(f->fp);
+        if (!read_header(f->fp, &header) || header.sample_rate != sample_rate) {
+            pulse_snippet_file_close(f);
+            errno = EINVAL;
+            return NULL;
+        }
+    }
+    return f;
+}
+
+pulse_snippet_file_t *pulse_snippet_file_open(const char *path) {
+    pulse_snippet_file_t *f = calloc(1, sizeof(pulse_snippet_file_t));
+    if (f == NULL) {
+        return NULL;
+    }
+    f->fp = fopen(path, "rb");
+    if (f->fp == NULL) {
+        free(f);
+        return NULL;
+    }
+    snippet_header_t header;
+    if (!read_header(f->fp, &header)) {
+        pulse_snippet_file_close(f);
+        errno = EINVAL;
+        return NULL;
+    }
+    f->sample_rate = header.sample_rate;
+    return f;
+}
+
+double pulse_snippet_file_sample_rate(const pulse_snippet_file_t *f) {
+    return f->sample_rate;
+}
+
+int pulse_snippet_file_write(pulse_snippet_file_t *f, const pulse_snippet_t *snippet, const float *samples) {
+    /* Appends always go to the end, so each record lands whole after the
+     * last, and it is flushed so a reader sees it without waiting */
+    if (fwrite(snippet, sizeof(*snippet), 1, f->fp) != 1 ||
+        fwrite(samples, sizeof(float), snippet->count, f->fp) != snippet->count ||
+        fflush(f->fp) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+int pulse_snippet_file_read(pulse_snippet_file_t *f, pulse_snippet_t *snippet, float *samples, size_t max_samples) {
+    if (fread(snippet, sizeof(*snippet), 1, f->fp) != 1) {
+        /* A record cut short by a crash ends the file */
+        return ferror(f->fp) ? -1 : 0;
+    }
+    size_t n = snippet->count < max_samples ? snippet->count : max_samples;
+    if (fread(samples, sizeof(float), n, f->fp) != n) {
+        return ferror(f->fp) ? -1 : 0;
+    }
+    if (n < snippet->count && fseek(f->fp, (long)((snippet->count - n) * sizeof(float)), SEEK_CUR) < 0) {
+        return -1;
+    }
+    return 1;
+}
+
+void pulse_snippet_file_close(pulse_snippet_file_t *f) {
+    if (f == NULL) {
+        return;
+    }
+    if (f->fp) {
+        fclose(f->fp);
+    }
+    free(f);
+}
+
+static const char *const kind_names[] = {
+    [PULSE_SNIPPET_ACCEPTED] = "accepted",
+    [PULSE_SNIPPET_REJECTED] = "rejected",
+    [PULSE_SNIPPET_DISCARDED] = "discarded",
+    [PULSE_SNIPPET_MISSED] = "missed",
+    [PULSE_SNIPPET_DETECTED] = "detected",
+};
+
+const char *pulse_snippet_kind_name(pulse_snippet_kind_t kind) {
+    if ((unsigned)kind < sizeof(kind_names) / sizeof(kind_names[0])) {
+        return kind_names[kind];
+    }
+    return "unknown";
+}
+
+int pulse_snippet_parse_kind(const char *name, pulse_snippet_kind_t *kind) {
+    for (unsigned i = 0; i < sizeof(kind_names) / sizeof(kind_names[0]); i++) {
+        if (strcmp(name, kind_names[i]) == 0) {
+            *kind = (pulse_snippet_kind_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
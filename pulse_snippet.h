@@ -0,0 +1,117 @@
+#ifndef PULSE_SNIPPET_H
+#define PULSE_SNIPPET_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "timens.h"
+
+/* Waveform snippets around pulses.
+ *
+ * A recorder is fed the same blocks as the pulse detector and keeps the
+ * most recent samples in a preallocated history ring. Events (a detected
+ * pulse, or the predicted position of a missed one) are marked as they
+ * are reported; once the samples after an event have arrived, the
+ * recorder copies the window of samples either side of it into a queue
+ * for another thread. Feeding and marking never allocate, block or make
+ * system calls, so they can run in the audio callback.
+ *
+ * Snippets are saved to an append-only file: a header followed by one
+ * record per snippet, each a pulse_snippet_t and its samples.
+ */
+
+typedef struct pulse_snippet_recorder pulse_snippet_recorder_t;
+typedef struct pulse_snippet_file pulse_snippet_file_t;
+
+typedef enum {
+    PULSE_SNIPPET_ACCEPTED,    /* pulse sent on */
+    PULSE_SNIPPET_REJECTED,    /* pulse rejected by the filter */
+    PULSE_SNIPPET_DISCARDED,   /* pulse that could not be timed */
+    PULSE_SNIPPET_MISSED,      /* predicted position of a pulse that did not arrive */
+    PULSE_SNIPPET_DETECTED     /* pulse with no further verdict */
+} pulse_snippet_kind_t;
+
+typedef struct {
+    uint64_t seq;              /* detector sequence number of the pulse; 0 if missed */
+    uint64_t first;            /* sample position of the first sample */
+    double center;             /* sample position of the event (fractional edge for pulses) */
+    uint64_t host_time;        /* host time of the event (pulses only) */
+    timens_t time;             /* system time of the event, 0 if not known */
+    float level;               /* pulse level */
+    uint32_t count;            /* samples in the snippet */
+    uint8_t kind;              /* pulse_snippet_kind_t */
+    uint8_t reserved[7];
+} pulse_snippet_t;
+
+typedef struct {
+    uint64_t snippets;         /* snippets completed */
+    uint64_t dropped;          /* events whose samples were gone or that found the queue full */
+} pulse_snippet_stats_t;
+
+/* Create a recorder
+ * half_width: samples kept either side of an event
+ * history: samples kept in the history ring; an event can be marked
+ *   until this many samples after it, less half_width
+ * Returns NULL on error
+ */
+pulse_snippet_recorder_t *pulse_snippet_recorder_create(unsigned half_width, size_t history);
+
+/* Feed a block of samples (producer only), completing any marked events
+ * whose samples have all arrived */
+void pulse_snippet_push(pulse_snippet_recorder_t *rec, const float *samples, size_t count);
+
+/* Mark an event at sample position center (producer only) */
+void pulse_snippet_mark(pulse_snippet_recorder_t *rec, pulse_snippet_kind_t kind, double center,
+                        uint64_t seq, uint64_t host_time, float level);
+
+/* Take a completed snippet (consumer only)
+ * snippet: receives the header
+ * samples: receives 2 * half_width + 1 samples
+ * Returns true if a snippet was taken
+ */
+bool pulse_snippet_pop(pulse_snippet_recorder_t *rec, pulse_snippet_t *snippet, float *samples);
+
+/* Get the counters */
+void pulse_snippet_stats(const pulse_snippet_recorder_t *rec, pulse_snippet_stats_t *stats);
+
+/* Destroy the recorder */
+void pulse_snippet_recorder_destroy(pulse_snippet_recorder_t *rec);
+
+/* Open a snippet file for appending, creating it with a header if it
+ * doesn't exist
+ * Returns NULL on error with errno set
+ */
+pulse_snippet_file_t *pulse_snippet_file_create(const char *path, double sample_rate);
+
+/* Open a snippet file for reading
+ * Returns NULL on error with errno set (EINVAL if it is not a snippet file)
+ */
+pulse_snippet_file_t *pulse_snippet_file_open(const char *path);
+
+/* Get the sample rate of a snippet file */
+double pulse_snippet_file_sample_rate(const pulse_snippet_file_t *f);
+
+/* Append a snippet
+ * Returns 0 on success, -1 on error
+ */
+int pulse_snippet_file_write(pulse_snippet_file_t *f, const pulse_snippet_t *snippet, const float *samples);
+
+/* Read the next snippet
+ * samples: receives up to max_samples samples; longer snippets are cut
+ *   short, with count still giving their full length
+ * Returns 1 if a snippet was read, 0 at the end of the file, -1 on error
+ */
+int pulse_snippet_file_read(pulse_snippet_file_t *f, pulse_snippet_t *snippet, float *samples, size_t max_samples);
+
+/* Close a snippet file */
+void pulse_snippet_file_close(pulse_snippet_file_t *f);
+
+/* Get the name of a kind ("accepted", "rejected", ...) */
+const char *pulse_snippet_kind_name(pulse_snippet_kind_t kind);
+
+/* Parse a kind name
+ * Returns 0 on success, -1 if the name is not recognized
+ */
+int pulse_snippet_parse_kind(const char *name, pulse_snippet_kind_t *kind);
+
+#endif /* PULSE_SNIPPET_H */
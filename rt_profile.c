@@ -0,0 +1,144 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#endif
+#include "rt_profile.h"
+#include "timens.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/mman.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <linux/serial.h>
+#endif
+#ifdef __APPLE__
+#include <mach/mach.h>
+#include <mach/mach_time.h>
+#include <mach/thread_policy.h>
+#endif
+
+/* Stack touched after locking memory */
+#define PREFAULT_STACK (64 * 1024)
+
+void rt_profile_default_config(rt_profile_config_t *config) {
+    config->priority = 50;
+    config->computation = 50 * TIMENS_PER_USEC;
+    config->constraint = TIMENS_PER_MSEC;
+}
+
+int rt_profile_set_scheduling(const rt_profile_config_t *config) {
+#ifdef __APPLE__
+    mach_timebase_info_data_t timebase;
+    mach_timebase_info(&timebase);
+    thread_time_constraint_policy_data_t policy;
+    policy.period = 0;
+    policy.computation = (uint32_t)(config->computation * timebase.denom / timebase.numer);
+    policy.constraint = (uint32_t)(config->constraint * timebase.denom / timebase.numer);
+    policy.preemptible = TRUE;
+    if (thread_policy_set(mach_thread_self(), THREAD_TIME_CONSTRAINT_POLICY, (thread_policy_t)&policy,
+                          THREAD_TIME_CONSTRAINT_POLICY_COUNT) != KERN_SUCCESS) {
+        errno = EPERM;
+        return -1;
+    }
+    return 0;
+#else
+    struct sched_param param;
+    memset(&param, 0, sizeof(param));
+    param.sched_priority = config->priority;
+    int err = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+#endif
+}
+
+int rt_profile_lock_memory(void) {
+    if (mlockall(MCL_CURRENT | MCL_FUTURE) < 0) {
+        return -1;
+    }
+    volatile char stack[PREFAULT_STACK];
+    for (size_t i = 0; i < sizeof(stack); i += 4096) {
+        stack[i] = 0;
+    }
+    return 0;
+}
+
+int rt_profile_pin_cpu(int cpu) {
+#ifdef __linux__
+    cpu_set_t set;
+    if (cpu < 0 || cpu >= CPU_SETSIZE) {
+        errno = EINVAL;
+        return -1;
+    }
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err != 0) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+#else
+    /* macOS only has affinity hints, which Apple silicon ignores */
+    (void)cpu;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int rt_profile_serial_low_latency(int fd) {
+#if defined(__linux__) && defined(ASYNC_LOW_LATENCY)
+    struct serial_struct serial;
+    if (ioctl(fd, TIOCGSERIAL, &serial) < 0) {
+        return -1;
+    }
+    serial.flags |= ASYNC_LOW_LATENCY;
+    return ioctl(fd, TIOCSSERIAL, &serial) < 0 ? -1 : 0;
+#else
+    (void)fd;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
+
+int rt_profile_ftdi_latency_timer(const char *device, int ms) {
+#ifdef __linux__
+    if (ms < 1 || ms > 255) {
+        errno = EINVAL;
+        return -1;
+    }
+    char resolved[PATH_MAX];
+    if (realpath(device, resolved) == NULL) {
+        return -1;
+    }
+    const char *name = strrchr(resolved, '/');
+    name = name ? name + 1 : resolved;
+
+    char path[PATH_MAX];
+    int len = snprintf(path, sizeof(path), "/sys/bus/usb-serial/devices/%s/latency_timer", name);
+    if (len < 0 || (size_t)len >= sizeof(path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    FILE *f = fopen(path, "w");
+    if (f == NULL) {
+        return -1;
+    }
+    int written = fprintf(f, "%d\n", ms);
+    if (fclose(f) != 0 || written < 0) {
+        return -1;
+    }
+    return 0;
+#else
+    (void)device;
+    (void)ms;
+    errno = ENOTSUP;
+    return -1;
+#endif
+}
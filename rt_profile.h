@@ -0,0 +1,51 @@
+#ifndef RT_PROFILE_H
+#define RT_PROFILE_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Real-time execution profile for the polling thread.
+ *
+ * Each part is separate, so that the caller can report which ones the
+ * system refused (most need root or CAP_SYS_NICE) and carry on without
+ * them. On Linux the thread runs under SCHED_FIFO; on macOS it gets a
+ * time-constraint policy, which is what Core Audio uses for its threads.
+ * The serial settings only exist on Linux: ASYNC_LOW_LATENCY asks the
+ * driver to push modem status changes up straight away, and an FTDI
+ * adapter's latency_timer is how long it holds a partial USB packet
+ * before sending it (16ms by default).
+ *
+ * Functions return 0 on success, -1 on error with errno set; errno is
+ * ENOTSUP where the system has no such setting.
+ */
+
+typedef struct {
+    int priority;              /* SCHED_FIFO priority (Linux) */
+    int64_t computation;       /* time-constraint policy: CPU time needed (macOS) */
+    int64_t constraint;        /* in every span of this long (macOS) */
+} rt_profile_config_t;
+
+/* Fill in the default configuration (priority 50; 50us in every 1ms) */
+void rt_profile_default_config(rt_profile_config_t *config);
+
+/* Give the calling thread real-time scheduling */
+int rt_profile_set_scheduling(const rt_profile_config_t *config);
+
+/* Lock all current and future memory and prefault some stack, so that
+ * the thread does not take page faults */
+int rt_profile_lock_memory(void);
+
+/* Pin the calling thread to a CPU */
+int rt_profile_pin_cpu(int cpu);
+
+/* Set ASYNC_LOW_LATENCY on a serial port */
+int rt_profile_serial_low_latency(int fd);
+
+/* Set the latency timer of the FTDI adapter behind a serial device
+ * device: path of the device, e.g. /dev/ttyUSB0 or a symlink to it
+ * ms: 1 to 255
+ * Returns -1 with errno ENOENT if the device is not an FTDI adapter
+ */
+int rt_profile_ftdi_latency_timer(const char *device, int ms);
+
+#endif /* RT_PROFILE_H */
@@ -0,0 +1,153 @@
+#include "sample_clock.h"
+#include <stdlib.h>
+#include <math.h>
+
+struct sample_clock {
+    sample_clock_config_t config;
+    double nominal_tps;
+
+    bool initialized;
+    uint64_t origin;           /* host time that phase is relative to */
+    double phase;              /* loop's host time of sample time ref, relative to origin */
+    double ref;                /* sample time of the last update */
+    double tps;                /* host ticks per sample */
+    double expected;           /* sample time the next buffer should start at */
+    double offset;             /* sample time minus stream position */
+    double settled_at;         /* sample time after which the loop is settled */
+    double mean_square;        /* smoothed square of the loop error (ticks) */
+
+    bool have_discontinuity;
+    double discontinuity;      /* stream position of the last discontinuity */
+
+    uint64_t buffers;
+    uint64_t gaps;
+    uint64_t dropped_samples;
+    uint64_t last_gap;         /* samples skipped before the last buffer */
+    uint64_t jumps;
+};
+
+void sample_clock_default_config(sample_clock_config_t *config) {
+    config->sample_rate = 48000.0;
+    config->ticks_per_second = 1e9;
+    config->bandwidth = 0.1;
+    config->settle_time = 5.0;
+    config->max_error = 0.001;
+    config->guard = 512.0;
+}
+
+sample_clock_t *sample_clock_create(const sample_clock_config_t *config) {
+    if (config->sample_rate <= 0.0 || config->ticks_per_second <= 0.0 || config->bandwidth <= 0.0) {
+        return NULL;
+    }
+    sample_clock_t *clock = calloc(1, sizeof(sample_clock_t));
+    if (clock == NULL) {
+        return NULL;
+    }
+    clock->config = *config;
+    clock->nominal_tps = config->ticks_per_second / config->sample_rate;
+    clock->tps = clock->nominal_tps;
+    return clock;
+}
+
+/* Start the loop again from this buffer, keeping the rate estimate */
+static void anchor(sample_clock_t *clock, double sample_time, uint64_t host_time) {
+    clock->origin = host_time;
+    clock->phase = 0.0;
+    clock->ref = sample_time;
+    clock->settled_at = sample_time + clock->config.settle_time * clock->config.sample_rate;
+    clock->mean_square = 0.0;
+}
+
+unsigned sample_clock_update(sample_clock_t *clock, uint64_t stream_pos, double sample_time,
+                             uint64_t host_time, size_t count) {
+    unsigned flags = 0;
+
+    clock->buffers++;
+    clock->last_gap = 0;
+    if (!clock->initialized) {
+        clock->initialized = true;
+        anchor(clock, sample_time, host_time);
+    } else {
+        double skipped = sample_time - clock->expected;
+        double elapsed = sample_time - clock->ref;
+        double predicted = clock->phase + elapsed * clock->tps;
+        double error = (double)(int64_t)(host_time - clock->origin) - predicted;
+
+        if (skipped > 0.5) {
+            flags |= SAMPLE_CLOCK_GAP;
+            clock->gaps++;
+            clock->last_gap = (uint64_t)llround(skipped);
+            clock->dropped_samples += clock->last_gap;
+        } else if (skipped < -0.5) {
+            flags |= SAMPLE_CLOCK_JUMP;
+        }
+        if (fabs(error) > clock->config.max_error * clock->config.ticks_per_second) {
+            flags |= SAMPLE_CLOCK_JUMP;
+        }
+
+        if (flags & SAMPLE_CLOCK_JUMP) {
+            clock->jumps++;
+            anchor(clock, sample_time, host_time);
+        } else if (elapsed > 0.0) {
+            /* Second order loop: the bandwidth is scaled by the time
+             * since the last update, which may span dropped buffers */
+            double bandwidth = clock->config.bandwidth;
+            if (sample_time < clock->settled_at) {
+                bandwidth *= 10.0;
+            }
+            double omega = 2.0 * M_PI * bandwidth * elapsed / clock->config.sample_rate;
+            clock->phase = predicted + sqrt(2.0) * omega * error;
+            clock->tps += omega * omega * error / elapsed;
+            clock->ref = sample_time;
+            clock->mean_square += (error * error - clock->mean_square) / 64.0;
+
+            /* Keep phase small so that it stays exact as a double */
+            int64_t whole = (int64_t)clock->phase;
+            clock->origin += (uint64_t)whole;
+            clock->phase -= (double)whole;
+        }
+
+        if (flags) {
+            clock->have_discontinuity = true;
+            clock->discontinuity = (double)stream_pos;
+        }
+    }
+
+    clock->expected = sample_time + (double)count;
+    clock->offset = sample_time - (double)stream_pos;
+    return flags;
+}
+
+int sample_clock_host_time(const sample_clock_t *clock, double stream_pos, uint64_t *host_time) {
+    if (!clock->initialized) {
+        return -1;
+    }
+    /* Positions before a discontinuity had a different sample time offset */
+    if (clock->have_discontinuity && stream_pos < clock->discontinuity + clock->config.guard) {
+        return -1;
+    }
+
+    double sample_time = stream_pos + clock->offset;
+    double ticks = clock->phase + (sample_time - clock->ref) * clock->tps;
+    *host_time = clock->origin + (uint64_t)(int64_t)llround(ticks);
+    return 0;
+}
+
+uint64_t sample_clock_last_gap(const sample_clock_t *clock) {
+    return clock->last_gap;
+}
+
+void sample_clock_status(const sample_clock_t *clock, sample_clock_status_t *status) {
+    status->settled = clock->initialized && clock->ref >= clock->settled_at;
+    status->rate = clock->config.ticks_per_second / clock->tps;
+    status->rate_ppm = (clock->nominal_tps / clock->tps - 1.0) * 1e6;
+    status->jitter_ns = sqrt(clock->mean_square) * 1e9 / clock->config.ticks_per_second;
+    status->buffers = clock->buffers;
+    status->gaps = clock->gaps;
+    status->dropped_samples = clock->dropped_samples;
+    status->jumps = clock->jumps;
+}
+
+void sample_clock_destroy(sample_clock_t *clock) {
+    free(clock);
+}
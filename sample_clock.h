@@ -0,0 +1,84 @@
+#ifndef SAMPLE_CLOCK_H
+#define SAMPLE_CLOCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Tracking of the audio sample clock against the host clock.
+ *
+ * A delay-locked loop fits the host time of each buffer against its
+ * sample time, estimating the true sample rate and phase. Stream
+ * positions are converted through the smoothed loop rather than the
+ * jittery per-buffer host time.
+ *
+ * The sample time of each buffer should follow on from the previous one.
+ * A gap (dropped buffers) or jump in sample time, or a host time far from
+ * the prediction, is a discontinuity: the loop re-anchors after a jump,
+ * and conversions of positions before or just after the discontinuity
+ * fail, so that pulses straddling it can be discarded.
+ */
+
+typedef struct sample_clock sample_clock_t;
+
+typedef struct {
+    double sample_rate;        /* nominal sample rate */
+    double ticks_per_second;   /* host clock ticks per second */
+    double bandwidth;          /* loop bandwidth (Hz) once settled */
+    double settle_time;        /* seconds at 10x bandwidth after a reset */
+    double max_error;          /* host time error (seconds) treated as a discontinuity */
+    double guard;              /* samples after a discontinuity that cannot be converted */
+} sample_clock_config_t;
+
+/* Flags returned by sample_clock_update */
+#define SAMPLE_CLOCK_GAP       0x1    /* sample time skipped forward: buffers were dropped */
+#define SAMPLE_CLOCK_JUMP      0x2    /* sample time went backwards or host time jumped */
+
+typedef struct {
+    bool settled;              /* loop has run at its final bandwidth */
+    double rate;               /* estimated sample rate */
+    double rate_ppm;           /* estimated sample rate relative to nominal */
+    double jitter_ns;          /* RMS difference between buffer host times and the loop */
+    uint64_t buffers;
+    uint64_t gaps;
+    uint64_t dropped_samples;
+    uint64_t jumps;
+} sample_clock_status_t;
+
+/* Fill in the default configuration (48kHz, nanosecond ticks, 0.1Hz
+ * bandwidth, 5s settling, 1ms maximum error, 512 sample guard) */
+void sample_clock_default_config(sample_clock_config_t *config);
+
+/* Create a new tracker
+ * Returns NULL on error
+ */
+sample_clock_t *sample_clock_create(const sample_clock_config_t *config);
+
+/* Feed in a buffer
+ * stream_pos: stream position of the buffer's first sample, counting
+ *   samples processed (as pulse_detector_samples)
+ * sample_time: the device's sample time of that sample (mSampleTime)
+ * host_time: host time of that sample (mHostTime)
+ * count: samples in the buffer
+ * Returns SAMPLE_CLOCK_* flags for discontinuities before this buffer
+ */
+unsigned sample_clock_update(sample_clock_t *clock, uint64_t stream_pos, double sample_time,
+                             uint64_t host_time, size_t count);
+
+/* Convert a stream position to host time with the loop
+ * Returns 0 on success, -1 if there is no estimate yet or the position is
+ * too close to a discontinuity
+ */
+int sample_clock_host_time(const sample_clock_t *clock, double stream_pos, uint64_t *host_time);
+
+/* Get the number of samples skipped just before the last buffer, when
+ * sample_clock_update returned SAMPLE_CLOCK_GAP, or 0 */
+uint64_t sample_clock_last_gap(const sample_clock_t *clock);
+
+/* Get the loop state and counters */
+void sample_clock_status(const sample_clock_t *clock, sample_clock_status_t *status);
+
+/* Destroy the tracker */
+void sample_clock_destroy(sample_clock_t *clock);
+
+#endif /* SAMPLE_CLOCK_H */
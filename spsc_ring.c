@@ -0,0 +1,177 @@
+#ifndef __APPLE__
+#define _GNU_SOURCE            /* sem_clockwait */
+#endif
+#include "spsc_ring.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <errno.h>
+
+#ifdef __APPLE__
+#include <dispatch/dispatch.h>
+#else
+#include <semaphore.h>
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 30))
+#define HAVE_SEM_CLOCKWAIT 1
+#endif
+#endif
+
+#define CACHE_LINE 64
+
+struct spsc_ring {
+    /* Written by the producer */
+    _Alignas(CACHE_LINE) _Atomic size_t head;
+    _Atomic uint64_t overflows;
+    _Atomic size_t high_water;
+
+    /* Written by the consumer */
+    _Alignas(CACHE_LINE) _Atomic size_t tail;
+
+    _Alignas(CACHE_LINE) size_t mask;
+    size_t record_size;
+    unsigned char *records;
+#ifdef __APPLE__
+    dispatch_semaphore_t sem;
+#else
+    sem_t sem;
+#endif
+};
+
+spsc_ring_t *spsc_ring_create(size_t capacity, size_t record_size) {
+    if (capacity == 0 || record_size == 0) {
+        return NULL;
+    }
+
+    size_t size = 1;
+    while (size < capacity) {
+        size <<= 1;
+    }
+
+    spsc_ring_t *ring = aligned_alloc(CACHE_LINE, (sizeof(spsc_ring_t) + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE);
+    if (ring == NULL) {
+        return NULL;
+    }
+    memset(ring, 0, sizeof(*ring));
+
+    ring->records = calloc(size, record_size);
+    if (ring->records == NULL) {
+        free(ring);
+        return NULL;
+    }
+    ring->mask = size - 1;
+    ring->record_size = record_size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    atomic_init(&ring->overflows, 0);
+    atomic_init(&ring->high_water, 0);
+
+#ifdef __APPLE__
+    ring->sem = dispatch_semaphore_create(0);
+    if (ring->sem == NULL) {
+#else
+    if (sem_init(&ring->sem, 0, 0) < 0) {
+#endif
+        free(ring->records);
+        free(ring);
+        return NULL;
+    }
+
+    return ring;
+}
+
+bool spsc_ring_push(spsc_ring_t *ring, const void *record) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail > ring->mask) {
+        atomic_fetch_add_explicit(&ring->overflows, 1, memory_order_relaxed);
+        return false;
+    }
+
+    memcpy(ring->records + (head & ring->mask) * ring->record_size, record, ring->record_size);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    size_t used = head + 1 - tail;
+    if (used > atomic_load_explicit(&ring->high_water, memory_order_relaxed)) {
+        atomic_store_explicit(&ring->high_water, used, memory_order_relaxed);
+    }
+
+    spsc_ring_wake(ring);
+    return true;
+}
+
+bool spsc_ring_pop(spsc_ring_t *ring, void *record) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (tail == head) {
+        return false;
+    }
+
+    memcpy(record, ring->records + (tail & ring->mask) * ring->record_size, ring->record_size);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return true;
+}
+
+bool spsc_ring_wait(spsc_ring_t *ring, unsigned timeout_ms) {
+#ifdef __APPLE__
+    dispatch_time_t deadline = dispatch_time(DISPATCH_TIME_NOW, (int64_t)timeout_ms * 1000000);
+    return dispatch_semaphore_wait(ring->sem, deadline) == 0;
+#else
+    /* A CLOCK_MONOTONIC deadline where the C library has sem_clockwait, so
+     * that a step of the system clock doesn't stretch or cut the wait */
+#ifdef HAVE_SEM_CLOCKWAIT
+    const clockid_t clock = CLOCK_MONOTONIC;
+#else
+    const clockid_t clock = CLOCK_REALTIME;
+#endif
+    struct timespec deadline;
+    clock_gettime(clock, &deadline);
+    deadline.tv_sec += timeout_ms / 1000;
+    deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+#ifdef HAVE_SEM_CLOCKWAIT
+    while (sem_clockwait(&ring->sem, clock, &deadline) < 0) {
+#else
+    while (sem_timedwait(&ring->sem, &deadline) < 0) {
+#endif
+        if (errno != EINTR) {
+            return false;
+        }
+    }
+    return true;
+#endif
+}
+
+void spsc_ring_wake(spsc_ring_t *ring) {
+#ifdef __APPLE__
+    dispatch_semaphore_signal(ring->sem);
+#else
+    sem_post(&ring->sem);
+#endif
+}
+
+uint64_t spsc_ring_overflows(const spsc_ring_t *ring) {
+    return atomic_load_explicit(&((spsc_ring_t *)ring)->overflows, memory_order_relaxed);
+}
+
+size_t spsc_ring_high_water(const spsc_ring_t *ring) {
+    return atomic_load_explicit(&((spsc_ring_t *)ring)->high_water, memory_order_relaxed);
+}
+
+void spsc_ring_destroy(spsc_ring_t *ring) {
+    if (ring == NULL) {
+        return;
+    }
+#ifdef __APPLE__
+    dispatch_release(ring->sem);
+#else
+    sem_destroy(&ring->sem);
+#endif
+    free(ring->records);
+    free(ring);
+}
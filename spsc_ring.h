@@ -0,0 +1,53 @@
+#ifndef SPSC_RING_H
+#define SPSC_RING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Lock-free single-producer/single-consumer ring of fixed-size records.
+ *
+ * All storage is allocated up front. Pushing never blocks, allocates or
+ * takes a lock, so it is safe from a real-time audio callback; when the
+ * ring is full the record is dropped and counted. The consumer can block
+ * in spsc_ring_wait until the producer has pushed something.
+ */
+
+typedef struct spsc_ring spsc_ring_t;
+
+/* Create a new ring
+ * capacity: number of records; rounded up to a power of two
+ * record_size: size of each record in bytes
+ * Returns NULL on error
+ */
+spsc_ring_t *spsc_ring_create(size_t capacity, size_t record_size);
+
+/* Append a record (producer only)
+ * Returns true on success, false if the ring was full
+ */
+bool spsc_ring_push(spsc_ring_t *ring, const void *record);
+
+/* Remove the oldest record (consumer only)
+ * Returns true if a record was copied to record, false if the ring was empty
+ */
+bool spsc_ring_pop(spsc_ring_t *ring, void *record);
+
+/* Wait until the ring may be non-empty (consumer only)
+ * timeout_ms: maximum time to wait
+ * Returns true if woken by a push, false on timeout
+ */
+bool spsc_ring_wait(spsc_ring_t *ring, unsigned timeout_ms);
+
+/* Wake a consumer blocked in spsc_ring_wait, e.g. for shutdown */
+void spsc_ring_wake(spsc_ring_t *ring);
+
+/* Get the number of records dropped because the ring was full */
+uint64_t spsc_ring_overflows(const spsc_ring_t *ring);
+
+/* Get the largest number of records that have been queued at once */
+size_t spsc_ring_high_water(const spsc_ring_t *ring);
+
+/* Destroy the ring */
+void spsc_ring_destroy(spsc_ring_t *ring);
+
+#endif /* SPSC_RING_H */
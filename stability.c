@@ -0,0 +1,219 @@
+#include "stability.h"
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <pthread.h>
+
+/* Offset as a phase from -0.5 to 0.5 seconds */
+static double wrap(double offset) {
+    return offset - floor(offset + 0.5);
+}
+
+size_t stability_phase_series(const timens_t *time, const double *offset, size_t n, double period,
+                              double **x, size_t *filled) {
+    if (n == 0 || period <= 0.0 || time[n - 1] < time[0]) {
+        return 0;
+    }
+
+    double period_ns = period * TIMENS_PER_SEC;
+    size_t length = (size_t)llround((double)(time[n - 1] - time[0]) / period_ns) + 1;
+    double *series = malloc(length * sizeof(double));
+    if (series == NULL) {
+        return 0;
+    }
+
+    size_t last = 0;
+    double phase = wrap(offset[0]);
+    series[0] = phase;
+    *filled = 0;
+    for (size_t k = 1; k < n; k++) {
+        long long index = llround((double)(time[k] - time[0]) / period_ns);
+        if (index <= (long long)last || (size_t)index >= length) {
+            continue;
+        }
+        /* Unwrap so a series crossing the second boundary stays continuous */
+        double next = phase + wrap(offset[k] - phase);
+        size_t gap = (size_t)index - last;
+        for (size_t i = 1; i < gap; i++) {
+            series[last + i] = phase + (next - phase) * i / gap;
+        }
+        *filled += gap - 1;
+        series[index] = next;
+        phase = next;
+        last = (size_t)index;
+    }
+
+    *x = series;
+    return last + 1;
+}
+
+size_t stability_octave_taus(size_t n, unsigned *m, size_t max) {
+    size_t count = 0;
+    for (size_t k = 1; 3 * k <= n && count < max; k *= 2) {
+        m[count++] = (unsigned)k;
+    }
+    return count;
+}
+
+typedef struct {
+    const double *x;
+    const double *sum;         /* prefix sums of x: sum[k] is x[0] + ... + x[k - 1] */
+    size_t n;
+    double tau0;
+    stability_point_t *points;
+    size_t count;
+    _Atomic size_t next;
+} job_t;
+
+static void compute_point(const job_t *job, stability_point_t *p, size_t *max_q, size_t *min_q) {
+    const double *x = job->x;
+    const double *s = job->sum;
+    size_t n = job->n;
+    size_t m = p->m;
+    double tau = m * job->tau0;
+
+    p->tau = tau;
+    p->terms = 0;
+    p->adev = p->tdev = p->mtie = NAN;
+
+    if (n >= 2 * m + 1) {
+        double total = 0.0;
+        for (size_t i = 0; i + 2 * m < n; i++) {
+            double d = x[i + 2 * m] - 2.0 * x[i + m] + x[i];
+            total += d * d;
+        }
+        p->terms = n - 2 * m;
+        p->adev = sqrt(total / (2.0 * p->terms * tau * tau));
+    }
+
+    if (n >= 3 * m) {
+        double total = 0.0;
+        size_t terms = n - 3 * m + 1;
+        for (size_t j = 0; j < terms; j++) {
+            double d = s[j + 3 * m] - 3.0 * s[j + 2 * m] + 3.0 * s[j + m] - s[j];
+            total += d * d;
+        }
+        double mvar = total / (2.0 * (double)m * m * tau * tau * terms);
+        p->tdev = tau * sqrt(mvar / 3.0);
+    }
+
+    if (n >= m + 1) {
+        /* Sliding maximum and minimum over windows of m + 1 values */
+        size_t max_head = 0, max_tail = 0, min_head = 0, min_tail = 0;
+        double mtie = 0.0;
+        for (size_t i = 0; i < n; i++) {
+            while (max_tail > max_head && x[max_q[max_tail - 1]] <= x[i]) {
+                max_tail--;
+            }
+            max_q[max_tail++] = i;
+            while (min_tail > min_head && x[min_q[min_tail - 1]] >= x[i]) {
+                min_tail--;
+            }
+            min_q[min_tail++] = i;
+            if (i < m) {
+                continue;
+            }
+            if (max_q[max_head] < i - m) {
+                max_head++;
+            }
+            if (min_q[min_head] < i - m) {
+                min_head++;
+            }
+            double range = x[max_q[max_head]] - x[min_q[min_head]];
+            if (range > mtie) {
+                mtie = range;
+            }
+        }
+        p->mtie = mtie;
+    }
+}
+
+static void *worker(void *arg) {
+    job_t *job = arg;
+    size_t *max_q = malloc(job->n * sizeof(size_t));
+    size_t *min_q = malloc(job->n * sizeof(size_t));
+    if (max_q == NULL || min_q == NULL) {
+        free(max_q);
+        free(min_q);
+        return (void *)-1;
+    }
+
+    size_t k;
+    while ((k = atomic_fetch_add(&job->next, 1)) < job->count) {
+        compute_point(job, &job->points[k], max_q, min_q);
+    }
+    free(max_q);
+    free(min_q);
+    return NULL;
+}
+
+int stability_compute(const double *x, size_t n, double tau0, stability_point_t *points, size_t count,
+                      unsigned threads) {
+    if (n == 0 || tau0 <= 0.0) {
+        return -1;
+    }
+
+    /* Prefix sums about the mean, so they stay small enough to difference */
+    double *sum = malloc((n + 1) * sizeof(double));
+    if (sum == NULL) {
+        return -1;
+    }
+    double mean = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        mean += x[i];
+    }
+    mean /= n;
+    sum[0] = 0.0;
+    for (size_t i = 0; i < n; i++) {
+        sum[i + 1] = sum[i] + (x[i] - mean);
+    }
+
+    job_t job = { x, sum, n, tau0, points, count, 0 };
+    atomic_init(&job.next, 0);
+
+    if (threads > count) {
+        threads = (unsigned)count;
+    }
+    int result = 0;
+    if (threads <= 1) {
+        result = worker(&job) == NULL ? 0 : -1;
+    } else {
+        pthread_t *ids = malloc((threads - 1) * sizeof(pthread_t));
+        unsigned started = 0;
+        if (ids != NULL) {
+            for (; started < threads - 1; started++) {
+                if (pthread_create(&ids[started], NULL, worker, &job) != 0) {
+                    break;
+                }
+            }
+        }
+        /* Whatever threads could be started share the work; this one
+         * picks up anything left */
+        if (worker(&job) != NULL) {
+            result = -1;
+        }
+        for (unsigned t = 0; t < started; t++) {
+            void *rc;
+            pthread_join(ids[t], &rc);
+            if (rc != NULL) {
+                result = -1;
+            }
+        }
+        free(ids);
+    }
+    free(sum);
+    return result;
+}
+
+double stability_percentile(const double *sorted, size_t n, double p) {
+    if (n == 0) {
+        return NAN;
+    }
+    double pos = p * (n - 1);
+    size_t i = (size_t)pos;
+    if (i + 1 >= n) {
+        return sorted[n - 1];
+    }
+    return sorted[i] + (sorted[i + 1] - sorted[i]) * (pos - i);
+}
@@ -0,0 +1,58 @@
+#ifndef STABILITY_H
+#define STABILITY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include "timens.h"
+
+/* Time stability statistics of a pulse offset (phase) series.
+ *
+ * The series is the phase error x of each pulse in seconds, sampled once
+ * per period tau0. For each averaging time tau = m * tau0 this computes
+ * the overlapping Allan deviation, the time deviation (TDEV) and the
+ * maximum time interval error (MTIE). Each of them is O(n) per tau, using
+ * prefix sums for TDEV and monotonic deques for MTIE, so octave-spaced
+ * taus cost O(n log n) in total; taus are spread across threads.
+ */
+
+typedef struct {
+    unsigned m;                /* averaging time in periods */
+    double tau;                /* averaging time (seconds) */
+    size_t terms;              /* terms in the overlapping Allan variance */
+    double adev;               /* overlapping Allan deviation */
+    double tdev;               /* time deviation (seconds) */
+    double mtie;               /* maximum time interval error (seconds) */
+} stability_point_t;
+
+/* Build an evenly spaced phase series from pulse times and offsets
+ * time: system time of each pulse, in order
+ * offset: offset of each pulse (seconds past the second); offsets are
+ *   unwrapped across the second boundary
+ * period: nominal time between pulses (seconds)
+ * x: set to a newly allocated series, one value per period from the
+ *   first pulse to the last; missing pulses are linearly interpolated
+ * filled: set to the number of missing pulses interpolated
+ * Returns the length of the series, 0 on error
+ */
+size_t stability_phase_series(const timens_t *time, const double *offset, size_t n, double period,
+                              double **x, size_t *filled);
+
+/* Fill in octave-spaced averaging times (1, 2, 4, ... periods) for which
+ * every statistic has at least one term
+ * Returns the number filled in
+ */
+size_t stability_octave_taus(size_t n, unsigned *m, size_t max);
+
+/* Compute the statistics for each point, whose m must be filled in
+ * x: phase series (seconds) from stability_phase_series
+ * tau0: time between values of x (seconds)
+ * threads: number of worker threads (0 or 1 computes on this thread)
+ * Returns 0 on success, -1 on error
+ */
+int stability_compute(const double *x, size_t n, double tau0, stability_point_t *points, size_t count,
+                      unsigned threads);
+
+/* Value at fraction p (0 to 1) of sorted values, linearly interpolated */
+double stability_percentile(const double *sorted, size_t n, double p);
+
+#endif /* STABILITY_H */
@@ -0,0 +1,161 @@
+#include "stage_trace.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+
+/* 2^SUB_BITS buckets per power of two */
+#define SUB_BITS 4
+#define SUB_COUNT (1u << SUB_BITS)
+
+/* Values up to 2^MAX_BITS ns get their own buckets; larger ones go in the last */
+#define MAX_BITS 40
+#define BUCKETS ((MAX_BITS - SUB_BITS + 1) * SUB_COUNT)
+
+typedef struct {
+    _Atomic uint64_t count;
+    _Atomic uint64_t sum;
+    _Atomic uint64_t min;
+    _Atomic uint64_t max;
+    _Atomic uint64_t buckets[BUCKETS];
+} histogram_t;
+
+struct stage_trace {
+    unsigned count;
+    const char *names[STAGE_TRACE_MAX_STAGES];
+    histogram_t stages[];
+};
+
+static unsigned bucket_of(uint64_t v) {
+    if (v < SUB_COUNT) {
+        return (unsigned)v;
+    }
+    unsigned e = 63u - (unsigned)__builtin_clzll(v);
+    if (e >= MAX_BITS) {
+        return BUCKETS - 1;
+    }
+    return (e - SUB_BITS + 1) * SUB_COUNT + (unsigned)((v >> (e - SUB_BITS)) & (SUB_COUNT - 1));
+}
+
+/* Middle of the values that fall in a bucket */
+static double bucket_value(unsigned b) {
+    if (b < SUB_COUNT) {
+        return (double)b;
+    }
+    unsigned shift = b / SUB_COUNT - 1;
+    uint64_t low = (uint64_t)(SUB_COUNT + b % SUB_COUNT) << shift;
+    return (double)low + (double)(UINT64_C(1) << shift) / 2.0;
+}
+
+/* Only the stage's own thread writes, so a load and store is enough */
+static void bump(_Atomic uint64_t *counter, uint64_t amount) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount,
+                          memory_order_relaxed);
+}
+
+stage_trace_t *stage_trace_create(const char *const *names, unsigned count) {
+    if (count == 0 || count > STAGE_TRACE_MAX_STAGES) {
+        return NULL;
+    }
+    stage_trace_t *trace = calloc(1, sizeof(stage_trace_t) + count * sizeof(histogram_t));
+    if (trace == NULL) {
+        return NULL;
+    }
+    trace->count = count;
+    for (unsigned i = 0; i < count; i++) {
+        trace->names[i] = names[i];
+        atomic_init(&trace->stages[i].min, UINT64_MAX);
+    }
+    return trace;
+}
+
+void stage_trace_record(stage_trace_t *trace, unsigned stage, int64_t ns) {
+    if (trace == NULL || stage >= trace->count) {
+        return;
+    }
+    histogram_t *h = &trace->stages[stage];
+    uint64_t v = ns > 0 ? (uint64_t)ns : 0;
+
+    bump(&h->buckets[bucket_of(v)], 1);
+    bump(&h->sum, v);
+    if (v < atomic_load_explicit(&h->min, memory_order_relaxed)) {
+        atomic_store_explicit(&h->min, v, memory_order_relaxed);
+    }
+    if (v > atomic_load_explicit(&h->max, memory_order_relaxed)) {
+        atomic_store_explicit(&h->max, v, memory_order_relaxed);
+    }
+    /* The count goes last, so a reader never sees more samples than buckets */
+    atomic_store_explicit(&h->count, atomic_load_explicit(&h->count, memory_order_relaxed) + 1,
+                          memory_order_release);
+}
+
+timens_t stage_trace_since(stage_trace_t *trace, unsigned stage, timens_t start) {
+    timens_t now = timens_now(CLOCK_MONOTONIC);
+    stage_trace_record(trace, stage, now - start);
+    return now;
+}
+
+void stage_trace_stats(const stage_trace_t *trace, unsigned stage, stage_trace_stats_t *stats) {
+    memset(stats, 0, sizeof(*stats));
+    if (trace == NULL || stage >= trace->count) {
+        return;
+    }
+    histogram_t *h = (histogram_t *)&trace->stages[stage];
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_acquire);
+    if (count == 0) {
+        return;
+    }
+
+    /* Buckets may be a few samples ahead of the count; rank against the
+     * bucket total so the percentiles stay consistent */
+    uint64_t total = 0;
+    uint64_t buckets[BUCKETS];
+    for (unsigned b = 0; b < BUCKETS; b++) {
+        buckets[b] = atomic_load_explicit(&h->buckets[b], memory_order_relaxed);
+        total += buckets[b];
+    }
+    double percents[4] = { 50.0, 90.0, 99.0, 99.9 };
+    double *results[4] = { &stats->p50, &stats->p90, &stats->p99, &stats->p999 };
+    uint64_t seen = 0;
+    unsigned next = 0;
+    for (unsigned b = 0; b < BUCKETS && next < 4; b++) {
+        seen += buckets[b];
+        while (next < 4 && (double)seen >= percents[next] / 100.0 * (double)total && seen > 0) {
+            *results[next++] = bucket_value(b);
+        }
+    }
+
+    stats->count = count;
+    stats->mean = (double)atomic_load_explicit(&h->sum, memory_order_relaxed) / (double)total;
+    stats->min = (double)atomic_load_explicit(&h->min, memory_order_relaxed);
+    stats->max = (double)atomic_load_explicit(&h->max, memory_order_relaxed);
+    for (unsigned i = 0; i < 4; i++) {
+        if (*results[i] < stats->min) {
+            *results[i] = stats->min;
+        } else if (*results[i] > stats->max) {
+            *results[i] = stats->max;
+        }
+    }
+}
+
+void stage_trace_print(const stage_trace_t *trace, FILE *out) {
+    if (trace == NULL) {
+        return;
+    }
+    fprintf(out, "%-10s %10s %10s %10s %10s %10s %10s %10s %10s\n",
+            "stage (us)", "count", "mean", "min", "p50", "p90", "p99", "p99.9", "max");
+    for (unsigned i = 0; i < trace->count; i++) {
+        stage_trace_stats_t s;
+        stage_trace_stats(trace, i, &s);
+        if (s.count == 0) {
+            continue;
+        }
+        fprintf(out, "%-10s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+                trace->names[i], (unsigned long long)s.count, s.mean / 1e3, s.min / 1e3,
+                s.p50 / 1e3, s.p90 / 1e3, s.p99 / 1e3, s.p999 / 1e3, s.max / 1e3);
+    }
+    fflush(out);
+}
+
+void stage_trace_destroy(stage_trace_t *trace) {
+    free(trace);
+}
@@ -0,0 +1,58 @@
+#ifndef STAGE_TRACE_H
+#define STAGE_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "timens.h"
+
+/* Latency histograms for the stages of the pulse path.
+ *
+ * Each stage keeps a log-linear histogram in the style of HdrHistogram:
+ * 16 buckets per power of two from 1ns to about 18 minutes, so any
+ * latency is recorded to within 1/16 of its value in a fixed 5KB table.
+ * Recording is a handful of relaxed atomic stores with no locks,
+ * allocation or system calls, so it can stay on in the audio callback.
+ * Each stage must be recorded from a single thread; any thread can read
+ * or print the histograms at any time.
+ */
+
+typedef struct stage_trace stage_trace_t;
+
+#define STAGE_TRACE_MAX_STAGES 16
+
+typedef struct {
+    uint64_t count;
+    double mean;               /* nanoseconds */
+    double min;
+    double p50;
+    double p90;
+    double p99;
+    double p999;
+    double max;
+} stage_trace_stats_t;
+
+/* Create histograms for a list of stages
+ * names: stage names, which must stay valid; at most STAGE_TRACE_MAX_STAGES
+ * Returns NULL on error
+ */
+stage_trace_t *stage_trace_create(const char *const *names, unsigned count);
+
+/* Record a latency for a stage (one thread per stage)
+ * ns: latency in nanoseconds; negative values are recorded as 0
+ */
+void stage_trace_record(stage_trace_t *trace, unsigned stage, int64_t ns);
+
+/* Record the time since start (CLOCK_MONOTONIC) and return the current time,
+ * so that consecutive stages can be chained */
+timens_t stage_trace_since(stage_trace_t *trace, unsigned stage, timens_t start);
+
+/* Get the statistics of a stage; percentiles are bucket midpoints */
+void stage_trace_stats(const stage_trace_t *trace, unsigned stage, stage_trace_stats_t *stats);
+
+/* Print a table of all stages with samples, in microseconds */
+void stage_trace_print(const stage_trace_t *trace, FILE *out);
+
+/* Destroy the histograms */
+void stage_trace_destroy(stage_trace_t *trace);
+
+#endif /* STAGE_TRACE_H */
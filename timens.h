@@ -0,0 +1,89 @@
+#ifndef TIMENS_H
+#define TIMENS_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/time.h>
+
+/* Exact time as a signed 64-bit count of nanoseconds, either since the
+ * epoch or since an arbitrary start for monotonic clocks. This covers
+ * +/-292 years, with none of the precision loss of a double holding
+ * epoch seconds (about 0.24us today).
+ *
+ * These are inline because they are used when timestamping pulses.
+ */
+
+typedef int64_t timens_t;
+
+#define TIMENS_PER_SEC  INT64_C(1000000000)
+#define TIMENS_PER_MSEC INT64_C(1000000)
+#define TIMENS_PER_USEC INT64_C(1000)
+
+/* Divide, rounding towards minus infinity */
+static inline int64_t timens_floor_div(int64_t a, int64_t b) {
+    int64_t q = a / b;
+    return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+/* Divide, rounding to nearest with halves away from zero */
+static inline int64_t timens_round_div(int64_t a, int64_t b) {
+    int64_t q = a / b, r = a % b;
+    if (r < 0) {
+        r = -r;
+    }
+    if (2 * r >= (b < 0 ? -b : b)) {
+        q += ((a < 0) != (b < 0)) ? -1 : 1;
+    }
+    return q;
+}
+
+static inline timens_t timens_from_timespec(const struct timespec *ts) {
+    return (timens_t)ts->tv_sec * TIMENS_PER_SEC + ts->tv_nsec;
+}
+
+static inline void timens_to_timespec(timens_t t, struct timespec *ts) {
+    int64_t sec = timens_floor_div(t, TIMENS_PER_SEC);
+    ts->tv_sec = (time_t)sec;
+    ts->tv_nsec = (long)(t - sec * TIMENS_PER_SEC);
+}
+
+/* Convert to the nearest microsecond */
+static inline void timens_to_timeval(timens_t t, struct timeval *tv) {
+    int64_t usec = timens_round_div(t, TIMENS_PER_USEC);
+    int64_t sec = timens_floor_div(usec, 1000000);
+    tv->tv_sec = (time_t)sec;
+    tv->tv_usec = (suseconds_t)(usec - sec * 1000000);
+}
+
+/* Nanoseconds past the second, 0 to 999999999 */
+static inline int64_t timens_subsec(timens_t t) {
+    return t - timens_floor_div(t, TIMENS_PER_SEC) * TIMENS_PER_SEC;
+}
+
+/* Read a clock, e.g. CLOCK_REALTIME or CLOCK_MONOTONIC */
+static inline timens_t timens_now(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return timens_from_timespec(&ts);
+}
+
+/* Convert host clock ticks to nanoseconds with the rational timebase
+ * numer/denom (as mach_timebase_info), rounding to nearest. Splitting
+ * off whole multiples of denom keeps the product from overflowing for
+ * any tick count whose result fits in 63 bits.
+ */
+static inline timens_t timens_from_ticks(uint64_t ticks, uint32_t numer, uint32_t denom) {
+    uint64_t whole = ticks / denom;
+    uint64_t rest = ticks % denom;
+    return (timens_t)(whole * numer + (rest * numer + denom / 2) / denom);
+}
+
+/* Convert nanoseconds to host clock ticks with the rational timebase
+ * numer/denom, rounding to nearest */
+static inline uint64_t timens_to_ticks(timens_t ns, uint32_t numer, uint32_t denom) {
+    uint64_t whole = (uint64_t)ns / numer;
+    uint64_t rest = (uint64_t)ns % numer;
+    return whole * denom + (rest * denom + numer / 2) / numer;
+}
+
+#endif /* TIMENS_H */